@@ -0,0 +1,203 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atmotube.h>
+#include "atmotube-config.h"
+#include "atmotube-plugin.h"
+#include "atmotube-ring.h"
+#include "atmotube-host.h"
+#include "atmotube-time.h"
+#include "atmotube-sqlite.h"
+
+/* Runs one output plugin for atmotube-reader, which starts it as:
+ *   atmhost type file fd filename commit_rows commit_interval
+ *           partition retention storage voc_scale [name address]...
+ * Records are read from the ring in the memory file fd until the reader
+ * closes it or exits. A plugin exporting plugin_flush has it called
+ * twice per commit_interval meanwhile, as the worker of an output
+ * does. */
+
+/* Records taken from the ring at a time. */
+#define HOST_READ_MAX 256
+/* Interval at which the host checks that the reader is still there. */
+#define HOST_READER_POLL_MS 1000
+
+static AtmotubeRecord records[HOST_READ_MAX];
+static uint64_t ts[HOST_READ_MAX];
+static int device[HOST_READ_MAX];
+static int metric[HOST_READ_MAX];
+static double value[HOST_READ_MAX];
+
+static void
+deliver (AtmotubePlugin * plugin, void *ctx, size_t n)
+{
+  size_t i;
+
+  if (plugin->write_batch != NULL)
+    {
+      for (i = 0; i < n; i++)
+	{
+	  ts[i] = records[i].ts;
+	  device[i] = records[i].device;
+	  metric[i] = records[i].metric;
+	  value[i] = records[i].value;
+	}
+      plugin->write_batch (ctx, n, ts, device, metric, value);
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      const AtmotubeRecord *r = &records[i];
+
+      switch (r->metric)
+	{
+	case TEMPERATURE:
+	  plugin->temperature (ctx, r->ts, r->device,
+			       (unsigned long) r->value);
+	  break;
+	case HUMIDITY:
+	  plugin->humidity (ctx, r->ts, r->device, (unsigned long) r->value);
+	  break;
+	case VOC:
+	  plugin->voc (ctx, r->ts, r->device, (float) r->value);
+	  break;
+	default:
+	  PRINT_ERROR ("Unknown metric: %d\n", r->metric);
+	  break;
+	}
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i;
+  size_t n;
+
+  if (argc < HOST_ARGS || (argc - HOST_ARGS) % 2 != 0)
+    {
+      printf ("Usage: %s type file fd filename commit_rows commit_interval "
+	      "partition retention storage voc_scale [name address]...\n",
+	      argv[0]);
+      return 1;
+    }
+
+  /* The reader stops the host by closing the ring. It may have been
+   * started by a thread of the reader which has exited since, so the
+   * reader itself is checked on instead of asking for a signal when
+   * that thread goes. */
+  const pid_t reader = getppid ();
+  signal (SIGINT, SIG_IGN);
+
+  const char *type = argv[1];
+  const char *file = argv[2];
+  const int fd = atoi (argv[3]);
+
+  AtmotubeOutput o;
+  const char *names[(argc - HOST_ARGS) / 2 + 1];
+  const char *addresses[(argc - HOST_ARGS) / 2 + 1];
+
+  o.filename = argv[4];
+  o.commit_rows = atoi (argv[5]);
+  o.commit_interval = atoi (argv[6]);
+  o.partition = (Atmotube_Partition) atoi (argv[7]);
+  o.retention = atoi (argv[8]);
+  o.storage = (Atmotube_Storage) atoi (argv[9]);
+  o.voc_scale = atoi (argv[10]);
+  o.num_devices = (argc - HOST_ARGS) / 2;
+  o.device_names = names;
+  o.device_addresses = addresses;
+  for (i = 0; i < o.num_devices; i++)
+    {
+      names[i] = argv[HOST_ARGS + 2 * i];
+      addresses[i] = argv[HOST_ARGS + 1 + 2 * i];
+    }
+
+  AtmotubeRing *ring = ring_attach (fd);
+  close (fd);
+  if (ring == NULL)
+    {
+      PRINT_ERROR ("%s\n", "Unable to map the ring");
+      return 1;
+    }
+
+  sqlite_heap_start ();
+
+  AtmotubePlugin *plugin = atmotube_plugin_load (type, file);
+  if (plugin == NULL)
+    {
+      sqlite_heap_stop ();
+      ring_detach (ring);
+      return 1;
+    }
+
+  void *ctx = plugin->plugin_start (&o);
+  if (ctx == NULL)
+    {
+      PRINT_ERROR ("Unable to start plugin %s\n", file);
+      atmotube_plugin_close (plugin);
+      sqlite_heap_stop ();
+      ring_detach (ring);
+      return 1;
+    }
+
+  const uint64_t flush_interval = plugin->plugin_flush != NULL ?
+    ATMOTUBE_MS_TO_NS (o.commit_interval) / 2 : 0;
+  uint64_t next_flush = atmotube_timestamp_ns () + flush_interval;
+
+  for (;;)
+    {
+      uint64_t timeout = ATMOTUBE_MS_TO_NS (HOST_READER_POLL_MS);
+
+      if (flush_interval > 0)
+	{
+	  uint64_t now = atmotube_timestamp_ns ();
+	  if (now >= next_flush)
+	    {
+	      plugin->plugin_flush (ctx);
+	      now = atmotube_timestamp_ns ();
+	      next_flush = now + flush_interval;
+	    }
+	  if (next_flush - now < timeout)
+	    {
+	      timeout = next_flush - now;
+	    }
+	}
+
+      n = ring_read (ring, records, HOST_READ_MAX, timeout);
+      if (n > 0)
+	{
+	  deliver (plugin, ctx, n);
+	}
+      else if (ring_closed (ring) || getppid () != reader)
+	{
+	  break;
+	}
+    }
+
+  int ret = plugin->plugin_stop (ctx);
+
+  atmotube_plugin_close (plugin);
+  sqlite_heap_stop ();
+  ring_detach (ring);
+
+  return ret == ATMOTUBE_RET_OK ? 0 : 1;
+}
@@ -17,6 +17,7 @@
 #include <signal.h>
 #include <assert.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -41,6 +42,21 @@ intHandler (int dummy)
   aborted = true;
 }
 
+/* SIGHUP: swap in new versions of the output plugins. */
+static gboolean
+reload_handler (gpointer data)
+{
+  UNUSED (data);
+  printf ("Reloading plugins.\n");
+
+  if (atmotube_reload_plugins (NULL) != ATMOTUBE_RET_OK)
+    {
+      printf ("Unable to reload plugins.\n");
+    }
+
+  return TRUE;
+}
+
 /* Sleep for a number of milliseconds. */
 static int
 sleep_ms (uint16_t milliseconds)
@@ -135,6 +151,7 @@ main (int argc, char *argv[])
   printf ("Ready to receive.\n");
 
   loop = g_main_loop_new (NULL, 0);
+  g_unix_signal_add (SIGHUP, reload_handler, NULL);
   g_main_loop_run (loop);
   g_main_loop_unref (loop);
 
@@ -50,6 +50,24 @@ enum CHARACTER_ID
 #define ATMOTUBE_MAX_RESOUTION 60*1000	/* ms */
 #define ATMOTUBE_DEF_RESOUTION 1000	/* ms */
 
+/* Outputs with batch support get records handed over when this many
+ * are collected, or when the oldest one is this old. */
+#define ATMOTUBE_DEF_BATCH_SIZE 256
+#define ATMOTUBE_DEF_BATCH_INTERVAL 5000	/* ms */
+
+/* Records an output queue holds before its policy applies. */
+#define ATMOTUBE_DEF_QUEUE_SIZE 1024
+
+/* Queue fill, in percent, from which the shed policy coalesces
+ * records and then drops low priority metrics. */
+#define ATMOTUBE_DEF_SHED_COALESCE 50
+#define ATMOTUBE_DEF_SHED_DROP 75
+
+/* Outputs writing in transactions commit when this many rows are
+ * pending, or when the oldest one is this old. */
+#define ATMOTUBE_DEF_COMMIT_ROWS 1000
+#define ATMOTUBE_DEF_COMMIT_INTERVAL 1000	/* ms */
+
 struct stored
 {
   uint64_t timestamp;
@@ -82,6 +100,16 @@ int atmotube_add_devices_from_config (const char *fullName);
 /* Create output plugins described by config. */
 int atmotube_create_outputs ();
 
+/* Reload the plugin library of the given output type, or of all
+ * loaded plugins when type is NULL, without touching the devices.
+ * Each output hands what it has taken to the old instance, which is
+ * stopped; records arriving meanwhile are queued for the new
+ * instance. When the new library does not load, or an output fails
+ * to start it, all outputs keep the old one and ATMOTUBE_RET_ERROR is
+ * returned. Replace the library file, do not write into it. Call
+ * from the main thread. */
+int atmotube_reload_plugins (const char *type);
+
 /* Find atmotube plugins. */
 int atmotube_plugin_find (const char *path);
 
@@ -0,0 +1,59 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+
+#include "atmotube-plugin.h"
+#include "atmotube-builtin.h"
+#include "atmotube.h"
+
+#define BUILTIN_PLUGIN(id, p, name, flush) \
+  { \
+    .type = name, \
+    .handle = NULL, \
+    .fd = -1, \
+    .builtin = id, \
+    .get_plugin_type = p ## get_plugin_type, \
+    .plugin_start = p ## plugin_start, \
+    .temperature = p ## temperature, \
+    .humidity = p ## humidity, \
+    .voc = p ## voc, \
+    .write_batch = p ## write_batch, \
+    .plugin_flush = flush, \
+    .plugin_stop = p ## plugin_stop, \
+  }
+
+static AtmotubePlugin builtins[] = {
+  BUILTIN_PLUGIN (ATMOTUBE_BUILTIN_FILE, file_, "file", NULL),
+  BUILTIN_PLUGIN (ATMOTUBE_BUILTIN_DB, db_, "db", db_plugin_flush),
+};
+
+#define NUM_BUILTINS (sizeof (builtins) / sizeof (builtins[0]))
+
+AtmotubePlugin *
+atmotube_builtin_get (const char *type)
+{
+  size_t i;
+
+  for (i = 0; i < NUM_BUILTINS; i++)
+    {
+      if (strcmp (builtins[i].type, type) == 0)
+	{
+	  return &builtins[i];
+	}
+    }
+
+  return NULL;
+}
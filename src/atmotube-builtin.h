@@ -0,0 +1,39 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ATMOTUBE_BUILTIN_H
+#define ATMOTUBE_BUILTIN_H
+
+#include "atmotube-plugin-if.h"
+
+/* Plugins linked into atmlib when built with ATMOTUBE_BUILTIN_PLUGINS.
+ * They are registered at compile time and called directly, loaded
+ * plugins are used for every other type. */
+typedef enum
+{
+  ATMOTUBE_BUILTIN_NONE = 0,
+  ATMOTUBE_BUILTIN_FILE,
+  ATMOTUBE_BUILTIN_DB,
+} Atmotube_Builtin_Id;
+
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+
+ATMOTUBE_PLUGIN_DECLARE (file_);
+ATMOTUBE_PLUGIN_DECLARE (db_);
+int db_plugin_flush (void *ctx);
+
+#endif /* ATMOTUBE_BUILTIN_PLUGINS */
+
+#endif /* ATMOTUBE_BUILTIN_H */
@@ -11,23 +11,52 @@
 
 static cfg_t *cfg;
 
+static cfg_opt_t transform_opts[] = {
+  CFG_FLOAT ("scale", 1.0, CFGF_NONE),
+  CFG_FLOAT ("offset", 0.0, CFGF_NONE),
+  CFG_FLOAT_LIST ("clamp", 0, CFGF_NONE),
+  CFG_END ()
+};
+
 static cfg_opt_t device_opts[] = {
   CFG_STR ("name", 0, CFGF_NONE),
   CFG_STR ("address", 0, CFGF_NONE),
   CFG_STR ("description", 0, CFGF_NONE),
   CFG_INT ("resolution", 0, CFGF_NONE),
+  CFG_STR ("group", 0, CFGF_NONE),
+  CFG_SEC ("transform", transform_opts, CFGF_MULTI | CFGF_TITLE),
   CFG_END ()
 };
 
 static cfg_opt_t output_opts[] = {
   CFG_STR ("type", 0, CFGF_NONE),
-  CFG_STR ("source", 0, CFGF_NONE),
+  CFG_STR_LIST ("source", 0, CFGF_NONE),
+  CFG_STR_LIST ("group", 0, CFGF_NONE),
+  CFG_STR_LIST ("metric", 0, CFGF_NONE),
+  CFG_INT ("min_resolution", 0, CFGF_NONE),
+  CFG_INT ("max_resolution", 0, CFGF_NONE),
   CFG_STR ("filename", 0, CFGF_NONE),
+  CFG_INT ("batch_size", ATMOTUBE_DEF_BATCH_SIZE, CFGF_NONE),
+  CFG_INT ("batch_interval", ATMOTUBE_DEF_BATCH_INTERVAL, CFGF_NONE),
+  CFG_INT ("queue_size", ATMOTUBE_DEF_QUEUE_SIZE, CFGF_NONE),
+  CFG_STR ("queue_policy", "block", CFGF_NONE),
+  CFG_INT ("shed_coalesce", ATMOTUBE_DEF_SHED_COALESCE, CFGF_NONE),
+  CFG_INT ("shed_drop", ATMOTUBE_DEF_SHED_DROP, CFGF_NONE),
+  CFG_STR_LIST ("low_priority", 0, CFGF_NONE),
+  CFG_INT ("max_latency", 0, CFGF_NONE),
+  CFG_INT ("latency_budget", 0, CFGF_NONE),
+  CFG_INT ("commit_rows", ATMOTUBE_DEF_COMMIT_ROWS, CFGF_NONE),
+  CFG_INT ("commit_interval", ATMOTUBE_DEF_COMMIT_INTERVAL, CFGF_NONE),
+  CFG_STR ("partition", "none", CFGF_NONE),
+  CFG_INT ("retention", 0, CFGF_NONE),
+  CFG_STR ("storage", "rows", CFGF_NONE),
+  CFG_STR ("host", 0, CFGF_NONE),
   CFG_END ()
 };
 
 static cfg_opt_t global_opts[] = {
   CFG_STR ("plugin_dir", 0, CFGF_NONE),
+  CFG_BOOL ("voc_scaled", cfg_false, CFGF_NONE),
   CFG_END ()
 };
 
@@ -43,6 +72,8 @@ static int numOutputs = 0;
 
 static char *configFilename = NULL;
 
+static bool vocScaled = false;
+
 static int
 validate_global (cfg_t * cfg, cfg_opt_t * opt)
 {
@@ -64,6 +95,94 @@ validate_global (cfg_t * cfg, cfg_opt_t * opt)
   return ATMOTUBE_RET_OK;
 }
 
+/* Names of Atmotube_Queue_Policy values used in the config. */
+static const char *queue_policies[] = {
+  "block", "drop-oldest", "coalesce", "shed"
+};
+
+static int
+get_queue_policy (const char *name, Atmotube_Queue_Policy * policy)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof (queue_policies) / sizeof (char *); i++)
+    {
+      if (strcmp (queue_policies[i], name) == 0)
+	{
+	  *policy = (Atmotube_Queue_Policy) i;
+	  return ATMOTUBE_RET_OK;
+	}
+    }
+
+  return ATMOTUBE_RET_ERROR;
+}
+
+/* Names of Atmotube_Partition values used in the config. */
+static const char *partitions[] = {
+  "none", "day", "month"
+};
+
+static int
+get_partition (const char *name, Atmotube_Partition * partition)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof (partitions) / sizeof (char *); i++)
+    {
+      if (strcmp (partitions[i], name) == 0)
+	{
+	  *partition = (Atmotube_Partition) i;
+	  return ATMOTUBE_RET_OK;
+	}
+    }
+
+  return ATMOTUBE_RET_ERROR;
+}
+
+/* Names of Atmotube_Storage values used in the config. */
+static const char *storages[] = {
+  "rows", "chunks"
+};
+
+static int
+get_storage (const char *name, Atmotube_Storage * storage)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof (storages) / sizeof (char *); i++)
+    {
+      if (strcmp (storages[i], name) == 0)
+	{
+	  *storage = (Atmotube_Storage) i;
+	  return ATMOTUBE_RET_OK;
+	}
+    }
+
+  return ATMOTUBE_RET_ERROR;
+}
+
+/* Metrics an output can select, indexed by CHARACTER_ID. */
+static const char *metric_names[] = {
+  "voc", "humidity", "temperature"
+};
+
+/* Get the CHARACTER_ID of a metric name, or -1. */
+static int
+get_metric (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof (metric_names) / sizeof (char *); i++)
+    {
+      if (strcmp (metric_names[i], name) == 0)
+	{
+	  return (int) i;
+	}
+    }
+
+  return -1;
+}
+
 static int
 validate_output (cfg_t * cfg, cfg_opt_t * opt)
 {
@@ -89,9 +208,130 @@ validate_output (cfg_t * cfg, cfg_opt_t * opt)
       return ATMOTUBE_RET_ERROR;
     }
 
-  if (cfg_getstr (sec, "source") == 0)
+  if (cfg_size (sec, "source") == 0 && cfg_size (sec, "group") == 0)
     {
-      cfg_error (cfg, "source option must be set for output '%s'",
+      cfg_error (cfg, "source or group option must be set for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  unsigned int i;
+  for (i = 0; i < cfg_size (sec, "metric"); i++)
+    {
+      if (get_metric (cfg_getnstr (sec, "metric", i)) < 0)
+	{
+	  cfg_error (cfg,
+		     "metric option must be voc, humidity or temperature for output '%s'",
+		     cfg_title (sec));
+	  return ATMOTUBE_RET_ERROR;
+	}
+    }
+
+  if (cfg_getint (sec, "min_resolution") < 0
+      || cfg_getint (sec, "max_resolution") < 0)
+    {
+      cfg_error (cfg, "resolution limits can't be negative for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (cfg_getint (sec, "batch_size") < 1)
+    {
+      cfg_error (cfg, "batch_size option must be positive for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (cfg_getint (sec, "batch_interval") < 0)
+    {
+      cfg_error (cfg, "batch_interval option can't be negative for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (cfg_getint (sec, "queue_size") < 1)
+    {
+      cfg_error (cfg, "queue_size option must be positive for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  Atmotube_Queue_Policy policy;
+  if (get_queue_policy (cfg_getstr (sec, "queue_policy"), &policy) !=
+      ATMOTUBE_RET_OK)
+    {
+      cfg_error (cfg,
+		 "queue_policy option must be block, drop-oldest, coalesce or shed for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  int coalesce = cfg_getint (sec, "shed_coalesce");
+  int drop = cfg_getint (sec, "shed_drop");
+  if (coalesce < 0 || coalesce > 100 || drop < 0 || drop > 100)
+    {
+      cfg_error (cfg,
+		 "shed_coalesce and shed_drop options must be between 0 and 100 for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  for (i = 0; i < cfg_size (sec, "low_priority"); i++)
+    {
+      if (get_metric (cfg_getnstr (sec, "low_priority", i)) < 0)
+	{
+	  cfg_error (cfg,
+		     "low_priority option must be voc, humidity or temperature for output '%s'",
+		     cfg_title (sec));
+	  return ATMOTUBE_RET_ERROR;
+	}
+    }
+
+  if (cfg_getint (sec, "max_latency") < 0)
+    {
+      cfg_error (cfg, "max_latency option can't be negative for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (cfg_getint (sec, "commit_rows") < 0
+      || cfg_getint (sec, "commit_interval") < 0)
+    {
+      cfg_error (cfg,
+		 "commit_rows and commit_interval options can't be negative for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  Atmotube_Partition partition;
+  if (get_partition (cfg_getstr (sec, "partition"), &partition) !=
+      ATMOTUBE_RET_OK)
+    {
+      cfg_error (cfg,
+		 "partition option must be none, day or month for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (cfg_getint (sec, "retention") < 0)
+    {
+      cfg_error (cfg, "retention option can't be negative for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  Atmotube_Storage storage;
+  if (get_storage (cfg_getstr (sec, "storage"), &storage) != ATMOTUBE_RET_OK)
+    {
+      cfg_error (cfg, "storage option must be rows or chunks for output '%s'",
+		 cfg_title (sec));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (cfg_getint (sec, "latency_budget") < 0)
+    {
+      cfg_error (cfg,
+		 "latency_budget option can't be negative for output '%s'",
 		 cfg_title (sec));
       return ATMOTUBE_RET_ERROR;
     }
@@ -137,6 +377,31 @@ validate_device (cfg_t * cfg, cfg_opt_t * opt)
       return ATMOTUBE_RET_ERROR;
     }
 
+  unsigned int i;
+  for (i = 0; i < cfg_size (sec, "transform"); i++)
+    {
+      cfg_t *t = cfg_getnsec (sec, "transform", i);
+      int metric = get_metric (cfg_title (t));
+
+      if (metric < 0 || metric >= ATMOTUBE_TRANSFORM_METRICS)
+	{
+	  cfg_error (cfg,
+		     "transform must be for voc, humidity or temperature in device '%s'",
+		     cfg_title (sec));
+	  return ATMOTUBE_RET_ERROR;
+	}
+
+      if (cfg_size (t, "clamp") != 0
+	  && (cfg_size (t, "clamp") != 2
+	      || cfg_getnfloat (t, "clamp", 0) > cfg_getnfloat (t, "clamp",
+								   1)))
+	{
+	  cfg_error (cfg, "clamp must be {min, max} in device '%s'",
+		     cfg_title (sec));
+	  return ATMOTUBE_RET_ERROR;
+	}
+    }
+
   return ATMOTUBE_RET_OK;
 }
 
@@ -163,12 +428,66 @@ atmotube_config_start (const char *fullName)
 static void
 dumpDevice (Atmotube_Device * device)
 {
+  int i, j;
+
   PRINT_DEBUG ("Device #%u (%s):\n", device->device_id, device->device_name);
   PRINT_DEBUG ("  address = %s\n", device->device_address);
   PRINT_DEBUG ("  description = %s\n", device->device_description);
   PRINT_DEBUG ("  resolution = %d\n", device->device_resolution);
-  PRINT_DEBUG ("  output type = %s\n", device->output_type);
-  PRINT_DEBUG ("  filename = %s\n", device->output_filename);
+  if (device->device_group != NULL)
+    {
+      PRINT_DEBUG ("  group = %s\n", device->device_group);
+    }
+  for (i = 0; i < ATMOTUBE_TRANSFORM_METRICS; i++)
+    {
+      const Atmotube_Transform *t = &device->device_transforms[i];
+      for (j = 0; j < t->num_ops; j++)
+	{
+	  PRINT_DEBUG ("  transform %s: %s %f %f\n", metric_names[i],
+		       t->ops[j].type == TRANSFORM_AFFINE ? "affine" : "clamp",
+		       t->ops[j].a, t->ops[j].b);
+	}
+    }
+}
+
+static void
+dumpOutput (Atmotube_Output_Config * output)
+{
+  int i;
+
+  PRINT_DEBUG ("Output #%u (%s):\n", output->output_id, output->output_name);
+  PRINT_DEBUG ("  type = %s\n", output->output_type);
+  PRINT_DEBUG ("  filename = %s\n", output->output_filename);
+  PRINT_DEBUG ("  batch size = %d\n", output->output_batch_size);
+  PRINT_DEBUG ("  batch interval = %d\n", output->output_batch_interval);
+  PRINT_DEBUG ("  commit rows = %d\n", output->output_commit_rows);
+  PRINT_DEBUG ("  commit interval = %d\n", output->output_commit_interval);
+  PRINT_DEBUG ("  partition = %s\n", partitions[output->output_partition]);
+  PRINT_DEBUG ("  retention = %d\n", output->output_retention);
+  PRINT_DEBUG ("  storage = %s\n", storages[output->output_storage]);
+  PRINT_DEBUG ("  queue size = %d\n", output->output_queue_size);
+  PRINT_DEBUG ("  queue policy = %s\n",
+	       queue_policies[output->output_queue_policy]);
+  if (output->output_queue_policy == QUEUE_POLICY_SHED)
+    {
+      PRINT_DEBUG ("  shed coalesce = %d%%, drop = %d%%\n",
+		   output->output_shed_coalesce, output->output_shed_drop);
+      PRINT_DEBUG ("  low priority = 0x%x\n", output->output_low_priority);
+      PRINT_DEBUG ("  max latency = %d\n", output->output_max_latency);
+    }
+  if (output->output_latency_budget > 0)
+    {
+      PRINT_DEBUG ("  latency budget = %d\n", output->output_latency_budget);
+    }
+  if (output->output_host != NULL)
+    {
+      PRINT_DEBUG ("  host = %s\n", output->output_host);
+    }
+  PRINT_DEBUG ("  metrics = 0x%x\n", output->output_metrics);
+  for (i = 0; i < output->num_sources; i++)
+    {
+      PRINT_DEBUG ("  source = device #%d\n", output->source_ids[i]);
+    }
 }
 
 /*
@@ -194,12 +513,11 @@ get_ptr (void *src, int number, size_t element_size, size_t offset)
   return (Atmotube_Device *) p;
 }
 
-static char *UNDEF_OUTPUT_TYPE = NULL;
-
 static void
 clean_up_devices (void *memory, size_t element_size, size_t offset)
 {
   int i = 0;
+  int j;
   for (i = 0; i < numDevices; i++)
     {
       PRINT_DEBUG ("Deallocate device %d\n", i);
@@ -207,20 +525,291 @@ clean_up_devices (void *memory, size_t element_size, size_t offset)
       free (device->device_name);
       free (device->device_address);
       free (device->device_description);
-      free (device->output_type);
-      free (device->output_filename);
+      free (device->device_group);
+      for (j = 0; j < ATMOTUBE_TRANSFORM_METRICS; j++)
+	{
+	  transform_free (&device->device_transforms[j]);
+	}
     }
 }
 
+void
+atmotube_config_free_outputs (Atmotube_Output_Config * outputs,
+			      int numOutputs)
+{
+  int i;
+
+  if (outputs == NULL)
+    {
+      return;
+    }
+
+  for (i = 0; i < numOutputs; i++)
+    {
+      Atmotube_Output_Config *output = outputs + i;
+      free (output->output_name);
+      free (output->output_type);
+      free (output->output_filename);
+      free (output->output_host);
+      free (output->source_ids);
+    }
+
+  free (outputs);
+}
+
+/* Get the device_id of the device called name, or -1. */
+static int
+find_device_id (void *memory, size_t element_size, size_t offset,
+		const char *name)
+{
+  int i;
+
+  for (i = 0; i < numDevices; i++)
+    {
+      Atmotube_Device *device = get_ptr (memory, i, element_size, offset);
+      if (strcmp (device->device_name, name) == 0)
+	{
+	  return device->device_id;
+	}
+    }
+
+  return -1;
+}
+
+/* Whether x, in units of 1/unit, is a whole number of them. */
+static bool
+is_whole (double x, double unit)
+{
+  const double v = x * unit;
+  const double r = (double) (long) (v < 0 ? v - 0.5 : v + 0.5);
+
+  return v - r < 1e-9 && r - v < 1e-9;
+}
+
+/* Integer metrics (humidity and temperature, VOC when it is kept
+ * scaled) are logged as integers, so a transform must take a whole
+ * value to a whole value: whole scale, and offset and clamp in whole
+ * units. */
+static bool
+keeps_integers (cfg_t * cfg_transform, int metric)
+{
+  const double unit = metric != VOC ? 1 : ATMOTUBE_VOC_SCALE;
+  unsigned int i;
+
+  if (metric == VOC && !vocScaled)
+    {
+      return true;
+    }
+
+  if (!is_whole (cfg_getfloat (cfg_transform, "scale"), 1)
+      || !is_whole (cfg_getfloat (cfg_transform, "offset"), unit))
+    {
+      return false;
+    }
+
+  for (i = 0; i < cfg_size (cfg_transform, "clamp"); i++)
+    {
+      if (!is_whole (cfg_getnfloat (cfg_transform, "clamp", i), unit))
+	{
+	  return false;
+	}
+    }
+
+  return true;
+}
+
+/* Compile the transform sections of a device, in the given order. */
+static int
+load_transforms (cfg_t * cfg_device, Atmotube_Device * device)
+{
+  unsigned int i;
+  int ret = ATMOTUBE_RET_OK;
+
+  for (i = 0; i < cfg_size (cfg_device, "transform"); i++)
+    {
+      cfg_t *cfg_transform = cfg_getnsec (cfg_device, "transform", i);
+      const int metric = get_metric (cfg_title (cfg_transform));
+      Atmotube_Transform *t = &device->device_transforms[metric];
+
+      if (!keeps_integers (cfg_transform, metric))
+	{
+	  PRINT_ERROR ("Transform %s of device %s must keep whole values\n",
+		       cfg_title (cfg_transform), cfg_title (cfg_device));
+	  return ATMOTUBE_RET_ERROR;
+	}
+
+      ret |= transform_add_affine (t, cfg_getfloat (cfg_transform, "scale"),
+				   cfg_getfloat (cfg_transform, "offset"));
+      if (cfg_size (cfg_transform, "clamp") == 2)
+	{
+	  ret |= transform_add_clamp (t,
+				      cfg_getnfloat (cfg_transform, "clamp",
+						     0),
+				      cfg_getnfloat (cfg_transform, "clamp",
+						     1));
+	}
+    }
+
+  return ret;
+}
+
+/* Add device id to the sources of output, unless it is there already
+ * or its resolution is outside [min, max] (0 for no limit). */
+static void
+add_source (Atmotube_Output_Config * output, void *memory,
+	    size_t element_size, size_t offset, int id, int min, int max)
+{
+  int i;
+  Atmotube_Device *device = get_ptr (memory, id, element_size, offset);
+
+  for (i = 0; i < output->num_sources; i++)
+    {
+      if (output->source_ids[i] == id)
+	{
+	  return;
+	}
+    }
+
+  if ((min > 0 && device->device_resolution < min)
+      || (max > 0 && device->device_resolution > max))
+    {
+      PRINT_DEBUG ("Resolution of device %d out of range for %s\n", id,
+		   output->output_name);
+      return;
+    }
+
+  output->source_ids[output->num_sources++] = id;
+}
+
+static int
+load_output (cfg_t * cfg_output, Atmotube_Output_Config * output,
+	     void *memory, size_t element_size, size_t offset)
+{
+  int i, j;
+  const int min = cfg_getint (cfg_output, "min_resolution");
+  const int max = cfg_getint (cfg_output, "max_resolution");
+
+  output->output_name = strdup (cfg_title (cfg_output));
+  output->output_type = strdup (cfg_getstr (cfg_output, "type"));
+  output->output_filename = strdup (cfg_getstr (cfg_output, "filename"));
+  output->output_batch_size = cfg_getint (cfg_output, "batch_size");
+  output->output_batch_interval = cfg_getint (cfg_output, "batch_interval");
+  output->output_queue_size = cfg_getint (cfg_output, "queue_size");
+  get_queue_policy (cfg_getstr (cfg_output, "queue_policy"),
+		    &output->output_queue_policy);
+  output->output_shed_coalesce = cfg_getint (cfg_output, "shed_coalesce");
+  output->output_shed_drop = cfg_getint (cfg_output, "shed_drop");
+  output->output_max_latency = cfg_getint (cfg_output, "max_latency");
+  output->output_latency_budget = cfg_getint (cfg_output, "latency_budget");
+  output->output_commit_rows = cfg_getint (cfg_output, "commit_rows");
+  output->output_commit_interval = cfg_getint (cfg_output, "commit_interval");
+  get_partition (cfg_getstr (cfg_output, "partition"),
+		 &output->output_partition);
+  output->output_retention = cfg_getint (cfg_output, "retention");
+  get_storage (cfg_getstr (cfg_output, "storage"), &output->output_storage);
+  output->output_low_priority = 0;
+  for (i = 0; i < (int) cfg_size (cfg_output, "low_priority"); i++)
+    {
+      output->output_low_priority |=
+	1u << get_metric (cfg_getnstr (cfg_output, "low_priority", i));
+    }
+  if (cfg_getstr (cfg_output, "host") != NULL)
+    {
+      output->output_host = strdup (cfg_getstr (cfg_output, "host"));
+    }
+
+  output->output_metrics = 0;
+  for (i = 0; i < (int) cfg_size (cfg_output, "metric"); i++)
+    {
+      output->output_metrics |=
+	1u << get_metric (cfg_getnstr (cfg_output, "metric", i));
+    }
+  if (output->output_metrics == 0)
+    {
+      output->output_metrics = (1u << VOC) | (1u << HUMIDITY)
+	| (1u << TEMPERATURE);
+    }
+
+  output->num_sources = 0;
+  output->source_ids = (int *) malloc (numDevices * sizeof (int));
+  if (output->source_ids == NULL && numDevices > 0)
+    {
+      PRINT_ERROR ("Unable to allocate the sources of output %s\n",
+		   output->output_name);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* Named devices first, in the given order. */
+  for (i = 0; i < (int) cfg_size (cfg_output, "source"); i++)
+    {
+      char *src = cfg_getnstr (cfg_output, "source", i);
+      int id = find_device_id (memory, element_size, offset, src);
+      if (id < 0)
+	{
+	  printf ("Unable to find source %s\n", src);
+	  return ATMOTUBE_RET_ERROR;
+	}
+
+      PRINT_DEBUG ("Found device %d for source %s\n", id, src);
+      add_source (output, memory, element_size, offset, id, min, max);
+    }
+
+  /* Then the members of the groups. */
+  for (i = 0; i < (int) cfg_size (cfg_output, "group"); i++)
+    {
+      char *group = cfg_getnstr (cfg_output, "group", i);
+
+      for (j = 0; j < numDevices; j++)
+	{
+	  Atmotube_Device *device = get_ptr (memory, j, element_size, offset);
+	  if (device->device_group != NULL
+	      && strcmp (device->device_group, group) == 0)
+	    {
+	      PRINT_DEBUG ("Found device %d in group %s\n", j, group);
+	      add_source (output, memory, element_size, offset, j, min, max);
+	    }
+	}
+    }
+
+  if (output->num_sources == 0)
+    {
+      printf ("No source devices for output %s\n", output->output_name);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Check if any output has the device as a source. */
+static bool
+has_output (Atmotube_Output_Config * outputs, int device_id)
+{
+  int i, j;
+
+  for (i = 0; i < numOutputs; i++)
+    {
+      for (j = 0; j < outputs[i].num_sources; j++)
+	{
+	  if (outputs[i].source_ids[j] == device_id)
+	    {
+	      return true;
+	    }
+	}
+    }
+
+  return false;
+}
+
 int
 atmotube_config_load (setPluginPathCB pluginPathCb,
 		      NumDevicesCB numDevicesCb,
-		      deviceCB deviceFb, size_t element_size, size_t offset)
+		      deviceCB deviceFb, outputsCB outputsCb,
+		      size_t element_size, size_t offset)
 {
   int ret = 0;
   int i = 0;
-  int j = 0;
   void *memory = NULL;
+  Atmotube_Output_Config *outputs = NULL;
   int deviceId = 0;
 
   cfg = cfg_init (opts, CFGF_NOCASE);
@@ -249,6 +838,7 @@ atmotube_config_load (setPluginPathCB pluginPathCb,
     }
 
   pluginPathCb (path);
+  vocScaled = cfg_getbool (cfg_global, "voc_scaled");
 
   numDevices = cfg_size (cfg, "device");
   PRINT_DEBUG ("Load: %d device(s) present\n", numDevices);
@@ -256,12 +846,11 @@ atmotube_config_load (setPluginPathCB pluginPathCb,
   numOutputs = cfg_size (cfg, "output");
   PRINT_DEBUG ("Load: %d output(s) present\n", numOutputs);
 
-  /* Check that devices and outputs match: */
-  if (numDevices != numOutputs)
+  /* Outputs can have several sources and devices several outputs,
+   * but there has to be at least one output. */
+  if (numOutputs == 0)
     {
-      printf ("Unexpected number of devices (%d) vs outputs (%d).\n",
-	      numDevices, numOutputs);
-      printf ("Was expecting %d outputs\n", numDevices);
+      printf ("No outputs configured.\n");
       cfg_free (cfg);
       return ATMOTUBE_RET_ERROR;
     }
@@ -278,8 +867,9 @@ atmotube_config_load (setPluginPathCB pluginPathCb,
       device->device_address = NULL;
       device->device_description = NULL;
       device->device_resolution = 0;
-      device->output_type = UNDEF_OUTPUT_TYPE;
-      device->output_filename = NULL;
+      device->device_group = NULL;
+      memset (device->device_transforms, 0,
+	      sizeof (device->device_transforms));
     }
 
   deviceId = 0;
@@ -294,35 +884,40 @@ atmotube_config_load (setPluginPathCB pluginPathCb,
       device->device_description =
 	strdup (cfg_getstr (cfg_device, "description"));
       device->device_resolution = cfg_getint (cfg_device, "resolution");
+      if (cfg_getstr (cfg_device, "group") != NULL)
+	{
+	  device->device_group = strdup (cfg_getstr (cfg_device, "group"));
+	}
+      if (load_transforms (cfg_device, device) != ATMOTUBE_RET_OK)
+	{
+	  clean_up_devices (memory, element_size, offset);
+	  cfg_free (cfg);
+	  return ATMOTUBE_RET_ERROR;
+	}
 
       PRINT_DEBUG ("Added device %d\n", deviceId);
       deviceId++;
     }
 
+  outputs = (Atmotube_Output_Config *)
+    calloc (numOutputs, sizeof (Atmotube_Output_Config));
+  if (outputs == NULL && numOutputs > 0)
+    {
+      clean_up_devices (memory, element_size, offset);
+      cfg_free (cfg);
+      return ATMOTUBE_RET_ERROR;
+    }
+
   for (i = 0; i < numOutputs; i++)
     {
       cfg_t *cfg_output = cfg_getnsec (cfg, "output", i);
-      char *src = cfg_getstr (cfg_output, "source");
+      Atmotube_Output_Config *output = outputs + i;
 
-      PRINT_DEBUG ("Output %s\n", src);
-
-      bool found = false;
-      for (j = 0; j < numDevices; j++)
+      output->output_id = i;
+      if (load_output (cfg_output, output, memory, element_size, offset) !=
+	  ATMOTUBE_RET_OK)
 	{
-	  Atmotube_Device *device = get_ptr (memory, j, element_size, offset);
-	  if (strcmp (device->device_name, src) == 0)
-	    {
-	      PRINT_DEBUG ("Found device %s for source %s\n",
-			   device->device_name, src);
-	      device->output_type = strdup (cfg_getstr (cfg_output, "type"));
-	      device->output_filename =
-		strdup (cfg_getstr (cfg_output, "filename"));
-	      found = true;
-	    }
-	}
-      if (!found)
-	{
-	  printf ("Unable to find source %s\n", src);
+	  atmotube_config_free_outputs (outputs, numOutputs);
 	  clean_up_devices (memory, element_size, offset);
 	  cfg_free (cfg);
 	  return ATMOTUBE_RET_ERROR;
@@ -334,10 +929,11 @@ atmotube_config_load (setPluginPathCB pluginPathCb,
     {
       Atmotube_Device *device = get_ptr (memory, i, element_size, offset);
 
-      if (device->output_type == UNDEF_OUTPUT_TYPE)
+      if (!has_output (outputs, device->device_id))
 	{
 	  printf ("Device %s needs an output. Can't continue.\n",
 		  device->device_name);
+	  atmotube_config_free_outputs (outputs, numOutputs);
 	  clean_up_devices (memory, element_size, offset);
 	  cfg_free (cfg);
 	  return ATMOTUBE_RET_ERROR;
@@ -352,12 +948,32 @@ atmotube_config_load (setPluginPathCB pluginPathCb,
       deviceFb (device);
     }
 
+  for (i = 0; i < numOutputs; i++)
+    {
+      dumpOutput (outputs + i);
+    }
+
+  if (outputsCb != NULL)
+    {
+      outputsCb (outputs, numOutputs);
+    }
+  else
+    {
+      atmotube_config_free_outputs (outputs, numOutputs);
+    }
+
   cfg_free (cfg);
   cfg = NULL;
 
   return ATMOTUBE_RET_OK;
 }
 
+bool
+atmotube_config_voc_scaled (void)
+{
+  return vocScaled;
+}
+
 void
 atmotube_config_end ()
 {
@@ -18,12 +18,28 @@
 #define ATMOTUBE_CONFIG_H
 
 #include <stddef.h>
+#include <stdbool.h>
+
+#include "atmotube-transform.h"
+#include "atmotube-plugin-if.h"
 
 #define OUTPUT_FILE "file"
 #define OUTPUT_DB   "db"
 /* Some other plugin, not implemented yet: */
 #define OUTPUT_CUSTOM "custom"
 
+/* What an output queue does when it is full. */
+typedef enum
+{
+  QUEUE_POLICY_BLOCK = 0,
+  QUEUE_POLICY_DROP_OLDEST,
+  QUEUE_POLICY_COALESCE,
+  QUEUE_POLICY_SHED
+} Atmotube_Queue_Policy;
+
+/* Metrics which can have transforms: VOC, HUMIDITY and TEMPERATURE. */
+#define ATMOTUBE_TRANSFORM_METRICS 3
+
 typedef struct Atmotube_Device_S
 {
   /* Device: */
@@ -32,11 +48,63 @@ typedef struct Atmotube_Device_S
   char *device_address;
   char *device_description;
   int device_resolution;
+  /* Group the device belongs to, NULL for none. */
+  char *device_group;
+  /* Corrections, indexed by CHARACTER_ID. */
+  Atmotube_Transform device_transforms[ATMOTUBE_TRANSFORM_METRICS];
+} Atmotube_Device;
 
-  /* Output: */
+/* An output and the devices writing to it. */
+typedef struct Atmotube_Output_Config_S
+{
+  int output_id;
+  /* Title of the output section. */
+  char *output_name;
   char *output_type;
   char *output_filename;
-} Atmotube_Device;
+  /* Records per batch, for outputs with batch support. */
+  int output_batch_size;
+  /* Max age of a batched record before it is written, in ms. */
+  int output_batch_interval;
+  /* Records the output queue can hold. */
+  int output_queue_size;
+  /* What to do when the output queue is full. */
+  Atmotube_Queue_Policy output_queue_policy;
+  /* Shed policy: percentage of queue_size from which records are
+   * coalesced, and from which low priority metrics are dropped. */
+  int output_shed_coalesce;
+  int output_shed_drop;
+  /* Shed policy: metrics dropped first, bit (1 << CHARACTER_ID) for
+   * each. */
+  unsigned int output_low_priority;
+  /* Shed policy: time the output may take to write what the worker
+   * took from the queue before it counts as overloaded, in ms. 0 to
+   * only watch the queue depth. */
+  int output_max_latency;
+  /* p99 latency of the plugin calls above which a warning is logged,
+   * in ms. 0 for none. */
+  int output_latency_budget;
+  /* Rows per transaction, for outputs writing in transactions. */
+  int output_commit_rows;
+  /* Max age of an uncommitted row, in ms. */
+  int output_commit_interval;
+  /* Split of the data over files, and days it is kept. */
+  Atmotube_Partition output_partition;
+  int output_retention;
+  Atmotube_Storage output_storage;
+  /* Plugin host executable, NULL to run the plugin in process. */
+  char *output_host;
+
+  /* Metrics routed to this output, bit (1 << CHARACTER_ID) for each. */
+  unsigned int output_metrics;
+
+  /* Number of devices writing to this output. Those named in source
+   * or in a group listed in group, with a resolution between
+   * min_resolution and max_resolution. */
+  int num_sources;
+  /* device_id of each of them, in the order given by source. */
+  int *source_ids;
+} Atmotube_Output_Config;
 
 void atmotube_config_start (const char *fullName);
 
@@ -46,12 +114,23 @@ void atmotube_config_start (const char *fullName);
 typedef void (setPluginPathCB) (const char *plugin_path);
 typedef int (deviceCB) (void *memory);
 typedef void *(NumDevicesCB) (int numDevices);
+/* Takes ownership of outputs, release with atmotube_config_free_outputs. */
+typedef void (outputsCB) (Atmotube_Output_Config * outputs, int numOutputs);
 
-/* offset - Atmotube_Device offset in the provided memory which is (n x element_size) size bytes. */
+/* offset - Atmotube_Device offset in the provided memory which is (n x element_size) size bytes.
+ * outputsCb can be NULL if the outputs are not needed. */
 int atmotube_config_load (setPluginPathCB pluginPathCb,
 			  NumDevicesCB numDevicesCb,
-			  deviceCB deviceCb, size_t element_size,
-			  size_t offset);
+			  deviceCB deviceCb, outputsCB outputsCb,
+			  size_t element_size, size_t offset);
+
+void atmotube_config_free_outputs (Atmotube_Output_Config * outputs,
+				   int numOutputs);
+
+/* Whether VOC is carried as an integer number of 1/ATMOTUBE_VOC_SCALE
+ * ppm, as read from the device, instead of a float number of ppm. Set
+ * by atmotube_config_load. */
+bool atmotube_config_voc_scaled (void);
 
 void atmotube_config_end ();
 
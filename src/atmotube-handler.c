@@ -26,9 +26,21 @@
 #include "atmotube-interval.h"
 #include "atmotube-output.h"
 #include "atmotube-private.h"
+#include "atmotube-time.h"
+
+/* Decoded values go through the transforms of the device before they
+ * are logged. The transforms of integer metrics keep them whole (see
+ * atmotube_config_load), rounding only takes out floating point error;
+ * they do not go below 0. */
+static unsigned long
+to_ulong (double x)
+{
+  return x > 0 ? (unsigned long) (x + 0.5) : 0;
+}
 
 static void
-atmotube_handle_voc (int device_id, const uint8_t * data, size_t data_length)
+atmotube_handle_voc (const Atmotube_Device * device, uint64_t ts,
+		     const uint8_t * data, size_t data_length)
 {
   if ((data_length) < 2)
     {
@@ -37,15 +49,31 @@ atmotube_handle_voc (int device_id, const uint8_t * data, size_t data_length)
     }
 
   uint16_t voc_input = *(data + 1) | ((uint16_t) * (data)) << 8;
-  double voc = voc_input / 100.0f;
+  const Atmotube_Transform *t = &device->device_transforms[VOC];
+
+  if (atmotube_config_voc_scaled ())
+    {
+      /* Kept as read, unless there are corrections to apply, which are
+       * in ppm. */
+      unsigned long voc = t->num_ops == 0 ? voc_input
+	: to_ulong (transform_apply (t, voc_input / (double)
+				     ATMOTUBE_VOC_SCALE) *
+		    ATMOTUBE_VOC_SCALE);
+      PRINT_DEBUG ("handle_voc: 0x%x, %lu\n", voc_input, voc);
+      interval_log (device->device_id, ts, intervalnames[VOC], fmts[VOC],
+		    voc);
+      return;
+    }
+
+  double voc = transform_apply (t, voc_input / 100.0f);
   PRINT_DEBUG ("handle_voc: 0x%x, %f\n", voc_input, voc);
 
-  interval_log (device_id, intervalnames[VOC], fmts[VOC], voc);
+  interval_log (device->device_id, ts, intervalnames[VOC], fmts[VOC], voc);
 }
 
 static void
-atmotube_handle_humidity (int device_id, const uint8_t * data,
-			  size_t data_length)
+atmotube_handle_humidity (const Atmotube_Device * device, uint64_t ts,
+			  const uint8_t * data, size_t data_length)
 {
   if ((data_length) < 1)
     {
@@ -53,14 +81,17 @@ atmotube_handle_humidity (int device_id, const uint8_t * data,
       return;
     }
 
-  uint16_t humidity = data[0] & 0xFF;
-  PRINT_DEBUG ("handle_humidity: 0x%x, %d%%\n", data[0], humidity);
-  interval_log (device_id, intervalnames[HUMIDITY], fmts[HUMIDITY], humidity);
+  unsigned long humidity =
+    to_ulong (transform_apply (&device->device_transforms[HUMIDITY],
+			       data[0] & 0xFF));
+  PRINT_DEBUG ("handle_humidity: 0x%x, %lu%%\n", data[0], humidity);
+  interval_log (device->device_id, ts, intervalnames[HUMIDITY],
+		fmts[HUMIDITY], humidity);
 }
 
 static void
-atmotube_handle_temperature (int device_id, const uint8_t * data,
-			     size_t data_length)
+atmotube_handle_temperature (const Atmotube_Device * device, uint64_t ts,
+			     const uint8_t * data, size_t data_length)
 {
   if ((data_length) < 1)
     {
@@ -68,10 +99,12 @@ atmotube_handle_temperature (int device_id, const uint8_t * data,
       return;
     }
 
-  uint16_t temperature = data[0] & 0xFF;
-  PRINT_DEBUG ("handle_temperature: 0x%x, %d C\n", data[0], temperature);
-  interval_log (device_id, intervalnames[TEMPERATURE], fmts[TEMPERATURE],
-		temperature);
+  unsigned long temperature =
+    to_ulong (transform_apply (&device->device_transforms[TEMPERATURE],
+			       data[0] & 0xFF));
+  PRINT_DEBUG ("handle_temperature: 0x%x, %lu C\n", data[0], temperature);
+  interval_log (device->device_id, ts, intervalnames[TEMPERATURE],
+		fmts[TEMPERATURE], temperature);
 }
 
 static void
@@ -140,6 +173,8 @@ void
 atmotube_handle_notification (const uuid_t * uuid, const uint8_t * data,
 			      size_t data_length, void *user_data)
 {
+  /* Stamp the notification once, on receipt. */
+  const uint64_t ts = atmotube_timestamp_ns ();
   uint16_t i;
   enum CHARACTER_ID id = CHARACTER_MAX;
   AtmotubeData *d = (AtmotubeData *) user_data;
@@ -162,15 +197,15 @@ atmotube_handle_notification (const uuid_t * uuid, const uint8_t * data,
     {
     case VOC:
       PRINT_DEBUG ("%s\n", "VOC");
-      atmotube_handle_voc (device_id, data, data_length);
+      atmotube_handle_voc (&d->device, ts, data, data_length);
       break;
     case HUMIDITY:
       PRINT_DEBUG ("%s\n", "HUMIDITY");
-      atmotube_handle_humidity (device_id, data, data_length);
+      atmotube_handle_humidity (&d->device, ts, data, data_length);
       break;
     case TEMPERATURE:
       PRINT_DEBUG ("%s\n", "TEMPERATURE");
-      atmotube_handle_temperature (device_id, data, data_length);
+      atmotube_handle_temperature (&d->device, ts, data, data_length);
       break;
     case STATUS:
       PRINT_DEBUG ("%s\n", "STATUS");
@@ -0,0 +1,108 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <string.h>
+
+#include "atmotube-histogram.h"
+
+/* Largest value falling into bucket i. */
+static uint64_t
+bucket_end (unsigned int i)
+{
+  if (i < HISTOGRAM_SUB_COUNT)
+    {
+      return i;
+    }
+
+  unsigned int e = i / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = HISTOGRAM_SUB_COUNT + i % HISTOGRAM_SUB_COUNT;
+  uint64_t width = 1ULL << (e - HISTOGRAM_SUB_BITS);
+
+  return sub * width + (width - 1);
+}
+
+void
+histogram_reset (AtmotubeHistogram * h)
+{
+  memset (h, 0, sizeof (AtmotubeHistogram));
+}
+
+void
+histogram_copy (AtmotubeHistogram * dst, const AtmotubeHistogram * h)
+{
+  unsigned int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      dst->buckets[i] = __atomic_load_n (&h->buckets[i], __ATOMIC_RELAXED);
+    }
+  dst->count = __atomic_load_n (&h->count, __ATOMIC_RELAXED);
+  dst->max = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+}
+
+uint64_t
+histogram_percentile (const AtmotubeHistogram * h,
+		      const AtmotubeHistogram * since, double p)
+{
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+  uint64_t seen = 0;
+  uint64_t rank;
+  unsigned int i;
+
+  /* Count from the buckets rather than h->count, the two are not
+   * updated together. */
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      counts[i] = __atomic_load_n (&h->buckets[i], __ATOMIC_RELAXED);
+      if (since != NULL)
+	{
+	  counts[i] -= since->buckets[i];
+	}
+      total += counts[i];
+    }
+
+  if (total == 0)
+    {
+      return 0;
+    }
+
+  rank = (uint64_t) (p / 100.0 * (double) total + 0.5);
+  if (rank < 1)
+    {
+      rank = 1;
+    }
+  if (rank > total)
+    {
+      rank = total;
+    }
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+	{
+	  break;
+	}
+    }
+
+  uint64_t max = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+  uint64_t end = bucket_end (i);
+
+  return end < max ? end : max;
+}
@@ -0,0 +1,79 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ATMOTUBE_HISTOGRAM_H
+#define ATMOTUBE_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear histogram of durations in ns. Each power of two is split
+ * into HISTOGRAM_SUB_COUNT linear buckets, so a recorded value is
+ * known to within 1/HISTOGRAM_SUB_COUNT of itself. One thread records,
+ * any thread can read. Recording is a few instructions and does not
+ * allocate. */
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct
+{
+  /* Values recorded. */
+  uint64_t count;
+  /* Largest value recorded. */
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} AtmotubeHistogram;
+
+static inline unsigned int
+histogram_index (uint64_t v)
+{
+  if (v < HISTOGRAM_SUB_COUNT)
+    {
+      return (unsigned int) v;
+    }
+
+  unsigned int e = 63 - __builtin_clzll (v);
+  return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT
+    + (unsigned int) ((v >> (e - HISTOGRAM_SUB_BITS))
+		      & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+static inline void
+histogram_record (AtmotubeHistogram * h, uint64_t v)
+{
+  __atomic_fetch_add (&h->buckets[histogram_index (v)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->count, 1, __ATOMIC_RELAXED);
+  if (v > __atomic_load_n (&h->max, __ATOMIC_RELAXED))
+    {
+      __atomic_store_n (&h->max, v, __ATOMIC_RELAXED);
+    }
+}
+
+void histogram_reset (AtmotubeHistogram * h);
+
+/* Take a copy of h while it is being recorded to. */
+void histogram_copy (AtmotubeHistogram * dst, const AtmotubeHistogram * h);
+
+/* Value below which p percent of the recorded values fall, rounded up
+ * to the end of its bucket. Only the values recorded since the copy
+ * since was taken are looked at, all of them when since is NULL.
+ * Returns 0 when there are none. */
+uint64_t histogram_percentile (const AtmotubeHistogram * h,
+			       const AtmotubeHistogram * since, double p);
+
+#endif /* ATMOTUBE_HISTOGRAM_H */
@@ -0,0 +1,287 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "atmotube.h"
+#include "atmotube-host.h"
+#include "atmotube-time.h"
+
+/* Interval at which a stopping host is checked on. */
+#define HOST_POLL_MS 10
+
+static int host_write_batch (void *ctx, size_t n, const uint64_t ts[],
+			     const int device[], const int metric[],
+			     const double value[]);
+static int host_stop (void *ctx);
+
+static AtmotubePlugin hostPlugin = {
+  .type = "host",
+  .handle = NULL,
+  .fd = -1,
+  .builtin = ATMOTUBE_BUILTIN_NONE,
+  .write_batch = host_write_batch,
+  .plugin_stop = host_stop,
+};
+
+AtmotubePlugin *
+host_plugin (void)
+{
+  return &hostPlugin;
+}
+
+/* Check whether the host is gone, reaping it if so. The next one is
+ * started after restart_delay_ms, which doubles when the host did not
+ * last. */
+static bool
+host_exited (AtmotubeHost * h)
+{
+  if (!h->dead && waitpid (h->pid, NULL, WNOHANG) == h->pid)
+    {
+      const uint64_t now = atmotube_timestamp_ns ();
+
+      if (now - h->started >= ATMOTUBE_MS_TO_NS (HOST_RESTART_MAX_MS))
+	{
+	  h->restart_delay_ms = HOST_RESTART_MIN_MS;
+	}
+      PRINT_ERROR ("Plugin host %d exited, starting it again in %u ms\n",
+		   (int) h->pid, h->restart_delay_ms);
+      h->dead = true;
+      h->restart_at = now + ATMOTUBE_MS_TO_NS (h->restart_delay_ms);
+      h->restart_delay_ms = h->restart_delay_ms * 2 < HOST_RESTART_MAX_MS ?
+	h->restart_delay_ms * 2 : HOST_RESTART_MAX_MS;
+    }
+
+  return h->dead;
+}
+
+/* Start the host process, on the ring in h->fd. */
+static int
+host_spawn (AtmotubeHost * h)
+{
+  h->pid = fork ();
+  if (h->pid == 0)
+    {
+      /* The ring is only for the host. */
+      fcntl (h->fd, F_SETFD, 0);
+      execvp (h->argv[0], h->argv);
+      _exit (127);
+    }
+
+  if (h->pid < 0)
+    {
+      PRINT_ERROR ("Unable to start plugin host %s\n", h->argv[0]);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  h->dead = false;
+  h->started = atmotube_timestamp_ns ();
+  return ATMOTUBE_RET_OK;
+}
+
+static void
+host_free (AtmotubeHost * h)
+{
+  int i;
+
+  if (h->ring != NULL)
+    {
+      ring_detach (h->ring);
+      close (h->fd);
+    }
+  for (i = 0; h->argv != NULL && h->argv[i] != NULL; i++)
+    {
+      free (h->argv[i]);
+    }
+  free (h->argv);
+  free (h);
+}
+
+AtmotubeHost *
+host_start (const Atmotube_Output_Config * config, const AtmotubeOutput * o)
+{
+  int i;
+  const char *file = atmotube_plugin_file (config->output_type);
+
+  if (file == NULL)
+    {
+      PRINT_ERROR ("Plugin with type '%s' not found\n", config->output_type);
+      return NULL;
+    }
+
+  AtmotubeHost *h = (AtmotubeHost *) calloc (1, sizeof (AtmotubeHost));
+  if (h == NULL)
+    {
+      return NULL;
+    }
+  h->restart_delay_ms = HOST_RESTART_MIN_MS;
+
+  h->ring = ring_create (config->output_queue_size, &h->fd);
+  if (h->ring == NULL)
+    {
+      free (h);
+      return NULL;
+    }
+
+  /* atmhost type file fd filename rows interval partition retention
+   *         storage voc_scale [name address]... */
+  char fdstr[16];
+  char rows[16];
+  char interval[16];
+  char partition[16];
+  char retention[16];
+  char storage[16];
+  char voc_scale[16];
+  const char *argv[HOST_ARGS + 2 * o->num_devices];
+
+  snprintf (fdstr, sizeof (fdstr), "%d", h->fd);
+  snprintf (rows, sizeof (rows), "%d", o->commit_rows);
+  snprintf (interval, sizeof (interval), "%d", o->commit_interval);
+  snprintf (partition, sizeof (partition), "%d", (int) o->partition);
+  snprintf (retention, sizeof (retention), "%d", o->retention);
+  snprintf (storage, sizeof (storage), "%d", (int) o->storage);
+  snprintf (voc_scale, sizeof (voc_scale), "%d", o->voc_scale);
+  argv[0] = config->output_host;
+  argv[1] = config->output_type;
+  argv[2] = file;
+  argv[3] = fdstr;
+  argv[4] = o->filename;
+  argv[5] = rows;
+  argv[6] = interval;
+  argv[7] = partition;
+  argv[8] = retention;
+  argv[9] = storage;
+  argv[10] = voc_scale;
+  for (i = 0; i < o->num_devices; i++)
+    {
+      argv[HOST_ARGS + 2 * i] = o->device_names[i];
+      argv[HOST_ARGS + 1 + 2 * i] = o->device_addresses[i];
+    }
+
+  /* Kept for starting the host again. */
+  const int argc = HOST_ARGS + 2 * o->num_devices;
+  h->argv = (char **) calloc (argc + 1, sizeof (char *));
+  for (i = 0; h->argv != NULL && i < argc; i++)
+    {
+      h->argv[i] = strdup (argv[i]);
+      if (h->argv[i] == NULL)
+	{
+	  break;
+	}
+    }
+
+  if (h->argv == NULL || i < argc || host_spawn (h) != ATMOTUBE_RET_OK)
+    {
+      host_free (h);
+      return NULL;
+    }
+
+  PRINT_DEBUG ("Started plugin host %d for %s\n", (int) h->pid,
+	       config->output_name);
+  return h;
+}
+
+static int
+host_write_batch (void *ctx, size_t n, const uint64_t ts[],
+		  const int device[], const int metric[],
+		  const double value[])
+{
+  AtmotubeHost *h = (AtmotubeHost *) ctx;
+  size_t done = 0;
+
+  if (host_exited (h) && atmotube_timestamp_ns () >= h->restart_at)
+    {
+      if (host_spawn (h) == ATMOTUBE_RET_OK)
+	{
+	  h->restarts++;
+	  PRINT_DEBUG ("Started plugin host %d again\n", (int) h->pid);
+	}
+      else
+	{
+	  h->restart_at = atmotube_timestamp_ns () +
+	    ATMOTUBE_MS_TO_NS (h->restart_delay_ms);
+	}
+    }
+
+  if (!h->dead)
+    {
+      done = ring_write (h->ring, n, ts, device, metric, value,
+			 ATMOTUBE_MS_TO_NS (HOST_WRITE_TIMEOUT_MS));
+    }
+
+  if (done == n)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  h->lost += n - done;
+  return ATMOTUBE_RET_ERROR;
+}
+
+static int
+host_stop (void *ctx)
+{
+  AtmotubeHost *h = (AtmotubeHost *) ctx;
+  int ret = ATMOTUBE_RET_OK;
+  int status;
+  int waited;
+  const struct timespec poll = { 0, HOST_POLL_MS * ATMOTUBE_NS_PER_MS };
+
+  ring_close (h->ring);
+
+  /* Give the host time to drain the ring. */
+  for (waited = 0; !h->dead && waited < HOST_STOP_TIMEOUT_MS;
+       waited += HOST_POLL_MS)
+    {
+      if (waitpid (h->pid, &status, WNOHANG) == h->pid)
+	{
+	  h->dead = true;
+	  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+	    {
+	      PRINT_ERROR ("Plugin host %d failed\n", (int) h->pid);
+	      ret = ATMOTUBE_RET_ERROR;
+	    }
+	  break;
+	}
+      nanosleep (&poll, NULL);
+    }
+
+  if (!h->dead)
+    {
+      PRINT_ERROR ("Plugin host %d does not stop, killing it\n",
+		   (int) h->pid);
+      kill (h->pid, SIGKILL);
+      waitpid (h->pid, NULL, 0);
+      ret = ATMOTUBE_RET_ERROR;
+    }
+
+  if (h->lost > 0)
+    {
+      PRINT_ERROR ("Plugin host %d lost %" PRIu64 " records\n",
+		   (int) h->pid, h->lost);
+    }
+
+  host_free (h);
+  return ret;
+}
@@ -0,0 +1,77 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ATMOTUBE_HOST_H
+#define ATMOTUBE_HOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "atmotube-config.h"
+#include "atmotube-plugin.h"
+#include "atmotube-ring.h"
+
+/* Outputs with a host option run their plugin in a separate process,
+ * the host executable (atmhost). The output worker hands its batches
+ * over through a shared memory ring, so a plugin which crashes or
+ * stalls only costs the data of its own output. */
+
+/* Time the worker waits for room in the ring before records are
+ * dropped. */
+#define HOST_WRITE_TIMEOUT_MS 1000
+/* Time a host gets to drain the ring and exit when stopped. */
+#define HOST_STOP_TIMEOUT_MS 5000
+/* A host which exits is started again, after a delay which doubles
+ * from HOST_RESTART_MIN_MS up to HOST_RESTART_MAX_MS for every exit
+ * within HOST_RESTART_MAX_MS of its start. */
+#define HOST_RESTART_MIN_MS 100
+#define HOST_RESTART_MAX_MS 30000
+
+/* Arguments of the host before the device names and addresses:
+ *   atmhost type file fd filename commit_rows commit_interval
+ *           partition retention storage voc_scale */
+#define HOST_ARGS 11
+
+/* An output plugin running in a host process. */
+typedef struct
+{
+  pid_t pid;
+  AtmotubeRing *ring;
+  /* Memory file of the ring, handed to every host started. */
+  int fd;
+  /* Command line of the host, NULL terminated. */
+  char **argv;
+  /* The host has exited, records for it are dropped until it is
+   * started again at restart_at. */
+  bool dead;
+  uint64_t started;
+  uint64_t restart_at;
+  uint32_t restart_delay_ms;
+  /* Times the host was started again. */
+  unsigned restarts;
+  /* Records which could not be handed to the host. */
+  uint64_t lost;
+} AtmotubeHost;
+
+/* Plugin forwarding to a host, its context is an AtmotubeHost. */
+AtmotubePlugin *host_plugin (void);
+
+/* Start a host running the plugin of the configured type for output
+ * o. Returns NULL on error. */
+AtmotubeHost *host_start (const Atmotube_Output_Config * config,
+			  const AtmotubeOutput * o);
+
+#endif /* ATMOTUBE_HOST_H */
@@ -1,6 +1,8 @@
 #include "atmotube-interval.h"
+#include "atmotube-time.h"
 #include "atmotube.h"
 #include <glib.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,28 +40,35 @@ typedef struct
 typedef struct
 {
   /* Identification. */
+  bool used;
   int device_id;
-  const char *label;
-  const char *fmt;
+  char label[INTERVAL_LABEL_MAX];
+  char fmt[INTERVAL_LABEL_MAX];
   /* State. */
   bool started;
-  /* Time. */
-  unsigned long time_interval;
-  unsigned long current_ts;
-  unsigned long max_ts;
-  /* Contents. */
+  /* Time (ns). A max_ts of 0 means that the window is opened by the
+   * next sample. */
+  uint64_t time_interval;
+  uint64_t current_ts;
+  uint64_t max_ts;
+  /* Contents. Integer samples are summed, so that their mean is
+   * exact. */
   unsigned long times;
+  uint64_t sum;
   IntervalData current;
   Callback callback;
 } Interval;
 
-GSList *intervalList = NULL;
+/* Intervals live in a preallocated pool, so that neither adding an
+ * interval nor logging to it allocates memory. */
+static Interval intervalPool[INTERVAL_MAX];
 
 #define find_in_list(device_id, found, label, fmt)          \
-    GSList *l;                              \
-    for (l = intervalList; l != NULL; l = l->next) {            \
-    Interval *i = (Interval*)l->data;               \
-    if ( (device_id == i->device_id) &&             \
+    int n;                                  \
+    for (n = 0; n < INTERVAL_MAX; n++) {            \
+    Interval *i = &intervalPool[n];                 \
+    if ( i->used &&                         \
+         (device_id == i->device_id) &&             \
          (strcmp(i->label, label) == 0) &&              \
          (strcmp(i->fmt, fmt) == 0) ) {             \
         found = i;                          \
@@ -67,13 +76,34 @@ GSList *intervalList = NULL;
     }                               \
     }
 
-inline static unsigned long
-getTimeStamp (void)
+static void
+interval_foreach (GFunc func, gpointer user_data)
 {
-  struct timeval te;
-  gettimeofday (&te, NULL);
-  long long milliseconds = te.tv_sec * 1000LL + te.tv_usec / 1000;
-  return milliseconds;
+  int n;
+
+  for (n = 0; n < INTERVAL_MAX; n++)
+    {
+      if (intervalPool[n].used)
+	{
+	  func (&intervalPool[n], user_data);
+	}
+    }
+}
+
+static Interval *
+interval_alloc (void)
+{
+  int n;
+
+  for (n = 0; n < INTERVAL_MAX; n++)
+    {
+      if (!intervalPool[n].used)
+	{
+	  return &intervalPool[n];
+	}
+    }
+
+  return NULL;
 }
 
 int
@@ -90,13 +120,25 @@ interval_add (int device_id, const char *label, const char *fmt)
       status = ATMOTUBE_RET_OK;
     }
 
+  if (strlen (label) >= INTERVAL_LABEL_MAX)
+    {
+      PRINT_ERROR ("Interval label too long: %s\n", label);
+      return ATMOTUBE_RET_ERROR;
+    }
+
   if (status == ATMOTUBE_RET_OK)
     {
-      Interval *i = (Interval *) malloc (sizeof (Interval));
+      Interval *i = interval_alloc ();
+      if (i == NULL)
+	{
+	  PRINT_ERROR ("No free intervals (max %d)\n", INTERVAL_MAX);
+	  return ATMOTUBE_RET_ERROR;
+	}
       memset (i, 0, sizeof (Interval));
+      i->used = true;
       i->device_id = device_id;
-      i->label = g_strdup (label);
-      i->fmt = g_strdup (fmt);
+      strcpy (i->label, label);
+      strcpy (i->fmt, fmt);
       i->started = false;
       i->time_interval = 1;
       i->current_ts = 0;
@@ -105,9 +147,6 @@ interval_add (int device_id, const char *label, const char *fmt)
       i->current.ul = 0;
       i->current.d = 0.0f;
       PRINT_DEBUG ("Adding interval %d:%s:%s\n", device_id, label, fmt);
-      intervalList = g_slist_append (intervalList, i);
-
-      PRINT_DEBUG ("List len=%d\n", g_slist_length (intervalList));
     }
 
   return status;
@@ -192,8 +231,7 @@ interval_remove (int device_id, const char *label, const char *fmt)
 
   if (found != NULL)
     {
-      free (found);
-      intervalList = g_slist_remove (intervalList, found);
+      found->used = false;
       return ATMOTUBE_RET_OK;
     }
 
@@ -209,13 +247,15 @@ interval_start (int device_id,
 
   if (found != NULL)
     {
-      PRINT_DEBUG ("Interval: %d, %lu, %lu, %lu\n",
+      PRINT_DEBUG ("Interval: %d, %" PRIu64 ", %" PRIu64 ", %" PRIu64 "\n",
 		   device_id, found->time_interval,
 		   found->current_ts, found->max_ts);
 
-      found->time_interval = interval_ms;
-      found->current_ts = getTimeStamp ();
-      found->max_ts = found->current_ts + interval_ms;
+      /* The window is anchored on the receipt time of the first
+       * sample, so starting does not need to read the clock. */
+      found->time_interval = ATMOTUBE_MS_TO_NS (interval_ms);
+      found->current_ts = 0;
+      found->max_ts = 0;
       found->started = true;
       PRINT_DEBUG ("Interval %d:%s:%s started (%ld)\n",
 		   device_id, label, fmt, interval_ms);
@@ -233,6 +273,7 @@ interval_start (int device_id,
 typedef struct
 {
   int device_id;
+  uint64_t ts;
   const char *label;
   const char *fmt;
   IntervalData data;
@@ -263,7 +304,7 @@ interval_log_impl (gpointer data, gpointer user_data)
   if ((p->device_id == i->device_id) &&
       (strcmp (p->label, i->label) == 0) && (strcmp (p->fmt, i->fmt) == 0))
     {
-      unsigned long ts = getTimeStamp ();
+      const uint64_t ts = p->ts;
 
       if (!i->started)
 	{
@@ -271,6 +312,12 @@ interval_log_impl (gpointer data, gpointer user_data)
 	  return;
 	}
 
+      if (i->max_ts == 0)
+	{
+	  i->current_ts = ts;
+	  i->max_ts = ts + i->time_interval;
+	}
+
       if (ts < i->max_ts)
 	{
 	  p->last = false;
@@ -288,16 +335,12 @@ interval_log_impl (gpointer data, gpointer user_data)
 
 	  if (i->times == 0)
 	    {
-	      i->current.ul = p->data.ul;
-	      i->times++;
-	    }
-	  else
-	    {
-	      i->times++;
-	      i->current.ul =
-		(unsigned long) appr_rolling_average (i->current.ul,
-						      p->data.ul, i->times);
+	      i->sum = 0;
 	    }
+	  i->times++;
+	  i->sum += p->data.ul;
+	  /* Rounded to the nearest. */
+	  i->current.ul = (unsigned long) ((i->sum + i->times / 2) / i->times);
 	  if (p->last)
 	    {
 	      PRINT_DEBUG ("+Logging(%s): %s, %lu times, current = %lu\n",
@@ -361,12 +404,14 @@ interval_log_impl (gpointer data, gpointer user_data)
 }
 
 void
-interval_log (int device_id, const char *label, const char *fmt, ...)
+interval_log (int device_id, uint64_t ts, const char *label,
+	      const char *fmt, ...)
 {
   va_list ap;
   intervalParams p = { 0 };
 
   p.device_id = device_id;
+  p.ts = ts;
   p.label = label;
   p.fmt = fmt;
 
@@ -392,7 +437,7 @@ interval_log (int device_id, const char *label, const char *fmt, ...)
       return;
     }
 
-  g_slist_foreach (intervalList, interval_log_impl, &p);
+  interval_foreach (interval_log_impl, &p);
 }
 
 int
@@ -427,9 +472,9 @@ interval_dump_impl (gpointer data, gpointer unused)
 
   printf ("Interval %d:%s:%s\n", i->device_id, i->label, i->fmt);
   printf ("\tstarted=%u\n", i->started);
-  printf ("\tinterval=%lu\n", i->time_interval);
-  printf ("\tts=%lu\n", i->current_ts);
-  printf ("\tmax_ts=%lu\n", i->max_ts);
+  printf ("\tinterval=%" PRIu64 "\n", i->time_interval);
+  printf ("\tts=%" PRIu64 "\n", i->current_ts);
+  printf ("\tmax_ts=%" PRIu64 "\n", i->max_ts);
   printf ("\ttimes=%lu\n", i->times);
   printf ("\tul=%lu\n", i->current.ul);
   printf ("\td=%f\n", i->current.d);
@@ -439,5 +484,5 @@ interval_dump_impl (gpointer data, gpointer unused)
 void
 interval_dump (void)
 {
-  g_slist_foreach (intervalList, interval_dump_impl, NULL);
+  interval_foreach (interval_dump_impl, NULL);
 }
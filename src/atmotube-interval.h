@@ -17,17 +17,25 @@
 #ifndef INTERVAL_H
 #define INTERVAL_H
 
+#include <stdint.h>
+
 /* Supported intervals. */
 #define INTERVAL_ULONG "%lu"
 #define INTERVAL_FLOAT "%f"
 
 #define INTERVAL_SEC_TO_MS(x) (1000*x)
 
+/* Size of the preallocated interval pool and max label length. */
+#define INTERVAL_MAX 64
+#define INTERVAL_LABEL_MAX 32
+
 /* Define an interval described by a label and a format. */
 int interval_add (int device_id, const char *label, const char *fmt);
 
-typedef void (*ulong_callback) (unsigned long, unsigned long, void *data_ptr);
-typedef void (*float_callback) (unsigned long, float, void *data_ptr);
+/* The timestamp passed to callbacks is the receipt time (ns) of the
+ * sample which closed the interval. */
+typedef void (*ulong_callback) (uint64_t, unsigned long, void *data_ptr);
+typedef void (*float_callback) (uint64_t, float, void *data_ptr);
 
 int interval_add_ulong_callback (int device_id,
 				 const char *label,
@@ -51,8 +59,10 @@ int interval_start (int device_id, const char *label, const char *fmt,
 /* Start a previously started interval. */
 int interval_stop (int device_id, const char *label, const char *fmt);
 
-/* Log some data using a previously defined interval. */
-void interval_log (int device_id, const char *label, const char *fmt, ...);
+/* Log some data using a previously defined interval.
+ * ts - receipt time of the sample in ns, see atmotube-time.h. */
+void interval_log (int device_id, uint64_t ts, const char *label,
+		   const char *fmt, ...);
 
 /* Print the defined intervals. */
 void interval_dump (void);
@@ -20,6 +20,9 @@
 #include <sys/time.h>
 #include <glib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include "atmotube.h"
 #include "atmotube-config.h"
@@ -27,9 +30,345 @@
 #include "atmotube-output.h"
 #include "atmotube-private.h"
 #include "atmotube-plugin.h"
+#include "atmotube-time.h"
+#include "atmotube-queue.h"
+#include "atmotube-host.h"
 
 extern AtmotubeGlData glData;
 
+/* Records taken from the queue at a time by a worker. */
+#define WORKER_POP_MAX 64
+
+/* How often a worker compares the p99 latency of its plugin calls to
+ * the latency budget of the output. */
+#define LATENCY_CHECK_INTERVAL ATMOTUBE_MS_TO_NS (10000)
+
+static int
+batch_create (AtmotubeBatch * b, size_t size, int interval_ms)
+{
+  b->count = 0;
+  b->size = size;
+  b->interval = ATMOTUBE_MS_TO_NS ((uint64_t) interval_ms);
+
+  b->ts = (uint64_t *) malloc (size * sizeof (uint64_t));
+  b->device = (int *) malloc (size * sizeof (int));
+  b->metric = (int *) malloc (size * sizeof (int));
+  b->value = (double *) malloc (size * sizeof (double));
+
+  if (b->ts == NULL || b->device == NULL || b->metric == NULL
+      || b->value == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+static void
+batch_destroy (AtmotubeBatch * b)
+{
+  free (b->ts);
+  free (b->device);
+  free (b->metric);
+  free (b->value);
+
+  b->ts = NULL;
+  b->device = NULL;
+  b->metric = NULL;
+  b->value = NULL;
+  b->count = 0;
+  b->size = 0;
+}
+
+/* Account for a plugin call which started at start. */
+static void
+call_done (AtmotubeSink * sink, uint64_t start, int ret)
+{
+  histogram_record (&sink->latency, atmotube_timestamp_ns () - start);
+  if (ret != ATMOTUBE_RET_OK)
+    {
+      __atomic_fetch_add (&sink->errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Write any collected records to the plugin. */
+static int
+batch_flush (AtmotubeSink * sink)
+{
+  AtmotubeBatch *b = &sink->batch;
+
+  if (b->count == 0)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  uint64_t start = atmotube_timestamp_ns ();
+  int ret = atmotube_plugin_write_batch (sink->plugin, sink->plugin_ctx,
+					 b->count, b->ts, b->device,
+					 b->metric, b->value);
+  call_done (sink, start, ret);
+  if (ret != ATMOTUBE_RET_OK)
+    {
+      PRINT_ERROR ("Unable to write %zu records to %s\n", b->count,
+		   sink->config->output_name);
+    }
+
+  b->count = 0;
+  return ret;
+}
+
+/* Hand one record to the plugin, through the batch when the plugin
+ * supports it. */
+static void
+write_record (AtmotubeSink * sink, const AtmotubeRecord * r)
+{
+  AtmotubePlugin *plugin = sink->plugin;
+  AtmotubeBatch *b = &sink->batch;
+
+  if (plugin->write_batch != NULL)
+    {
+      size_t i = b->count;
+
+      b->ts[i] = r->ts;
+      b->device[i] = r->device;
+      b->metric[i] = r->metric;
+      b->value[i] = r->value;
+      b->count++;
+
+      if (b->count == b->size)
+	{
+	  batch_flush (sink);
+	}
+      return;
+    }
+
+  uint64_t start = atmotube_timestamp_ns ();
+  int ret;
+
+  switch (r->metric)
+    {
+    case TEMPERATURE:
+      ret = plugin->temperature (sink->plugin_ctx, r->ts, r->device,
+				 (unsigned long) r->value);
+      break;
+    case HUMIDITY:
+      ret = plugin->humidity (sink->plugin_ctx, r->ts, r->device,
+			      (unsigned long) r->value);
+      break;
+    case VOC:
+      ret = plugin->voc (sink->plugin_ctx, r->ts, r->device,
+			 (float) r->value);
+      break;
+    default:
+      PRINT_ERROR ("Unknown metric: %d\n", r->metric);
+      return;
+    }
+
+  call_done (sink, start, ret);
+}
+
+/* Warn when the p99 latency of the calls made since the last check
+ * goes over the budget, and when it is back under. */
+static void
+check_latency (AtmotubeSink * sink, uint64_t now)
+{
+  if (now < sink->next_check)
+    {
+      return;
+    }
+  sink->next_check = now + LATENCY_CHECK_INTERVAL;
+
+  uint64_t p99 = histogram_percentile (&sink->latency,
+				       &sink->latency_checked, 99.0);
+  histogram_copy (&sink->latency_checked, &sink->latency);
+  if (p99 == 0)
+    {
+      return;
+    }
+
+  if (p99 > sink->latency_budget && !sink->over_budget)
+    {
+      PRINT_ERROR ("Output %s is slow: p99 latency %" PRIu64
+		   " us, budget %" PRIu64 " us\n",
+		   sink->config->output_name, p99 / 1000,
+		   sink->latency_budget / 1000);
+      sink->over_budget = true;
+    }
+  else if (p99 <= sink->latency_budget && sink->over_budget)
+    {
+      PRINT_DEBUG ("Output %s is back within its latency budget\n",
+		   sink->config->output_name);
+      sink->over_budget = false;
+    }
+}
+
+/* Worker thread of an output. All plugin calls for the output are
+ * made from here. Runs until the queue is closed and drained. */
+static void *
+output_worker (void *data_ptr)
+{
+  AtmotubeSink *sink = (AtmotubeSink *) data_ptr;
+  AtmotubeBatch *b = &sink->batch;
+  AtmotubeRecord records[WORKER_POP_MAX];
+  /* plugin_flush is called twice per commit interval. */
+  const uint64_t flush_interval =
+    sink->plugin->plugin_flush != NULL ?
+    ATMOTUBE_MS_TO_NS (sink->output->commit_interval) / 2 : 0;
+  uint64_t next_flush = atmotube_timestamp_ns () + flush_interval;
+
+  for (;;)
+    {
+      uint64_t timeout = 0;
+      uint64_t now = atmotube_timestamp_ns ();
+
+      if (flush_interval > 0)
+	{
+	  if (now >= next_flush)
+	    {
+	      call_done (sink, now,
+			 sink->plugin->plugin_flush (sink->plugin_ctx));
+	      now = atmotube_timestamp_ns ();
+	      next_flush = now + flush_interval;
+	    }
+	  timeout = next_flush - now;
+	}
+
+      /* Wait no longer than until the oldest batched record is due. */
+      if (b->count > 0)
+	{
+	  uint64_t due = b->ts[0] + b->interval;
+	  if (now >= due)
+	    {
+	      batch_flush (sink);
+	      continue;
+	    }
+	  if (timeout == 0 || due - now < timeout)
+	    {
+	      timeout = due - now;
+	    }
+	}
+
+      size_t n = queue_pop (&sink->queue, records, WORKER_POP_MAX, timeout);
+      if (n == 0 && (timeout == 0 || queue_paused (&sink->queue)
+		     || queue_closed (&sink->queue)))
+	{
+	  /* Closed and drained, or paused for a reload. The batch is
+	   * written below rather than waited for. */
+	  break;
+	}
+
+      uint64_t start = atmotube_timestamp_ns ();
+      for (size_t i = 0; i < n; i++)
+	{
+	  write_record (sink, &records[i]);
+	}
+
+      now = atmotube_timestamp_ns ();
+      if (sink->max_latency > 0 && n > 0)
+	{
+	  queue_set_overloaded (&sink->queue, now - start > sink->max_latency);
+	}
+      if (sink->latency_budget > 0)
+	{
+	  check_latency (sink, now);
+	}
+    }
+
+  batch_flush (sink);
+  return NULL;
+}
+
+static void
+dump_queue_stats (AtmotubeSink * sink)
+{
+  AtmotubeQueueStats stats;
+
+  queue_get_stats (&sink->queue, &stats);
+  PRINT_DEBUG ("Output queue for %s: size %zu, depth %zu, high water %zu, "
+	       "pushed %" PRIu64 ", dropped %" PRIu64 ", coalesced %" PRIu64
+	       ", shed %" PRIu64 ", overloaded %" PRIu64 " times, blocked %"
+	       PRIu64 " times for %" PRIu64 " ms\n",
+	       sink->config->output_name, stats.size, stats.depth,
+	       stats.high_water, stats.pushed, stats.dropped,
+	       stats.coalesced, stats.shed, stats.overloads, stats.blocked,
+	       ATMOTUBE_NS_TO_MS (stats.blocked_ns));
+}
+
+static void
+get_latency_stats (AtmotubeSink * sink, AtmotubeLatencyStats * stats)
+{
+  stats->calls = __atomic_load_n (&sink->latency.count, __ATOMIC_RELAXED);
+  stats->errors = __atomic_load_n (&sink->errors, __ATOMIC_RELAXED);
+  stats->p50 = histogram_percentile (&sink->latency, NULL, 50.0);
+  stats->p90 = histogram_percentile (&sink->latency, NULL, 90.0);
+  stats->p99 = histogram_percentile (&sink->latency, NULL, 99.0);
+  stats->max = __atomic_load_n (&sink->latency.max, __ATOMIC_RELAXED);
+}
+
+static void
+dump_latency_stats (AtmotubeSink * sink)
+{
+  AtmotubeLatencyStats stats;
+
+  get_latency_stats (sink, &stats);
+  PRINT_DEBUG ("Plugin calls for %s: %" PRIu64 ", errors %" PRIu64
+	       ", latency p50 %" PRIu64 " us, p90 %" PRIu64 " us, p99 %"
+	       PRIu64 " us, max %" PRIu64 " us\n",
+	       sink->config->output_name, stats.calls, stats.errors,
+	       stats.p50 / 1000, stats.p90 / 1000, stats.p99 / 1000,
+	       stats.max / 1000);
+}
+
+static void
+free_output (AtmotubeOutput * o)
+{
+  if (o != NULL)
+    {
+      free (o->device_names);
+      free (o->device_addresses);
+      free (o);
+    }
+}
+
+/* Describe an output and its devices to the plugin. */
+static AtmotubeOutput *
+create_output (const Atmotube_Output_Config * config)
+{
+  int i;
+  AtmotubeOutput *o = (AtmotubeOutput *) calloc (1, sizeof (AtmotubeOutput));
+  if (o == NULL)
+    {
+      return NULL;
+    }
+
+  o->filename = config->output_filename;
+  o->num_devices = config->num_sources;
+  o->commit_rows = config->output_commit_rows;
+  o->commit_interval = config->output_commit_interval;
+  o->partition = config->output_partition;
+  o->retention = config->output_retention;
+  o->storage = config->output_storage;
+  o->voc_scale = atmotube_config_voc_scaled () ? ATMOTUBE_VOC_SCALE : 1;
+  o->device_names =
+    (const char **) malloc (config->num_sources * sizeof (char *));
+  o->device_addresses =
+    (const char **) malloc (config->num_sources * sizeof (char *));
+  if (o->device_names == NULL || o->device_addresses == NULL)
+    {
+      free_output (o);
+      return NULL;
+    }
+
+  for (i = 0; i < config->num_sources; i++)
+    {
+      AtmotubeData *d = glData.deviceConfiguration + config->source_ids[i];
+      o->device_names[i] = d->device.device_name;
+      o->device_addresses[i] = d->device.device_address;
+    }
+
+  return o;
+}
+
 static void
 clear_outputs ()
 {
@@ -39,12 +378,236 @@ clear_outputs ()
     {
       AtmotubeData *d = glData.deviceConfiguration + i;
 
-      if (d->output != NULL)
+      free (d->sinks);
+      d->sinks = NULL;
+      d->num_sinks = 0;
+      memset (d->routes, 0, sizeof (d->routes));
+    }
+
+  if (glData.sinks == NULL)
+    {
+      return;
+    }
+
+  /* Let all workers drain their queues. */
+  for (i = 0; i < glData.outputConfigurationSize; i++)
+    {
+      AtmotubeSink *sink = glData.sinks + i;
+
+      if (sink->worker_started)
+	{
+	  queue_close (&sink->queue);
+	}
+    }
+
+  for (i = 0; i < glData.outputConfigurationSize; i++)
+    {
+      AtmotubeSink *sink = glData.sinks + i;
+
+      if (sink->worker_started)
+	{
+	  pthread_join (sink->worker, NULL);
+	  sink->worker_started = false;
+	  dump_queue_stats (sink);
+	  dump_latency_stats (sink);
+	}
+
+      if (sink->plugin != NULL && sink->plugin_ctx != NULL)
+	{
+	  int status = sink->plugin->plugin_stop (sink->plugin_ctx);
+	  PRINT_DEBUG ("Stopped plugin: %d\n", status);
+	}
+      sink->plugin_ctx = NULL;
+      sink->plugin = NULL;
+      batch_destroy (&sink->batch);
+
+      if (sink->queue.ring != NULL)
+	{
+	  queue_destroy (&sink->queue);
+	}
+
+      free_output (sink->output);
+      sink->output = NULL;
+    }
+
+  free (glData.sinks);
+  glData.sinks = NULL;
+}
+
+/* Start an instance of plugin, or of the plugin of the sink when
+ * NULL, in process or in a host, and the worker feeding it from the
+ * queue. */
+static int
+start_instance (AtmotubeSink * sink, AtmotubePlugin * plugin)
+{
+  Atmotube_Output_Config *config = sink->config;
+
+  if (config->output_host != NULL)
+    {
+      sink->plugin = host_plugin ();
+    }
+  else if (plugin != NULL)
+    {
+      sink->plugin = plugin;
+    }
+  else
+    {
+      sink->plugin = atmotube_plugin_get (config->output_type);
+    }
+
+  if (sink->plugin == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (sink->plugin->write_batch != NULL && sink->batch.ts == NULL
+      && batch_create (&sink->batch, config->output_batch_size,
+		       config->output_batch_interval) != ATMOTUBE_RET_OK)
+    {
+      PRINT_ERROR ("Unable to allocate batch for %s\n", config->output_name);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (config->output_host != NULL)
+    {
+      sink->plugin_ctx = host_start (config, sink->output);
+    }
+  else
+    {
+      sink->plugin_ctx = sink->plugin->plugin_start (sink->output);
+    }
+
+  if (sink->plugin_ctx == NULL)
+    {
+      PRINT_ERROR ("Unable to start output %s (%s)\n",
+		   config->output_name, config->output_type);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (pthread_create (&sink->worker, NULL, output_worker, sink) != 0)
+    {
+      PRINT_ERROR ("Unable to start worker for %s\n", config->output_name);
+      return ATMOTUBE_RET_ERROR;
+    }
+  sink->worker_started = true;
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Stop the worker once it has written what it took from the queue,
+ * then stop the plugin instance. Records still queued, and any pushed
+ * meanwhile, wait for the next instance. */
+static void
+stop_instance (AtmotubeSink * sink)
+{
+  queue_pause (&sink->queue);
+
+  if (sink->worker_started)
+    {
+      pthread_join (sink->worker, NULL);
+      sink->worker_started = false;
+    }
+
+  if (sink->plugin != NULL && sink->plugin_ctx != NULL)
+    {
+      int status = sink->plugin->plugin_stop (sink->plugin_ctx);
+      PRINT_DEBUG ("Stopped plugin: %d\n", status);
+    }
+  sink->plugin_ctx = NULL;
+  sink->plugin = NULL;
+}
+
+static int
+start_sink (AtmotubeSink * sink)
+{
+  Atmotube_Output_Config *config = sink->config;
+
+  PRINT_DEBUG ("Creating output %s: %s\n", config->output_name,
+	       config->output_type);
+
+  sink->output = create_output (config);
+  if (sink->output == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (queue_init (&sink->queue, config->output_queue_size,
+		  sink->output->num_devices,
+		  config->output_queue_policy) != ATMOTUBE_RET_OK)
+    {
+      PRINT_ERROR ("Unable to allocate queue for %s\n", config->output_name);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (config->output_queue_policy == QUEUE_POLICY_SHED)
+    {
+      AtmotubeQueueShed shed;
+      size_t size = (size_t) config->output_queue_size;
+
+      shed.coalesce_depth = size * config->output_shed_coalesce / 100;
+      shed.drop_depth = size * config->output_shed_drop / 100;
+      shed.low_priority = config->output_low_priority;
+      queue_set_shed (&sink->queue, &shed);
+      sink->max_latency =
+	ATMOTUBE_MS_TO_NS (config->output_max_latency);
+    }
+
+  histogram_reset (&sink->latency);
+  sink->errors = 0;
+  sink->latency_budget = ATMOTUBE_MS_TO_NS (config->output_latency_budget);
+  sink->next_check = atmotube_timestamp_ns () + LATENCY_CHECK_INTERVAL;
+  sink->over_budget = false;
+  histogram_reset (&sink->latency_checked);
+
+  return start_instance (sink, NULL);
+}
+
+/* Let every device know which outputs it writes to, and compile the
+ * metric filters of the outputs into its routing table. */
+static int
+connect_sinks ()
+{
+  int i, j, m;
+
+  for (i = 0; i < glData.outputConfigurationSize; i++)
+    {
+      AtmotubeSink *sink = glData.sinks + i;
+
+      for (j = 0; j < sink->config->num_sources; j++)
 	{
-	  free (d->output);
-	  d->output = NULL;
+	  AtmotubeData *d =
+	    glData.deviceConfiguration + sink->config->source_ids[j];
+
+	  if (d->num_sinks == ATMOTUBE_MAX_DEVICE_SINKS)
+	    {
+	      PRINT_ERROR ("Device %s has more than %d outputs\n",
+			   d->device.device_name, ATMOTUBE_MAX_DEVICE_SINKS);
+	      return ATMOTUBE_RET_ERROR;
+	    }
+
+	  AtmotubeSinkRef *refs = (AtmotubeSinkRef *)
+	    realloc (d->sinks, (d->num_sinks + 1) * sizeof (AtmotubeSinkRef));
+	  if (refs == NULL)
+	    {
+	      return ATMOTUBE_RET_ERROR;
+	    }
+
+	  d->sinks = refs;
+	  d->sinks[d->num_sinks].sink = sink;
+	  d->sinks[d->num_sinks].device = j;
+
+	  for (m = 0; m < CHARACTER_MAX; m++)
+	    {
+	      if (sink->config->output_metrics & (1u << m))
+		{
+		  d->routes[m] |= 1u << d->num_sinks;
+		}
+	    }
+	  d->num_sinks++;
 	}
     }
+
+  return ATMOTUBE_RET_OK;
 }
 
 int
@@ -52,7 +615,8 @@ atmotube_create_outputs ()
 {
   int i;
   int ret;
-  PRINT_DEBUG ("Devices: %d\n", glData.deviceConfigurationSize);
+  PRINT_DEBUG ("Devices: %d, outputs: %d\n", glData.deviceConfigurationSize,
+	       glData.outputConfigurationSize);
 
   if (glData.deviceConfigurationSize == 0)
     {
@@ -69,29 +633,29 @@ atmotube_create_outputs ()
       return ATMOTUBE_RET_ERROR;
     }
 
-  for (i = 0; i < glData.deviceConfigurationSize; i++)
+  glData.sinks = (AtmotubeSink *)
+    calloc (glData.outputConfigurationSize, sizeof (AtmotubeSink));
+  if (glData.sinks == NULL)
     {
-      AtmotubeData *d = glData.deviceConfiguration + i;
+      return ATMOTUBE_RET_ERROR;
+    }
 
-      d->output = NULL;
+  for (i = 0; i < glData.outputConfigurationSize; i++)
+    {
+      AtmotubeSink *sink = glData.sinks + i;
 
-      PRINT_DEBUG ("Creating output: %s\n", d->device.output_type);
-      AtmotubePlugin *op = atmotube_plugin_get (d->device.output_type);
-      if (op == NULL)
+      sink->config = glData.outputConfiguration + i;
+      if (start_sink (sink) != ATMOTUBE_RET_OK)
 	{
 	  clear_outputs ();
 	  return ATMOTUBE_RET_ERROR;
 	}
-      d->output = (AtmotubeOutput *) malloc (sizeof (AtmotubeOutput));
-
-      d->output->device_name = d->device.device_name;
-      d->output->device_address = d->device.device_address;
-
-      d->output->filename = d->device.output_filename;
-      d->output->state = NULL;
+    }
 
-      d->plugin = op;
-      d->plugin->plugin_start (d->output);
+  if (connect_sinks () != ATMOTUBE_RET_OK)
+    {
+      clear_outputs ();
+      return ATMOTUBE_RET_ERROR;
     }
 
   return ATMOTUBE_RET_OK;
@@ -99,41 +663,255 @@ atmotube_create_outputs ()
 
 int
 atmotube_destroy_outputs ()
+{
+  clear_outputs ();
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Stop the instance of a sink and start one of plugin instead, see
+ * start_instance. */
+static int
+restart_instance (AtmotubeSink * sink, AtmotubePlugin * plugin)
+{
+  PRINT_DEBUG ("Restarting output %s\n", sink->config->output_name);
+  stop_instance (sink);
+  queue_resume (&sink->queue);
+  if (start_instance (sink, plugin) != ATMOTUBE_RET_OK)
+    {
+      stop_instance (sink);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Swap the plugin of all outputs of one type for a fresh copy of
+ * its library. The new library is loaded and checked first, and the
+ * old one is only unloaded once all outputs run the new one: if one of
+ * them fails to start, they all go back to the old one. */
+static int
+reload_type (const char *type)
 {
   int i;
+  const int n = glData.outputConfigurationSize;
+  bool switched[n];
+  AtmotubePlugin *old = NULL;
 
-  for (i = 0; i < glData.deviceConfigurationSize; i++)
+  for (i = 0; i < n; i++)
     {
-      AtmotubeData *d = glData.deviceConfiguration + i;
+      AtmotubeSink *sink = glData.sinks + i;
 
-      int status = d->plugin->plugin_stop ();
-      PRINT_DEBUG ("Stopped plugin: %d\n", status);
-      free (d->output);
+      if (sink->plugin == NULL
+	  || strcmp (sink->config->output_type, type) != 0)
+	{
+	  continue;
+	}
+
+      if (sink->plugin->builtin != ATMOTUBE_BUILTIN_NONE)
+	{
+	  PRINT_ERROR ("Plugin %s is builtin, it cannot be reloaded\n", type);
+	  return ATMOTUBE_RET_ERROR;
+	}
+      if (sink->config->output_host == NULL)
+	{
+	  old = sink->plugin;
+	}
     }
 
+  const char *file = atmotube_plugin_file (type);
+  AtmotubePlugin *plugin = (file != NULL) ?
+    atmotube_plugin_load_copy (type, file) : NULL;
+  if (plugin == NULL)
+    {
+      PRINT_ERROR ("Unable to reload plugin %s, keeping the old one\n",
+		   type);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      AtmotubeSink *sink = glData.sinks + i;
+
+      switched[i] = false;
+      if (sink->plugin == NULL
+	  || strcmp (sink->config->output_type, type) != 0)
+	{
+	  continue;
+	}
+
+      switched[i] = true;
+      if (restart_instance (sink, plugin) != ATMOTUBE_RET_OK)
+	{
+	  break;
+	}
+    }
+
+  if (i == n)
+    {
+      /* Nothing refers to the old library now. */
+      if (old != NULL)
+	{
+	  atmotube_plugin_replace (plugin);
+	}
+      else
+	{
+	  atmotube_plugin_close (plugin);
+	}
+      return ATMOTUBE_RET_OK;
+    }
+
+  PRINT_ERROR ("Unable to start plugin %s, going back to the old one\n",
+	       type);
+  for (; i >= 0; i--)
+    {
+      AtmotubeSink *sink = glData.sinks + i;
+
+      if (switched[i] && restart_instance (sink, old) != ATMOTUBE_RET_OK)
+	{
+	  /* Do not leave the devices waiting on a full queue. */
+	  PRINT_ERROR ("Output %s is out of service\n",
+		       sink->config->output_name);
+	  queue_close (&sink->queue);
+	}
+    }
+  atmotube_plugin_close (plugin);
+
+  return ATMOTUBE_RET_ERROR;
+}
+
+int
+atmotube_reload_plugins (const char *type)
+{
+  int i, j;
+  int ret = ATMOTUBE_RET_OK;
+
+  if (glData.sinks == NULL)
+    {
+      PRINT_ERROR ("%s\n", "No outputs to reload.");
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (type != NULL)
+    {
+      return reload_type (type);
+    }
+
+  /* Every loaded plugin, once. */
+  for (i = 0; i < glData.outputConfigurationSize; i++)
+    {
+      AtmotubeSink *sink = glData.sinks + i;
+      const char *t = sink->config->output_type;
+
+      if (sink->plugin == NULL
+	  || sink->plugin->builtin != ATMOTUBE_BUILTIN_NONE)
+	{
+	  continue;
+	}
+
+      for (j = 0; j < i; j++)
+	{
+	  if (strcmp (glData.sinks[j].config->output_type, t) == 0)
+	    {
+	      break;
+	    }
+	}
+
+      if (j == i && reload_type (t) != ATMOTUBE_RET_OK)
+	{
+	  ret = ATMOTUBE_RET_ERROR;
+	}
+    }
+
+  return ret;
+}
+
+int
+output_get_queue_stats (int output_id, AtmotubeQueueStats * stats)
+{
+  if (glData.sinks == NULL || output_id < 0
+      || output_id >= glData.outputConfigurationSize)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  AtmotubeSink *sink = glData.sinks + output_id;
+  if (!sink->worker_started)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  queue_get_stats (&sink->queue, stats);
   return ATMOTUBE_RET_OK;
 }
 
+int
+output_get_latency_stats (int output_id, AtmotubeLatencyStats * stats)
+{
+  if (glData.sinks == NULL || output_id < 0
+      || output_id >= glData.outputConfigurationSize)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  AtmotubeSink *sink = glData.sinks + output_id;
+  if (!sink->worker_started)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  get_latency_stats (sink, stats);
+  return ATMOTUBE_RET_OK;
+}
+
+/* Fan a sample out to the outputs of the device taking its metric.
+ * The sample is aggregated once, each output only gets its own copy of
+ * the record. */
+static void
+output_push (AtmotubeData * d, uint64_t ts, int metric, double value)
+{
+  AtmotubeRecord r;
+  uint32_t mask = d->routes[metric];
+
+  r.ts = ts;
+  r.metric = metric;
+  r.value = value;
+
+  while (mask != 0)
+    {
+      AtmotubeSinkRef *ref = d->sinks + __builtin_ctz (mask);
+
+      mask &= mask - 1;
+
+      r.device = ref->device;
+      if (queue_push (&ref->sink->queue, &r) != ATMOTUBE_RET_OK)
+	{
+	  PRINT_ERROR ("Output %s is closed\n",
+		       ref->sink->config->output_name);
+	}
+    }
+}
+
+void
+output_temperature (uint64_t ts, unsigned long value, void *data_ptr)
+{
+  output_push ((AtmotubeData *) data_ptr, ts, TEMPERATURE, value);
+}
+
 void
-output_temperature (unsigned long ts, unsigned long value, void *data_ptr)
+output_humidity (uint64_t ts, unsigned long value, void *data_ptr)
 {
-  AtmotubeData *d = (AtmotubeData *) data_ptr;
-  AtmotubePlugin *plugin = d->plugin;
-  plugin->temperature (ts, value);
+  output_push ((AtmotubeData *) data_ptr, ts, HUMIDITY, value);
 }
 
 void
-output_humidity (unsigned long ts, unsigned long value, void *data_ptr)
+output_voc (uint64_t ts, float value, void *data_ptr)
 {
-  AtmotubeData *d = (AtmotubeData *) data_ptr;
-  AtmotubePlugin *plugin = d->plugin;
-  plugin->humidity (ts, value);
+  output_push ((AtmotubeData *) data_ptr, ts, VOC, value);
 }
 
 void
-output_voc (unsigned long ts, float value, void *data_ptr)
+output_voc_scaled (uint64_t ts, unsigned long value, void *data_ptr)
 {
-  AtmotubeData *d = (AtmotubeData *) data_ptr;
-  AtmotubePlugin *plugin = d->plugin;
-  plugin->voc (ts, value);
+  output_push ((AtmotubeData *) data_ptr, ts, VOC, value);
 }
@@ -17,12 +17,55 @@
 #ifndef ATMOTUBE_OUTPUT_H
 #define ATMOTUBE_OUTPUT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atmotube-queue.h"
+
+/* Records collected for an output which supports write_batch. The
+ * arrays are allocated when the output is created, so collecting does
+ * not allocate. */
+typedef struct
+{
+  /* Number of records collected. */
+  size_t count;
+  /* Capacity of the arrays. */
+  size_t size;
+  /* Max age of the oldest record before the batch is written, in ns. */
+  uint64_t interval;
+
+  uint64_t *ts;
+  int *device;
+  int *metric;
+  double *value;
+} AtmotubeBatch;
+
 /* Deallocate any plugins. */
 int atmotube_destroy_outputs ();
 
-void output_temperature (unsigned long ts, unsigned long value,
-			 void *data_ptr);
-void output_humidity (unsigned long ts, unsigned long value, void *data_ptr);
-void output_voc (unsigned long ts, float value, void *data_ptr);
+void output_temperature (uint64_t ts, unsigned long value, void *data_ptr);
+void output_humidity (uint64_t ts, unsigned long value, void *data_ptr);
+void output_voc (uint64_t ts, float value, void *data_ptr);
+/* VOC in 1/ATMOTUBE_VOC_SCALE ppm, see atmotube_config_voc_scaled. */
+void output_voc_scaled (uint64_t ts, unsigned long value, void *data_ptr);
+
+/* Plugin call metrics of an output, latencies in ns. */
+typedef struct
+{
+  /* Calls made to the plugin, single records and batches alike. */
+  uint64_t calls;
+  /* Calls which returned an error. */
+  uint64_t errors;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t max;
+} AtmotubeLatencyStats;
+
+/* Get the queue metrics of an output. */
+int output_get_queue_stats (int output_id, AtmotubeQueueStats * stats);
+
+/* Get the plugin call metrics of an output. */
+int output_get_latency_stats (int output_id, AtmotubeLatencyStats * stats);
 
 #endif /* ATMOTUBE_OUTPUT_H */
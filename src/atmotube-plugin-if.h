@@ -17,24 +17,150 @@
 #ifndef ATMOTUBE_PLUGIN_IF_H
 #define ATMOTUBE_PLUGIN_IF_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Plugin interface */
 
+/* Version of the plugin interface described below. Plugins report the
+ * version they implement through get_plugin_abi_version, plugins
+ * built against another version are not loaded.
+ *
+ * Version 2: plugin_start returns an instance context, which is
+ * passed to every other call. A plugin keeps its state in the context,
+ * so one loaded plugin can serve any number of outputs.
+ *
+ * Version 3: an output can have several source devices. Samples carry
+ * the index of their device within AtmotubeOutput.
+ *
+ * Version 4: AtmotubeOutput carries the storage settings of the output
+ * (commit, partition, retention, storage) and the unit of VOC.
+ */
+#define ATMOTUBE_PLUGIN_ABI_VERSION 4
+
+/* plugin_start and plugin_stop are called from the main thread. All
+ * other calls for an instance are made from the worker thread of its
+ * output, one at a time. On a reload a copy of the library is opened
+ * next to the old one, whose instances are then stopped and new ones
+ * started; the old library is closed once none of its instances run.
+ * A plugin must not rely on state kept in the library across a
+ * reload. */
+
+/* How an output splits its data over files. */
+typedef enum
+{
+  ATMOTUBE_PARTITION_NONE = 0,
+  ATMOTUBE_PARTITION_DAY,
+  ATMOTUBE_PARTITION_MONTH
+} Atmotube_Partition;
+
+/* VOC as read from the device is an integer number of 1/100 ppm. */
+#define ATMOTUBE_VOC_SCALE 100
+
+/* How an output lays out samples. */
+typedef enum
+{
+  /* One row per sample. */
+  ATMOTUBE_STORAGE_ROWS = 0,
+  /* Compressed chunks of samples. */
+  ATMOTUBE_STORAGE_CHUNKS
+} Atmotube_Storage;
+
+/* Description of an output, passed to plugin_start. It stays valid
+ * until plugin_stop. */
 typedef struct
 {
   /* const char* type; */
   const char *filename;
-  const char *device_name;
-  const char *device_address;
-  void *state;
+  /* Devices writing to the output. */
+  int num_devices;
+  const char **device_names;
+  const char **device_addresses;
+  /* Outputs which write in transactions commit once this many rows are
+   * pending, 0 to commit after every call. */
+  int commit_rows;
+  /* ... or when the oldest pending row is this old, in ms. 0 for no
+   * limit. */
+  int commit_interval;
+  /* Outputs which support it write to one file per partition, named
+   * after filename and the date of the partition. */
+  Atmotube_Partition partition;
+  /* Partitions older than this many days are removed, 0 to keep them
+   * all. */
+  int retention;
+  /* Layout, for outputs which support several. */
+  Atmotube_Storage storage;
+  /* VOC values given to the plugin are in 1/voc_scale ppm: 1, or
+   * ATMOTUBE_VOC_SCALE when VOC is carried as read from the device, in
+   * which case they are integers. */
+  int voc_scale;
 } AtmotubeOutput;
 
+/* Stock plugins can be linked into atmlib (ATMOTUBE_BUILTIN_PLUGINS).
+ * Each one is then compiled with ATMOTUBE_BUILTIN_PLUGIN set to a
+ * prefix, e.g. file_, which is prepended to the names below so that
+ * several plugins fit in one library. */
+#define ATMOTUBE_PLUGIN_CONCAT_(a, b) a ## b
+#define ATMOTUBE_PLUGIN_CONCAT(a, b) ATMOTUBE_PLUGIN_CONCAT_(a, b)
+
+#ifdef ATMOTUBE_BUILTIN_PLUGIN
+#define ATMOTUBE_PLUGIN_NAME(name) \
+  ATMOTUBE_PLUGIN_CONCAT(ATMOTUBE_BUILTIN_PLUGIN, name)
+#define get_plugin_abi_version ATMOTUBE_PLUGIN_NAME(get_plugin_abi_version)
+#define get_plugin_type ATMOTUBE_PLUGIN_NAME(get_plugin_type)
+#define plugin_start ATMOTUBE_PLUGIN_NAME(plugin_start)
+#define temperature ATMOTUBE_PLUGIN_NAME(temperature)
+#define humidity ATMOTUBE_PLUGIN_NAME(humidity)
+#define voc ATMOTUBE_PLUGIN_NAME(voc)
+#define write_batch ATMOTUBE_PLUGIN_NAME(write_batch)
+#define plugin_flush ATMOTUBE_PLUGIN_NAME(plugin_flush)
+#define plugin_stop ATMOTUBE_PLUGIN_NAME(plugin_stop)
+#endif
+
+/* Declare the interface of a plugin built with prefix p. */
+#define ATMOTUBE_PLUGIN_DECLARE(p) \
+  int p ## get_plugin_abi_version (void); \
+  const char *p ## get_plugin_type (void); \
+  void *p ## plugin_start (const AtmotubeOutput * o); \
+  int p ## temperature (void *ctx, uint64_t ts, int device, \
+			unsigned long value); \
+  int p ## humidity (void *ctx, uint64_t ts, int device, \
+		     unsigned long value); \
+  int p ## voc (void *ctx, uint64_t ts, int device, float value); \
+  int p ## write_batch (void *ctx, size_t n, const uint64_t ts[], \
+			const int device[], const int metric[], \
+			const double value[]); \
+  int p ## plugin_stop (void *ctx)
+
+/* Get the plugin interface version implemented by the plugin. */
+int get_plugin_abi_version (void);
 /* Get type of plugin. */
 const char *get_plugin_type (void);
-int plugin_start (AtmotubeOutput * o);
-void temperature (unsigned long ts, unsigned long value);
-void humidity (unsigned long ts, unsigned long value);
-void voc (unsigned long ts, float value);
-int plugin_stop (void);
+/* Start an instance, returns its context or NULL on error. */
+void *plugin_start (const AtmotubeOutput * o);
+/* Write a sample, returns ATMOTUBE_RET_OK or ATMOTUBE_RET_ERROR.
+ * ts is the receipt time of the sample, in ns since the Unix epoch.
+ * device is an index into the devices of the output. VOC values are
+ * in 1/voc_scale ppm of the output, here and in write_batch. */
+int temperature (void *ctx, uint64_t ts, int device, unsigned long value);
+int humidity (void *ctx, uint64_t ts, int device, unsigned long value);
+int voc (void *ctx, uint64_t ts, int device, float value);
+/* Optional. Write n records at once, returns ATMOTUBE_RET_OK or
+ * ATMOTUBE_RET_ERROR. Record i is made of ts[i], device[i] (index of
+ * the device within the output), metric[i] (an enum CHARACTER_ID) and
+ * value[i]. When a plugin exports this, the core collects samples and
+ * hands them over in batches instead of calling temperature, humidity
+ * and voc. */
+int write_batch (void *ctx, size_t n, const uint64_t ts[],
+		 const int device[], const int metric[],
+		 const double value[]);
+/* Optional. Called twice per commit_interval of the output, whether or
+ * not records come, so that an output writing in transactions can
+ * commit the pending rows in time. Returns ATMOTUBE_RET_OK or
+ * ATMOTUBE_RET_ERROR. */
+int plugin_flush (void *ctx);
+/* Stop an instance and release its context. */
+int plugin_stop (void *ctx);
 
 /* Plugin interface */
 
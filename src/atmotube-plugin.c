@@ -13,6 +13,7 @@
 * along with atmotube-reader.
 * If not, see <http://www.gnu.org/licenses/>.
 */
+#define _GNU_SOURCE
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -21,9 +22,11 @@
 #include <glib.h>
 #include <stdbool.h>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "atmotube-plugin.h"
 #include "atmotube.h"
@@ -31,18 +34,32 @@
 #include "atmotube-interval.h"
 #include "atmotube-private.h"
 
+#define FUNCTION_GET_PLUGIN_ABI_VERSION "get_plugin_abi_version"
 #define FUNCTION_GET_PLUGIN_TYPE "get_plugin_type"
 #define FUNCTION_PLUGIN_START "plugin_start"
 #define FUNCTION_PLUGIN_STOP "plugin_stop"
 #define FUNCTION_TEMPERATURE "temperature"
 #define FUNCTION_HUMIDITY "humidity"
 #define FUNCTION_VOC "voc"
+#define FUNCTION_WRITE_BATCH "write_batch"
+#define FUNCTION_PLUGIN_FLUSH "plugin_flush"
+
+/* Optional list of plugins in the plugin directory, one "type file"
+ * pair per line. When present the directory is not scanned. */
+#define PLUGIN_MANIFEST "plugins.manifest"
+/* Otherwise a plugin of type T is expected in libT.so. */
+#define PLUGIN_PREFIX "lib"
+#define PLUGIN_SUFFIX ".so"
 
 extern AtmotubeGlData glData;
 
-static GSList *plugins = NULL;
+/* Plugins found in the plugin directory, type -> path of the
+ * library. Built once by atmotube_plugin_find, without loading
+ * anything. */
+static GHashTable *pluginIndex = NULL;
 
-static int numberOfPlugins = 0;
+/* Plugins loaded so far, type -> AtmotubePlugin. */
+static GHashTable *plugins = NULL;
 
 #define LOAD_FUNCTION(ptr,function) *(void **) (&ptr) = dlsym(handle, function)
 #define CHECK_DLSYM_RESULT(ptr,function) if (ptr == NULL) { PRINT_ERROR("Unable to load %s\n", function); return ATMOTUBE_RET_ERROR; }
@@ -53,6 +70,19 @@ plugin_assign (void *handle, AtmotubePlugin * dest)
 
   PRINT_DEBUG ("plugin_assign\n");
 
+  CB_get_plugin_abi_version *get_plugin_abi_version = NULL;
+  LOAD_FUNCTION (get_plugin_abi_version, FUNCTION_GET_PLUGIN_ABI_VERSION);
+  CHECK_DLSYM_RESULT (get_plugin_abi_version,
+		      FUNCTION_GET_PLUGIN_ABI_VERSION);
+
+  int version = get_plugin_abi_version ();
+  if (version != ATMOTUBE_PLUGIN_ABI_VERSION)
+    {
+      PRINT_ERROR ("Plugin ABI version %d, expected %d\n", version,
+		   ATMOTUBE_PLUGIN_ABI_VERSION);
+      return ATMOTUBE_RET_ERROR;
+    }
+
   CB_get_plugin_type *get_plugin_type = NULL;
   LOAD_FUNCTION (get_plugin_type, FUNCTION_GET_PLUGIN_TYPE);
   CHECK_DLSYM_RESULT (get_plugin_type, FUNCTION_GET_PLUGIN_TYPE);
@@ -73,15 +103,26 @@ plugin_assign (void *handle, AtmotubePlugin * dest)
   LOAD_FUNCTION (voc, FUNCTION_VOC);
   CHECK_DLSYM_RESULT (voc, FUNCTION_VOC);
 
+  CB_write_batch *write_batch = NULL;
+  LOAD_FUNCTION (write_batch, FUNCTION_WRITE_BATCH);
+  /* Optional, no check. */
+
+  CB_plugin_flush *plugin_flush = NULL;
+  LOAD_FUNCTION (plugin_flush, FUNCTION_PLUGIN_FLUSH);
+  /* Optional, no check. */
+
   CB_plugin_stop *plugin_stop = NULL;
   LOAD_FUNCTION (plugin_stop, FUNCTION_PLUGIN_STOP);
   CHECK_DLSYM_RESULT (plugin_stop, FUNCTION_PLUGIN_STOP);
 
+  dest->builtin = ATMOTUBE_BUILTIN_NONE;
   dest->get_plugin_type = get_plugin_type;
   dest->plugin_start = plugin_start;
   dest->temperature = temperature;
   dest->humidity = humidity;
   dest->voc = voc;
+  dest->write_batch = write_batch;
+  dest->plugin_flush = plugin_flush;
   dest->plugin_stop = plugin_stop;
 
   PRINT_DEBUG ("%s\n", "All functions present");
@@ -89,17 +130,43 @@ plugin_assign (void *handle, AtmotubePlugin * dest)
   return ATMOTUBE_RET_OK;
 }
 
-int
-atmotube_plugin_find (const char *path)
+static void
+index_add (const char *path, const char *type, const char *filename)
 {
-  if (path == NULL)
+  const size_t len = strlen (path) + strlen ("/") + strlen (filename) + 1;
+  char *fullname = malloc (len);
+  snprintf (fullname, len, "%s/%s", path, filename);
+
+  PRINT_DEBUG ("Indexed plugin %s: %s\n", type, fullname);
+  g_hash_table_replace (pluginIndex, strdup (type), fullname);
+}
+
+static int
+index_manifest (const char *path, FILE * f)
+{
+  char line[256];
+  char type[128];
+  char filename[128];
+
+  while (fgets (line, sizeof (line), f) != NULL)
     {
-      PRINT_ERROR ("%s\n", "atmotube_plugin_find, invalid path");
-      return ATMOTUBE_RET_ERROR;
+      if (line[0] == '#')
+	{
+	  continue;
+	}
+
+      if (sscanf (line, "%127s %127s", type, filename) == 2)
+	{
+	  index_add (path, type, filename);
+	}
     }
 
-  PRINT_DEBUG ("Searching for DSO(s) in %s\n", path);
+  return ATMOTUBE_RET_OK;
+}
 
+static int
+index_directory (const char *path)
+{
   DIR *dir = opendir (path);
   if (!dir)
     {
@@ -108,105 +175,287 @@ atmotube_plugin_find (const char *path)
     }
 
   struct dirent *direntry;
+  const size_t prefix_len = strlen (PLUGIN_PREFIX);
+  const size_t suffix_len = strlen (PLUGIN_SUFFIX);
 
   while ((direntry = readdir (dir)) != NULL)
     {
       char *filename = direntry->d_name;
-      char *dot = strrchr (filename, '.');
-      if (dot && !strcmp (dot, ".so"))
+      const size_t len = strlen (filename);
+
+      if (len > prefix_len + suffix_len
+	  && strncmp (filename, PLUGIN_PREFIX, prefix_len) == 0
+	  && strcmp (filename + len - suffix_len, PLUGIN_SUFFIX) == 0)
 	{
-	  const size_t len =
-	    strlen (path) + strlen ("/") + strlen (filename) + 1;
-	  char fullname[len];
-	  snprintf (&fullname[0], sizeof (fullname), "%s/%s", path, filename);
-
-	  void *libhandle = dlopen (&fullname[0], RTLD_NOW);
-	  if (libhandle == NULL)
-	    {
-	      PRINT_ERROR ("Unable to use plugin: %s\n", &fullname[0]);
-	      continue;
-	    }
-
-	  PRINT_DEBUG ("Loading plugin: %s\n", fullname);
-
-	  AtmotubePlugin *info = malloc (sizeof (AtmotubePlugin));
-	  if (plugin_assign (libhandle, info) != ATMOTUBE_RET_OK)
-	    {
-	      dlclose (info->handle);
-	      free (info);
-	      info = NULL;
-	      continue;
-	    }
-
-	  info->handle = libhandle;
-	  PRINT_DEBUG ("Found function call: %s\n", FUNCTION_GET_PLUGIN_TYPE);
-	  info->type = strdup (info->get_plugin_type ());
-	  PRINT_DEBUG ("Found plugin type: %s\n", info->type);
-
-	  plugins = g_slist_append (plugins, info);
-
-	  numberOfPlugins++;
+	  char type[len];
+	  const size_t type_len = len - prefix_len - suffix_len;
+	  memcpy (type, filename + prefix_len, type_len);
+	  type[type_len] = '\0';
+
+	  index_add (path, type, filename);
 	}
     }
 
   closedir (dir);
+  return ATMOTUBE_RET_OK;
+}
+
+static void
+plugin_unload (gpointer data)
+{
+  AtmotubePlugin *info = (AtmotubePlugin *) data;
+
+  PRINT_DEBUG ("Unloading plugin: %s\n", info->type);
+  dlclose (info->handle);
+  if (info->fd >= 0)
+    {
+      close (info->fd);
+    }
+  free ((char *) info->type);
+  free (info);
+}
+
+int
+atmotube_plugin_find (const char *path)
+{
+  int ret;
+
+  if (path == NULL)
+    {
+      PRINT_ERROR ("%s\n", "atmotube_plugin_find, invalid path");
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  PRINT_DEBUG ("Indexing plugins in %s\n", path);
+
+  if (pluginIndex == NULL)
+    {
+      pluginIndex = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   free, free);
+      plugins = g_hash_table_new_full (g_str_hash, g_str_equal,
+				       NULL, plugin_unload);
+    }
+
+  const size_t len = strlen (path) + strlen ("/" PLUGIN_MANIFEST) + 1;
+  char manifest[len];
+  snprintf (&manifest[0], sizeof (manifest), "%s/%s", path, PLUGIN_MANIFEST);
+
+  FILE *f = fopen (&manifest[0], "r");
+  if (f != NULL)
+    {
+      ret = index_manifest (path, f);
+      fclose (f);
+    }
+  else
+    {
+      ret = index_directory (path);
+    }
+
+  if (ret != ATMOTUBE_RET_OK)
+    {
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+      PRINT_DEBUG ("%s\n", "Using builtin plugins only");
+      return ATMOTUBE_RET_OK;
+#else
+      return ATMOTUBE_RET_ERROR;
+#endif
+    }
 
-  if (numberOfPlugins > 0)
+  if (g_hash_table_size (pluginIndex) > 0)
     {
-      PRINT_DEBUG ("numberOfPlugins=%d\n", numberOfPlugins);
+      PRINT_DEBUG ("numberOfPlugins=%u\n", g_hash_table_size (pluginIndex));
       return ATMOTUBE_RET_OK;
     }
 
-  PRINT_ERROR ("No plugins, numberOfPlugins=%d\n", numberOfPlugins);
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+  PRINT_DEBUG ("No plugins in %s, using builtin plugins only\n", path);
+  return ATMOTUBE_RET_OK;
+#endif
+
+  PRINT_ERROR ("No plugins in %s\n", path);
   return ATMOTUBE_RET_ERROR;
 }
 
 AtmotubePlugin *
-atmotube_plugin_get (const char *type)
+atmotube_plugin_load (const char *type, const char *fullname)
 {
-  int i;
-  GSList *node;
+  void *libhandle = dlopen (fullname, RTLD_NOW);
+  if (libhandle == NULL)
+    {
+      PRINT_ERROR ("Unable to use plugin: %s (%s)\n", fullname, dlerror ());
+      return NULL;
+    }
+
+  PRINT_DEBUG ("Loading plugin: %s\n", fullname);
 
-  if (numberOfPlugins == 0)
+  AtmotubePlugin *info = malloc (sizeof (AtmotubePlugin));
+  if (info == NULL || plugin_assign (libhandle, info) != ATMOTUBE_RET_OK)
     {
-      PRINT_ERROR ("%s\n", "No plugins loaded.");
+      PRINT_ERROR ("Unable to use plugin: %s\n", fullname);
+      dlclose (libhandle);
+      free (info);
       return NULL;
     }
 
-  for (i = 0; i < numberOfPlugins; i++)
+  info->handle = libhandle;
+  info->fd = -1;
+  info->type = strdup (info->get_plugin_type ());
+  PRINT_DEBUG ("Found plugin type: %s\n", info->type);
+
+  if (strcmp (info->type, type) != 0)
     {
-      //PRINT_DEBUG("Plugin %d: %s\n", i, );
-      node = g_slist_nth (plugins, i);
-      AtmotubePlugin *info = (AtmotubePlugin *) node->data;
-      if (strcmp (info->type, type) == 0)
+      PRINT_ERROR ("Plugin %s has type '%s', expected '%s'\n", fullname,
+		   info->type, type);
+      plugin_unload (info);
+      return NULL;
+    }
+
+  return info;
+}
+
+/* Copy the file src to the descriptor fd. */
+static int
+copy_file (const char *src, int fd)
+{
+  char buf[4096];
+  ssize_t n;
+
+  int in = open (src, O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    {
+      PRINT_ERROR ("Unable to read plugin: %s\n", src);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  while ((n = read (in, buf, sizeof (buf))) > 0)
+    {
+      if (write (fd, buf, (size_t) n) != n)
 	{
-	  PRINT_DEBUG ("Found plugin %d: %s\n", i, info->type);
-	  return info;
+	  n = -1;
+	  break;
 	}
     }
+  close (in);
+
+  return n == 0 ? ATMOTUBE_RET_OK : ATMOTUBE_RET_ERROR;
+}
+
+AtmotubePlugin *
+atmotube_plugin_load_copy (const char *type, const char *fullname)
+{
+  char path[64];
+
+  /* The dynamic loader hands out the library already loaded from the
+   * same path, or the same file, instead of reading it again. A memory
+   * file is neither, and it is kept open, so its path stays unique,
+   * until the plugin is unloaded. */
+  int fd = memfd_create (type, MFD_CLOEXEC);
+  if (fd < 0)
+    {
+      PRINT_ERROR ("Unable to copy plugin: %s\n", fullname);
+      return NULL;
+    }
+
+  if (copy_file (fullname, fd) != ATMOTUBE_RET_OK)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  snprintf (path, sizeof (path), "/proc/self/fd/%d", fd);
+  PRINT_DEBUG ("Loading a copy of %s from %s\n", fullname, path);
+
+  AtmotubePlugin *info = atmotube_plugin_load (type, path);
+  if (info == NULL)
+    {
+      close (fd);
+      return NULL;
+    }
 
-  PRINT_ERROR ("Plugin with type '%s' not found\n", type);
-  return NULL;
+  info->fd = fd;
+  return info;
+}
+
+AtmotubePlugin *
+atmotube_plugin_get (const char *type)
+{
+  if (pluginIndex == NULL)
+    {
+      PRINT_ERROR ("%s\n", "No plugins found.");
+      return NULL;
+    }
+
+  AtmotubePlugin *info;
+
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+  info = atmotube_builtin_get (type);
+  if (info != NULL)
+    {
+      return info;
+    }
+#endif
+
+  info = g_hash_table_lookup (plugins, type);
+  if (info != NULL)
+    {
+      return info;
+    }
+
+  /* Load on first use. */
+  const char *fullname = g_hash_table_lookup (pluginIndex, type);
+  if (fullname == NULL)
+    {
+      PRINT_ERROR ("Plugin with type '%s' not found\n", type);
+      return NULL;
+    }
+
+  info = atmotube_plugin_load (type, fullname);
+  if (info == NULL)
+    {
+      return NULL;
+    }
+
+  g_hash_table_insert (plugins, (gpointer) info->type, info);
+  return info;
+}
+
+void
+atmotube_plugin_close (AtmotubePlugin * info)
+{
+  plugin_unload (info);
+}
+
+const char *
+atmotube_plugin_file (const char *type)
+{
+  if (pluginIndex == NULL)
+    {
+      return NULL;
+    }
+
+  return g_hash_table_lookup (pluginIndex, type);
+}
+
+void
+atmotube_plugin_replace (AtmotubePlugin * info)
+{
+  g_hash_table_replace (plugins, (gpointer) info->type, info);
 }
 
 int
 atmotube_plugin_unload_all ()
 {
-  int i;
-  GSList *node;
-
-  for (i = 0; i < numberOfPlugins; i++)
+  if (plugins != NULL)
     {
-      node = g_slist_nth (plugins, i);
-      AtmotubePlugin *info = (AtmotubePlugin *) node->data;
-      PRINT_DEBUG ("Unloading plugin: %s\n", info->type);
-      dlclose (info->handle);
-      free (info);
+      g_hash_table_destroy (plugins);
+      plugins = NULL;
     }
 
-  g_slist_free (plugins);
-  numberOfPlugins = 0;
-  plugins = NULL;
+  if (pluginIndex != NULL)
+    {
+      g_hash_table_destroy (pluginIndex);
+      pluginIndex = NULL;
+    }
 
   return ATMOTUBE_RET_OK;
 }
@@ -19,30 +19,92 @@
 
 #include "atmotube-output.h"
 #include "atmotube-plugin-if.h"
+#include "atmotube-builtin.h"
 
+typedef int (CB_get_plugin_abi_version) (void);
 typedef const char *(CB_get_plugin_type) (void);
-typedef int (CB_plugin_start) (AtmotubeOutput * o);
-typedef int (CB_temperature) (unsigned long ts, unsigned long value);
-typedef int (CB_humidity) (unsigned long ts, unsigned long value);
-typedef int (CB_voc) (unsigned long ts, float value);
-typedef int (CB_plugin_stop) (void);
+typedef void *(CB_plugin_start) (const AtmotubeOutput * o);
+typedef int (CB_temperature) (void *ctx, uint64_t ts, int device,
+			      unsigned long value);
+typedef int (CB_humidity) (void *ctx, uint64_t ts, int device,
+			   unsigned long value);
+typedef int (CB_voc) (void *ctx, uint64_t ts, int device, float value);
+typedef int (CB_write_batch) (void *ctx, size_t n, const uint64_t ts[],
+			     const int device[], const int metric[],
+			     const double value[]);
+typedef int (CB_plugin_flush) (void *ctx);
+typedef int (CB_plugin_stop) (void *ctx);
 
 typedef struct
 {
   const char *type;
   void *handle;
+  /* Memory file the library was copied to, -1 if none. */
+  int fd;
+  /* Set for plugins linked into atmlib, handle is NULL then. */
+  Atmotube_Builtin_Id builtin;
 
   CB_get_plugin_type *get_plugin_type;
   CB_plugin_start *plugin_start;
   CB_temperature *temperature;
   CB_humidity *humidity;
   CB_voc *voc;
+  /* Optional, NULL when not exported by the plugin. */
+  CB_write_batch *write_batch;
+  CB_plugin_flush *plugin_flush;
   CB_plugin_stop *plugin_stop;
 } AtmotubePlugin;
 
 /* Finding / loading */
 AtmotubePlugin *atmotube_plugin_get (const char *type);
 
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+/* Builtin plugin of the given type, NULL if there is none. */
+AtmotubePlugin *atmotube_builtin_get (const char *type);
+#endif
+
+/* Write a batch. Builtin plugins are called directly, so that the
+ * call can be inlined with link time optimization. */
+static inline int
+atmotube_plugin_write_batch (const AtmotubePlugin * p, void *ctx, size_t n,
+			     const uint64_t ts[], const int device[],
+			     const int metric[], const double value[])
+{
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+  switch (p->builtin)
+    {
+    case ATMOTUBE_BUILTIN_FILE:
+      return file_write_batch (ctx, n, ts, device, metric, value);
+    case ATMOTUBE_BUILTIN_DB:
+      return db_write_batch (ctx, n, ts, device, metric, value);
+    default:
+      break;
+    }
+#endif
+  return p->write_batch (ctx, n, ts, device, metric, value);
+}
+
+/* Path of the library of a plugin type, NULL if there is none. */
+const char *atmotube_plugin_file (const char *type);
+
+/* Load the library fullname, outside of the plugin table. It has to
+ * contain a plugin of the given type. Release with
+ * atmotube_plugin_close. */
+AtmotubePlugin *atmotube_plugin_load (const char *type,
+				      const char *fullname);
+void atmotube_plugin_close (AtmotubePlugin * info);
+
+/* Same as atmotube_plugin_load, from a copy of the library: the file
+ * is read again even when it is loaded already, e.g. to reload a
+ * plugin which was rebuilt. */
+AtmotubePlugin *atmotube_plugin_load_copy (const char *type,
+					   const char *fullname);
+
+/* Make info, from atmotube_plugin_load, the plugin of its type. The
+ * plugin it replaces, if any, is unloaded: no instance of it may be
+ * running. */
+void atmotube_plugin_replace (AtmotubePlugin * info);
+
 int atmotube_plugin_unload_all ();
 
 #endif /* ATMOTUBE_PLUGIN_H */
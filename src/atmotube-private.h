@@ -23,14 +23,60 @@
 #include "atmotube-plugin-if.h"
 #include "atmotube-plugin.h"
 #include "atmotube-interval.h"
+#include "atmotube-histogram.h"
 
 #include <stdbool.h>
 #include <glib.h>
+#include <pthread.h>
 
 #define NUM_UUIDS 4
 
+/* Outputs a device can write to, one bit each in a routing table. */
+#define ATMOTUBE_MAX_DEVICE_SINKS 32
+
 /* Global data used internally. */
 
+/* An output instance, written to by one or more devices. */
+typedef struct
+{
+  /* Description from config: */
+  Atmotube_Output_Config *config;
+
+  AtmotubeOutput *output;
+  AtmotubePlugin *plugin;
+  /* Context returned by plugin_start. */
+  void *plugin_ctx;
+  /* Used when the plugin supports write_batch. */
+  AtmotubeBatch batch;
+  /* Records waiting for the worker. */
+  AtmotubeQueue queue;
+  /* Time the worker may take to write what it took from the queue
+   * before the shed policy kicks in, in ns. 0 for no limit. */
+  uint64_t max_latency;
+  /* Duration of each plugin call, and calls which failed. Written by
+   * the worker only. */
+  AtmotubeHistogram latency;
+  uint64_t errors;
+  /* p99 latency above which a warning is logged, in ns, 0 for none.
+   * The worker checks it every LATENCY_CHECK_INTERVAL against the
+   * calls made since latency_checked was taken. */
+  uint64_t latency_budget;
+  uint64_t next_check;
+  AtmotubeHistogram latency_checked;
+  bool over_budget;
+  /* Thread making all plugin calls for this output. */
+  pthread_t worker;
+  bool worker_started;
+} AtmotubeSink;
+
+/* An output a device writes to. */
+typedef struct
+{
+  AtmotubeSink *sink;
+  /* Index of the device within the devices of the output. */
+  int device;
+} AtmotubeSinkRef;
+
 /* TODO: rename this! */
 typedef struct
 {
@@ -41,8 +87,12 @@ typedef struct
   bool connected;
   /* bool registred; */
 
-  AtmotubeOutput *output;
-  AtmotubePlugin *plugin;
+  /* Outputs written to by this device. */
+  int num_sinks;
+  AtmotubeSinkRef *sinks;
+  /* Routing table, bit i of routes[metric] is set when sinks[i] takes
+   * the metric. */
+  uint32_t routes[CHARACTER_MAX];
 } AtmotubeData;
 
 typedef struct
@@ -60,6 +110,12 @@ typedef struct
   /* List of pointers to device configurations. */
   AtmotubeData *deviceConfiguration;
 
+  /* Number of outputs read from configuration. */
+  int outputConfigurationSize;
+  Atmotube_Output_Config *outputConfiguration;
+  /* Output instances, one per output configuration. */
+  AtmotubeSink *sinks;
+
   const char *plugin_path;
 } AtmotubeGlData;
 
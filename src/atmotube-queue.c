@@ -0,0 +1,363 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "atmotube.h"
+#include "atmotube-queue.h"
+#include "atmotube-time.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+/* No record of a source and metric in the queue. */
+#define QUEUE_NONE UINT64_MAX
+
+int
+queue_init (AtmotubeQueue * q, size_t size, size_t sources,
+	    Atmotube_Queue_Policy policy)
+{
+  pthread_condattr_t attr;
+  size_t i;
+
+  q->ring = (AtmotubeRecord *) malloc (size * sizeof (AtmotubeRecord));
+  q->weights = (uint32_t *) malloc (size * sizeof (uint32_t));
+  q->newest = (uint64_t *) malloc (sources * CHARACTER_MAX *
+				   sizeof (uint64_t));
+  if (q->ring == NULL || q->weights == NULL
+      || (q->newest == NULL && sources > 0))
+    {
+      free (q->ring);
+      free (q->weights);
+      free (q->newest);
+      return ATMOTUBE_RET_ERROR;
+    }
+  for (i = 0; i < sources * CHARACTER_MAX; i++)
+    {
+      q->newest[i] = QUEUE_NONE;
+    }
+
+  q->sources = sources;
+  q->head = 0;
+  q->count = 0;
+  q->taken = 0;
+  q->closed = false;
+  q->paused = false;
+  q->policy = policy;
+  q->shed.coalesce_depth = size;
+  q->shed.drop_depth = size;
+  q->shed.low_priority = 0;
+  q->overloaded = false;
+
+  memset (&q->stats, 0, sizeof (AtmotubeQueueStats));
+  q->stats.size = size;
+
+  pthread_mutex_init (&q->lock, NULL);
+
+  /* Timed waits use the monotonic clock. */
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&q->not_empty, &attr);
+  pthread_cond_init (&q->not_full, &attr);
+  pthread_condattr_destroy (&attr);
+
+  return ATMOTUBE_RET_OK;
+}
+
+void
+queue_destroy (AtmotubeQueue * q)
+{
+  pthread_cond_destroy (&q->not_full);
+  pthread_cond_destroy (&q->not_empty);
+  pthread_mutex_destroy (&q->lock);
+
+  free (q->ring);
+  free (q->weights);
+  free (q->newest);
+  q->ring = NULL;
+  q->weights = NULL;
+  q->newest = NULL;
+}
+
+static AtmotubeRecord *
+queue_at (AtmotubeQueue * q, size_t i)
+{
+  return &q->ring[(q->head + i) % q->stats.size];
+}
+
+static void
+drop_oldest (AtmotubeQueue * q)
+{
+  q->head = (q->head + 1) % q->stats.size;
+  q->count--;
+  q->taken++;
+  q->stats.dropped++;
+}
+
+/* Slot of the newest position of r's device and metric, NULL if it
+ * has none. */
+static uint64_t *
+newest_of (AtmotubeQueue * q, const AtmotubeRecord * r)
+{
+  if (r->device < 0 || (size_t) r->device >= q->sources || r->metric < 0
+      || r->metric >= CHARACTER_MAX)
+    {
+      return NULL;
+    }
+
+  return &q->newest[(size_t) r->device * CHARACTER_MAX + r->metric];
+}
+
+/* Merge r into the newest queued record of the same device and
+ * metric, if it is still queued. */
+static bool
+coalesce (AtmotubeQueue * q, const AtmotubeRecord * r)
+{
+  uint64_t *newest = newest_of (q, r);
+
+  if (newest == NULL || *newest == QUEUE_NONE || *newest < q->taken)
+    {
+      return false;
+    }
+
+  const size_t i = (size_t) (*newest - q->taken);
+  const size_t slot = (q->head + i) % q->stats.size;
+  AtmotubeRecord *p = &q->ring[slot];
+  const uint32_t w = q->weights[slot];
+
+  p->value = (p->value * w + r->value) / (w + 1);
+  p->ts = r->ts;
+  q->weights[slot] = w + 1;
+  q->stats.coalesced++;
+  return true;
+}
+
+void
+queue_set_shed (AtmotubeQueue * q, const AtmotubeQueueShed * shed)
+{
+  pthread_mutex_lock (&q->lock);
+  q->shed = *shed;
+  pthread_mutex_unlock (&q->lock);
+}
+
+/* Overload stages of the shed policy short of a full queue. Returns
+ * true when r was merged or refused. */
+static bool
+shed (AtmotubeQueue * q, const AtmotubeRecord * r)
+{
+  if (q->count >= q->shed.coalesce_depth || q->overloaded)
+    {
+      if (coalesce (q, r))
+	{
+	  q->stats.pushed++;
+	  return true;
+	}
+    }
+
+  if ((q->count >= q->shed.drop_depth || q->overloaded)
+      && (q->shed.low_priority & (1u << r->metric)) != 0)
+    {
+      q->stats.shed++;
+      return true;
+    }
+
+  return false;
+}
+
+int
+queue_push (AtmotubeQueue * q, const AtmotubeRecord * r)
+{
+  pthread_mutex_lock (&q->lock);
+
+  if (q->policy == QUEUE_POLICY_SHED && !q->closed && shed (q, r))
+    {
+      pthread_mutex_unlock (&q->lock);
+      return ATMOTUBE_RET_OK;
+    }
+
+  if (q->count == q->stats.size && !q->closed)
+    {
+      switch (q->policy)
+	{
+	case QUEUE_POLICY_BLOCK:
+	  {
+	    uint64_t start = atmotube_timestamp_ns ();
+	    while (q->count == q->stats.size && !q->closed)
+	      {
+		pthread_cond_wait (&q->not_full, &q->lock);
+	      }
+	    q->stats.blocked++;
+	    q->stats.blocked_ns += atmotube_timestamp_ns () - start;
+	    break;
+	  }
+	case QUEUE_POLICY_COALESCE:
+	  if (coalesce (q, r))
+	    {
+	      q->stats.pushed++;
+	      pthread_mutex_unlock (&q->lock);
+	      return ATMOTUBE_RET_OK;
+	    }
+	  drop_oldest (q);
+	  break;
+	case QUEUE_POLICY_DROP_OLDEST:
+	case QUEUE_POLICY_SHED:
+	  drop_oldest (q);
+	  break;
+	}
+    }
+
+  if (q->closed)
+    {
+      pthread_mutex_unlock (&q->lock);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  uint64_t *newest = newest_of (q, r);
+  if (newest != NULL)
+    {
+      *newest = q->taken + q->count;
+    }
+  q->weights[(q->head + q->count) % q->stats.size] = 1;
+  *queue_at (q, q->count) = *r;
+  q->count++;
+  q->stats.pushed++;
+  if (q->count > q->stats.high_water)
+    {
+      q->stats.high_water = q->count;
+    }
+
+  pthread_cond_signal (&q->not_empty);
+  pthread_mutex_unlock (&q->lock);
+
+  return ATMOTUBE_RET_OK;
+}
+
+size_t
+queue_pop (AtmotubeQueue * q, AtmotubeRecord * out, size_t max,
+	   uint64_t timeout_ns)
+{
+  size_t n = 0;
+  struct timespec deadline;
+
+  if (timeout_ns > 0)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &deadline);
+      uint64_t ns = (uint64_t) deadline.tv_nsec + timeout_ns;
+      deadline.tv_sec += ns / NS_PER_SEC;
+      deadline.tv_nsec = ns % NS_PER_SEC;
+    }
+
+  pthread_mutex_lock (&q->lock);
+
+  while (q->count == 0 && !q->closed && !q->paused)
+    {
+      if (timeout_ns == 0)
+	{
+	  pthread_cond_wait (&q->not_empty, &q->lock);
+	}
+      else if (pthread_cond_timedwait (&q->not_empty, &q->lock,
+				       &deadline) != 0)
+	{
+	  break;
+	}
+    }
+
+  while (n < max && q->count > 0 && !q->paused)
+    {
+      out[n] = *queue_at (q, 0);
+      q->head = (q->head + 1) % q->stats.size;
+      q->count--;
+      q->taken++;
+      n++;
+    }
+
+  if (n > 0)
+    {
+      pthread_cond_broadcast (&q->not_full);
+    }
+
+  pthread_mutex_unlock (&q->lock);
+
+  return n;
+}
+
+void
+queue_close (AtmotubeQueue * q)
+{
+  pthread_mutex_lock (&q->lock);
+  q->closed = true;
+  pthread_cond_broadcast (&q->not_empty);
+  pthread_cond_broadcast (&q->not_full);
+  pthread_mutex_unlock (&q->lock);
+}
+
+bool
+queue_closed (AtmotubeQueue * q)
+{
+  pthread_mutex_lock (&q->lock);
+  bool closed = q->closed;
+  pthread_mutex_unlock (&q->lock);
+  return closed;
+}
+
+void
+queue_pause (AtmotubeQueue * q)
+{
+  pthread_mutex_lock (&q->lock);
+  q->paused = true;
+  pthread_cond_broadcast (&q->not_empty);
+  pthread_mutex_unlock (&q->lock);
+}
+
+void
+queue_resume (AtmotubeQueue * q)
+{
+  pthread_mutex_lock (&q->lock);
+  q->paused = false;
+  pthread_mutex_unlock (&q->lock);
+}
+
+bool
+queue_paused (AtmotubeQueue * q)
+{
+  pthread_mutex_lock (&q->lock);
+  bool paused = q->paused;
+  pthread_mutex_unlock (&q->lock);
+  return paused;
+}
+
+void
+queue_set_overloaded (AtmotubeQueue * q, bool overloaded)
+{
+  pthread_mutex_lock (&q->lock);
+  if (overloaded && !q->overloaded)
+    {
+      q->stats.overloads++;
+    }
+  q->overloaded = overloaded;
+  pthread_mutex_unlock (&q->lock);
+}
+
+void
+queue_get_stats (AtmotubeQueue * q, AtmotubeQueueStats * stats)
+{
+  pthread_mutex_lock (&q->lock);
+  *stats = q->stats;
+  stats->depth = q->count;
+  pthread_mutex_unlock (&q->lock);
+}
@@ -0,0 +1,152 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ATMOTUBE_QUEUE_H
+#define ATMOTUBE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "atmotube-config.h"
+
+/* Bounded queue of output records. Any number of threads can push,
+ * one thread pops. The ring is allocated by queue_init, pushing and
+ * popping do not allocate. */
+
+/* One sample on its way to an output. */
+typedef struct
+{
+  uint64_t ts;
+  int device;
+  int metric;
+  double value;
+} AtmotubeRecord;
+
+/* Queue metrics. */
+typedef struct
+{
+  /* Capacity of the queue. */
+  size_t size;
+  /* Records currently queued. */
+  size_t depth;
+  /* Highest depth seen. */
+  size_t high_water;
+  /* Records accepted by queue_push. */
+  uint64_t pushed;
+  /* Records thrown away to make room (drop-oldest, coalesce, shed). */
+  uint64_t dropped;
+  /* Records merged into a queued record of the same device and
+   * metric (coalesce, shed). */
+  uint64_t coalesced;
+  /* Records of low priority metrics refused while overloaded (shed). */
+  uint64_t shed;
+  /* Number of times the output went over its latency budget (shed). */
+  uint64_t overloads;
+  /* Number of pushes which had to wait for room (block). */
+  uint64_t blocked;
+  /* Total time spent waiting for room, in ns. */
+  uint64_t blocked_ns;
+} AtmotubeQueueStats;
+
+/* Thresholds of the shed policy. */
+typedef struct
+{
+  /* Depth from which records are coalesced. */
+  size_t coalesce_depth;
+  /* Depth from which low priority metrics are dropped. */
+  size_t drop_depth;
+  /* Low priority metrics, bit (1 << metric) for each. */
+  unsigned int low_priority;
+} AtmotubeQueueShed;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+
+  AtmotubeRecord *ring;
+  /* Number of records merged into each record of ring. */
+  uint32_t *weights;
+  size_t head;
+  size_t count;
+  /* Records taken out of the queue so far, popped or dropped. With the
+   * number pushed, records have a position which does not change. */
+  uint64_t taken;
+  /* Position of the newest record pushed per source and metric, for
+   * coalescing, at [source * CHARACTER_MAX + metric]. */
+  uint64_t *newest;
+  size_t sources;
+  bool closed;
+  /* Pops return nothing, pushes are still accepted. */
+  bool paused;
+  Atmotube_Queue_Policy policy;
+  AtmotubeQueueShed shed;
+  /* The consumer is over its latency budget. */
+  bool overloaded;
+
+  AtmotubeQueueStats stats;
+} AtmotubeQueue;
+
+/* A queue for size records, of devices 0 to sources - 1. */
+int queue_init (AtmotubeQueue * q, size_t size, size_t sources,
+		Atmotube_Queue_Policy policy);
+
+void queue_destroy (AtmotubeQueue * q);
+
+/* Set the thresholds of the shed policy. By default they are the
+ * size of the queue, with no low priority metrics. */
+void queue_set_shed (AtmotubeQueue * q, const AtmotubeQueueShed * shed);
+
+/* Add a record. When the queue is full the policy decides: block
+ * waits for the consumer, drop-oldest throws away the oldest record
+ * and coalesce merges it into the newest queued record of the same
+ * device and metric (or drops the oldest if there is none), which then
+ * holds the mean of the values merged and the newest time. Shed escalates
+ * before the queue is full: from coalesce_depth, or while overloaded,
+ * records are coalesced; from drop_depth, or while overloaded, low
+ * priority metrics are refused; a full queue drops the oldest record.
+ * Returns ATMOTUBE_RET_ERROR when the queue is closed. */
+int queue_push (AtmotubeQueue * q, const AtmotubeRecord * r);
+
+/* Take up to max records. Waits up to timeout_ns for the first one,
+ * or until one arrives when timeout_ns is 0. Returns the number of
+ * records taken, 0 on timeout, when the queue is paused or when it is
+ * closed and empty. */
+size_t queue_pop (AtmotubeQueue * q, AtmotubeRecord * out, size_t max,
+		  uint64_t timeout_ns);
+
+/* Wake up everybody, no more pushes are accepted. Queued records can
+ * still be popped. */
+void queue_close (AtmotubeQueue * q);
+bool queue_closed (AtmotubeQueue * q);
+
+/* Make the consumer return from queue_pop and keep any further
+ * records queued until queue_resume. */
+void queue_pause (AtmotubeQueue * q);
+void queue_resume (AtmotubeQueue * q);
+bool queue_paused (AtmotubeQueue * q);
+
+/* Let the producers know whether the consumer is keeping up, for the
+ * shed policy. */
+void queue_set_overloaded (AtmotubeQueue * q, bool overloaded);
+
+void queue_get_stats (AtmotubeQueue * q, AtmotubeQueueStats * stats);
+
+#endif /* ATMOTUBE_QUEUE_H */
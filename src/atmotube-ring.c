@@ -0,0 +1,270 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "atmotube.h"
+#include "atmotube-ring.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+#define LOAD(p) __atomic_load_n (p, __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n (p, v, __ATOMIC_SEQ_CST)
+#define BUMP(p) __atomic_add_fetch (p, 1, __ATOMIC_SEQ_CST)
+
+/* The ring is shared between processes, so no private futexes. */
+static int
+futex_wait (uint32_t * addr, uint32_t val, uint64_t timeout_ns)
+{
+  struct timespec ts;
+  struct timespec *tsp = NULL;
+
+  if (timeout_ns > 0)
+    {
+      ts.tv_sec = timeout_ns / NS_PER_SEC;
+      ts.tv_nsec = timeout_ns % NS_PER_SEC;
+      tsp = &ts;
+    }
+
+  return syscall (SYS_futex, addr, FUTEX_WAIT, val, tsp, NULL, 0);
+}
+
+static void
+futex_wake (uint32_t * addr)
+{
+  syscall (SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static size_t
+ring_bytes (size_t size)
+{
+  return sizeof (AtmotubeRingShared) + size * sizeof (AtmotubeRecord);
+}
+
+static AtmotubeRing *
+ring_map (int fd, size_t size)
+{
+  AtmotubeRing *r = (AtmotubeRing *) malloc (sizeof (AtmotubeRing));
+  if (r == NULL)
+    {
+      return NULL;
+    }
+
+  r->shared = (AtmotubeRingShared *) mmap (NULL, ring_bytes (size),
+					   PROT_READ | PROT_WRITE,
+					   MAP_SHARED, fd, 0);
+  if (r->shared == MAP_FAILED)
+    {
+      free (r);
+      return NULL;
+    }
+
+  r->size = size;
+  r->pos = 0;
+  return r;
+}
+
+AtmotubeRing *
+ring_create (size_t size, int *fd)
+{
+  if (size == 0 || size > UINT32_MAX / 2)
+    {
+      return NULL;
+    }
+
+  *fd = memfd_create ("atmotube-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (*fd < 0)
+    {
+      PRINT_ERROR ("%s\n", "Unable to create shared memory");
+      return NULL;
+    }
+
+  /* The file starts out zeroed. Sealed, so that the host cannot
+   * shrink it under the mapping of the reader. */
+  AtmotubeRing *r = NULL;
+  if (ftruncate (*fd, ring_bytes (size)) != 0
+      || fcntl (*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+		| F_SEAL_SEAL) != 0 || (r = ring_map (*fd, size)) == NULL)
+    {
+      close (*fd);
+      return NULL;
+    }
+
+  return r;
+}
+
+AtmotubeRing *
+ring_attach (int fd)
+{
+  struct stat st;
+
+  if (fstat (fd, &st) != 0 || (size_t) st.st_size <= ring_bytes (0))
+    {
+      return NULL;
+    }
+
+  AtmotubeRing *r = ring_map (fd, ((size_t) st.st_size - ring_bytes (0)) /
+			      sizeof (AtmotubeRecord));
+  if (r == NULL)
+    {
+      return NULL;
+    }
+
+  /* A host started again goes on where the last one stopped. */
+  r->pos = LOAD (&r->shared->head);
+  return r;
+}
+
+void
+ring_detach (AtmotubeRing * r)
+{
+  munmap (r->shared, ring_bytes (r->size));
+  free (r);
+}
+
+size_t
+ring_write (AtmotubeRing * r, size_t n, const uint64_t ts[],
+	    const int device[], const int metric[], const double value[],
+	    uint64_t timeout_ns)
+{
+  AtmotubeRingShared *s = r->shared;
+  size_t done = 0;
+
+  while (done < n)
+    {
+      const uint32_t head = LOAD (&s->head);
+      uint32_t tail = r->pos;
+      uint32_t used = tail - head;
+
+      /* A head out of range leaves no room, until the host is done. */
+      uint32_t room = used < r->size ? r->size - used : 0;
+
+      if (room == 0)
+	{
+	  const uint32_t seq = LOAD (&s->space_seq);
+
+	  STORE (&s->producer_waiting, 1);
+	  if (LOAD (&s->head) == head
+	      && futex_wait (&s->space_seq, seq, timeout_ns) != 0
+	      && errno == ETIMEDOUT)
+	    {
+	      STORE (&s->producer_waiting, 0);
+	      break;
+	    }
+	  STORE (&s->producer_waiting, 0);
+	  continue;
+	}
+
+      for (; room > 0 && done < n; room--, done++, tail++)
+	{
+	  AtmotubeRecord *rec = &s->records[tail % r->size];
+	  rec->ts = ts[done];
+	  rec->device = device[done];
+	  rec->metric = metric[done];
+	  rec->value = value[done];
+	}
+
+      r->pos = tail;
+      STORE (&s->tail, tail);
+      BUMP (&s->data_seq);
+      if (LOAD (&s->consumer_waiting))
+	{
+	  futex_wake (&s->data_seq);
+	}
+    }
+
+  return done;
+}
+
+size_t
+ring_read (AtmotubeRing * r, AtmotubeRecord * out, size_t max,
+	   uint64_t timeout_ns)
+{
+  AtmotubeRingShared *s = r->shared;
+  size_t n = 0;
+  uint32_t head = r->pos;
+
+  for (;;)
+    {
+      const uint32_t tail = LOAD (&s->tail);
+
+      if (tail != head)
+	{
+	  uint32_t avail = tail - head;
+
+	  /* At most a full ring, whatever the tail says. */
+	  if (avail > r->size)
+	    {
+	      avail = r->size;
+	    }
+	  for (; avail > 0 && n < max; avail--, head++, n++)
+	    {
+	      out[n] = s->records[head % r->size];
+	    }
+	  break;
+	}
+
+      if (LOAD (&s->closed))
+	{
+	  return 0;
+	}
+
+      const uint32_t seq = LOAD (&s->data_seq);
+
+      STORE (&s->consumer_waiting, 1);
+      if (LOAD (&s->tail) == tail && !LOAD (&s->closed)
+	  && futex_wait (&s->data_seq, seq, timeout_ns) != 0
+	  && errno == ETIMEDOUT)
+	{
+	  STORE (&s->consumer_waiting, 0);
+	  return 0;
+	}
+      STORE (&s->consumer_waiting, 0);
+    }
+
+  r->pos = head;
+  STORE (&s->head, head);
+  BUMP (&s->space_seq);
+  if (LOAD (&s->producer_waiting))
+    {
+      futex_wake (&s->space_seq);
+    }
+
+  return n;
+}
+
+void
+ring_close (AtmotubeRing * r)
+{
+  STORE (&r->shared->closed, 1);
+  BUMP (&r->shared->data_seq);
+  futex_wake (&r->shared->data_seq);
+}
+
+bool
+ring_closed (AtmotubeRing * r)
+{
+  return LOAD (&r->shared->closed) != 0;
+}
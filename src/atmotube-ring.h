@@ -0,0 +1,90 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ATMOTUBE_RING_H
+#define ATMOTUBE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "atmotube-queue.h"
+
+/* Ring of output records in shared memory, between the reader and a
+ * plugin host process. One producer, one consumer. Records are stored
+ * as they are, a side waits on a futex only when the ring is empty
+ * (consumer) or full (producer). */
+
+/* Layout of the shared memory. */
+typedef struct
+{
+  /* Free running counters, the ring holds tail - head records. */
+  uint32_t head;
+  uint32_t tail;
+  /* Futex words, bumped after every write (data) and read (space). */
+  uint32_t data_seq;
+  uint32_t space_seq;
+  /* Set while a side sleeps on its futex. */
+  uint32_t consumer_waiting;
+  uint32_t producer_waiting;
+  /* No more records will be written. */
+  uint32_t closed;
+
+  AtmotubeRecord records[];
+} AtmotubeRingShared;
+
+/* A side of the ring. The other process can write anything to the
+ * shared memory, so what keeps a side within the mapping is its own. */
+typedef struct
+{
+  AtmotubeRingShared *shared;
+  /* Capacity, in records, as created or as the memory file holds. */
+  uint32_t size;
+  /* The counter this side moves, tail for the producer and head for
+   * the consumer. Only stored to the shared memory. */
+  uint32_t pos;
+} AtmotubeRing;
+
+/* Create a ring for size records in a new memory file, whose
+ * descriptor is returned in fd, to be produced into. The file cannot be
+ * resized, and is closed on exec. Returns NULL on error. */
+AtmotubeRing *ring_create (size_t size, int *fd);
+
+/* Map the ring in the memory file fd, to be consumed from. Returns NULL
+ * on error. */
+AtmotubeRing *ring_attach (int fd);
+
+/* Unmap the ring and free the side. */
+void ring_detach (AtmotubeRing * r);
+
+/* Write record i from ts[i], device[i], metric[i] and value[i], waiting
+ * up to timeout_ns for room. Returns the number of records
+ * written. */
+size_t ring_write (AtmotubeRing * r, size_t n, const uint64_t ts[],
+		   const int device[], const int metric[],
+		   const double value[], uint64_t timeout_ns);
+
+/* Take up to max records, waiting for the first one until it arrives,
+ * the ring is closed or timeout_ns passed (0 for no limit). Returns the
+ * number of records taken, 0 on timeout or when the ring is closed and
+ * empty. */
+size_t ring_read (AtmotubeRing * r, AtmotubeRecord * out, size_t max,
+		  uint64_t timeout_ns);
+
+/* Tell the consumer that nothing more is coming. */
+void ring_close (AtmotubeRing * r);
+bool ring_closed (AtmotubeRing * r);
+
+#endif /* ATMOTUBE_RING_H */
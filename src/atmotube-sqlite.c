@@ -0,0 +1,243 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "atmotube.h"
+#include "atmotube-sqlite.h"
+
+/* A heap of HEAP_SIZE bytes, in blocks of 2^HEAP_MIN_SHIFT to
+ * 2^HEAP_MAX_SHIFT bytes, and a cache of PAGE_CACHE_PAGES database
+ * pages of PAGE_SIZE bytes. Larger blocks, and any once the heap is
+ * used up, come from malloc. */
+#define HEAP_SIZE (4 * 1024 * 1024)
+#define HEAP_MIN_SHIFT 5
+#define HEAP_MAX_SHIFT 12
+#define HEAP_CLASSES (HEAP_MAX_SHIFT - HEAP_MIN_SHIFT + 1)
+#define PAGE_SIZE 4096
+#define PAGE_CACHE_PAGES 256
+
+typedef struct
+{
+  uint32_t size;
+  /* Block size shift, 0 for memory from malloc. */
+  uint32_t shift;
+} HeapHeader;
+
+static struct
+{
+  pthread_mutex_t lock;
+  char *base;
+  size_t used;
+  void *free[HEAP_CLASSES];
+  /* Set while SQLite is configured to use the heap. */
+  bool started;
+  void *page_cache;
+} heap = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t
+heap_shift (int n)
+{
+  uint32_t shift = HEAP_MIN_SHIFT;
+  while (shift <= HEAP_MAX_SHIFT && (1 << shift) < n)
+    {
+      shift++;
+    }
+  return shift;
+}
+
+static void *
+heap_malloc (int n)
+{
+  HeapHeader *h = NULL;
+  uint32_t shift = heap_shift (n);
+
+  if (n <= 0)
+    {
+      return NULL;
+    }
+
+  if (shift <= HEAP_MAX_SHIFT)
+    {
+      void **list = &heap.free[shift - HEAP_MIN_SHIFT];
+      size_t size = sizeof (HeapHeader) + ((size_t) 1 << shift);
+
+      pthread_mutex_lock (&heap.lock);
+      if (*list != NULL)
+	{
+	  void *p = *list;
+	  *list = *(void **) p;
+	  h = (HeapHeader *) p - 1;
+	}
+      else if (heap.base != NULL && heap.used + size <= HEAP_SIZE)
+	{
+	  h = (HeapHeader *) (heap.base + heap.used);
+	  heap.used += size;
+	}
+      pthread_mutex_unlock (&heap.lock);
+
+      if (h != NULL)
+	{
+	  h->size = 1 << shift;
+	  h->shift = shift;
+	  return h + 1;
+	}
+    }
+
+  h = (HeapHeader *) malloc (sizeof (HeapHeader) + (size_t) n);
+  if (h == NULL)
+    {
+      return NULL;
+    }
+  h->size = (uint32_t) n;
+  h->shift = 0;
+  return h + 1;
+}
+
+static void
+heap_free (void *p)
+{
+  if (p == NULL)
+    {
+      return;
+    }
+
+  HeapHeader *h = (HeapHeader *) p - 1;
+  if (h->shift == 0)
+    {
+      free (h);
+      return;
+    }
+
+  void **list = &heap.free[h->shift - HEAP_MIN_SHIFT];
+  pthread_mutex_lock (&heap.lock);
+  *(void **) p = *list;
+  *list = p;
+  pthread_mutex_unlock (&heap.lock);
+}
+
+static int
+heap_size (void *p)
+{
+  return p != NULL ? (int) ((HeapHeader *) p - 1)->size : 0;
+}
+
+static void *
+heap_realloc (void *p, int n)
+{
+  if (n <= heap_size (p))
+    {
+      return p;
+    }
+
+  void *q = heap_malloc (n);
+  if (q != NULL && p != NULL)
+    {
+      memcpy (q, p, (size_t) heap_size (p));
+      heap_free (p);
+    }
+  return q;
+}
+
+static int
+heap_roundup (int n)
+{
+  uint32_t shift = heap_shift (n);
+  return shift <= HEAP_MAX_SHIFT ? 1 << shift : (n + 7) & ~7;
+}
+
+static int
+heap_init (void *data)
+{
+  UNUSED (data);
+  heap.base = (char *) malloc (HEAP_SIZE);
+  return heap.base != NULL ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static void
+heap_shutdown (void *data)
+{
+  UNUSED (data);
+  free (heap.base);
+  heap.base = NULL;
+  heap.used = 0;
+  memset (heap.free, 0, sizeof (heap.free));
+}
+
+int
+sqlite_heap_start (void)
+{
+  static const sqlite3_mem_methods methods = {
+    heap_malloc, heap_free, heap_realloc, heap_size, heap_roundup,
+    heap_init, heap_shutdown, NULL
+  };
+  int header = 0;
+
+  if (heap.started)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  /* Fails once SQLite is initialized, its own memory is used then. */
+  if (sqlite3_config (SQLITE_CONFIG_MALLOC, &methods) != SQLITE_OK)
+    {
+      PRINT_DEBUG ("%s\n", "SQLite already initialized, using malloc");
+      return ATMOTUBE_RET_OK;
+    }
+  sqlite3_config (SQLITE_CONFIG_MEMSTATUS, 0);
+
+  sqlite3_config (SQLITE_CONFIG_PCACHE_HDRSZ, &header);
+  heap.page_cache = malloc ((size_t) (PAGE_SIZE + header) *
+			    PAGE_CACHE_PAGES);
+  if (heap.page_cache != NULL)
+    {
+      sqlite3_config (SQLITE_CONFIG_PAGECACHE, heap.page_cache,
+		      PAGE_SIZE + header, PAGE_CACHE_PAGES);
+    }
+  heap.started = true;
+
+  if (sqlite3_initialize () != SQLITE_OK)
+    {
+      PRINT_ERROR ("%s\n", "Failed to init SQLite");
+      sqlite_heap_stop ();
+      return ATMOTUBE_RET_ERROR;
+    }
+  return ATMOTUBE_RET_OK;
+}
+
+void
+sqlite_heap_stop (void)
+{
+  static const sqlite3_mem_methods defaults = { 0 };
+
+  if (!heap.started)
+    {
+      return;
+    }
+
+  sqlite3_shutdown ();
+  sqlite3_config (SQLITE_CONFIG_PAGECACHE, NULL, 0, 0);
+  sqlite3_config (SQLITE_CONFIG_MEMSTATUS, 1);
+  sqlite3_config (SQLITE_CONFIG_MALLOC, &defaults);
+  free (heap.page_cache);
+  heap.page_cache = NULL;
+  heap.started = false;
+}
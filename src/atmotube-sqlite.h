@@ -0,0 +1,41 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ATMOTUBE_SQLITE_H
+#define ATMOTUBE_SQLITE_H
+
+/* Memory for SQLite, so that the db plugin writes rows without calling
+ * malloc once warmed up. SQLite allocates while stepping statements,
+ * e.g. cursors and records, and frees again when they are reset.
+ * Lookaside memory would serve those, but it is left out of many builds
+ * of SQLite, so it is given a heap instead: allocated once, handed out
+ * in power of two blocks which go back to a free list of their size.
+ * Pages have a cache of their own.
+ *
+ * The setting is for the whole process, so it is made by the program,
+ * atmotube_start and the plugin host, and not by the plugin. SQLite's
+ * own memory statistics are turned off, which leaves the heap's lock as
+ * the only one taken per allocation. */
+
+/* Give SQLite its memory. Does nothing when SQLite was initialized
+ * before, it keeps using malloc then. Returns ATMOTUBE_RET_OK or
+ * ATMOTUBE_RET_ERROR. */
+int sqlite_heap_start (void);
+
+/* Shut SQLite down and free its memory, once all connections are
+ * closed. SQLite uses malloc again if it is initialized afterwards. */
+void sqlite_heap_stop (void);
+
+#endif /* ATMOTUBE_SQLITE_H */
@@ -0,0 +1,58 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <time.h>
+#include <stdbool.h>
+
+#include "atmotube-time.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static bool initialized = false;
+static uint64_t monotonic_offset = 0;
+
+static uint64_t
+read_clock (clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime (id, &ts);
+  return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+void
+atmotube_time_init (void)
+{
+  /* Sample the monotonic clock on both sides of the wall clock, so
+   * that the offset is taken from the middle of the window. */
+  uint64_t before = read_clock (CLOCK_MONOTONIC);
+  uint64_t wall = read_clock (CLOCK_REALTIME);
+  uint64_t after = read_clock (CLOCK_MONOTONIC);
+
+  monotonic_offset = wall - (before + (after - before) / 2);
+  initialized = true;
+}
+
+uint64_t
+atmotube_timestamp_ns (void)
+{
+  if (!initialized)
+    {
+      atmotube_time_init ();
+    }
+
+  return read_clock (CLOCK_MONOTONIC) + monotonic_offset;
+}
@@ -0,0 +1,37 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ATMOTUBE_TIME_H
+#define ATMOTUBE_TIME_H
+
+#include <stdint.h>
+
+/* Timestamps are nanoseconds since the Unix epoch, stored in 64 bits
+ * so that they do not wrap on 32 bit targets.
+ */
+
+#define ATMOTUBE_NS_PER_MS 1000000ULL
+#define ATMOTUBE_MS_TO_NS(x) ((uint64_t)(x) * ATMOTUBE_NS_PER_MS)
+#define ATMOTUBE_NS_TO_MS(x) ((uint64_t)(x) / ATMOTUBE_NS_PER_MS)
+
+/* Capture the offset between the monotonic and the wall clock. */
+void atmotube_time_init (void);
+
+/* Read the monotonic clock, mapped to wall clock time. */
+uint64_t atmotube_timestamp_ns (void);
+
+#endif /* ATMOTUBE_TIME_H */
@@ -0,0 +1,73 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+
+#include "atmotube.h"
+#include "atmotube-transform.h"
+
+static int
+add_op (Atmotube_Transform * t, Atmotube_Transform_Op_Type type, double a,
+	double b)
+{
+  Atmotube_Transform_Op *ops = (Atmotube_Transform_Op *)
+    realloc (t->ops, (t->num_ops + 1) * sizeof (Atmotube_Transform_Op));
+  if (ops == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  t->ops = ops;
+  t->ops[t->num_ops].type = type;
+  t->ops[t->num_ops].a = a;
+  t->ops[t->num_ops].b = b;
+  t->num_ops++;
+
+  return ATMOTUBE_RET_OK;
+}
+
+int
+transform_add_affine (Atmotube_Transform * t, double scale, double offset)
+{
+  if (scale == 1.0 && offset == 0.0)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  if (t->num_ops > 0 && t->ops[t->num_ops - 1].type == TRANSFORM_AFFINE)
+    {
+      /* scale * (a * x + b) + offset */
+      Atmotube_Transform_Op *op = t->ops + t->num_ops - 1;
+      op->a = scale * op->a;
+      op->b = scale * op->b + offset;
+      return ATMOTUBE_RET_OK;
+    }
+
+  return add_op (t, TRANSFORM_AFFINE, scale, offset);
+}
+
+int
+transform_add_clamp (Atmotube_Transform * t, double min, double max)
+{
+  return add_op (t, TRANSFORM_CLAMP, min, max);
+}
+
+void
+transform_free (Atmotube_Transform * t)
+{
+  free (t->ops);
+  t->ops = NULL;
+  t->num_ops = 0;
+}
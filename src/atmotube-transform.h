@@ -0,0 +1,77 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ATMOTUBE_TRANSFORM_H
+#define ATMOTUBE_TRANSFORM_H
+
+/* Per device and metric corrections (calibration, unit conversion),
+ * applied to each decoded sample before it reaches the intervals. The
+ * configured steps are compiled into a short array of operations,
+ * consecutive affine steps folded into one. */
+
+typedef enum
+{
+  /* x = a * x + b */
+  TRANSFORM_AFFINE = 0,
+  /* x = min (max (x, a), b) */
+  TRANSFORM_CLAMP
+} Atmotube_Transform_Op_Type;
+
+typedef struct
+{
+  Atmotube_Transform_Op_Type type;
+  double a;
+  double b;
+} Atmotube_Transform_Op;
+
+/* Operations for one metric of a device, none means no change. */
+typedef struct
+{
+  int num_ops;
+  Atmotube_Transform_Op *ops;
+} Atmotube_Transform;
+
+/* Append a step. Affine steps following an affine step are folded into
+ * it, identity steps are left out. Returns ATMOTUBE_RET_ERROR when out
+ * of memory. */
+int transform_add_affine (Atmotube_Transform * t, double scale,
+			  double offset);
+int transform_add_clamp (Atmotube_Transform * t, double min, double max);
+
+void transform_free (Atmotube_Transform * t);
+
+static inline double
+transform_apply (const Atmotube_Transform * t, double x)
+{
+  int i;
+
+  for (i = 0; i < t->num_ops; i++)
+    {
+      const Atmotube_Transform_Op *op = t->ops + i;
+
+      if (op->type == TRANSFORM_AFFINE)
+	{
+	  x = op->a * x + op->b;
+	}
+      else
+	{
+	  x = x < op->a ? op->a : (x > op->b ? op->b : x);
+	}
+    }
+
+  return x;
+}
+
+#endif /* ATMOTUBE_TRANSFORM_H */
@@ -20,6 +20,7 @@
 #include <sys/time.h>
 #include <glib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "atmotube.h"
 #include "atmotube-private.h"
@@ -27,6 +28,8 @@
 #include "atmotube-interval.h"
 #include "atmotube-output.h"
 #include "atmotube-handler.h"
+#include "atmotube-time.h"
+#include "atmotube-sqlite.h"
 
 AtmotubeGlData glData;
 
@@ -58,6 +61,9 @@ init_gl_data (AtmotubeGlData * ptr)
 
   ptr->deviceConfigurationSize = 0;
   ptr->deviceConfiguration = NULL;
+  ptr->outputConfigurationSize = 0;
+  ptr->outputConfiguration = NULL;
+  ptr->sinks = NULL;
   ptr->plugin_path = NULL;
 }
 
@@ -78,6 +84,8 @@ atmotube_start ()
 	  exit (1);
 	}
     }
+  atmotube_time_init ();
+  sqlite_heap_start ();
   init_gl_data (&glData);
 }
 
@@ -162,6 +170,13 @@ atmotube_add_device (void *m)
   return ATMOTUBE_RET_OK;
 }
 
+static void
+atmotube_set_outputs (Atmotube_Output_Config * outputs, int n)
+{
+  glData.outputConfigurationSize = n;
+  glData.outputConfiguration = outputs;
+}
+
 static void
 atmotube_set_plugin_path (const char *path)
 {
@@ -175,7 +190,8 @@ atmotube_add_devices_from_config (const char *fullName)
   atmotube_config_start (fullName);
   int ret = atmotube_config_load (atmotube_set_plugin_path,
 				  atmotube_num_devices,
-				  atmotube_add_device, sizeof (AtmotubeData),
+				  atmotube_add_device, atmotube_set_outputs,
+				  sizeof (AtmotubeData),
 				  offsetof (AtmotubeData, device));
 
   if (ret != ATMOTUBE_RET_OK)
@@ -183,11 +199,16 @@ atmotube_add_devices_from_config (const char *fullName)
       /* Deallocate any memory. */
       atmotube_config_end ();
       free (glData.deviceConfiguration);
+      glData.deviceConfiguration = NULL;
+      glData.deviceConfigurationSize = 0;
       return ATMOTUBE_RET_ERROR;
     }
 
   PRINT_DEBUG ("Devices: %d\n", glData.deviceConfigurationSize);
 
+  /* Scaled VOC is accumulated like the other integer metrics. */
+  fmts[VOC] = atmotube_config_voc_scaled ()? INTERVAL_ULONG : INTERVAL_FLOAT;
+
   int i = 0;
   for (i = 0; i < glData.deviceConfigurationSize; i++)
     {
@@ -195,8 +216,9 @@ atmotube_add_devices_from_config (const char *fullName)
       d->connection = NULL;
       d->connected = 0;
       //d->registred  = 0;
-      d->output = NULL;
-      d->plugin = NULL;
+      d->num_sinks = 0;
+      d->sinks = NULL;
+      memset (d->routes, 0, sizeof (d->routes));
       dumpAtmotubeData (d);
       glData.connectableDevices =
 	g_slist_append (glData.connectableDevices, d);
@@ -326,8 +348,16 @@ modify_intervals (AtmotubeData * d, bool add_interval)
 	      switch (character_id)
 		{
 		case VOC:
-		  interval_add_float_callback (d->device.device_id, label,
-					       fmt, output_voc, d);
+		  if (strcmp (fmt, INTERVAL_ULONG) == 0)
+		    {
+		      interval_add_ulong_callback (d->device.device_id, label,
+						   fmt, output_voc_scaled, d);
+		    }
+		  else
+		    {
+		      interval_add_float_callback (d->device.device_id, label,
+						   fmt, output_voc, d);
+		    }
 		  break;
 		case HUMIDITY:
 		  interval_add_ulong_callback (d->device.device_id, label,
@@ -494,5 +524,10 @@ atmotube_end ()
   atmotube_unregister ();
   atmotube_destroy_outputs ();
   atmotube_plugin_unload_all ();
+  atmotube_config_free_outputs (glData.outputConfiguration,
+				glData.outputConfigurationSize);
+  glData.outputConfiguration = NULL;
+  glData.outputConfigurationSize = 0;
   freeFoundDevices ();
+  sqlite_heap_stop ();
 }
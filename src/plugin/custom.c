@@ -17,40 +17,68 @@
 #include "custom.h"
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include <atmotube.h>
 #include "atmotube-config.h"
 
-static bool started = false;
-static FILE *f = NULL;
 static const char *type = "custom";
 
+/* Written after each sample. The tests build a second library with
+ * another tag, to tell which one runs after a reload. */
+#ifndef CUSTOM_TAG
+#define CUSTOM_TAG ""
+#endif
+
+/* State of one plugin instance. */
+typedef struct
+{
+  FILE *f;
+  double voc_scale;
+} CustomPlugin;
+
+int
+get_plugin_abi_version (void)
+{
+  return ATMOTUBE_PLUGIN_ABI_VERSION;
+}
+
 const char *
 get_plugin_type (void)
 {
   return type;
 }
 
-int
-plugin_start (AtmotubeOutput * o)
+void *
+plugin_start (const AtmotubeOutput * o)
 {
-  f = fopen (o->filename, "a");
-  if (f == NULL)
+  CustomPlugin *p = (CustomPlugin *) malloc (sizeof (CustomPlugin));
+  if (p == NULL)
+    {
+      return NULL;
+    }
+
+  p->f = fopen (o->filename, "a");
+  if (p->f == NULL)
     {
       PRINT_ERROR ("Unable to open file %s for appending", o->filename);
-      return ATMOTUBE_RET_ERROR;
+      free (p);
+      return NULL;
     }
+  p->voc_scale = o->voc_scale > 0 ? o->voc_scale : 1;
 
-  started = true;
-  return -1;
+  return p;
 }
 
 int
-plugin_stop (void)
+plugin_stop (void *ctx)
 {
-  if (started)
+  CustomPlugin *p = (CustomPlugin *) ctx;
+
+  if (p != NULL)
     {
-      started = false;
-      fclose (f);
+      fclose (p->f);
+      free (p);
       return ATMOTUBE_RET_OK;
     }
 
@@ -58,29 +86,29 @@ plugin_stop (void)
   return ATMOTUBE_RET_ERROR;
 }
 
-void
-temperature (unsigned long ts, unsigned long value)
+int
+temperature (void *ctx, uint64_t ts, int device, unsigned long value)
 {
-  if (started)
-    {
-      fprintf (f, "%lu,temperature,%lu", ts, value);
-    }
+  CustomPlugin *p = (CustomPlugin *) ctx;
+  UNUSED (device);
+  fprintf (p->f, "%" PRIu64 ",temperature,%lu" CUSTOM_TAG, ts, value);
+  return ATMOTUBE_RET_OK;
 }
 
-void
-humidity (unsigned long ts, unsigned long value)
+int
+humidity (void *ctx, uint64_t ts, int device, unsigned long value)
 {
-  if (started)
-    {
-      fprintf (f, "%lu,humidity,%lu", ts, value);
-    }
+  CustomPlugin *p = (CustomPlugin *) ctx;
+  UNUSED (device);
+  fprintf (p->f, "%" PRIu64 ",humidity,%lu" CUSTOM_TAG, ts, value);
+  return ATMOTUBE_RET_OK;
 }
 
-void
-voc (unsigned long ts, float value)
+int
+voc (void *ctx, uint64_t ts, int device, float value)
 {
-  if (started)
-    {
-      fprintf (f, "%lu,voc,%f", ts, value);
-    }
+  CustomPlugin *p = (CustomPlugin *) ctx;
+  UNUSED (device);
+  fprintf (p->f, "%" PRIu64 ",voc,%f" CUSTOM_TAG, ts, value / p->voc_scale);
+  return ATMOTUBE_RET_OK;
 }
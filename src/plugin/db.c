@@ -15,16 +15,23 @@
 */
 
 #include "db.h"
+#include "gorilla.h"
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <atmotube.h>
 #include "atmotube-config.h"
 #include <sqlite3.h>
 
-static bool started = false;
 static const char *type = "db";
-static sqlite3 *datbase_handle = NULL;
-static const char *filename = NULL;
 
 /* Statements used by this plugin. */
 
@@ -33,20 +40,164 @@ typedef enum
   SQLS_INSERT_DEVICE = 0,
   SQLS_SELECT_DEVICE,
 
-  SQLS_INSERT_TEMP,
-  SQLS_INSERT_HUM,
-  SQLS_INSERT_VOC,
+  SQLS_INSERT_SAMPLE,
+  SQLS_GET_SAMPLE,
 
-  SQLS_GET_TEMP,
-  SQLS_GET_HUM,
-  SQLS_GET_VOC,
+  /* One per rollup level, in the order of rollups. */
+  SQLS_UPSERT_ROLLUP_1M,
+  SQLS_UPSERT_ROLLUP_1H,
+  SQLS_UPSERT_ROLLUP_1D,
+
+  SQLS_INSERT_CHUNK,
+  SQLS_LAST_CHUNK,
+  SQLS_GET_CHUNKS,
+
+  SQLS_BEGIN,
+  SQLS_COMMIT,
+  SQLS_ROLLBACK,
 
   SQLS_MAX
 } sql_statement;
 
-static sqlite3_stmt *sql_statements[SQLS_MAX] = { NULL };
+#define DB_NS_PER_SEC 1000000000ULL
+#define DB_NS_PER_DAY (86400ULL * DB_NS_PER_SEC)
+
+/* Metrics stored: VOC, HUMIDITY and TEMPERATURE. All are stored as
+ * integers, VOC in 1/ATMOTUBE_VOC_SCALE ppm, and scaled back to ppm
+ * when read. */
+#define DB_METRICS 3
+
+/* Chunk storage: the samples of a device and metric within an hour
+ * since the epoch are stored compressed in one row of chunks, or in
+ * several when there are more than DB_CHUNK_SAMPLES. */
+#define DB_CHUNK_WIDTH (3600ULL * DB_NS_PER_SEC)
+#define DB_CHUNK_SAMPLES 4096
+
+/* How long a write waits for a lock held by another connection, in
+ * ms, before the row goes to the spool instead. When the file is
+ * closed, pending rows wait for up to DB_CLOSE_TIMEOUT_MS. */
+#define DB_BUSY_TIMEOUT_MS 10
+#define DB_CLOSE_TIMEOUT_MS 5000
+
+/* Spool: rows refused because the database was locked are appended to
+ * the output file name with DB_SPOOL_SUFFIX, then written back in
+ * transactions of up to DB_SPOOL_COMMIT rows once the lock is gone.
+ * After a failed drain the next one is tried DB_SPOOL_RETRY ns later,
+ * rows coming meanwhile go to the spool directly. */
+#define DB_SPOOL_SUFFIX ".spool"
+#define DB_SPOOL_READ 256
+#define DB_SPOOL_COMMIT 4096
+#define DB_SPOOL_RETRY DB_NS_PER_SEC
+
+/* The sample is already in the rollups. */
+#define DB_SPOOL_ROLLED_UP 0x1
+
+/* A spooled row, value in the stored unit. */
+typedef struct
+{
+  uint64_t ts;
+  double value;
+  int32_t device;
+  uint16_t metric;
+  uint16_t flags;
+} DbSpoolRecord;
+
+/* Rollups: count, min, max and sum of the samples of a device and
+ * metric per minute, hour and day, in the tables below. Buckets start
+ * at multiples of their width since the epoch. */
+#define DB_ROLLUP_LEVELS 3
+
+static const char *rollup_tables[DB_ROLLUP_LEVELS] = {
+  "rollup_1m", "rollup_1h", "rollup_1d"
+};
+
+static const uint64_t rollup_widths[DB_ROLLUP_LEVELS] = {
+  60ULL * DB_NS_PER_SEC, 3600ULL * DB_NS_PER_SEC, DB_NS_PER_DAY
+};
+
+/* Aggregate of the samples of one bucket. */
+typedef struct
+{
+  uint64_t start;
+  uint64_t count;
+  double min;
+  double max;
+  double sum;
+} DbBucket;
+
+/* Samples of a device and metric being compressed into a chunk. */
+typedef struct
+{
+  uint64_t first;
+  uint64_t last;
+  double min;
+  double max;
+  GorillaEncoder samples;
+  /* What the chunks table of the open file holds, to tell samples
+   * already stored: the time of its latest sample, once known, and the
+   * sorted times of the samples of hour stored_hour, once loaded. */
+  bool last_known;
+  bool has_stored;
+  uint64_t stored_last;
+  bool hour_loaded;
+  uint64_t stored_hour;
+  uint64_t *stored_times;
+  size_t stored_count;
+  size_t stored_alloc;
+} DbChunk;
+
+/* State of one plugin instance. */
+struct DbPlugin_S
+{
+  bool started;
+  const AtmotubeOutput *output;
+  /* Connection to the file being written, NULL while none is open. */
+  sqlite3 *handle;
+  const char *filename;
+  sqlite3_stmt *statements[SQLS_MAX];
+  /* Rows are written in a transaction, committed once commit_rows are
+   * pending or the transaction is commit_interval ns old. */
+  bool in_transaction;
+  int pending;
+  uint64_t transaction_start;
+  int commit_rows;
+  uint64_t commit_interval;
+  /* Row id in the device table, per device of the output. */
+  int num_devices;
+  int *device_row_ids;
+  /* With partitions, the open file is partition_key (days or months
+   * since the epoch) named partition_name. Partitions which ended
+   * retention ns ago are removed. */
+  Atmotube_Partition partition;
+  int64_t partition_key;
+  char *partition_name;
+  uint64_t retention;
+  /* Open rollup bucket per device, metric and level. */
+  DbBucket *buckets;
+  /* With chunk storage, the open chunk per device and metric. */
+  Atmotube_Storage storage;
+  DbChunk *chunks;
+  /* From the VOC unit of the output to the stored one. */
+  double voc_factor;
+  /* The last row was refused because the database was locked, or was
+   * already stored. */
+  bool locked;
+  bool duplicate;
+  /* Spool file, open while it holds rows. The first spool_read of its
+   * spool_size bytes have been written to the database. */
+  char *spool_name;
+  int spool_fd;
+  uint64_t spool_read;
+  uint64_t spool_size;
+  uint64_t spool_retry;
+  DbSpoolStats spool_stats;
+};
 
-static int device_row_id = -1;
+int
+get_plugin_abi_version (void)
+{
+  return ATMOTUBE_PLUGIN_ABI_VERSION;
+}
 
 const char *
 get_plugin_type (void)
@@ -54,413 +205,3261 @@ get_plugin_type (void)
   return type;
 }
 
-#define RETURN_ATM_ERROR(ret, msg) do                                   \
+#define RETURN_ATM_ERROR(db, ret, msg) do                               \
         {                                                               \
             if (ret != SQLITE_OK) {                                     \
-                PRINT_ERROR("%s(%s)\n", msg, sqlite3_errmsg(datbase_handle)); \
+                PRINT_ERROR("%s(%s)\n", msg, sqlite3_errmsg(db->handle)); \
                 return ATMOTUBE_RET_ERROR;                              \
             }                                                           \
         } while(0)
 
-int
-db_plugin_create_tables (void)
+/* Schema migrations. The schema version of a database is kept in
+ * PRAGMA user_version, migration i takes it from version i to i + 1.
+ * A migration runs in a transaction which also sets the new version,
+ * so one which is interrupted runs again on the next start. Those
+ * copying data commit every DB_MIGRATION_CHUNK rows, with the source
+ * rows deleted as they are copied, so that a large database is
+ * converted in place without holding the lock for long or doubling
+ * its size. Those changing rows in place save how far they got with
+ * each batch, see migration_load. */
+
+/* Rows copied per transaction by a migration. */
+#define DB_MIGRATION_CHUNK 10000
+
+/* Tables of the first layout have times in ms. Times below this one,
+ * a day after the epoch in ns but the year 5138 in ms, are converted
+ * to ns as they are moved, later ones were already in ns. */
+#define DB_LEGACY_MS_LIMIT 100000000000000LL
+
+static int
+exec_sql (DbPlugin * db, const char *sql)
+{
+  char *err = NULL;
+
+  if (sqlite3_exec (db->handle, sql, NULL, NULL, &err) != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to execute '%s' on %s: %s\n", sql, db->filename,
+		   err);
+      sqlite3_free (err);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Run a query returning a single integer. */
+static int
+query_int (DbPlugin * db, const char *sql, int *value)
+{
+  sqlite3_stmt *stmt;
+
+  int ret = sqlite3_prepare_v2 (db->handle, sql, -1, &stmt, NULL);
+  RETURN_ATM_ERROR (db, ret, "Failed to prepare query");
+
+  ret = sqlite3_step (stmt);
+  if (ret == SQLITE_ROW)
+    {
+      *value = sqlite3_column_int (stmt, 0);
+    }
+  sqlite3_finalize (stmt);
+
+  return ret == SQLITE_ROW ? ATMOTUBE_RET_OK : ATMOTUBE_RET_ERROR;
+}
+
+/* Progress of a migration done in batches, so that one which is
+ * interrupted goes on where it stopped instead of doing its batches
+ * again, which would change rows twice for one changing them in place:
+ * the step it is at, and the device and key it got to in that step. It
+ * is saved in the transaction of each batch, and removed with the one
+ * setting the new version. */
+static int
+migration_load (DbPlugin * db, int version, int *step,
+		sqlite3_int64 * device, sqlite3_int64 * key)
+{
+  sqlite3_stmt *stmt = NULL;
+
+  if (exec_sql (db, "CREATE TABLE IF NOT EXISTS `migration_state` ( "
+		"`version` INTEGER NOT NULL PRIMARY KEY, "
+		"`step` INTEGER NOT NULL, "
+		"`device_id` INTEGER NOT NULL, "
+		"`key` INTEGER NOT NULL);") != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  int ret = sqlite3_prepare_v2 (db->handle, "SELECT step, device_id, key "
+				"FROM migration_state WHERE version = ?1;",
+				-1, &stmt, NULL);
+  RETURN_ATM_ERROR (db, ret, "Failed to prepare query");
+
+  sqlite3_bind_int (stmt, 1, version);
+  ret = sqlite3_step (stmt);
+  if (ret == SQLITE_ROW)
+    {
+      *step = sqlite3_column_int (stmt, 0);
+      *device = sqlite3_column_int64 (stmt, 1);
+      *key = sqlite3_column_int64 (stmt, 2);
+      PRINT_DEBUG ("Migration to version %d goes on at step %d\n", version,
+		   *step);
+    }
+  sqlite3_finalize (stmt);
+
+  return (ret == SQLITE_ROW || ret == SQLITE_DONE) ?
+    ATMOTUBE_RET_OK : ATMOTUBE_RET_ERROR;
+}
+
+/* Save the progress, then commit the batch. */
+static int
+migration_save (DbPlugin * db, int version, int step, sqlite3_int64 device,
+		sqlite3_int64 key)
+{
+  char *sql = sqlite3_mprintf ("INSERT OR REPLACE INTO migration_state "
+			       "VALUES (%d, %d, %lld, %lld);", version, step,
+			       (long long) device, (long long) key);
+  int ret = (sql != NULL && exec_sql (db, sql) == ATMOTUBE_RET_OK) ?
+    exec_sql (db, "COMMIT; BEGIN;") : ATMOTUBE_RET_ERROR;
+
+  sqlite3_free (sql);
+  return ret;
+}
+
+static int
+migration_done (DbPlugin * db, int version)
+{
+  char *sql = sqlite3_mprintf ("DELETE FROM migration_state "
+			       "WHERE version = %d;", version);
+  int ret = (sql != NULL) ? exec_sql (db, sql) : ATMOTUBE_RET_ERROR;
+
+  sqlite3_free (sql);
+  return ret;
+}
+
+/* Version 1: all samples in one table, clustered by device, metric
+ * and time so that the samples of a device and metric over a time
+ * range are stored next to each other. metric_id is an enum
+ * CHARACTER_ID. */
+static int
+migrate_create_tables (DbPlugin * db)
 {
   const char *statements[] = {
-    "CREATE TABLE IF NOT EXISTS `voc` ( \
-        `device_id` INTEGER NOT NULL,       \
-        `time`  INTEGER NOT NULL,           \
-        `value`         REAL NOT NULL,              \
-        `description` VARCHAR(255) NOT NULL);",
-    /* */
-    "CREATE TABLE IF NOT EXISTS `temperature` (     \
-        `device_id` INTEGER NOT NULL,                   \
-        `time`  NUMERIC NOT NULL,                       \
-        `value`         INTEGER NOT NULL);",
+    "CREATE TABLE IF NOT EXISTS `samples` ( \
+        `device_id` INTEGER NOT NULL,      \
+        `metric_id` INTEGER NOT NULL,      \
+        `time`  INTEGER NOT NULL,          \
+        `value` NUMERIC NOT NULL,          \
+        PRIMARY KEY(`device_id`, `metric_id`, `time`)) WITHOUT ROWID;",
     /* */
     "CREATE TABLE IF NOT EXISTS `device` (                  \
         `id`  INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,       \
         `name`  VARCHAR(255) NOT NULL,                          \
         `address` VARCHAR(255) NOT NULL);",
     /* */
-    "CREATE TABLE IF NOT EXISTS `humidity` ( \
-        `time`  INTEGER NOT NULL,                \
-        `device_id` INTEGER NOT NULL,       \
-        `value`         INTEGER NOT NULL,                \
-        PRIMARY KEY(`time`) );",
-    /* */
-    "CREATE INDEX IF NOT EXISTS `voc_index` ON `voc` ( \
-        `time` ASC,                                        \
-        `value` ASC,                                       \
-        `description` ASC,                                 \
-        `device_id` ASC);",
-    /* */
-    "CREATE UNIQUE INDEX IF NOT EXISTS `temperature_index` ON `temperature` ( \
-         `time` ASC,                                                    \
-         `value` ASC,                                                   \
-         `device_id` ASC);",
-    /* */
-    "CREATE UNIQUE INDEX IF NOT EXISTS `humidity_index` ON `humidity` ( \
-        `time` ASC,                                                     \
-        `value` ASC,                                                    \
-        `device_id` ASC);",
-    /* */
     "CREATE UNIQUE INDEX IF NOT EXISTS `device_index` ON `device` ( \
         `name`  ASC, \
         `address` ASC);"
   };
 
   uint16_t num_statements = sizeof (statements) / sizeof (char *);
-  sqlite3_stmt *createStmt;
+  int i;
 
-  int i = 0;
-  int ret = 0;
   for (i = 0; i < num_statements; i++)
     {
-      ret =
-	sqlite3_prepare_v2 (datbase_handle, statements[i], -1, &createStmt,
-			    NULL);
-      if (ret != SQLITE_OK)
-	{
-	  PRINT_ERROR ("Failed to prepare: %s\n",
-		       sqlite3_errmsg (datbase_handle));
-	  return ATMOTUBE_RET_ERROR;
-	}
-
-      ret = sqlite3_step (createStmt);
-      if (ret != SQLITE_DONE)
+      if (exec_sql (db, statements[i]) != ATMOTUBE_RET_OK)
 	{
-	  PRINT_ERROR ("Failed to create tables in %s\n", filename);
 	  return ATMOTUBE_RET_ERROR;
 	}
-
-      PRINT_DEBUG ("Execute %d: %s, ret=%d\n", i, statements[i], ret);
-      sqlite3_finalize (createStmt);
     }
 
-  PRINT_DEBUG ("Created tables (%d)\n", ret);
   return ATMOTUBE_RET_OK;
 }
 
-int
-db_plugin_create_statements (void)
+/* Move the rows of a table of the first layout into samples, then
+ * drop it. */
+static int
+move_table (DbPlugin * db, const char *table, int metric)
 {
-  int ret = sqlite3_prepare_v2 (datbase_handle,
-				"INSERT INTO device VALUES (NULL, ?1, ?2);",
-				-1,
-				&sql_statements[SQLS_INSERT_DEVICE], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: insert into device");
-  ret =
-    sqlite3_prepare_v2 (datbase_handle,
-			"select id from device where name=?1 and address=?2;",
-			-1, &sql_statements[SQLS_SELECT_DEVICE], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: select from device");
-  ret =
-    sqlite3_prepare_v2 (datbase_handle,
-			"INSERT INTO `temperature` (device_id,time,value) VALUES (?1,?2,?3);",
-			-1, &sql_statements[SQLS_INSERT_TEMP], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: insert into temperature");
-  ret =
-    sqlite3_prepare_v2 (datbase_handle,
-			"INSERT INTO `humidity` (device_id,time,value) VALUES (?1,?2,?3);",
-			-1, &sql_statements[SQLS_INSERT_HUM], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: insert into humidity");
-  ret =
-    sqlite3_prepare_v2 (datbase_handle,
-			"INSERT INTO `voc` (device_id,time,value,description) VALUES (?1,?2,?3,?4);",
-			-1, &sql_statements[SQLS_INSERT_VOC], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: insert into voc");
+  int exists = 0;
+  int ret = ATMOTUBE_RET_OK;
 
-  /* Used for testing. */
-  ret =
-    sqlite3_prepare_v2 (datbase_handle,
-			"select value from temperature where device_id=?1 and time=?2;",
-			-1, &sql_statements[SQLS_GET_TEMP], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: select temperature");
+  char *sql = sqlite3_mprintf ("SELECT count(*) FROM sqlite_master "
+			       "WHERE type='table' AND name=%Q;", table);
+  if (sql == NULL || query_int (db, sql, &exists) != ATMOTUBE_RET_OK)
+    {
+      sqlite3_free (sql);
+      return ATMOTUBE_RET_ERROR;
+    }
+  sqlite3_free (sql);
 
-  ret =
-    sqlite3_prepare_v2 (datbase_handle,
-			"select value from humidity where device_id=?1 and time=?2;",
-			-1, &sql_statements[SQLS_GET_HUM], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: select hum");
+  if (!exists)
+    {
+      return ATMOTUBE_RET_OK;
+    }
 
-  ret =
-    sqlite3_prepare_v2 (datbase_handle,
-			"select value from voc where device_id=?1 and time=?2;",
-			-1, &sql_statements[SQLS_GET_VOC], NULL);
-  RETURN_ATM_ERROR (ret, "Error creating: select voc");
+  char *copy =
+    sqlite3_mprintf ("INSERT OR IGNORE INTO samples "
+		     "(device_id, metric_id, time, value) "
+		     "SELECT device_id, %d, CASE WHEN time < %lld "
+		     "THEN time * 1000000 ELSE time END, value FROM `%w` "
+		     "WHERE rowid IN (SELECT rowid FROM `%w` "
+		     "ORDER BY rowid LIMIT %d);", metric,
+		     (long long) DB_LEGACY_MS_LIMIT, table, table,
+		     DB_MIGRATION_CHUNK);
+  char *delete =
+    sqlite3_mprintf ("DELETE FROM `%w` WHERE rowid IN "
+		     "(SELECT rowid FROM `%w` ORDER BY rowid LIMIT %d);",
+		     table, table, DB_MIGRATION_CHUNK);
+  char *drop = sqlite3_mprintf ("DROP TABLE `%w`;", table);
 
-  return ATMOTUBE_RET_OK;
-}
+  if (copy == NULL || delete == NULL || drop == NULL)
+    {
+      ret = ATMOTUBE_RET_ERROR;
+    }
 
-void
-db_plugin_destroy_statements (void)
-{
-  for (uint16_t i = 0; i < SQLS_MAX; i++)
+  while (ret == ATMOTUBE_RET_OK)
     {
-      if (sql_statements[i] != NULL)
+      if (exec_sql (db, copy) != ATMOTUBE_RET_OK
+	  || exec_sql (db, delete) != ATMOTUBE_RET_OK)
 	{
-	  sqlite3_finalize (sql_statements[i]);
+	  ret = ATMOTUBE_RET_ERROR;
+	  break;
 	}
-    }
-}
 
-/* Get the row ID of the device described by name / address. */
-int
-db_plugin_find_device (const char *name, const char *address, int *id)
-{
-  sqlite3_reset (sql_statements[SQLS_SELECT_DEVICE]);
-  int ret =
-    sqlite3_bind_text (sql_statements[SQLS_SELECT_DEVICE], 1, name, -1,
-		       SQLITE_STATIC);
-  ret =
-    sqlite3_bind_text (sql_statements[SQLS_SELECT_DEVICE], 2, address, -1,
-		       SQLITE_STATIC);
+      int moved = sqlite3_changes (db->handle);
+      PRINT_DEBUG ("Moved %d rows from %s\n", moved, table);
+      if (moved < DB_MIGRATION_CHUNK)
+	{
+	  break;
+	}
 
-  while ((ret =
-	  sqlite3_step (sql_statements[SQLS_SELECT_DEVICE])) == SQLITE_ROW)
+      ret = exec_sql (db, "COMMIT; BEGIN;");
+    }
+
+  if (ret == ATMOTUBE_RET_OK)
     {
-      *id = sqlite3_column_int (sql_statements[SQLS_SELECT_DEVICE], 0);
-      PRINT_DEBUG ("Found device %s/%s with id = %d\n", name, address, *id);
-      return ATMOTUBE_RET_OK;
+      ret = exec_sql (db, drop);
     }
 
-  PRINT_ERROR ("Device %s/%s not found\n", name, address);
-  return ATMOTUBE_RET_ERROR;
+  sqlite3_free (copy);
+  sqlite3_free (delete);
+  sqlite3_free (drop);
+  return ret;
 }
 
-int
-db_plugin_insert_device (const char *name, const char *address)
+/* Version 2: the samples of databases written before version 1, one
+ * table per metric, are moved into samples. */
+static int
+migrate_per_metric_tables (DbPlugin * db)
 {
-  int ret = 0;
-  int id = -1;
-  if (db_plugin_find_device (name, address, &id) == ATMOTUBE_RET_OK)
+  if (move_table (db, "temperature", TEMPERATURE) != ATMOTUBE_RET_OK
+      || move_table (db, "humidity", HUMIDITY) != ATMOTUBE_RET_OK
+      || move_table (db, "voc", VOC) != ATMOTUBE_RET_OK)
     {
-      /* Device already exists. */
-      return ATMOTUBE_RET_OK;
+      return ATMOTUBE_RET_ERROR;
     }
 
-  sqlite3_reset (sql_statements[SQLS_INSERT_DEVICE]);
+  return ATMOTUBE_RET_OK;
+}
+
+#define DB_ROLLUPS_VERSION 3
 
-  ret =
-    sqlite3_bind_text (sql_statements[SQLS_INSERT_DEVICE], 1, name, -1,
-		       SQLITE_STATIC);
-  if (ret != SQLITE_OK)
+/* Fill one rollup level with the samples of a metric, for devices from
+ * device on, the first one from key on. Each batch covers whole buckets
+ * from the one holding its first sample to the one holding its
+ * DB_MIGRATION_CHUNK-th sample. */
+static int
+fill_rollup (DbPlugin * db, int step, sqlite3_int64 device,
+	     sqlite3_int64 key)
+{
+  const int level = step / DB_METRICS;
+  const int metric = step % DB_METRICS;
+  const sqlite3_int64 width = (sqlite3_int64) rollup_widths[level];
+  const char *table = rollup_tables[level];
+  sqlite3_stmt *devices = NULL;
+  sqlite3_stmt *last = NULL;
+  sqlite3_stmt *fill = NULL;
+  int ret = ATMOTUBE_RET_ERROR;
+
+  /* ?1 device, ?2 metric, samples with a time in [?3, ?4). */
+  char *fill_sql =
+    sqlite3_mprintf ("INSERT OR IGNORE INTO `%w` SELECT device_id, "
+		     "metric_id, time - time %% %lld, count(*), "
+		     "min(value), max(value), sum(value) FROM samples "
+		     "WHERE device_id = ?1 AND metric_id = ?2 "
+		     "AND time >= ?3 AND time < ?4 GROUP BY 1, 2, 3;",
+		     table, (long long) width);
+
+  if (fill_sql != NULL
+      && sqlite3_prepare_v2 (db->handle, "SELECT id FROM device "
+			     "WHERE id >= ?1 ORDER BY id;", -1, &devices,
+			     NULL) == SQLITE_OK
+      && sqlite3_prepare_v2 (db->handle, "SELECT time FROM samples "
+			     "WHERE device_id = ?1 AND metric_id = ?2 "
+			     "AND time >= ?3 ORDER BY time LIMIT 1 "
+			     "OFFSET ?4;", -1, &last, NULL) == SQLITE_OK
+      && sqlite3_prepare_v2 (db->handle, fill_sql, -1, &fill,
+			     NULL) == SQLITE_OK)
     {
-      PRINT_ERROR ("ERROR binding '%s': %s\n", name,
-		   sqlite3_errmsg (datbase_handle));
-      return ATMOTUBE_RET_ERROR;
+      ret = ATMOTUBE_RET_OK;
+      sqlite3_bind_int64 (devices, 1, device);
+      sqlite3_bind_int (last, 2, metric);
+      sqlite3_bind_int (last, 4, DB_MIGRATION_CHUNK - 1);
+      sqlite3_bind_int (fill, 2, metric);
     }
 
-  ret =
-    sqlite3_bind_text (sql_statements[SQLS_INSERT_DEVICE], 2, address, -1,
-		       SQLITE_STATIC);
-  if (ret != SQLITE_OK)
+  while (ret == ATMOTUBE_RET_OK && sqlite3_step (devices) == SQLITE_ROW)
     {
-      PRINT_ERROR ("ERROR binding '%s': %s\n", address,
-		   sqlite3_errmsg (datbase_handle));
-      return ATMOTUBE_RET_ERROR;
+      sqlite3_int64 id = sqlite3_column_int64 (devices, 0);
+      sqlite3_int64 from = (id == device) ? key : 0;
+
+      while (ret == ATMOTUBE_RET_OK && from < INT64_MAX)
+	{
+	  sqlite3_int64 end = INT64_MAX;
+
+	  sqlite3_reset (last);
+	  sqlite3_bind_int64 (last, 1, id);
+	  sqlite3_bind_int64 (last, 3, from);
+	  if (sqlite3_step (last) == SQLITE_ROW)
+	    {
+	      sqlite3_int64 t = sqlite3_column_int64 (last, 0);
+	      end = t - t % width + width;
+	    }
+
+	  sqlite3_reset (fill);
+	  sqlite3_bind_int64 (fill, 1, id);
+	  sqlite3_bind_int64 (fill, 3, from);
+	  sqlite3_bind_int64 (fill, 4, end);
+	  if (sqlite3_step (fill) != SQLITE_DONE
+	      || migration_save (db, DB_ROLLUPS_VERSION, step, id,
+				 end) != ATMOTUBE_RET_OK)
+	    {
+	      ret = ATMOTUBE_RET_ERROR;
+	    }
+	  from = end;
+	}
     }
 
-  ret = sqlite3_step (sql_statements[SQLS_INSERT_DEVICE]);
-  if (ret != SQLITE_DONE)
+  if (ret != ATMOTUBE_RET_OK)
     {
-      PRINT_ERROR ("ERROR inserting data: %s\n",
-		   sqlite3_errmsg (datbase_handle));
-      return ATMOTUBE_RET_ERROR;
+      PRINT_ERROR ("Failed to fill %s: %s\n", table,
+		   sqlite3_errmsg (db->handle));
     }
 
-  PRINT_ERROR ("Inserted device %s/%s\n", name, address);
-  return ATMOTUBE_RET_OK;
+  sqlite3_finalize (devices);
+  sqlite3_finalize (last);
+  sqlite3_finalize (fill);
+  sqlite3_free (fill_sql);
+  return ret;
 }
 
-int
-db_plugin_setup_database (const char *file_name,
-			  const char *device_name, const char *device_address)
+/* Version 3: rollup tables, filled from the samples already there. One
+ * step per level and metric, see fill_rollup. */
+static int
+migrate_rollups (DbPlugin * db)
 {
-  PRINT_DEBUG ("Opening SQLite3 DB from string: %s,\n", file_name);
-  PRINT_DEBUG ("using device '%s' with address '%s'\n", device_name,
-	       device_address);
+  int level;
+  int step = 0;
+  sqlite3_int64 device = -1;
+  sqlite3_int64 key = 0;
 
-  filename = file_name;
+  for (level = 0; level < DB_ROLLUP_LEVELS; level++)
+    {
+      char *create =
+	sqlite3_mprintf ("CREATE TABLE IF NOT EXISTS `%w` ( "
+			 "`device_id` INTEGER NOT NULL, "
+			 "`metric_id` INTEGER NOT NULL, "
+			 "`bucket` INTEGER NOT NULL, "
+			 "`count` INTEGER NOT NULL, "
+			 "`min` NUMERIC NOT NULL, "
+			 "`max` NUMERIC NOT NULL, "
+			 "`sum` NUMERIC NOT NULL, "
+			 "PRIMARY KEY(`device_id`, `metric_id`, `bucket`)) "
+			 "WITHOUT ROWID;", rollup_tables[level]);
+      int ret = (create != NULL) ? exec_sql (db, create) : ATMOTUBE_RET_ERROR;
 
-  int ret = sqlite3_initialize ();
-  if (ret != SQLITE_OK)
+      sqlite3_free (create);
+      if (ret != ATMOTUBE_RET_OK)
+	{
+	  return ATMOTUBE_RET_ERROR;
+	}
+    }
+
+  if (migration_load (db, DB_ROLLUPS_VERSION, &step, &device, &key)
+      != ATMOTUBE_RET_OK)
     {
-      PRINT_ERROR ("Failed to init DB: %s\n", filename);
       return ATMOTUBE_RET_ERROR;
     }
 
-  ret =
-    sqlite3_open_v2 (filename, &datbase_handle,
-		     SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_READWRITE |
-		     SQLITE_OPEN_CREATE, NULL);
-  PRINT_DEBUG ("sqlite3_open_v2, ret = %d\n", ret);
-  if (ret != SQLITE_OK)
+  for (; step < DB_ROLLUP_LEVELS * DB_METRICS; step++)
     {
-      PRINT_ERROR ("Failed to open DB: %s\n", filename);
-      return ATMOTUBE_RET_ERROR;
+      if (fill_rollup (db, step, device, key) != ATMOTUBE_RET_OK)
+	{
+	  return ATMOTUBE_RET_ERROR;
+	}
+      device = -1;
+      key = 0;
     }
 
-  return ATMOTUBE_RET_OK;
+  return migration_done (db, DB_ROLLUPS_VERSION);
 }
 
-int
-plugin_start (AtmotubeOutput * o)
+/* Version 4: compressed chunks of samples, see DbChunk. The first and
+ * last time of a chunk are within DB_CHUNK_WIDTH of each other. */
+static int
+migrate_create_chunks (DbPlugin * db)
 {
-  int ret = db_plugin_setup_database (o->filename,
-				      o->device_name,
-				      o->device_address);
-  if (ret != ATMOTUBE_RET_OK)
+  return exec_sql (db, "CREATE TABLE IF NOT EXISTS `chunks` ( "
+		   "`device_id` INTEGER NOT NULL, "
+		   "`metric_id` INTEGER NOT NULL, "
+		   "`first` INTEGER NOT NULL, "
+		   "`last` INTEGER NOT NULL, "
+		   "`count` INTEGER NOT NULL, "
+		   "`min` NUMERIC NOT NULL, "
+		   "`max` NUMERIC NOT NULL, "
+		   "`data` BLOB NOT NULL, "
+		   "PRIMARY KEY(`device_id`, `metric_id`, `first`)) "
+		   "WITHOUT ROWID;");
+}
+
+/* Scale the VOC of one chunk, which is encoded again. */
+static int
+scale_voc_chunk (DbPlugin * db, sqlite3_stmt * chunk, sqlite3_stmt * update)
+{
+  GorillaDecoder dec;
+  GorillaEncoder enc;
+  uint64_t ts;
+  double value;
+  int ret = ATMOTUBE_RET_OK;
+
+  gorilla_decoder_init (&dec, sqlite3_column_blob (chunk, 2),
+			(size_t) sqlite3_column_bytes (chunk, 2),
+			(uint32_t) sqlite3_column_int (chunk, 3));
+  gorilla_encoder_init (&enc);
+  while (ret == ATMOTUBE_RET_OK && gorilla_next (&dec, &ts, &value))
     {
-      return ATMOTUBE_RET_ERROR;
+      double scaled = value * ATMOTUBE_VOC_SCALE;
+      if (!gorilla_append (&enc, ts, (double) (int64_t)
+			   (scaled < 0 ? scaled - 0.5 : scaled + 0.5)))
+	{
+	  ret = ATMOTUBE_RET_ERROR;
+	}
     }
 
-  ret = db_plugin_create_tables ();
-  if (ret != ATMOTUBE_RET_OK)
+  if (ret == ATMOTUBE_RET_OK && enc.count == dec.count)
     {
-      return ATMOTUBE_RET_ERROR;
+      sqlite3_reset (update);
+      sqlite3_bind_blob (update, 1, enc.data, (int) gorilla_size (&enc),
+			 SQLITE_STATIC);
+      sqlite3_bind_value (update, 2, sqlite3_column_value (chunk, 0));
+      sqlite3_bind_value (update, 3, sqlite3_column_value (chunk, 1));
+      if (sqlite3_step (update) != SQLITE_DONE)
+	{
+	  ret = ATMOTUBE_RET_ERROR;
+	}
     }
-
-  ret = db_plugin_create_statements ();
-  if (ret != ATMOTUBE_RET_OK)
+  else
     {
-      return ATMOTUBE_RET_ERROR;
+      ret = ATMOTUBE_RET_ERROR;
     }
 
-  db_plugin_insert_device (o->device_name, o->device_address);
-  /* Disregard error code here. */
-
-  if (db_plugin_find_device
-      (o->device_name, o->device_address, &device_row_id) != ATMOTUBE_RET_OK)
+  gorilla_encoder_free (&enc);
+  if (ret != ATMOTUBE_RET_OK)
     {
-      PRINT_ERROR ("DB, failed to find device '%s' with address '%s'\n",
-		   o->device_name, o->device_address);
-      return ATMOTUBE_RET_ERROR;
+      PRINT_ERROR ("Failed to scale a VOC chunk: %s\n",
+		   sqlite3_errmsg (db->handle));
     }
-
-  started = true;
-  return ATMOTUBE_RET_OK;
+  return ret;
 }
 
-int
-plugin_stop (void)
+#define DB_SCALE_VOC_VERSION 5
+
+/* The steps of migrate_scale_voc, one table each. The VOC rows of a
+ * device are taken in the order of key, rows at a time. set scales a
+ * row by ?5, NULL for chunks, whose data is encoded again. */
+static const struct
 {
-  db_plugin_destroy_statements ();
+  const char *table;
+  const char *key;
+  const char *set;
+  int rows;
+} scale_voc_steps[] = {
+  {"samples", "time", "value = CAST(round(value * ?5) AS INTEGER)",
+   DB_MIGRATION_CHUNK},
+  {"rollup_1m", "bucket", "min = round(min * ?5), max = round(max * ?5), "
+   "sum = round(sum * ?5)", DB_MIGRATION_CHUNK},
+  {"rollup_1h", "bucket", "min = round(min * ?5), max = round(max * ?5), "
+   "sum = round(sum * ?5)", DB_MIGRATION_CHUNK},
+  {"rollup_1d", "bucket", "min = round(min * ?5), max = round(max * ?5), "
+   "sum = round(sum * ?5)", DB_MIGRATION_CHUNK},
+  {"chunks", "first", NULL, DB_MIGRATION_CHUNK / DB_CHUNK_SAMPLES}
+};
 
-  int ret = sqlite3_close (datbase_handle);
-  if (ret != SQLITE_OK)
+/* Scale the rows of one device after key, in batches. */
+static int
+scale_voc_device (DbPlugin * db, int step, sqlite3_int64 device,
+		  sqlite3_int64 key, sqlite3_stmt * last,
+		  sqlite3_stmt * update, sqlite3_stmt * chunk)
+{
+  int ret = ATMOTUBE_RET_OK;
+
+  while (key < INT64_MAX)
     {
-      PRINT_ERROR ("Failed to close DB %s, reason:%s\n",
-		   filename, sqlite3_errmsg (datbase_handle));
-      return ATMOTUBE_RET_ERROR;
+      /* The batch ends at the key of its last row. */
+      sqlite3_int64 end = INT64_MAX;
+
+      sqlite3_reset (last);
+      sqlite3_bind_int64 (last, 1, device);
+      sqlite3_bind_int64 (last, 3, key);
+      if (sqlite3_step (last) == SQLITE_ROW)
+	{
+	  end = sqlite3_column_int64 (last, 0);
+	}
+
+      if (chunk == NULL)
+	{
+	  sqlite3_reset (update);
+	  sqlite3_bind_int64 (update, 1, device);
+	  sqlite3_bind_int64 (update, 3, key);
+	  sqlite3_bind_int64 (update, 4, end);
+	  if (sqlite3_step (update) != SQLITE_DONE)
+	    {
+	      ret = ATMOTUBE_RET_ERROR;
+	    }
+	}
+      else
+	{
+	  /* Chunks one at a time, by key, as they are updated. */
+	  sqlite3_int64 first = key;
+
+	  while (ret == ATMOTUBE_RET_OK)
+	    {
+	      sqlite3_reset (chunk);
+	      sqlite3_bind_int64 (chunk, 1, device);
+	      sqlite3_bind_int64 (chunk, 3, first);
+	      sqlite3_bind_int64 (chunk, 4, end);
+	      if (sqlite3_step (chunk) != SQLITE_ROW)
+		{
+		  break;
+		}
+	      first = sqlite3_column_int64 (chunk, 1);
+	      ret = scale_voc_chunk (db, chunk, update);
+	    }
+	}
+
+      if (ret != ATMOTUBE_RET_OK
+	  || migration_save (db, DB_SCALE_VOC_VERSION, step, device,
+			     end) != ATMOTUBE_RET_OK)
+	{
+	  return ATMOTUBE_RET_ERROR;
+	}
+      key = end;
     }
 
   return ATMOTUBE_RET_OK;
 }
 
-int
-get_temperature (unsigned long ts, unsigned long *value)
+/* Scale the VOC rows of one table. */
+static int
+scale_voc_table (DbPlugin * db, int step, sqlite3_int64 device,
+		 sqlite3_int64 key)
 {
-  int ret = sqlite3_reset (sql_statements[SQLS_GET_TEMP]);
-  ret = sqlite3_bind_int64 (sql_statements[SQLS_GET_TEMP], 1, device_row_id);
-  ret = sqlite3_bind_int64 (sql_statements[SQLS_GET_TEMP], 2, ts);
+  const char *table = scale_voc_steps[step].table;
+  const char *column = scale_voc_steps[step].key;
+  const char *set = scale_voc_steps[step].set;
+  sqlite3_stmt *devices = NULL;
+  sqlite3_stmt *last = NULL;
+  sqlite3_stmt *update = NULL;
+  sqlite3_stmt *chunk = NULL;
+  int ret = ATMOTUBE_RET_ERROR;
 
-  while ((ret = sqlite3_step (sql_statements[SQLS_GET_TEMP])) == SQLITE_ROW)
+  /* ?1 device, ?2 metric, ?3 key of the last row done, ?4 rows - 1. */
+  char *last_sql =
+    sqlite3_mprintf ("SELECT `%w` FROM `%w` WHERE device_id = ?1 "
+		     "AND metric_id = ?2 AND `%w` > ?3 ORDER BY 1 "
+		     "LIMIT 1 OFFSET ?4;", column, table, column);
+  /* ?1 device, ?2 metric, rows with a key in (?3, ?4]. */
+  char *update_sql = (set != NULL) ?
+    sqlite3_mprintf ("UPDATE `%w` SET %s WHERE device_id = ?1 "
+		     "AND metric_id = ?2 AND `%w` > ?3 AND `%w` <= ?4;",
+		     table, set, column, column) :
+    sqlite3_mprintf ("UPDATE chunks SET data = ?1, min = round(min * ?5), "
+		     "max = round(max * ?5) WHERE device_id = ?2 "
+		     "AND first = ?3 AND metric_id = ?4;");
+
+  if (last_sql != NULL && update_sql != NULL
+      && sqlite3_prepare_v2 (db->handle, "SELECT id FROM device "
+			     "WHERE id >= ?1 ORDER BY id;", -1, &devices,
+			     NULL) == SQLITE_OK
+      && sqlite3_prepare_v2 (db->handle, last_sql, -1, &last,
+			     NULL) == SQLITE_OK
+      && sqlite3_prepare_v2 (db->handle, update_sql, -1, &update,
+			     NULL) == SQLITE_OK
+      && (set != NULL
+	  || sqlite3_prepare_v2 (db->handle,
+				 "SELECT device_id, first, data, count "
+				 "FROM chunks WHERE device_id = ?1 "
+				 "AND metric_id = ?2 AND first > ?3 "
+				 "AND first <= ?4 ORDER BY first LIMIT 1;",
+				 -1, &chunk, NULL) == SQLITE_OK))
     {
-      *value = sqlite3_column_int64 (sql_statements[SQLS_GET_TEMP], 0);
-      return ATMOTUBE_RET_OK;
+      ret = ATMOTUBE_RET_OK;
     }
-  return ATMOTUBE_RET_ERROR;
-}
-
-void
-temperature (unsigned long ts, unsigned long value)
-{
-  PRINT_DEBUG ("Writing temperature to db(%u): %lu,%lu\n", started, ts,
-	       value);
 
-  if (started)
+  if (ret == ATMOTUBE_RET_OK)
     {
-      sqlite3_reset (sql_statements[SQLS_INSERT_TEMP]);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_TEMP], 1, device_row_id);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_TEMP], 2, ts);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_TEMP], 3, value);
-      int ret = sqlite3_step (sql_statements[SQLS_INSERT_TEMP]);
-      if (ret != SQLITE_DONE)
+      sqlite3_bind_int64 (devices, 1, device);
+      sqlite3_bind_int (last, 2, VOC);
+      sqlite3_bind_int (last, 4, scale_voc_steps[step].rows - 1);
+      sqlite3_bind_int (update, set != NULL ? 2 : 4, VOC);
+      sqlite3_bind_int (update, 5, ATMOTUBE_VOC_SCALE);
+      if (chunk != NULL)
 	{
-	  PRINT_ERROR ("ERROR inserting data: %s\n",
-		       sqlite3_errmsg (datbase_handle));
+	  sqlite3_bind_int (chunk, 2, VOC);
 	}
     }
-}
 
-int
-get_humidity (unsigned long ts, unsigned long *value)
-{
-  int ret = sqlite3_reset (sql_statements[SQLS_GET_HUM]);
-  ret = sqlite3_bind_int64 (sql_statements[SQLS_GET_HUM], 1, device_row_id);
-  ret = sqlite3_bind_int64 (sql_statements[SQLS_GET_HUM], 2, ts);
+  while (ret == ATMOTUBE_RET_OK && sqlite3_step (devices) == SQLITE_ROW)
+    {
+      sqlite3_int64 id = sqlite3_column_int64 (devices, 0);
+
+      /* Devices after the one the migration stopped at start over. */
+      ret = scale_voc_device (db, step, id, id == device ? key : -1, last,
+			      update, chunk);
+    }
 
-  while ((ret = sqlite3_step (sql_statements[SQLS_GET_HUM])) == SQLITE_ROW)
+  if (ret != ATMOTUBE_RET_OK)
     {
-      *value = sqlite3_column_int64 (sql_statements[SQLS_GET_HUM], 0);
-      return ATMOTUBE_RET_OK;
+      PRINT_ERROR ("Failed to scale VOC in %s: %s\n", table,
+		   sqlite3_errmsg (db->handle));
     }
-  return ATMOTUBE_RET_ERROR;
+
+  sqlite3_finalize (devices);
+  sqlite3_finalize (last);
+  sqlite3_finalize (update);
+  sqlite3_finalize (chunk);
+  sqlite3_free (last_sql);
+  sqlite3_free (update_sql);
+  return ret;
 }
 
-void
-humidity (unsigned long ts, unsigned long value)
+/* Version 5: VOC stored as integers, in 1/ATMOTUBE_VOC_SCALE ppm,
+ * instead of ppm. Scaling a row twice cannot be told from a larger
+ * value, so the progress is saved with each batch, see
+ * migration_load. */
+static int
+migrate_scale_voc (DbPlugin * db)
 {
-  PRINT_DEBUG ("Writing humidity to db(%u): %lu,%lu\n", started, ts, value);
-  if (started)
+  const int num_steps = sizeof (scale_voc_steps) /
+    sizeof (scale_voc_steps[0]);
+  int step = 0;
+  sqlite3_int64 device = -1;
+  sqlite3_int64 key = -1;
+
+  if (migration_load (db, DB_SCALE_VOC_VERSION, &step, &device, &key)
+      != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  for (; step < num_steps; step++)
     {
-      sqlite3_reset (sql_statements[SQLS_INSERT_HUM]);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_HUM], 1, device_row_id);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_HUM], 2, ts);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_HUM], 3, value);
-      int ret = sqlite3_step (sql_statements[SQLS_INSERT_HUM]);
-      if (ret != SQLITE_DONE)
+      if (scale_voc_table (db, step, device, key) != ATMOTUBE_RET_OK)
 	{
-	  PRINT_ERROR ("ERROR inserting data: %s\n",
-		       sqlite3_errmsg (datbase_handle));
+	  return ATMOTUBE_RET_ERROR;
 	}
+      device = -1;
+      key = -1;
     }
+
+  return migration_done (db, DB_SCALE_VOC_VERSION);
 }
 
+typedef struct
+{
+  const char *description;
+  int (*run) (DbPlugin * db);
+} DbMigration;
+
+static const DbMigration migrations[] = {
+  {"create the samples table", migrate_create_tables},
+  {"move the per metric tables into samples", migrate_per_metric_tables},
+  {"create the rollup tables", migrate_rollups},
+  {"create the chunks table", migrate_create_chunks},
+  {"store VOC as scaled integers", migrate_scale_voc}
+};
+
+#define DB_SCHEMA_VERSION \
+  ((int) (sizeof (migrations) / sizeof (DbMigration)))
+
 int
-get_voc (unsigned long ts, float *value)
+db_plugin_create_tables (DbPlugin * db)
 {
-  int ret = sqlite3_reset (sql_statements[SQLS_GET_VOC]);
-  ret = sqlite3_bind_int64 (sql_statements[SQLS_GET_VOC], 1, device_row_id);
-  ret = sqlite3_bind_int64 (sql_statements[SQLS_GET_VOC], 2, ts);
+  int version = 0;
 
-  while ((ret = sqlite3_step (sql_statements[SQLS_GET_VOC])) == SQLITE_ROW)
+  if (query_int (db, "PRAGMA user_version;", &version) != ATMOTUBE_RET_OK)
     {
-      *value = sqlite3_column_double (sql_statements[SQLS_GET_VOC], 0);
-      return ATMOTUBE_RET_OK;
+      return ATMOTUBE_RET_ERROR;
     }
-  return ATMOTUBE_RET_ERROR;
-}
 
-void
-voc (unsigned long ts, float value)
-{
-  PRINT_DEBUG ("Writing voc to db(%u): %lu,%f\n", started, ts, value);
-  if (started)
+  if (version > DB_SCHEMA_VERSION)
     {
-      sqlite3_reset (sql_statements[SQLS_INSERT_VOC]);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_VOC], 1, device_row_id);
-      sqlite3_bind_int64 (sql_statements[SQLS_INSERT_VOC], 2, ts);
-      sqlite3_bind_double (sql_statements[SQLS_INSERT_VOC], 3, value);
-      sqlite3_bind_text (sql_statements[SQLS_INSERT_VOC], 4, "", -1,
-			 SQLITE_STATIC);
+      PRINT_ERROR ("Schema version %d of %s is newer than %d\n", version,
+		   db->filename, DB_SCHEMA_VERSION);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  for (; version < DB_SCHEMA_VERSION; version++)
+    {
+      char pragma[64];
 
-      int ret = sqlite3_step (sql_statements[SQLS_INSERT_VOC]);
-      if (ret != SQLITE_DONE)
+      PRINT_DEBUG ("Migrating %s to version %d: %s\n", db->filename,
+		   version + 1, migrations[version].description);
+
+      snprintf (pragma, sizeof (pragma), "PRAGMA user_version=%d;",
+		version + 1);
+      if (exec_sql (db, "BEGIN;") != ATMOTUBE_RET_OK)
 	{
-	  PRINT_ERROR ("ERROR inserting data: %s\n",
-		       sqlite3_errmsg (datbase_handle));
+	  return ATMOTUBE_RET_ERROR;
 	}
-    }
+      if (migrations[version].run (db) != ATMOTUBE_RET_OK
+	  || exec_sql (db, pragma) != ATMOTUBE_RET_OK
+	  || exec_sql (db, "COMMIT;") != ATMOTUBE_RET_OK)
+	{
+	  PRINT_ERROR ("Failed to migrate %s to version %d\n", db->filename,
+		       version + 1);
+	  exec_sql (db, "ROLLBACK;");
+	  return ATMOTUBE_RET_ERROR;
+	}
+    }
+
+  PRINT_DEBUG ("Schema of %s is at version %d\n", db->filename, version);
+  return ATMOTUBE_RET_OK;
+}
+
+int
+db_plugin_create_statements (DbPlugin * db)
+{
+  int ret = sqlite3_prepare_v2 (db->handle,
+				"INSERT INTO device VALUES (NULL, ?1, ?2);",
+				-1,
+				&db->statements[SQLS_INSERT_DEVICE], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: insert into device");
+  ret =
+    sqlite3_prepare_v2 (db->handle,
+			"select id from device where name=?1 and address=?2;",
+			-1, &db->statements[SQLS_SELECT_DEVICE], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: select from device");
+  ret =
+    sqlite3_prepare_v2 (db->handle,
+			"INSERT INTO `samples` (device_id,metric_id,time,value) VALUES (?1,?2,?3,?4) "
+			"ON CONFLICT (device_id,metric_id,time) DO NOTHING;",
+			-1, &db->statements[SQLS_INSERT_SAMPLE], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: insert into samples");
+
+  /* Used for testing. */
+  ret =
+    sqlite3_prepare_v2 (db->handle,
+			"select value from samples where device_id=?1 and metric_id=?2 and time=?3;",
+			-1, &db->statements[SQLS_GET_SAMPLE], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: select sample");
+
+  for (int level = 0; level < DB_ROLLUP_LEVELS; level++)
+    {
+      char *sql =
+	sqlite3_mprintf ("INSERT INTO `%w` "
+			 "(device_id,metric_id,bucket,count,min,max,sum) "
+			 "VALUES (?1,?2,?3,?4,?5,?6,?7) "
+			 "ON CONFLICT (device_id,metric_id,bucket) DO UPDATE "
+			 "SET count = count + excluded.count, "
+			 "min = min(`min`, excluded.`min`), "
+			 "max = max(`max`, excluded.`max`), "
+			 "sum = sum + excluded.sum;", rollup_tables[level]);
+      ret = sql != NULL ?
+	sqlite3_prepare_v2 (db->handle, sql, -1,
+			    &db->statements[SQLS_UPSERT_ROLLUP_1M + level],
+			    NULL) : SQLITE_NOMEM;
+      sqlite3_free (sql);
+      RETURN_ATM_ERROR (db, ret, "Error creating: upsert rollup");
+    }
+
+  ret =
+    sqlite3_prepare_v2 (db->handle,
+			"INSERT INTO `chunks` (device_id,metric_id,first,last,"
+			"count,min,max,data) VALUES (?1,?2,?3,?4,?5,?6,?7,?8);",
+			-1, &db->statements[SQLS_INSERT_CHUNK], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: insert into chunks");
+  ret =
+    sqlite3_prepare_v2 (db->handle,
+			"SELECT max(last) FROM chunks "
+			"WHERE device_id=?1 AND metric_id=?2;",
+			-1, &db->statements[SQLS_LAST_CHUNK], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: select last chunk");
+  ret =
+    sqlite3_prepare_v2 (db->handle,
+			"SELECT count, data FROM chunks "
+			"WHERE device_id=?1 AND metric_id=?2 "
+			"AND first >= ?3 AND first < ?4;",
+			-1, &db->statements[SQLS_GET_CHUNKS], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: select chunks");
+
+  /* Rows are written in transactions. */
+  ret =
+    sqlite3_prepare_v2 (db->handle, "BEGIN;", -1,
+			&db->statements[SQLS_BEGIN], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: begin");
+
+  ret =
+    sqlite3_prepare_v2 (db->handle, "COMMIT;", -1,
+			&db->statements[SQLS_COMMIT], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: commit");
+
+  ret =
+    sqlite3_prepare_v2 (db->handle, "ROLLBACK;", -1,
+			&db->statements[SQLS_ROLLBACK], NULL);
+  RETURN_ATM_ERROR (db, ret, "Error creating: rollback");
+
+  return ATMOTUBE_RET_OK;
+}
+
+void
+db_plugin_destroy_statements (DbPlugin * db)
+{
+  for (uint16_t i = 0; i < SQLS_MAX; i++)
+    {
+      if (db->statements[i] != NULL)
+	{
+	  sqlite3_finalize (db->statements[i]);
+	  db->statements[i] = NULL;
+	}
+    }
+}
+
+/* Get the row ID of the device described by name / address. */
+int
+db_plugin_find_device (DbPlugin * db, const char *name, const char *address,
+		       int *id)
+{
+  sqlite3_reset (db->statements[SQLS_SELECT_DEVICE]);
+  int ret =
+    sqlite3_bind_text (db->statements[SQLS_SELECT_DEVICE], 1, name, -1,
+		       SQLITE_STATIC);
+  ret =
+    sqlite3_bind_text (db->statements[SQLS_SELECT_DEVICE], 2, address, -1,
+		       SQLITE_STATIC);
+
+  while ((ret =
+	  sqlite3_step (db->statements[SQLS_SELECT_DEVICE])) == SQLITE_ROW)
+    {
+      *id = sqlite3_column_int (db->statements[SQLS_SELECT_DEVICE], 0);
+      PRINT_DEBUG ("Found device %s/%s with id = %d\n", name, address, *id);
+      /* Left active, the statement would keep a read snapshot open for
+       * as long as the connection, and checkpoints could never restart
+       * the log. */
+      sqlite3_reset (db->statements[SQLS_SELECT_DEVICE]);
+      return ATMOTUBE_RET_OK;
+    }
+
+  PRINT_ERROR ("Device %s/%s not found\n", name, address);
+  return ATMOTUBE_RET_ERROR;
+}
+
+int
+db_plugin_insert_device (DbPlugin * db, const char *name,
+			 const char *address)
+{
+  int ret = 0;
+  int id = -1;
+  if (db_plugin_find_device (db, name, address, &id) == ATMOTUBE_RET_OK)
+    {
+      /* Device already exists. */
+      return ATMOTUBE_RET_OK;
+    }
+
+  sqlite3_reset (db->statements[SQLS_INSERT_DEVICE]);
+
+  ret =
+    sqlite3_bind_text (db->statements[SQLS_INSERT_DEVICE], 1, name, -1,
+		       SQLITE_STATIC);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("ERROR binding '%s': %s\n", name,
+		   sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  ret =
+    sqlite3_bind_text (db->statements[SQLS_INSERT_DEVICE], 2, address, -1,
+		       SQLITE_STATIC);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("ERROR binding '%s': %s\n", address,
+		   sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  ret = sqlite3_step (db->statements[SQLS_INSERT_DEVICE]);
+  if (ret != SQLITE_DONE)
+    {
+      PRINT_ERROR ("ERROR inserting data: %s\n",
+		   sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  PRINT_ERROR ("Inserted device %s/%s\n", name, address);
+  return ATMOTUBE_RET_OK;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * DB_NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+/* Wall clock time, in ns since the Unix epoch like sample times. */
+static uint64_t
+wall_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * DB_NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+/* Open the connection to db->filename. */
+static int
+open_handle (DbPlugin * db)
+{
+  PRINT_DEBUG ("Opening SQLite3 DB from string: %s\n", db->filename);
+
+  int ret = sqlite3_initialize ();
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to init DB: %s\n", db->filename);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* Only the worker of the output writes, one call at a time, so the
+   * connection goes without SQLite's per call mutex. Queries use
+   * connections of their own, see the read side below. */
+  ret =
+    sqlite3_open_v2 (db->filename, &db->handle,
+		     SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_READWRITE |
+		     SQLITE_OPEN_CREATE, NULL);
+  PRINT_DEBUG ("sqlite3_open_v2, ret = %d\n", ret);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to open DB: %s\n", db->filename);
+      sqlite3_close (db->handle);
+      db->handle = NULL;
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* Other connections may hold the lock for a short while, e.g. to
+   * checkpoint, longer waits are taken care of by the spool. */
+  sqlite3_busy_timeout (db->handle, DB_BUSY_TIMEOUT_MS);
+
+  /* Readers do not block the writer, and a commit appends to the log
+   * instead of rewriting pages. With synchronous=NORMAL the log is
+   * only synced at checkpoints, see close_file. */
+  ret = sqlite3_exec (db->handle,
+		      "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;",
+		      NULL, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      /* Not fatal, the default rollback journal still works. */
+      PRINT_ERROR ("Failed to enable WAL mode: %s\n",
+		   sqlite3_errmsg (db->handle));
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+DbPlugin *
+db_plugin_setup_database (const char *file_name)
+{
+  DbPlugin *db = (DbPlugin *) calloc (1, sizeof (DbPlugin));
+  if (db == NULL)
+    {
+      return NULL;
+    }
+
+  db->filename = file_name;
+  db->partition_key = -1;
+  db->spool_fd = -1;
+
+  if (open_handle (db) != ATMOTUBE_RET_OK)
+    {
+      free (db);
+      return NULL;
+    }
+
+  return db;
+}
+
+/* Open db->filename for writing: schema, statements and the rows of
+ * the devices of the output. */
+static int
+open_file (DbPlugin * db)
+{
+  const AtmotubeOutput *o = db->output;
+  int i;
+
+  if (open_handle (db) != ATMOTUBE_RET_OK
+      || db_plugin_create_tables (db) != ATMOTUBE_RET_OK
+      || db_plugin_create_statements (db) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  for (i = 0; i < o->num_devices; i++)
+    {
+      const char *name = o->device_names[i];
+      const char *address = o->device_addresses[i];
+
+      db_plugin_insert_device (db, name, address);
+      /* Disregard error code here. */
+
+      if (db_plugin_find_device (db, name, address, &db->device_row_ids[i])
+	  != ATMOTUBE_RET_OK)
+	{
+	  PRINT_ERROR ("DB, failed to find device '%s' with address '%s'\n",
+		       name, address);
+	  return ATMOTUBE_RET_ERROR;
+	}
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+static int step_statement (DbPlugin * db, sql_statement id);
+static int begin_transaction (DbPlugin * db);
+static int rollup_flush (DbPlugin * db);
+static int chunk_flush_all (DbPlugin * db);
+static void chunk_forget (DbPlugin * db);
+static int spool_append (DbPlugin * db, int device, int metric,
+			 uint64_t ts, double value, int flags);
+static void spool_open (DbPlugin * db);
+static int spool_drain (DbPlugin * db, bool wait);
+
+/* True when a statement failed with code because another connection
+ * held the lock. */
+static bool
+is_locked (int code)
+{
+  code &= 0xff;
+  return code == SQLITE_BUSY || code == SQLITE_LOCKED;
+}
+
+/* Commit the open transaction, if any. A commit refused because of a
+ * lock leaves the transaction open, to be committed the next time. */
+static int
+commit_transaction (DbPlugin * db)
+{
+  if (!db->in_transaction)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  sqlite3_stmt *stmt = db->statements[SQLS_COMMIT];
+  sqlite3_reset (stmt);
+  int ret = sqlite3_step (stmt);
+  if (is_locked (ret))
+    {
+      PRINT_DEBUG ("DB %s is locked, commit deferred\n", db->filename);
+      sqlite3_reset (stmt);
+      return ATMOTUBE_RET_OK;
+    }
+
+  db->in_transaction = false;
+  if (ret != SQLITE_DONE)
+    {
+      PRINT_ERROR ("ERROR executing statement: %s\n",
+		   sqlite3_errmsg (db->handle));
+      step_statement (db, SQLS_ROLLBACK);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Close the file being written. Whatever is pending is committed and
+ * the log is moved into the database, so that everything written is
+ * on disk once closed. */
+static int
+close_file (DbPlugin * db)
+{
+  if (db->handle == NULL)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  /* Nothing is left for later, so wait for the lock rather than
+   * spooling. */
+  sqlite3_busy_timeout (db->handle, DB_CLOSE_TIMEOUT_MS);
+
+  /* The open buckets and chunks belong to this file. */
+  if (rollup_flush (db) != ATMOTUBE_RET_OK)
+    {
+      PRINT_ERROR ("Failed to write the rollups of DB %s\n", db->filename);
+    }
+  if (chunk_flush_all (db) != ATMOTUBE_RET_OK)
+    {
+      PRINT_ERROR ("Failed to write the chunks of DB %s\n", db->filename);
+    }
+  chunk_forget (db);
+  commit_transaction (db);
+  if (db->in_transaction)
+    {
+      PRINT_ERROR ("DB %s is still locked, %d rows are lost\n",
+		   db->filename, db->pending);
+      step_statement (db, SQLS_ROLLBACK);
+      db->in_transaction = false;
+    }
+
+  int ret = sqlite3_wal_checkpoint_v2 (db->handle, NULL,
+				       SQLITE_CHECKPOINT_TRUNCATE, NULL,
+				       NULL);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to checkpoint DB %s: %s\n", db->filename,
+		   sqlite3_errmsg (db->handle));
+    }
+
+  db_plugin_destroy_statements (db);
+
+  ret = sqlite3_close (db->handle);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to close DB %s, reason:%s\n",
+		   db->filename, sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  db->handle = NULL;
+  return ATMOTUBE_RET_OK;
+}
+
+/* Partitions. The samples of partition k, days or months since the
+ * epoch (UTC), go to the output file name with the date of the
+ * partition inserted before the extension, e.g. atmotube-2024-05-17.db
+ * or atmotube-2024-05.db. Expired partitions are removed by deleting
+ * their files. */
+
+static int64_t
+partition_of (Atmotube_Partition partition, uint64_t ts)
+{
+  if (partition == ATMOTUBE_PARTITION_DAY)
+    {
+      return (int64_t) (ts / DB_NS_PER_DAY);
+    }
+
+  time_t secs = (time_t) (ts / DB_NS_PER_SEC);
+  struct tm tm;
+  gmtime_r (&secs, &tm);
+  return (int64_t) (tm.tm_year + 1900) * 12 + tm.tm_mon;
+}
+
+/* First ns of partition key. */
+static uint64_t
+partition_start (Atmotube_Partition partition, int64_t key)
+{
+  if (partition == ATMOTUBE_PARTITION_DAY)
+    {
+      return (uint64_t) key * DB_NS_PER_DAY;
+    }
+
+  struct tm tm;
+  memset (&tm, 0, sizeof (tm));
+  tm.tm_year = (int) (key / 12) - 1900;
+  tm.tm_mon = (int) (key % 12);
+  tm.tm_mday = 1;
+  return (uint64_t) timegm (&tm) * DB_NS_PER_SEC;
+}
+
+/* Length of the part of file_name before its extension. */
+static size_t
+stem_length (const char *file_name)
+{
+  const char *slash = strrchr (file_name, '/');
+  const char *dot = strrchr (file_name, '.');
+
+  if (dot != NULL && (slash == NULL || dot > slash))
+    {
+      return (size_t) (dot - file_name);
+    }
+  return strlen (file_name);
+}
+
+/* Name of the file of partition key, free with sqlite3_free. */
+static char *
+partition_file (const char *file_name, Atmotube_Partition partition,
+		int64_t key)
+{
+  size_t stem = stem_length (file_name);
+  char date[16];
+
+  if (partition == ATMOTUBE_PARTITION_DAY)
+    {
+      time_t secs = (time_t) (partition_start (partition, key)
+			      / DB_NS_PER_SEC);
+      struct tm tm;
+      gmtime_r (&secs, &tm);
+      strftime (date, sizeof (date), "%Y-%m-%d", &tm);
+    }
+  else
+    {
+      snprintf (date, sizeof (date), "%04d-%02d", (int) (key / 12),
+		(int) (key % 12) + 1);
+    }
+
+  return sqlite3_mprintf ("%.*s-%s%s", (int) stem, file_name, date,
+			  file_name + stem);
+}
+
+/* Partition key of a date as found in a file name, or -1. */
+static int64_t
+parse_partition (Atmotube_Partition partition, const char *date,
+		 size_t length)
+{
+  int year, month, day = 1;
+  char buf[16];
+
+  if (length >= sizeof (buf))
+    {
+      return -1;
+    }
+  memcpy (buf, date, length);
+  buf[length] = '\0';
+
+  if (partition == ATMOTUBE_PARTITION_DAY)
+    {
+      if (length != 10 || sscanf (buf, "%4d-%2d-%2d", &year, &month, &day)
+	  != 3)
+	{
+	  return -1;
+	}
+    }
+  else if (length != 7 || sscanf (buf, "%4d-%2d", &year, &month) != 2)
+    {
+      return -1;
+    }
+
+  if (month < 1 || month > 12 || day < 1 || day > 31)
+    {
+      return -1;
+    }
+
+  if (partition == ATMOTUBE_PARTITION_MONTH)
+    {
+      return (int64_t) year * 12 + month - 1;
+    }
+
+  struct tm tm;
+  memset (&tm, 0, sizeof (tm));
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+  tm.tm_mday = day;
+  return (int64_t) (timegm (&tm) / 86400);
+}
+
+static bool
+expired (DbPlugin * db, int64_t key)
+{
+  return db->retention > 0
+    && partition_start (db->partition, key + 1) + db->retention <=
+    wall_ns ();
+}
+
+/* Delete the files of the partitions past the retention. */
+static void
+remove_expired (DbPlugin * db)
+{
+  const char *file_name = db->output->filename;
+  const char *slash = strrchr (file_name, '/');
+  size_t dir_length = slash != NULL ? (size_t) (slash - file_name) + 1 : 0;
+  size_t stem = stem_length (file_name);
+  const char *ext = file_name + stem;
+  char *dir_name = sqlite3_mprintf ("%.*s", (int) dir_length, file_name);
+
+  if (db->retention == 0 || dir_name == NULL)
+    {
+      sqlite3_free (dir_name);
+      return;
+    }
+
+  DIR *dir = opendir (dir_length > 0 ? dir_name : ".");
+  struct dirent *entry;
+
+  /* Names are <stem>-<date><ext>. */
+  const char *prefix = file_name + dir_length;
+  size_t prefix_length = stem - dir_length;
+
+  while (dir != NULL && (entry = readdir (dir)) != NULL)
+    {
+      const char *name = entry->d_name;
+      size_t length = strlen (name);
+
+      if (length < prefix_length + 1 + strlen (ext)
+	  || strncmp (name, prefix, prefix_length) != 0
+	  || name[prefix_length] != '-'
+	  || strcmp (name + length - strlen (ext), ext) != 0)
+	{
+	  continue;
+	}
+
+      const char *date = name + prefix_length + 1;
+      int64_t key = parse_partition (db->partition, date,
+				     length - strlen (ext) - prefix_length -
+				     1);
+      if (key < 0 || key == db->partition_key || !expired (db, key))
+	{
+	  continue;
+	}
+
+      char *path = sqlite3_mprintf ("%s%s", dir_name, name);
+      char *wal = sqlite3_mprintf ("%s-wal", path);
+      char *shm = sqlite3_mprintf ("%s-shm", path);
+      if (path != NULL && wal != NULL && shm != NULL)
+	{
+	  PRINT_DEBUG ("Removing expired partition %s\n", path);
+	  unlink (wal);
+	  unlink (shm);
+	  if (unlink (path) != 0)
+	    {
+	      PRINT_ERROR ("Failed to remove expired partition %s\n", path);
+	    }
+	}
+      sqlite3_free (path);
+      sqlite3_free (wal);
+      sqlite3_free (shm);
+    }
+
+  if (dir != NULL)
+    {
+      closedir (dir);
+    }
+  sqlite3_free (dir_name);
+}
+
+/* Make sure the file a sample taken at ts goes to is open. */
+static int
+select_partition (DbPlugin * db, uint64_t ts)
+{
+  if (db->partition == ATMOTUBE_PARTITION_NONE)
+    {
+      return db->handle != NULL ? ATMOTUBE_RET_OK : ATMOTUBE_RET_ERROR;
+    }
+
+  int64_t key = partition_of (db->partition, ts);
+  if (key == db->partition_key && db->handle != NULL)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  if (expired (db, key))
+    {
+      PRINT_ERROR ("Sample at %" PRIu64 " is past the retention of %s\n",
+		   ts, db->output->filename);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  close_file (db);
+  sqlite3_free (db->partition_name);
+  db->partition_name =
+    partition_file (db->output->filename, db->partition, key);
+  if (db->partition_name == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  db->filename = db->partition_name;
+  db->partition_key = key;
+  if (open_file (db) != ATMOTUBE_RET_OK)
+    {
+      close_file (db);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  remove_expired (db);
+  return ATMOTUBE_RET_OK;
+}
+
+void *
+plugin_start (const AtmotubeOutput * o)
+{
+  DbPlugin *db = (DbPlugin *) calloc (1, sizeof (DbPlugin));
+  if (db == NULL)
+    {
+      return NULL;
+    }
+
+  db->output = o;
+  db->filename = o->filename;
+  db->num_devices = o->num_devices;
+  db->commit_rows = o->commit_rows;
+  db->commit_interval = (uint64_t) o->commit_interval * 1000000ULL;
+  db->partition = o->partition;
+  db->partition_key = -1;
+  db->retention = (uint64_t) o->retention * DB_NS_PER_DAY;
+  db->spool_fd = -1;
+  db->spool_name = sqlite3_mprintf ("%s" DB_SPOOL_SUFFIX, o->filename);
+  db->storage = o->storage;
+  db->voc_factor = (double) ATMOTUBE_VOC_SCALE /
+    (o->voc_scale > 0 ? o->voc_scale : 1);
+
+  db->device_row_ids = (int *) malloc (o->num_devices * sizeof (int));
+  db->buckets = (DbBucket *) calloc ((size_t) o->num_devices *
+				     DB_METRICS * DB_ROLLUP_LEVELS,
+				     sizeof (DbBucket));
+  if (db->storage == ATMOTUBE_STORAGE_CHUNKS)
+    {
+      db->chunks = (DbChunk *) calloc ((size_t) o->num_devices * DB_METRICS,
+				       sizeof (DbChunk));
+    }
+  if (db->device_row_ids == NULL || db->buckets == NULL
+      || db->spool_name == NULL
+      || (db->storage == ATMOTUBE_STORAGE_CHUNKS && db->chunks == NULL))
+    {
+      plugin_stop (db);
+      return NULL;
+    }
+
+  /* With partitions, start with the current one. */
+  int ret = (db->partition == ATMOTUBE_PARTITION_NONE) ? open_file (db)
+    : select_partition (db, wall_ns ());
+  if (ret != ATMOTUBE_RET_OK)
+    {
+      plugin_stop (db);
+      return NULL;
+    }
+
+  /* Rows spooled by a previous run are written with the first ones. */
+  spool_open (db);
+
+  db->started = true;
+  return db;
+}
+
+int
+plugin_stop (void *ctx)
+{
+  DbPlugin *db = (DbPlugin *) ctx;
+
+  if (db->spool_fd >= 0)
+    {
+      if (db->handle != NULL)
+	{
+	  sqlite3_busy_timeout (db->handle, DB_CLOSE_TIMEOUT_MS);
+	}
+      if (spool_drain (db, true) != ATMOTUBE_RET_OK)
+	{
+	  PRINT_ERROR ("%" PRIu64 " rows left in spool %s\n",
+		       (db->spool_size - db->spool_read) /
+		       sizeof (DbSpoolRecord), db->spool_name);
+	}
+    }
+
+  int ret = close_file (db);
+
+  if (db->spool_fd >= 0)
+    {
+      close (db->spool_fd);
+    }
+  sqlite3_free (db->spool_name);
+  sqlite3_free (db->partition_name);
+  free (db->device_row_ids);
+  free (db->buckets);
+  if (db->chunks != NULL)
+    {
+      size_t i;
+      for (i = 0; i < (size_t) db->num_devices * DB_METRICS; i++)
+	{
+	  gorilla_encoder_free (&db->chunks[i].samples);
+	  free (db->chunks[i].stored_times);
+	}
+      free (db->chunks);
+    }
+  free (db);
+  return ret;
+}
+
+/* Step the lookup of a sample, returns the statement on its row or
+ * NULL when there is none. */
+static sqlite3_stmt *
+find_sample (DbPlugin * db, int device, int metric, uint64_t ts)
+{
+  sqlite3_stmt *stmt = db->statements[SQLS_GET_SAMPLE];
+
+  sqlite3_reset (stmt);
+  sqlite3_bind_int64 (stmt, 1, db->device_row_ids[device]);
+  sqlite3_bind_int (stmt, 2, metric);
+  sqlite3_bind_int64 (stmt, 3, ts);
+
+  if (sqlite3_step (stmt) != SQLITE_ROW)
+    {
+      return NULL;
+    }
+  return stmt;
+}
+
+int
+get_temperature (DbPlugin * db, int device, uint64_t ts, unsigned long *value)
+{
+  sqlite3_stmt *stmt = find_sample (db, device, TEMPERATURE, ts);
+  if (stmt == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  *value = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+  return ATMOTUBE_RET_OK;
+}
+
+/* Insert one sample. */
+static int
+insert_row (DbPlugin * db, int device, int metric, uint64_t ts,
+	    double value)
+{
+  sqlite3_stmt *stmt = db->statements[SQLS_INSERT_SAMPLE];
+
+  if (device < 0 || device >= db->num_devices)
+    {
+      PRINT_ERROR ("Unknown device: %d\n", device);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  sqlite3_reset (stmt);
+  switch (metric)
+    {
+    case TEMPERATURE:
+    case HUMIDITY:
+    case VOC:
+      sqlite3_bind_int64 (stmt, 4, (sqlite3_int64) value);
+      break;
+    default:
+      PRINT_ERROR ("Unknown metric: %d\n", metric);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  sqlite3_bind_int64 (stmt, 1, db->device_row_ids[device]);
+  sqlite3_bind_int (stmt, 2, metric);
+  sqlite3_bind_int64 (stmt, 3, ts);
+
+  int ret = sqlite3_step (stmt);
+  if (ret != SQLITE_DONE)
+    {
+      db->locked = is_locked (ret);
+      if (!db->locked)
+	{
+	  PRINT_ERROR ("ERROR inserting data: %s\n",
+		       sqlite3_errmsg (db->handle));
+	}
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  db->duplicate = sqlite3_changes (db->handle) == 0;
+  return ATMOTUBE_RET_OK;
+}
+
+static int
+step_statement (DbPlugin * db, sql_statement id)
+{
+  sqlite3_stmt *stmt = db->statements[id];
+
+  sqlite3_reset (stmt);
+  if (sqlite3_step (stmt) != SQLITE_DONE)
+    {
+      PRINT_ERROR ("ERROR executing statement: %s\n",
+		   sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Make sure a transaction is open for the rows to come. */
+static int
+begin_transaction (DbPlugin * db)
+{
+  if (db->in_transaction)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  if (step_statement (db, SQLS_BEGIN) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  db->in_transaction = true;
+  db->pending = 0;
+  db->transaction_start = now_ns ();
+  return ATMOTUBE_RET_OK;
+}
+
+/* Commit the open transaction when it is big or old enough. */
+static int
+commit_due (DbPlugin * db)
+{
+  if (db->in_transaction
+      && (db->pending >= db->commit_rows
+	  || (db->commit_interval > 0
+	      && now_ns () - db->transaction_start >= db->commit_interval)))
+    {
+      return commit_transaction (db);
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Rollups. Each device, metric and level has one open bucket in
+ * memory, the latest one samples went to. The bucket is added to its
+ * rollup table once a sample of a later bucket comes or the file is
+ * closed, so rollups cost one upsert per bucket instead of one per
+ * sample. Samples older than the open bucket are added on their own. */
+
+static DbBucket *
+rollup_bucket (DbPlugin * db, int device, int metric, int level)
+{
+  return &db->buckets[((size_t) device * DB_METRICS + metric)
+		      * DB_ROLLUP_LEVELS + level];
+}
+
+/* Add b to the rollup table of level. */
+static int
+rollup_upsert (DbPlugin * db, int device, int metric, int level,
+	       const DbBucket * b)
+{
+  sqlite3_stmt *stmt = db->statements[SQLS_UPSERT_ROLLUP_1M + level];
+
+  sqlite3_reset (stmt);
+  sqlite3_bind_int64 (stmt, 1, db->device_row_ids[device]);
+  sqlite3_bind_int (stmt, 2, metric);
+  sqlite3_bind_int64 (stmt, 3, (sqlite3_int64) b->start);
+  sqlite3_bind_int64 (stmt, 4, (sqlite3_int64) b->count);
+  sqlite3_bind_double (stmt, 5, b->min);
+  sqlite3_bind_double (stmt, 6, b->max);
+  sqlite3_bind_double (stmt, 7, b->sum);
+
+  if (sqlite3_step (stmt) != SQLITE_DONE)
+    {
+      PRINT_ERROR ("ERROR writing %s: %s\n", rollup_tables[level],
+		   sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Account a sample just written in the buckets of its device and
+ * metric. */
+static int
+rollup_add (DbPlugin * db, int device, int metric, uint64_t ts,
+	    double value)
+{
+  int status = ATMOTUBE_RET_OK;
+  int level;
+
+  if (db->buckets == NULL || metric < 0 || metric >= DB_METRICS)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  for (level = 0; level < DB_ROLLUP_LEVELS; level++)
+    {
+      DbBucket *b = rollup_bucket (db, device, metric, level);
+      uint64_t start = ts - ts % rollup_widths[level];
+
+      if (b->count > 0 && start == b->start)
+	{
+	  b->count++;
+	  b->sum += value;
+	  if (value < b->min)
+	    {
+	      b->min = value;
+	    }
+	  if (value > b->max)
+	    {
+	      b->max = value;
+	    }
+	  continue;
+	}
+
+      DbBucket sample = { start, 1, value, value, value };
+      if (b->count > 0 && start < b->start)
+	{
+	  /* Late, the open bucket stays. */
+	  if (rollup_upsert (db, device, metric, level, &sample) !=
+	      ATMOTUBE_RET_OK)
+	    {
+	      status = ATMOTUBE_RET_ERROR;
+	    }
+	  continue;
+	}
+
+      if (b->count > 0
+	  && rollup_upsert (db, device, metric, level, b) != ATMOTUBE_RET_OK)
+	{
+	  status = ATMOTUBE_RET_ERROR;
+	}
+      *b = sample;
+    }
+
+  return status;
+}
+
+/* Write all open buckets, which then start over. */
+static int
+rollup_flush (DbPlugin * db)
+{
+  int status = ATMOTUBE_RET_OK;
+  int device, metric, level;
+
+  if (db->buckets == NULL)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  for (device = 0; device < db->num_devices; device++)
+    {
+      for (metric = 0; metric < DB_METRICS; metric++)
+	{
+	  for (level = 0; level < DB_ROLLUP_LEVELS; level++)
+	    {
+	      DbBucket *b = rollup_bucket (db, device, metric, level);
+	      if (b->count == 0)
+		{
+		  continue;
+		}
+
+	      if (begin_transaction (db) != ATMOTUBE_RET_OK
+		  || rollup_upsert (db, device, metric, level, b)
+		  != ATMOTUBE_RET_OK)
+		{
+		  status = ATMOTUBE_RET_ERROR;
+		}
+	      b->count = 0;
+	    }
+	}
+    }
+
+  return status;
+}
+
+/* Chunks. The samples of a device and metric are added to its open
+ * chunk as they come, which is written once a sample of another hour
+ * comes, it is full, or the file is closed. Samples must come in time
+ * order to be compressed, a late one is written as a chunk of its own.
+ * Open chunks are only in memory, like the rows of a transaction. */
+
+static DbChunk *
+chunk_of (DbPlugin * db, int device, int metric)
+{
+  return &db->chunks[(size_t) device * DB_METRICS + metric];
+}
+
+static int
+chunk_flush (DbPlugin * db, int device, int metric)
+{
+  DbChunk *c = chunk_of (db, device, metric);
+  sqlite3_stmt *stmt = db->statements[SQLS_INSERT_CHUNK];
+
+  if (c->samples.count == 0)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  sqlite3_reset (stmt);
+  sqlite3_bind_int64 (stmt, 1, db->device_row_ids[device]);
+  sqlite3_bind_int (stmt, 2, metric);
+  sqlite3_bind_int64 (stmt, 3, (sqlite3_int64) c->first);
+  sqlite3_bind_int64 (stmt, 4, (sqlite3_int64) c->last);
+  sqlite3_bind_int (stmt, 5, (int) c->samples.count);
+  sqlite3_bind_double (stmt, 6, c->min);
+  sqlite3_bind_double (stmt, 7, c->max);
+  sqlite3_bind_blob (stmt, 8, c->samples.data,
+		     (int) gorilla_size (&c->samples), SQLITE_STATIC);
+
+  int ret = sqlite3_step (stmt);
+  sqlite3_clear_bindings (stmt);
+  if (is_locked (ret))
+    {
+      /* Kept sample by sample, they are chunked again once written
+       * back. */
+      GorillaDecoder dec;
+      uint64_t ts;
+      double value;
+
+      gorilla_decoder_init (&dec, c->samples.data,
+			    gorilla_size (&c->samples), c->samples.count);
+      ret = SQLITE_DONE;
+      while (gorilla_next (&dec, &ts, &value))
+	{
+	  if (spool_append (db, device, metric, ts, value,
+			    DB_SPOOL_ROLLED_UP) != ATMOTUBE_RET_OK)
+	    {
+	      ret = SQLITE_ERROR;
+	    }
+	}
+    }
+  else if (ret == SQLITE_DONE)
+    {
+      if (c->last_known && (!c->has_stored || c->last > c->stored_last))
+	{
+	  c->stored_last = c->last;
+	}
+      c->has_stored = true;
+      if (c->stored_hour == c->first / DB_CHUNK_WIDTH)
+	{
+	  c->hour_loaded = false;
+	}
+    }
+  gorilla_encoder_reset (&c->samples);
+  if (ret != SQLITE_DONE)
+    {
+      PRINT_ERROR ("ERROR inserting chunk: %s\n",
+		   sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+static int
+chunk_flush_all (DbPlugin * db)
+{
+  int status = ATMOTUBE_RET_OK;
+  int device, metric;
+
+  if (db->chunks == NULL)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  for (device = 0; device < db->num_devices; device++)
+    {
+      for (metric = 0; metric < DB_METRICS; metric++)
+	{
+	  if (chunk_of (db, device, metric)->samples.count > 0
+	      && (begin_transaction (db) != ATMOTUBE_RET_OK
+		  || chunk_flush (db, device, metric) != ATMOTUBE_RET_OK))
+	    {
+	      status = ATMOTUBE_RET_ERROR;
+	    }
+	}
+    }
+
+  return status;
+}
+
+/* What is known of the chunks of the file is dropped when it is
+ * closed. */
+static void
+chunk_forget (DbPlugin * db)
+{
+  size_t i;
+
+  for (i = 0; db->chunks != NULL
+       && i < (size_t) db->num_devices * DB_METRICS; i++)
+    {
+      db->chunks[i].last_known = false;
+      db->chunks[i].hour_loaded = false;
+    }
+}
+
+static int
+compare_times (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Load the times of the samples stored for the hour of ts. */
+static int
+chunk_load_hour (DbPlugin * db, int device, int metric, uint64_t ts)
+{
+  DbChunk *c = chunk_of (db, device, metric);
+  sqlite3_stmt *stmt = db->statements[SQLS_GET_CHUNKS];
+  uint64_t hour = ts / DB_CHUNK_WIDTH;
+  int ret;
+
+  sqlite3_reset (stmt);
+  sqlite3_bind_int64 (stmt, 1, db->device_row_ids[device]);
+  sqlite3_bind_int (stmt, 2, metric);
+  sqlite3_bind_int64 (stmt, 3, (sqlite3_int64) (hour * DB_CHUNK_WIDTH));
+  sqlite3_bind_int64 (stmt, 4,
+		      (sqlite3_int64) ((hour + 1) * DB_CHUNK_WIDTH));
+
+  c->stored_count = 0;
+  while ((ret = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      uint32_t count = (uint32_t) sqlite3_column_int (stmt, 0);
+      const void *data = sqlite3_column_blob (stmt, 1);
+      size_t size = (size_t) sqlite3_column_bytes (stmt, 1);
+      GorillaDecoder dec;
+      uint64_t t;
+      double value;
+
+      if (c->stored_count + count > c->stored_alloc)
+	{
+	  size_t alloc = 2 * c->stored_alloc;
+	  if (alloc < c->stored_count + count)
+	    {
+	      alloc = c->stored_count + count;
+	    }
+	  uint64_t *times = (uint64_t *) realloc (c->stored_times,
+						  alloc * sizeof (uint64_t));
+	  if (times == NULL)
+	    {
+	      sqlite3_reset (stmt);
+	      return ATMOTUBE_RET_ERROR;
+	    }
+	  c->stored_times = times;
+	  c->stored_alloc = alloc;
+	}
+
+      gorilla_decoder_init (&dec, data, size, count);
+      while (c->stored_count < c->stored_alloc
+	     && gorilla_next (&dec, &t, &value))
+	{
+	  c->stored_times[c->stored_count++] = t;
+	}
+    }
+  sqlite3_reset (stmt);
+  if (ret != SQLITE_DONE)
+    {
+      PRINT_ERROR ("ERROR reading chunks: %s\n",
+		   sqlite3_errmsg (db->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* Late samples have chunks of their own, out of order. */
+  qsort (c->stored_times, c->stored_count, sizeof (uint64_t),
+	 compare_times);
+  c->stored_hour = hour;
+  c->hour_loaded = true;
+  return ATMOTUBE_RET_OK;
+}
+
+/* Whether a sample at ts is already in the chunks table. Samples after
+ * the latest one stored, as they come when ingesting live, are told
+ * without a lookup; others load the samples of their hour, once for
+ * all the samples of the hour when replaying. */
+static int
+chunk_stored (DbPlugin * db, int device, int metric, uint64_t ts,
+	      bool *stored)
+{
+  DbChunk *c = chunk_of (db, device, metric);
+
+  *stored = false;
+  if (!c->last_known)
+    {
+      sqlite3_stmt *stmt = db->statements[SQLS_LAST_CHUNK];
+
+      sqlite3_reset (stmt);
+      sqlite3_bind_int64 (stmt, 1, db->device_row_ids[device]);
+      sqlite3_bind_int (stmt, 2, metric);
+      if (sqlite3_step (stmt) != SQLITE_ROW)
+	{
+	  PRINT_ERROR ("ERROR reading chunks: %s\n",
+		       sqlite3_errmsg (db->handle));
+	  sqlite3_reset (stmt);
+	  return ATMOTUBE_RET_ERROR;
+	}
+      c->has_stored = sqlite3_column_type (stmt, 0) != SQLITE_NULL;
+      c->stored_last = (uint64_t) sqlite3_column_int64 (stmt, 0);
+      c->last_known = true;
+      sqlite3_reset (stmt);
+    }
+
+  if (!c->has_stored || ts > c->stored_last)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  if ((!c->hour_loaded || c->stored_hour != ts / DB_CHUNK_WIDTH)
+      && chunk_load_hour (db, device, metric, ts) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  *stored = bsearch (&ts, c->stored_times, c->stored_count,
+		     sizeof (uint64_t), compare_times) != NULL;
+  return ATMOTUBE_RET_OK;
+}
+
+/* Add one sample to the chunks of its device and metric. A sample
+ * already stored is skipped, with db->duplicate set. */
+static int
+chunk_add (DbPlugin * db, int device, int metric, uint64_t ts, double value)
+{
+  if (device < 0 || device >= db->num_devices)
+    {
+      PRINT_ERROR ("Unknown device: %d\n", device);
+      return ATMOTUBE_RET_ERROR;
+    }
+  if (metric < 0 || metric >= DB_METRICS)
+    {
+      PRINT_ERROR ("Unknown metric: %d\n", metric);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  DbChunk *c = chunk_of (db, device, metric);
+  bool stored;
+
+  /* A sample which is not after the open chunk is late, or was seen
+   * already. The open chunk is written first, so that it is looked up
+   * with the others. */
+  bool late = c->samples.count > 0 && ts <= c->last;
+  if (c->samples.count > 0
+      && (late || ts / DB_CHUNK_WIDTH != c->first / DB_CHUNK_WIDTH
+	  || c->samples.count == DB_CHUNK_SAMPLES)
+      && chunk_flush (db, device, metric) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  if (chunk_stored (db, device, metric, ts, &stored) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+  if (stored)
+    {
+      db->duplicate = true;
+      return ATMOTUBE_RET_OK;
+    }
+
+  if (c->samples.count == 0)
+    {
+      c->first = ts;
+      c->min = c->max = value;
+    }
+  if (!gorilla_append (&c->samples, ts, value))
+    {
+      PRINT_ERROR ("Out of memory for chunk of device %d\n", device);
+      return ATMOTUBE_RET_ERROR;
+    }
+  c->last = ts;
+  if (value < c->min)
+    {
+      c->min = value;
+    }
+  if (value > c->max)
+    {
+      c->max = value;
+    }
+
+  /* The later samples start a new chunk again. */
+  if (late)
+    {
+      return chunk_flush (db, device, metric);
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Insert one sample, value in the stored unit, within the transaction
+ * of its file, without committing. db->locked tells whether a failure
+ * was because of a lock, in which case nothing was written. */
+static int
+put_row (DbPlugin * db, int device, int metric, uint64_t ts, double value,
+	 bool rollup)
+{
+  db->locked = false;
+  db->duplicate = false;
+  if (select_partition (db, ts) != ATMOTUBE_RET_OK
+      || begin_transaction (db) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  db->pending++;
+  int ret = (db->storage == ATMOTUBE_STORAGE_CHUNKS) ?
+    chunk_add (db, device, metric, ts, value)
+    : insert_row (db, device, metric, ts, value);
+  if (ret != ATMOTUBE_RET_OK)
+    {
+      db->pending--;
+      if (db->locked && sqlite3_get_autocommit (db->handle))
+	{
+	  /* SQLite gave up the transaction. */
+	  PRINT_ERROR ("DB %s is locked, %d rows are lost\n", db->filename,
+		       db->pending);
+	  db->in_transaction = false;
+	}
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* A replayed sample is counted once. */
+  if (db->duplicate)
+    {
+      PRINT_DEBUG ("Sample at %" PRIu64 " already stored\n", ts);
+      return ATMOTUBE_RET_OK;
+    }
+
+  return rollup ? rollup_add (db, device, metric, ts, value)
+    : ATMOTUBE_RET_OK;
+}
+
+/* Spool. Records are only ever appended, and read back in order from
+ * spool_read. The file is removed once all have been read, one left
+ * at stop is read back on the next start. */
+
+static void
+spool_update_stats (DbPlugin * db)
+{
+  __atomic_store_n (&db->spool_stats.bytes, db->spool_size - db->spool_read,
+		    __ATOMIC_RELAXED);
+  __atomic_store_n (&db->spool_stats.pending,
+		    (db->spool_size - db->spool_read) /
+		    sizeof (DbSpoolRecord), __ATOMIC_RELAXED);
+}
+
+static int
+spool_append (DbPlugin * db, int device, int metric, uint64_t ts,
+	      double value, int flags)
+{
+  DbSpoolRecord r = { ts, value, device, (uint16_t) metric,
+    (uint16_t) flags
+  };
+
+  if (db->spool_name == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+  if (db->spool_fd < 0)
+    {
+      db->spool_fd = open (db->spool_name, O_RDWR | O_APPEND | O_CREAT,
+			   0644);
+      if (db->spool_fd < 0)
+	{
+	  PRINT_ERROR ("Failed to open spool %s: %s\n", db->spool_name,
+		       strerror (errno));
+	  return ATMOTUBE_RET_ERROR;
+	}
+    }
+  if (db->spool_size == db->spool_read)
+    {
+      PRINT_ERROR ("DB %s is locked, spooling to %s\n", db->filename,
+		   db->spool_name);
+    }
+
+  if (write (db->spool_fd, &r, sizeof (r)) != (ssize_t) sizeof (r))
+    {
+      PRINT_ERROR ("Failed to write spool %s: %s\n", db->spool_name,
+		   strerror (errno));
+      /* No torn record is left for the next ones to follow. */
+      if (ftruncate (db->spool_fd, (off_t) db->spool_size) != 0)
+	{
+	  PRINT_ERROR ("Failed to truncate spool %s\n", db->spool_name);
+	}
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  db->spool_size += sizeof (r);
+  __atomic_fetch_add (&db->spool_stats.spooled, 1, __ATOMIC_RELAXED);
+  spool_update_stats (db);
+  return ATMOTUBE_RET_OK;
+}
+
+/* Open the spool left by a previous run, if any. */
+static void
+spool_open (DbPlugin * db)
+{
+  db->spool_fd = open (db->spool_name, O_RDWR | O_APPEND);
+  if (db->spool_fd < 0)
+    {
+      return;
+    }
+
+  off_t size = lseek (db->spool_fd, 0, SEEK_END);
+  if (size < 0)
+    {
+      size = 0;
+    }
+  db->spool_size = (uint64_t) size - (uint64_t) size % sizeof (DbSpoolRecord);
+  db->spool_read = 0;
+  spool_update_stats (db);
+  PRINT_DEBUG ("Spool %s holds %" PRIu64 " rows\n", db->spool_name,
+	       db->spool_size / sizeof (DbSpoolRecord));
+}
+
+/* Commit the rows read from the spool up to offset. They only count
+ * as written once committed, a commit deferred because of a lock
+ * leaves them in the spool. Those of them which end up committed with
+ * the transaction are skipped as already stored when read again. */
+static int
+spool_commit (DbPlugin * db, uint64_t offset, uint64_t * drained)
+{
+  if (commit_transaction (db) != ATMOTUBE_RET_OK || db->in_transaction)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  *drained += (offset - db->spool_read) / sizeof (DbSpoolRecord);
+  db->spool_read = offset;
+  return ATMOTUBE_RET_OK;
+}
+
+/* Write the spooled rows to the database, in transactions of up to
+ * DB_SPOOL_COMMIT rows. Returns ATMOTUBE_RET_ERROR while the database
+ * is still locked, with the rows not committed left in the spool. */
+static int
+spool_drain (DbPlugin * db, bool wait)
+{
+  DbSpoolRecord records[DB_SPOOL_READ];
+  uint64_t start = now_ns ();
+  uint64_t offset = db->spool_read;
+  uint64_t drained = 0;
+  int status = ATMOTUBE_RET_OK;
+
+  if (db->spool_read == db->spool_size)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+  if (!wait && start < db->spool_retry)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  while (status == ATMOTUBE_RET_OK && offset < db->spool_size)
+    {
+      ssize_t n = pread (db->spool_fd, records, sizeof (records),
+			 (off_t) offset);
+      if (n < (ssize_t) sizeof (DbSpoolRecord))
+	{
+	  PRINT_ERROR ("Failed to read spool %s\n", db->spool_name);
+	  status = ATMOTUBE_RET_ERROR;
+	  break;
+	}
+
+      size_t i;
+      for (i = 0; i < (size_t) n / sizeof (DbSpoolRecord); i++)
+	{
+	  const DbSpoolRecord *r = &records[i];
+	  if (put_row (db, r->device, r->metric, r->ts, r->value,
+		       !(r->flags & DB_SPOOL_ROLLED_UP)) != ATMOTUBE_RET_OK)
+	    {
+	      if (db->locked)
+		{
+		  status = ATMOTUBE_RET_ERROR;
+		  break;
+		}
+	      __atomic_fetch_add (&db->spool_stats.dropped, 1,
+				  __ATOMIC_RELAXED);
+	    }
+	  offset += sizeof (DbSpoolRecord);
+	  if (db->pending >= DB_SPOOL_COMMIT
+	      && spool_commit (db, offset, &drained) != ATMOTUBE_RET_OK)
+	    {
+	      status = ATMOTUBE_RET_ERROR;
+	      break;
+	    }
+	}
+    }
+  if (offset > db->spool_read
+      && spool_commit (db, offset, &drained) != ATMOTUBE_RET_OK)
+    {
+      status = ATMOTUBE_RET_ERROR;
+    }
+
+  uint64_t elapsed = now_ns () - start;
+  __atomic_fetch_add (&db->spool_stats.drained, drained, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&db->spool_stats.drain_ns, elapsed, __ATOMIC_RELAXED);
+  if (drained > 0 && elapsed > 0)
+    {
+      __atomic_store_n (&db->spool_stats.drain_rate,
+			drained * DB_NS_PER_SEC / elapsed, __ATOMIC_RELAXED);
+    }
+
+  if (status != ATMOTUBE_RET_OK || db->spool_read < db->spool_size)
+    {
+      status = ATMOTUBE_RET_ERROR;
+      db->spool_retry = now_ns () + DB_SPOOL_RETRY;
+    }
+  else
+    {
+      PRINT_DEBUG ("Spool %s drained, %" PRIu64 " rows\n", db->spool_name,
+		   drained);
+      close (db->spool_fd);
+      unlink (db->spool_name);
+      db->spool_fd = -1;
+      db->spool_read = db->spool_size = 0;
+    }
+  spool_update_stats (db);
+  return status;
+}
+
+/* Write one sample, or spool it when the database is locked. Rows
+ * already spooled go first. */
+static int
+write_row (DbPlugin * db, int device, int metric, uint64_t ts, double value)
+{
+  /* Rounded to the stored unit once, so that rows, chunks and rollups
+   * hold the same integers. */
+  if (metric == VOC)
+    {
+      double scaled = value * db->voc_factor;
+      value = (double) (int64_t) (scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+    }
+
+  if (spool_drain (db, false) != ATMOTUBE_RET_OK)
+    {
+      return spool_append (db, device, metric, ts, value, 0);
+    }
+
+  if (put_row (db, device, metric, ts, value, true) != ATMOTUBE_RET_OK)
+    {
+      return db->locked ? spool_append (db, device, metric, ts, value, 0)
+	: ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+static int
+write_sample (DbPlugin * db, int device, int metric, uint64_t ts,
+	      double value)
+{
+  int status = write_row (db, device, metric, ts, value);
+  if (commit_due (db) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return status;
+}
+
+int
+temperature (void *ctx, uint64_t ts, int device, unsigned long value)
+{
+  DbPlugin *db = (DbPlugin *) ctx;
+
+  PRINT_DEBUG ("Writing temperature to db(%u): %" PRIu64 ",%lu\n", db->started,
+	       ts, value);
+
+  if (db->started)
+    {
+      return write_sample (db, device, TEMPERATURE, ts, value);
+    }
+
+  return ATMOTUBE_RET_ERROR;
+}
+
+int
+get_humidity (DbPlugin * db, int device, uint64_t ts, unsigned long *value)
+{
+  sqlite3_stmt *stmt = find_sample (db, device, HUMIDITY, ts);
+  if (stmt == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  *value = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+  return ATMOTUBE_RET_OK;
+}
+
+int
+humidity (void *ctx, uint64_t ts, int device, unsigned long value)
+{
+  DbPlugin *db = (DbPlugin *) ctx;
+
+  PRINT_DEBUG ("Writing humidity to db(%u): %" PRIu64 ",%lu\n", db->started,
+	       ts, value);
+
+  if (db->started)
+    {
+      return write_sample (db, device, HUMIDITY, ts, value);
+    }
+
+  return ATMOTUBE_RET_ERROR;
+}
+
+int
+get_voc (DbPlugin * db, int device, uint64_t ts, float *value)
+{
+  sqlite3_stmt *stmt = find_sample (db, device, VOC, ts);
+  if (stmt == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  *value = sqlite3_column_double (stmt, 0) / ATMOTUBE_VOC_SCALE;
+  sqlite3_reset (stmt);
+  return ATMOTUBE_RET_OK;
+}
+
+int
+voc (void *ctx, uint64_t ts, int device, float value)
+{
+  DbPlugin *db = (DbPlugin *) ctx;
+
+  PRINT_DEBUG ("Writing voc to db(%u): %" PRIu64 ",%f\n", db->started,
+	       ts, value);
+
+  if (db->started)
+    {
+      return write_sample (db, device, VOC, ts, value);
+    }
+
+  return ATMOTUBE_RET_ERROR;
+}
+
+int
+write_batch (void *ctx, size_t n, const uint64_t ts[], const int device[],
+	     const int metric[], const double value[])
+{
+  DbPlugin *db = (DbPlugin *) ctx;
+  size_t i;
+
+  PRINT_DEBUG ("Writing %zu records to db(%u)\n", n, db->started);
+
+  if (!db->started)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* A failing row does not take the rest of the batch with it, same
+   * as when rows are written one by one. */
+  int status = ATMOTUBE_RET_OK;
+  for (i = 0; i < n; i++)
+    {
+      if (write_row (db, device[i], metric[i], ts[i], value[i]) !=
+	  ATMOTUBE_RET_OK)
+	{
+	  status = ATMOTUBE_RET_ERROR;
+	}
+    }
+
+  if (commit_due (db) != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return status;
+}
+
+int
+plugin_flush (void *ctx)
+{
+  DbPlugin *db = (DbPlugin *) ctx;
+
+  if (!db->started)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* Fails while the database is still locked, the rows then wait in
+   * the spool for the next try. */
+  spool_drain (db, false);
+  return commit_due (db);
+}
+
+int
+db_plugin_spool_stats (DbPlugin * db, DbSpoolStats * stats)
+{
+  stats->pending = __atomic_load_n (&db->spool_stats.pending,
+				    __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n (&db->spool_stats.bytes, __ATOMIC_RELAXED);
+  stats->spooled = __atomic_load_n (&db->spool_stats.spooled,
+				    __ATOMIC_RELAXED);
+  stats->drained = __atomic_load_n (&db->spool_stats.drained,
+				    __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n (&db->spool_stats.dropped,
+				    __ATOMIC_RELAXED);
+  stats->drain_ns = __atomic_load_n (&db->spool_stats.drain_ns,
+				     __ATOMIC_RELAXED);
+  stats->drain_rate = __atomic_load_n (&db->spool_stats.drain_rate,
+				       __ATOMIC_RELAXED);
+  return ATMOTUBE_RET_OK;
+}
+
+/* Read side. A reader has its own connection, to an in-memory main
+ * database with the partitions of interest attached read-only. With
+ * WAL, readers and the writer never wait for each other. Connections
+ * are used by one thread at a time, so they go without SQLite's per
+ * call mutex as well. */
+struct DbReader_S
+{
+  sqlite3 *handle;
+  int num_partitions;
+  /* Where the connection goes back to when closed, if any. */
+  DbPool *pool;
+};
+
+/* Connections kept open for readers, idle ones on a stack. */
+struct DbPool_S
+{
+  char *file_name;
+  Atmotube_Partition partition;
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  int size;
+  int num_idle;
+  sqlite3 **idle;
+};
+
+static int
+open_reader_handle (sqlite3 ** handle)
+{
+  if (sqlite3_open_v2 (":memory:", handle,
+		       SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_READWRITE |
+		       SQLITE_OPEN_URI, NULL) != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to open reader: %s\n", sqlite3_errmsg (*handle));
+      sqlite3_close (*handle);
+      *handle = NULL;
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Attach file_name as partition n of the reader. */
+static int
+attach_partition (DbReader * reader, const char *file_name)
+{
+  if (access (file_name, F_OK) != 0)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  if (reader->num_partitions ==
+      sqlite3_limit (reader->handle, SQLITE_LIMIT_ATTACHED, -1))
+    {
+      PRINT_ERROR ("Too many partitions to attach %s\n", file_name);
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  /* A read-only URI, with the characters URIs give a meaning to
+   * escaped in the file name. */
+  sqlite3_str *uri = sqlite3_str_new (reader->handle);
+  const char *c;
+
+  sqlite3_str_appendall (uri, "file:");
+  for (c = file_name; *c != '\0'; c++)
+    {
+      if (*c == '%' || *c == '?' || *c == '#')
+	{
+	  sqlite3_str_appendf (uri, "%%%02X", (unsigned char) *c);
+	}
+      else
+	{
+	  sqlite3_str_appendchar (uri, 1, *c);
+	}
+    }
+  sqlite3_str_appendall (uri, "?mode=ro");
+
+  char *uri_name = sqlite3_str_finish (uri);
+  char *sql = uri_name != NULL ?
+    sqlite3_mprintf ("ATTACH %Q AS p%d;", uri_name,
+		     reader->num_partitions) : NULL;
+  sqlite3_free (uri_name);
+  int ret = sql != NULL ? sqlite3_exec (reader->handle, sql, NULL, NULL,
+					NULL) : SQLITE_NOMEM;
+  sqlite3_free (sql);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to attach %s: %s\n", file_name,
+		   sqlite3_errmsg (reader->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  reader->num_partitions++;
+  return ATMOTUBE_RET_OK;
+}
+
+/* The samples of all attached partitions within [t0, t1). Device row
+ * ids are per file, so devices are given by name and address. */
+static int
+create_range_view (DbReader * reader, uint64_t t0, uint64_t t1)
+{
+  char *sql = sqlite3_mprintf ("CREATE TEMP VIEW range_samples AS ");
+  int i;
+
+  for (i = 0; i < reader->num_partitions && sql != NULL; i++)
+    {
+      char *next =
+	sqlite3_mprintf ("%s%sSELECT d.name AS name, d.address AS address, "
+			 "s.metric_id AS metric_id, s.time AS time, "
+			 "CASE s.metric_id WHEN %d THEN s.value / %d.0 "
+			 "ELSE s.value END AS value FROM p%d.samples s "
+			 "JOIN p%d.device d ON d.id = s.device_id "
+			 "WHERE s.time >= %lld AND s.time < %lld", sql,
+			 i > 0 ? " UNION ALL " : "", VOC, ATMOTUBE_VOC_SCALE,
+			 i, i, (long long) t0, (long long) t1);
+      sqlite3_free (sql);
+      sql = next;
+    }
+
+  if (sql != NULL && reader->num_partitions == 0)
+    {
+      char *next = sqlite3_mprintf ("%sSELECT NULL AS name, NULL AS address, "
+				    "NULL AS metric_id, NULL AS time, "
+				    "NULL AS value WHERE 0", sql);
+      sqlite3_free (sql);
+      sql = next;
+    }
+
+  int ret = sql != NULL ? sqlite3_exec (reader->handle, sql, NULL, NULL,
+					NULL) : SQLITE_NOMEM;
+  sqlite3_free (sql);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to create the range view: %s\n",
+		   sqlite3_errmsg (reader->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return ATMOTUBE_RET_OK;
+}
+
+/* Attach the partitions of file_name overlapping [t0, t1) and create
+ * the range view. */
+static int
+reader_attach (DbReader * reader, const char *file_name,
+	       Atmotube_Partition partition, uint64_t t0, uint64_t t1)
+{
+  int ret = ATMOTUBE_RET_OK;
+
+  if (partition == ATMOTUBE_PARTITION_NONE)
+    {
+      ret = attach_partition (reader, file_name);
+    }
+  else if (t1 > t0)
+    {
+      int64_t key;
+      int64_t last = partition_of (partition, t1 - 1);
+
+      /* Only the partitions overlapping the range. */
+      for (key = partition_of (partition, t0);
+	   key <= last && ret == ATMOTUBE_RET_OK; key++)
+	{
+	  char *name = partition_file (file_name, partition, key);
+	  ret = name != NULL ? attach_partition (reader, name)
+	    : ATMOTUBE_RET_ERROR;
+	  sqlite3_free (name);
+	}
+    }
+
+  if (ret != ATMOTUBE_RET_OK)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  return create_range_view (reader, t0, t1);
+}
+
+DbReader *
+db_reader_open (const char *file_name, Atmotube_Partition partition,
+		uint64_t t0, uint64_t t1)
+{
+  DbReader *reader = (DbReader *) calloc (1, sizeof (DbReader));
+  if (reader == NULL)
+    {
+      return NULL;
+    }
+
+  if (open_reader_handle (&reader->handle) != ATMOTUBE_RET_OK
+      || reader_attach (reader, file_name, partition, t0,
+			t1) != ATMOTUBE_RET_OK)
+    {
+      db_reader_close (reader);
+      return NULL;
+    }
+
+  return reader;
+}
+
+struct sqlite3 *
+db_reader_handle (DbReader * reader)
+{
+  return reader->handle;
+}
+
+int
+db_reader_partitions (DbReader * reader)
+{
+  return reader->num_partitions;
+}
+
+void
+db_reader_close (DbReader * reader)
+{
+  if (reader == NULL)
+    {
+      return;
+    }
+
+  if (reader->pool == NULL)
+    {
+      sqlite3_close (reader->handle);
+      free (reader);
+      return;
+    }
+
+  /* Back to the pool, as new. */
+  DbPool *pool = reader->pool;
+  int i;
+  int ret = sqlite3_exec (reader->handle,
+			  "DROP VIEW IF EXISTS temp.range_samples;", NULL,
+			  NULL, NULL);
+  for (i = 0; i < reader->num_partitions && ret == SQLITE_OK; i++)
+    {
+      char *sql = sqlite3_mprintf ("DETACH p%d;", i);
+      ret = sql != NULL ? sqlite3_exec (reader->handle, sql, NULL, NULL,
+					NULL) : SQLITE_NOMEM;
+      sqlite3_free (sql);
+    }
+  if (ret != SQLITE_OK)
+    {
+      /* Replace the connection rather than keep it half detached. */
+      PRINT_ERROR ("Failed to reset reader: %s\n",
+		   sqlite3_errmsg (reader->handle));
+      sqlite3_close (reader->handle);
+      open_reader_handle (&reader->handle);
+    }
+
+  pthread_mutex_lock (&pool->lock);
+  if (reader->handle != NULL)
+    {
+      pool->idle[pool->num_idle++] = reader->handle;
+    }
+  else
+    {
+      /* One connection less from now on. */
+      pool->size--;
+    }
+  pthread_cond_signal (&pool->released);
+  pthread_mutex_unlock (&pool->lock);
+  free (reader);
+}
+
+DbPool *
+db_pool_open (const char *file_name, Atmotube_Partition partition,
+	      int size)
+{
+  DbPool *pool = (DbPool *) calloc (1, sizeof (DbPool));
+  if (pool == NULL)
+    {
+      return NULL;
+    }
+
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->released, NULL);
+  pool->partition = partition;
+  pool->file_name = strdup (file_name);
+  pool->idle = (sqlite3 **) calloc (size > 0 ? size : 1, sizeof (sqlite3 *));
+  if (size <= 0 || pool->file_name == NULL || pool->idle == NULL)
+    {
+      db_pool_close (pool);
+      return NULL;
+    }
+
+  for (pool->size = 0; pool->size < size; pool->size++)
+    {
+      if (open_reader_handle (&pool->idle[pool->size]) != ATMOTUBE_RET_OK)
+	{
+	  db_pool_close (pool);
+	  return NULL;
+	}
+      pool->num_idle++;
+    }
+
+  return pool;
+}
+
+DbReader *
+db_pool_acquire (DbPool * pool, uint64_t t0, uint64_t t1)
+{
+  DbReader *reader = (DbReader *) calloc (1, sizeof (DbReader));
+  if (reader == NULL)
+    {
+      return NULL;
+    }
+
+  pthread_mutex_lock (&pool->lock);
+  while (pool->num_idle == 0 && pool->size > 0)
+    {
+      pthread_cond_wait (&pool->released, &pool->lock);
+    }
+  if (pool->num_idle > 0)
+    {
+      reader->handle = pool->idle[--pool->num_idle];
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  if (reader->handle == NULL)
+    {
+      PRINT_ERROR ("No connection left in the pool of %s\n",
+		   pool->file_name);
+      free (reader);
+      return NULL;
+    }
+
+  reader->pool = pool;
+  if (reader_attach (reader, pool->file_name, pool->partition, t0, t1) !=
+      ATMOTUBE_RET_OK)
+    {
+      db_reader_close (reader);
+      return NULL;
+    }
+
+  return reader;
+}
+
+void
+db_pool_close (DbPool * pool)
+{
+  int i;
+
+  if (pool == NULL)
+    {
+      return;
+    }
+
+  for (i = 0; i < pool->num_idle; i++)
+    {
+      sqlite3_close (pool->idle[i]);
+    }
+  pthread_cond_destroy (&pool->released);
+  pthread_mutex_destroy (&pool->lock);
+  free (pool->idle);
+  free (pool->file_name);
+  free (pool);
+}
+
+/* A range query reads the attached partitions one after the other,
+ * each with statements walking the primary keys of samples and then
+ * of chunks in time order, so no sort or result set is built. The
+ * samples of a chunk are decoded as they are returned. Buckets of
+ * samples are computed by the statement, and adjacent rows of a
+ * bucket merged here. */
+typedef enum
+{
+  RANGE_SAMPLES = 0,
+  RANGE_CHUNKS,
+  RANGE_STAGES
+} DbRangeStage;
+
+/* A chunk being decoded, with its next sample. */
+typedef struct
+{
+  GorillaDecoder dec;
+  void *data;
+  uint64_t ts;
+  double value;
+} DbRangeChunk;
+
+struct DbRange_S
+{
+  DbReader *reader;
+  DbRangeQuery query;
+  char *name;
+  char *address;
+  int partition;
+  DbRangeStage stage;
+  sqlite3_stmt *stmt;
+  bool prepared;
+  bool done;
+  /* Chunks being decoded, merged in time order. A late sample is
+   * stored as a chunk of its own inside the span of another, so the
+   * next row of stmt, starting at next_first, is only taken once no
+   * chunk being decoded has a sample before it. */
+  DbRangeChunk *chunks;
+  int num_chunks;
+  int max_chunks;
+  bool row_pending;
+  uint64_t next_first;
+  /* Bucket being aggregated, if any. */
+  bool have_row;
+  DbRangeRow row;
+  bool failed;
+};
+
+/* Prepare the statement of the current partition and stage, leaves
+ * stmt NULL when the partition has nothing for the stage. */
+static int
+prepare_range (DbRange * range)
+{
+  const DbRangeQuery *q = &range->query;
+  char schema[16];
+  char *sql;
+
+  snprintf (schema, sizeof (schema), "p%d", range->partition);
+  if (range->stage == RANGE_SAMPLES)
+    {
+      sql =
+	sqlite3_mprintf ("SELECT s.time / ?4 * ?4, s.value FROM %s.samples s "
+			 "JOIN %s.device d ON d.id = s.device_id "
+			 "WHERE d.name = ?1 AND d.address = ?2 "
+			 "AND s.metric_id = ?3 AND s.time >= ?5 "
+			 "AND s.time < ?6 ORDER BY s.time;", schema, schema);
+    }
+  else if (sqlite3_table_column_metadata (range->reader->handle, schema,
+					  "chunks", NULL, NULL, NULL, NULL,
+					  NULL, NULL) == SQLITE_OK)
+    {
+      /* Chunks do not span more than DB_CHUNK_WIDTH. */
+      sql =
+	sqlite3_mprintf ("SELECT c.data, c.count, c.first FROM %s.chunks c "
+			 "JOIN %s.device d ON d.id = c.device_id "
+			 "WHERE d.name = ?1 AND d.address = ?2 "
+			 "AND c.metric_id = ?3 AND c.first > ?5 - %lld "
+			 "AND c.first < ?6 AND c.last >= ?5 "
+			 "ORDER BY c.first;", schema, schema,
+			 (long long) DB_CHUNK_WIDTH);
+    }
+  else
+    {
+      /* Written before chunks. */
+      return ATMOTUBE_RET_OK;
+    }
+
+  int ret = sql != NULL ?
+    sqlite3_prepare_v2 (range->reader->handle, sql, -1, &range->stmt,
+			NULL) : SQLITE_NOMEM;
+  sqlite3_free (sql);
+  if (ret != SQLITE_OK)
+    {
+      PRINT_ERROR ("Failed to prepare range query: %s\n",
+		   sqlite3_errmsg (range->reader->handle));
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  sqlite3_bind_text (range->stmt, 1, range->name, -1, SQLITE_STATIC);
+  sqlite3_bind_text (range->stmt, 2, range->address, -1, SQLITE_STATIC);
+  sqlite3_bind_int (range->stmt, 3, q->metric);
+  if (range->stage == RANGE_SAMPLES)
+    {
+      sqlite3_bind_int64 (range->stmt, 4,
+			  (sqlite3_int64) (q->bucket > 0 ? q->bucket : 1));
+    }
+  sqlite3_bind_int64 (range->stmt, 5, (sqlite3_int64) q->t0);
+  sqlite3_bind_int64 (range->stmt, 6, (sqlite3_int64) q->t1);
+  return ATMOTUBE_RET_OK;
+}
+
+/* Read the next sample of chunk i, dropping the chunk after its
+ * last one. */
+static void
+range_chunk_next (DbRange * range, int i)
+{
+  DbRangeChunk *c = &range->chunks[i];
+
+  if (gorilla_next (&c->dec, &c->ts, &c->value))
+    {
+      return;
+    }
+
+  if (c->dec.read != c->dec.count)
+    {
+      PRINT_ERROR ("Truncated chunk in range\n");
+      range->failed = true;
+    }
+  free (c->data);
+  *c = range->chunks[--range->num_chunks];
+}
+
+/* Start decoding the chunk of the current row of stmt. */
+static int
+range_take_chunk (DbRange * range)
+{
+  if (range->num_chunks == range->max_chunks)
+    {
+      int max = range->max_chunks > 0 ? range->max_chunks * 2 : 4;
+      DbRangeChunk *chunks = (DbRangeChunk *) realloc (range->chunks,
+						       max *
+						       sizeof (DbRangeChunk));
+      if (chunks == NULL)
+	{
+	  return ATMOTUBE_RET_ERROR;
+	}
+      range->chunks = chunks;
+      range->max_chunks = max;
+    }
+
+  /* The blob only stays valid until the next step. */
+  size_t size = (size_t) sqlite3_column_bytes (range->stmt, 0);
+  DbRangeChunk *c = &range->chunks[range->num_chunks];
+  c->data = malloc (size > 0 ? size : 1);
+  if (c->data == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+  if (size > 0)
+    {
+      memcpy (c->data, sqlite3_column_blob (range->stmt, 0), size);
+    }
+
+  gorilla_decoder_init (&c->dec, c->data, size,
+			(uint32_t) sqlite3_column_int (range->stmt, 1));
+  range_chunk_next (range, range->num_chunks++);
+  return ATMOTUBE_RET_OK;
+}
+
+/* Index of the chunk with the earliest next sample, -1 if none. */
+static int
+range_first_chunk (const DbRange * range)
+{
+  int first = -1;
+
+  for (int i = 0; i < range->num_chunks; i++)
+    {
+      if (first < 0 || range->chunks[i].ts < range->chunks[first].ts)
+	{
+	  first = i;
+	}
+    }
+  return first;
+}
+
+static void
+range_next_stage (DbRange * range)
+{
+  sqlite3_finalize (range->stmt);
+  range->stmt = NULL;
+  range->prepared = false;
+  range->done = false;
+  if (++range->stage == RANGE_STAGES)
+    {
+      range->stage = RANGE_SAMPLES;
+      range->partition++;
+    }
+}
+
+/* The next sample of the range, with its time as bucket start. */
+static bool
+range_fetch (DbRange * range, uint64_t * time, double *value)
+{
+  const DbRangeQuery *q = &range->query;
+
+  while (!range->failed)
+    {
+      if (!range->prepared)
+	{
+	  if (range->partition == range->reader->num_partitions)
+	    {
+	      return false;
+	    }
+	  if (prepare_range (range) != ATMOTUBE_RET_OK)
+	    {
+	      range->failed = true;
+	      return false;
+	    }
+	  range->prepared = true;
+	}
+
+      if (!range->done && !range->row_pending)
+	{
+	  int ret = range->stmt != NULL ? sqlite3_step (range->stmt)
+	    : SQLITE_DONE;
+	  if (ret == SQLITE_DONE)
+	    {
+	      range->done = true;
+	    }
+	  else if (ret != SQLITE_ROW)
+	    {
+	      PRINT_ERROR ("Failed to read range: %s\n",
+			   sqlite3_errmsg (range->reader->handle));
+	      range->failed = true;
+	      return false;
+	    }
+	  else if (range->stage == RANGE_SAMPLES)
+	    {
+	      *time = (uint64_t) sqlite3_column_int64 (range->stmt, 0);
+	      *value = sqlite3_column_double (range->stmt, 1);
+	      if (q->metric == VOC)
+		{
+		  *value /= ATMOTUBE_VOC_SCALE;
+		}
+	      return true;
+	    }
+	  else
+	    {
+	      range->row_pending = true;
+	      range->next_first =
+		(uint64_t) sqlite3_column_int64 (range->stmt, 2);
+	    }
+	}
+
+      int first = range_first_chunk (range);
+      if (range->row_pending
+	  && (first < 0 || range->next_first <= range->chunks[first].ts))
+	{
+	  if (range_take_chunk (range) != ATMOTUBE_RET_OK)
+	    {
+	      PRINT_ERROR ("Failed to decode chunk in range\n");
+	      range->failed = true;
+	      return false;
+	    }
+	  range->row_pending = false;
+	  continue;
+	}
+
+      if (first < 0)
+	{
+	  range_next_stage (range);
+	  continue;
+	}
+
+      uint64_t ts = range->chunks[first].ts;
+      *value = range->chunks[first].value;
+      range_chunk_next (range, first);
+      if (ts < q->t0 || ts >= q->t1)
+	{
+	  continue;
+	}
+      *time = q->bucket > 0 ? ts / q->bucket * q->bucket : ts;
+      if (q->metric == VOC)
+	{
+	  *value /= ATMOTUBE_VOC_SCALE;
+	}
+      return true;
+    }
+
+  return false;
+}
+
+/* A range over reader, which it closes. */
+static DbRange *
+range_create (DbReader * reader, const DbRangeQuery * query)
+{
+  if (reader == NULL)
+    {
+      return NULL;
+    }
+
+  DbRange *range = (DbRange *) calloc (1, sizeof (DbRange));
+  if (range == NULL)
+    {
+      db_reader_close (reader);
+      return NULL;
+    }
+
+  range->reader = reader;
+  range->query = *query;
+  range->name = strdup (query->name);
+  range->address = strdup (query->address);
+  if (range->name == NULL || range->address == NULL)
+    {
+      db_range_close (range);
+      return NULL;
+    }
+
+  return range;
+}
+
+DbRange *
+db_range_open (const char *file_name, Atmotube_Partition partition,
+	       const DbRangeQuery * query)
+{
+  return range_create (db_reader_open (file_name, partition, query->t0,
+				       query->t1), query);
+}
+
+DbRange *
+db_pool_range (DbPool * pool, const DbRangeQuery * query)
+{
+  return range_create (db_pool_acquire (pool, query->t0, query->t1),
+		       query);
+}
+
+bool
+db_range_next (DbRange * range, DbRangeRow * row)
+{
+  uint64_t time;
+  double value;
+
+  while (range_fetch (range, &time, &value))
+    {
+      DbRangeRow *r = &range->row;
+
+      if (range->have_row && time == r->time)
+	{
+	  r->count++;
+	  r->sum += value;
+	  if (value < r->min)
+	    {
+	      r->min = value;
+	    }
+	  if (value > r->max)
+	    {
+	      r->max = value;
+	    }
+	  continue;
+	}
+
+      bool done = range->have_row;
+      if (done)
+	{
+	  *row = *r;
+	}
+      r->time = time;
+      r->count = 1;
+      r->min = r->max = r->sum = value;
+      range->have_row = true;
+      if (done)
+	{
+	  return true;
+	}
+    }
+
+  if (range->have_row && !range->failed)
+    {
+      *row = range->row;
+      range->have_row = false;
+      return true;
+    }
+
+  return false;
+}
+
+int
+db_range_close (DbRange * range)
+{
+  if (range == NULL)
+    {
+      return ATMOTUBE_RET_OK;
+    }
+
+  int ret = range->failed ? ATMOTUBE_RET_ERROR : ATMOTUBE_RET_OK;
+  sqlite3_finalize (range->stmt);
+  for (int i = 0; i < range->num_chunks; i++)
+    {
+      free (range->chunks[i].data);
+    }
+  free (range->chunks);
+  db_reader_close (range->reader);
+  free (range->name);
+  free (range->address);
+  free (range);
+  return ret;
+}
+
+int
+db_range_query (const char *file_name, Atmotube_Partition partition,
+		const DbRangeQuery * query, DbRangeCallback callback,
+		void *user)
+{
+  DbRange *range = db_range_open (file_name, partition, query);
+  DbRangeRow row;
+
+  if (range == NULL)
+    {
+      return ATMOTUBE_RET_ERROR;
+    }
+
+  while (db_range_next (range, &row))
+    {
+      if (callback (user, &row) != ATMOTUBE_RET_OK)
+	{
+	  break;
+	}
+    }
+
+  return db_range_close (range);
 }
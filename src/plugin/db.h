@@ -17,31 +17,197 @@
 #ifndef DB_H
 #define DB_H
 
+#include <stdbool.h>
+
 #include "atmotube-plugin-if.h"
 
-int db_plugin_setup_database (const char *file_name,
-			      const char *device_name,
-			      const char *device_address);
+#ifdef ATMOTUBE_BUILTIN_PLUGIN
+#define db_plugin_setup_database ATMOTUBE_PLUGIN_NAME(db_plugin_setup_database)
+#define db_plugin_create_tables ATMOTUBE_PLUGIN_NAME(db_plugin_create_tables)
+#define db_plugin_create_statements \
+  ATMOTUBE_PLUGIN_NAME(db_plugin_create_statements)
+#define db_plugin_destroy_statements \
+  ATMOTUBE_PLUGIN_NAME(db_plugin_destroy_statements)
+#define db_plugin_find_device ATMOTUBE_PLUGIN_NAME(db_plugin_find_device)
+#define db_plugin_insert_device ATMOTUBE_PLUGIN_NAME(db_plugin_insert_device)
+#define get_temperature ATMOTUBE_PLUGIN_NAME(get_temperature)
+#define get_humidity ATMOTUBE_PLUGIN_NAME(get_humidity)
+#define get_voc ATMOTUBE_PLUGIN_NAME(get_voc)
+#define db_plugin_spool_stats ATMOTUBE_PLUGIN_NAME(db_plugin_spool_stats)
+#define db_reader_open ATMOTUBE_PLUGIN_NAME(db_reader_open)
+#define db_reader_handle ATMOTUBE_PLUGIN_NAME(db_reader_handle)
+#define db_reader_partitions ATMOTUBE_PLUGIN_NAME(db_reader_partitions)
+#define db_reader_close ATMOTUBE_PLUGIN_NAME(db_reader_close)
+#define db_range_open ATMOTUBE_PLUGIN_NAME(db_range_open)
+#define db_range_next ATMOTUBE_PLUGIN_NAME(db_range_next)
+#define db_range_close ATMOTUBE_PLUGIN_NAME(db_range_close)
+#define db_range_query ATMOTUBE_PLUGIN_NAME(db_range_query)
+#define db_pool_open ATMOTUBE_PLUGIN_NAME(db_pool_open)
+#define db_pool_acquire ATMOTUBE_PLUGIN_NAME(db_pool_acquire)
+#define db_pool_close ATMOTUBE_PLUGIN_NAME(db_pool_close)
+#define db_pool_range ATMOTUBE_PLUGIN_NAME(db_pool_range)
+#endif
+
+/* State of one db plugin instance. */
+typedef struct DbPlugin_S DbPlugin;
+
+/* Open the database, returns NULL on error. The instance is freed by
+ * plugin_stop. */
+DbPlugin *db_plugin_setup_database (const char *file_name);
+
+/* Create the tables, or bring those of an existing database to the
+ * current schema version. */
+int db_plugin_create_tables (DbPlugin * db);
 
-int db_plugin_create_tables (void);
+int db_plugin_create_statements (DbPlugin * db);
 
-int db_plugin_create_statements (void);
+void db_plugin_destroy_statements (DbPlugin * db);
 
-void db_plugin_destroy_statements (void);
+int db_plugin_find_device (DbPlugin * db, const char *name,
+			   const char *address, int *id);
 
-int db_plugin_find_device (const char *name, const char *address, int *id);
+int db_plugin_insert_device (DbPlugin * db, const char *name,
+			     const char *address);
 
-int db_plugin_insert_device (const char *name, const char *address);
+/* Samples are keyed by device, metric and time. One already stored
+ * is skipped and the call succeeds, so that records can be delivered
+ * more than once. */
+int temperature (void *ctx, uint64_t ts, int device, unsigned long value);
 
-void temperature (unsigned long ts, unsigned long value);
+int humidity (void *ctx, uint64_t ts, int device, unsigned long value);
 
-void humidity (unsigned long ts, unsigned long value);
+int voc (void *ctx, uint64_t ts, int device, float value);
 
-void voc (unsigned long ts, float value);
+int write_batch (void *ctx, size_t n, const uint64_t ts[],
+		 const int device[], const int metric[],
+		 const double value[]);
+
+/* Commit the open transaction once it is commit_interval old, and
+ * write the spool back once the lock is gone, with or without new
+ * rows. */
+int plugin_flush (void *ctx);
 
 /* Used for unit testing. */
-int get_temperature (unsigned long ts, unsigned long *value);
-int get_humidity (unsigned long ts, unsigned long *value);
-int get_voc (unsigned long ts, float *value);
+int get_temperature (DbPlugin * db, int device, uint64_t ts,
+		     unsigned long *value);
+int get_humidity (DbPlugin * db, int device, uint64_t ts,
+		  unsigned long *value);
+int get_voc (DbPlugin * db, int device, uint64_t ts, float *value);
+
+/* Spool metrics. Rows the database refuses because another connection
+ * holds the lock are spooled to the output file name with .spool
+ * appended, and written back once the lock is gone. */
+typedef struct
+{
+  /* Rows waiting in the spool, and their size in bytes. */
+  uint64_t pending;
+  uint64_t bytes;
+  /* Rows spooled since start. */
+  uint64_t spooled;
+  /* Rows read back from the spool, and the time spent doing so in ns. */
+  uint64_t drained;
+  uint64_t drain_ns;
+  /* Rows read back which the database refused for another reason. */
+  uint64_t dropped;
+  /* Rows per second of the last drain. */
+  uint64_t drain_rate;
+} DbSpoolStats;
+
+/* Can be called from any thread. */
+int db_plugin_spool_stats (DbPlugin * db, DbSpoolStats * stats);
+
+/* Read access to the samples of an output between t0 and t1 (ns since
+ * the epoch, t1 excluded). Only the partitions overlapping the range
+ * are attached, read-only, as p0, p1, ... The samples are in the
+ * temporary view range_samples (name, address, metric_id, time,
+ * value), VOC in ppm. A reader is used by one thread at a time. */
+typedef struct DbReader_S DbReader;
+
+/* A fixed number of reader connections to an output, shared by
+ * threads. */
+typedef struct DbPool_S DbPool;
+
+struct sqlite3;
+
+/* file_name and partition as given to plugin_start. Returns NULL on
+ * error, or when the range spans more partitions than SQLite can
+ * attach. */
+DbReader *db_reader_open (const char *file_name,
+			  Atmotube_Partition partition, uint64_t t0,
+			  uint64_t t1);
+
+struct sqlite3 *db_reader_handle (DbReader * reader);
+
+/* Number of partitions attached. */
+int db_reader_partitions (DbReader * reader);
+
+/* Readers from a pool go back to it. */
+void db_reader_close (DbReader * reader);
+
+/* file_name and partition as given to plugin_start. Returns NULL on
+ * error. */
+DbPool *db_pool_open (const char *file_name, Atmotube_Partition partition,
+		      int size);
+
+/* A reader from the pool, as db_reader_open does. Waits for one to be
+ * closed when all are in use. */
+DbReader *db_pool_acquire (DbPool * pool, uint64_t t0, uint64_t t1);
+
+/* All readers of the pool must be closed first. */
+void db_pool_close (DbPool * pool);
+
+/* Range queries: the samples of one device and metric between t0 and
+ * t1 (ns since the epoch, t1 excluded), in time order. With a bucket
+ * width (ns) the samples are aggregated per bucket, buckets starting
+ * at multiples of the width since the epoch. Rows are read from the
+ * database as they are returned, whatever the size of the range.
+ * With chunk storage, samples which came late are returned after the
+ * chunk they should have been part of. */
+typedef struct
+{
+  const char *name;
+  const char *address;
+  int metric;
+  uint64_t t0;
+  uint64_t t1;
+  /* 0 for the samples themselves. */
+  uint64_t bucket;
+} DbRangeQuery;
+
+/* A sample, or a bucket of count samples starting at time. VOC is in
+ * ppm. */
+typedef struct
+{
+  uint64_t time;
+  uint64_t count;
+  double min;
+  double max;
+  double sum;
+} DbRangeRow;
+
+typedef struct DbRange_S DbRange;
+
+/* file_name and partition as given to plugin_start. The query is
+ * copied. Returns NULL on error. */
+DbRange *db_range_open (const char *file_name,
+			Atmotube_Partition partition,
+			const DbRangeQuery * query);
+
+/* The same with a reader from pool. */
+DbRange *db_pool_range (DbPool * pool, const DbRangeQuery * query);
+
+/* Returns false at the end of the range, or on error. */
+bool db_range_next (DbRange * range, DbRangeRow * row);
+
+/* Returns ATMOTUBE_RET_ERROR if reading the range failed. */
+int db_range_close (DbRange * range);
+
+/* Called per row, stops the query unless it returns ATMOTUBE_RET_OK. */
+typedef int (*DbRangeCallback) (void *user, const DbRangeRow * row);
+
+/* Run a query through callback. */
+int db_range_query (const char *file_name, Atmotube_Partition partition,
+		    const DbRangeQuery * query, DbRangeCallback callback,
+		    void *user);
 
 #endif /* DB_H */
@@ -17,89 +17,176 @@
 #include "file.h"
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include <atmotube.h>
 #include "atmotube-config.h"
 
-static bool started = false;
-static FILE *f = NULL;
 static const char *type = "file";
 
+/* State of one plugin instance. */
+typedef struct
+{
+  FILE *f;
+  /* Preallocated stdio buffer, so that writes do not allocate. */
+  char write_buffer[BUFSIZ];
+  /* Lines get a device column when several devices share the file. */
+  int num_devices;
+  const char **device_names;
+  /* VOC is written in ppm. */
+  double voc_scale;
+} FilePlugin;
+
+int
+get_plugin_abi_version (void)
+{
+  return ATMOTUBE_PLUGIN_ABI_VERSION;
+}
+
 const char *
 get_plugin_type (void)
 {
   return type;
 }
 
-int
-plugin_start (AtmotubeOutput * o)
+void *
+plugin_start (const AtmotubeOutput * o)
 {
   if (o->filename == NULL)
     {
       PRINT_ERROR ("%s\n", "plugin_start, no filename provided");
-      return ATMOTUBE_RET_ERROR;
+      return NULL;
     }
 
   PRINT_DEBUG ("plugin_start, opening file %s for appending\n", o->filename);
 
-  f = fopen (o->filename, "a");
-  if (f == NULL)
+  FilePlugin *p = (FilePlugin *) malloc (sizeof (FilePlugin));
+  if (p == NULL)
+    {
+      return NULL;
+    }
+
+  p->f = fopen (o->filename, "a");
+  if (p->f == NULL)
     {
       PRINT_ERROR ("plugin_start, unable to open file %s for appending\n",
 		   o->filename);
-      return ATMOTUBE_RET_ERROR;
+      free (p);
+      return NULL;
     }
 
-  started = true;
-  return ATMOTUBE_RET_OK;
+  setvbuf (p->f, p->write_buffer, _IOFBF, sizeof (p->write_buffer));
+
+  p->num_devices = o->num_devices;
+  p->device_names = o->device_names;
+  p->voc_scale = o->voc_scale > 0 ? o->voc_scale : 1;
+
+  return p;
 }
 
 int
-plugin_stop (void)
+plugin_stop (void *ctx)
 {
-  if (started)
+  FilePlugin *p = (FilePlugin *) ctx;
+
+  if (p == NULL)
     {
-      started = false;
-      fclose (f);
-      return ATMOTUBE_RET_OK;
+      PRINT_ERROR ("%s\n", "plugin_stop, invalid state");
+      return ATMOTUBE_RET_ERROR;
     }
 
-  PRINT_ERROR ("%s\n", "plugin_stop, invalid state");
-  return ATMOTUBE_RET_ERROR;
+  fclose (p->f);
+  free (p);
+  return ATMOTUBE_RET_OK;
 }
 
-void
-temperature (unsigned long ts, unsigned long value)
+static int
+flush_output (FilePlugin * p)
 {
-  PRINT_DEBUG ("Writing temperature to file(%u): %lu,%lu\n", started, ts,
-	       value);
-
-  if (started)
+  if (fflush (p->f) != 0)
     {
-      fprintf (f, "%lu,temperature,%lu\n", ts, value);
-      fflush (f);
+      PRINT_ERROR ("%s\n", "Unable to write to file");
+      return ATMOTUBE_RET_ERROR;
     }
+
+  return ATMOTUBE_RET_OK;
 }
 
-void
-humidity (unsigned long ts, unsigned long value)
+/* Names used in the file, indexed by enum CHARACTER_ID. */
+static const char *metric_names[CHARACTER_MAX] = {
+  "voc", "humidity", "temperature", "status"
+};
+
+/* Write one line: ts,[device,]metric,value */
+static void
+write_sample (FilePlugin * p, uint64_t ts, int device, int metric,
+	      double value)
 {
-  PRINT_DEBUG ("Writing humidity to file(%u): %lu,%lu\n", started, ts, value);
+  fprintf (p->f, "%" PRIu64 ",", ts);
 
-  if (started)
+  if (p->num_devices > 1)
     {
-      fprintf (f, "%lu,humidity,%lu\n", ts, value);
-      fflush (f);
+      fprintf (p->f, "%s,", p->device_names[device]);
     }
+
+  if (metric == VOC)
+    {
+      fprintf (p->f, "%s,%f\n", metric_names[metric], value / p->voc_scale);
+    }
+  else
+    {
+      fprintf (p->f, "%s,%lu\n", metric_names[metric],
+	       (unsigned long) value);
+    }
+}
+
+int
+temperature (void *ctx, uint64_t ts, int device, unsigned long value)
+{
+  FilePlugin *p = (FilePlugin *) ctx;
+
+  PRINT_DEBUG ("Writing temperature to file: %" PRIu64 ",%lu\n", ts, value);
+
+  write_sample (p, ts, device, TEMPERATURE, value);
+  return flush_output (p);
+}
+
+int
+humidity (void *ctx, uint64_t ts, int device, unsigned long value)
+{
+  FilePlugin *p = (FilePlugin *) ctx;
+
+  PRINT_DEBUG ("Writing humidity to file: %" PRIu64 ",%lu\n", ts, value);
+
+  write_sample (p, ts, device, HUMIDITY, value);
+  return flush_output (p);
+}
+
+int
+voc (void *ctx, uint64_t ts, int device, float value)
+{
+  FilePlugin *p = (FilePlugin *) ctx;
+
+  PRINT_DEBUG ("Writing voc to file: %" PRIu64 ",%f\n", ts, value);
+
+  write_sample (p, ts, device, VOC, value);
+  return flush_output (p);
 }
 
-void
-voc (unsigned long ts, float value)
+int
+write_batch (void *ctx, size_t n, const uint64_t ts[], const int device[],
+	     const int metric[], const double value[])
 {
-  PRINT_DEBUG ("Writing voc to file(%u): %lu,%f\n", started, ts, value);
+  FilePlugin *p = (FilePlugin *) ctx;
+  size_t i;
+
+  PRINT_DEBUG ("Writing %zu records to file\n", n);
 
-  if (started)
+  for (i = 0; i < n; i++)
     {
-      fprintf (f, "%lu,voc,%f\n", ts, value);
-      fflush (f);
+      write_sample (p, ts[i], device[i], metric[i], value[i]);
     }
+
+  /* One flush for the whole batch. */
+  return flush_output (p);
 }
@@ -0,0 +1,378 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "gorilla.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Delta of delta classes: a prefix of ones ended by a zero (none for
+ * the last class), then the value in as many bits. A zero delta of
+ * delta is the single bit 0. */
+#define GORILLA_DOD_CLASSES 5
+static const int dod_bits[GORILLA_DOD_CLASSES] = { 7, 9, 12, 32, 64 };
+
+static bool
+put_bits (GorillaEncoder * enc, uint64_t value, int n)
+{
+  size_t needed = (enc->bits + n + 7) / 8;
+  int i;
+
+  if (needed > enc->capacity)
+    {
+      size_t capacity = enc->capacity > 0 ? enc->capacity * 2 : 64;
+      while (capacity < needed)
+	{
+	  capacity *= 2;
+	}
+      uint8_t *data = (uint8_t *) realloc (enc->data, capacity);
+      if (data == NULL)
+	{
+	  return false;
+	}
+      memset (data + enc->capacity, 0, capacity - enc->capacity);
+      enc->data = data;
+      enc->capacity = capacity;
+    }
+
+  for (i = n - 1; i >= 0; i--)
+    {
+      if ((value >> i) & 1)
+	{
+	  enc->data[enc->bits / 8] |= (uint8_t) (0x80 >> (enc->bits % 8));
+	}
+      enc->bits++;
+    }
+
+  return true;
+}
+
+static bool
+get_bits (GorillaDecoder * dec, int n, uint64_t * value)
+{
+  int i;
+
+  if (dec->bits + n > dec->size * 8)
+    {
+      return false;
+    }
+
+  *value = 0;
+  for (i = 0; i < n; i++)
+    {
+      *value = (*value << 1)
+	| ((dec->data[dec->bits / 8] >> (7 - dec->bits % 8)) & 1);
+      dec->bits++;
+    }
+
+  return true;
+}
+
+static uint64_t
+double_bits (double value)
+{
+  uint64_t bits;
+  memcpy (&bits, &value, sizeof (bits));
+  return bits;
+}
+
+static double
+bits_double (uint64_t bits)
+{
+  double value;
+  memcpy (&value, &bits, sizeof (value));
+  return value;
+}
+
+static int
+leading_zeros (uint64_t x)
+{
+  return x == 0 ? 64 : __builtin_clzll (x);
+}
+
+static int
+trailing_zeros (uint64_t x)
+{
+  return x == 0 ? 64 : __builtin_ctzll (x);
+}
+
+void
+gorilla_encoder_init (GorillaEncoder * enc)
+{
+  memset (enc, 0, sizeof (*enc));
+}
+
+static bool
+put_dod (GorillaEncoder * enc, int64_t dod)
+{
+  int c;
+
+  if (dod == 0)
+    {
+      return put_bits (enc, 0, 1);
+    }
+
+  for (c = 0; c < GORILLA_DOD_CLASSES - 1; c++)
+    {
+      int64_t limit = (int64_t) 1 << (dod_bits[c] - 1);
+      if (dod >= -limit && dod < limit)
+	{
+	  /* c + 1 ones, then a zero. */
+	  return put_bits (enc, ((1ULL << (c + 1)) - 1) << 1, c + 2)
+	    && put_bits (enc, (uint64_t) dod & ((1ULL << dod_bits[c]) - 1),
+			 dod_bits[c]);
+	}
+    }
+
+  return put_bits (enc, (1ULL << GORILLA_DOD_CLASSES) - 1,
+		   GORILLA_DOD_CLASSES) && put_bits (enc, (uint64_t) dod, 64);
+}
+
+static bool
+put_value (GorillaEncoder * enc, uint64_t value)
+{
+  uint64_t x = value ^ enc->last_value;
+
+  if (x == 0)
+    {
+      return put_bits (enc, 0, 1);
+    }
+
+  int leading = leading_zeros (x);
+  int trailing = trailing_zeros (x);
+
+  /* Within the window of the previous value. */
+  if (enc->count > 1 && leading >= enc->leading
+      && trailing >= enc->trailing)
+    {
+      return put_bits (enc, 2, 2)
+	&& put_bits (enc, x >> enc->trailing,
+		     64 - enc->leading - enc->trailing);
+    }
+
+  /* The number of leading zeros takes 5 bits. */
+  if (leading > 31)
+    {
+      leading = 31;
+    }
+  int meaningful = 64 - leading - trailing;
+  enc->leading = leading;
+  enc->trailing = trailing;
+
+  /* A length of 64 is written as 0. */
+  return put_bits (enc, 3, 2) && put_bits (enc, leading, 5)
+    && put_bits (enc, meaningful & 63, 6)
+    && put_bits (enc, x >> trailing, meaningful);
+}
+
+bool
+gorilla_append (GorillaEncoder * enc, uint64_t ts, double value)
+{
+  GorillaEncoder saved = *enc;
+  uint64_t bits = double_bits (value);
+  bool ok;
+
+  if (enc->count == 0)
+    {
+      ok = put_bits (enc, ts, 64) && put_bits (enc, bits, 64);
+    }
+  else
+    {
+      int64_t delta = (int64_t) (ts - enc->last_ts);
+      ok = put_dod (enc, delta - enc->last_delta)
+	&& put_value (enc, bits);
+      enc->last_delta = delta;
+    }
+
+  if (!ok)
+    {
+      /* Back to before the sample, but with the new buffer. */
+      size_t i;
+      for (i = saved.bits; i < enc->bits; i++)
+	{
+	  enc->data[i / 8] &= (uint8_t) ~(0x80 >> (i % 8));
+	}
+      saved.data = enc->data;
+      saved.capacity = enc->capacity;
+      *enc = saved;
+      return false;
+    }
+
+  enc->count++;
+  enc->last_ts = ts;
+  enc->last_value = bits;
+  return true;
+}
+
+size_t
+gorilla_size (const GorillaEncoder * enc)
+{
+  return (enc->bits + 7) / 8;
+}
+
+void
+gorilla_encoder_reset (GorillaEncoder * enc)
+{
+  uint8_t *data = enc->data;
+  size_t capacity = enc->capacity;
+
+  if (data != NULL)
+    {
+      memset (data, 0, gorilla_size (enc));
+    }
+  gorilla_encoder_init (enc);
+  enc->data = data;
+  enc->capacity = capacity;
+}
+
+void
+gorilla_encoder_free (GorillaEncoder * enc)
+{
+  free (enc->data);
+  gorilla_encoder_init (enc);
+}
+
+void
+gorilla_decoder_init (GorillaDecoder * dec, const void *data, size_t size,
+		      uint32_t count)
+{
+  memset (dec, 0, sizeof (*dec));
+  dec->data = (const uint8_t *) data;
+  dec->size = size;
+  dec->count = count;
+}
+
+static bool
+get_dod (GorillaDecoder * dec, int64_t * dod)
+{
+  uint64_t bit;
+  uint64_t value;
+  int c;
+
+  for (c = 0; c < GORILLA_DOD_CLASSES; c++)
+    {
+      if (!get_bits (dec, 1, &bit))
+	{
+	  return false;
+	}
+      if (bit == 0)
+	{
+	  break;
+	}
+    }
+
+  if (c == 0)
+    {
+      *dod = 0;
+      return true;
+    }
+
+  int n = dod_bits[c - 1];
+  if (!get_bits (dec, n, &value))
+    {
+      return false;
+    }
+
+  /* Sign extend. */
+  if (n < 64 && (value >> (n - 1)) & 1)
+    {
+      value |= ~0ULL << n;
+    }
+  *dod = (int64_t) value;
+  return true;
+}
+
+static bool
+get_value (GorillaDecoder * dec, uint64_t * value)
+{
+  uint64_t bit;
+  uint64_t x;
+
+  if (!get_bits (dec, 1, &bit))
+    {
+      return false;
+    }
+  if (bit == 0)
+    {
+      *value = dec->last_value;
+      return true;
+    }
+
+  if (!get_bits (dec, 1, &bit))
+    {
+      return false;
+    }
+  if (bit == 1)
+    {
+      uint64_t leading;
+      uint64_t meaningful;
+
+      if (!get_bits (dec, 5, &leading) || !get_bits (dec, 6, &meaningful))
+	{
+	  return false;
+	}
+      if (meaningful == 0)
+	{
+	  meaningful = 64;
+	}
+      dec->leading = (int) leading;
+      dec->trailing = 64 - (int) leading - (int) meaningful;
+    }
+
+  if (!get_bits (dec, 64 - dec->leading - dec->trailing, &x))
+    {
+      return false;
+    }
+
+  *value = dec->last_value ^ (x << dec->trailing);
+  return true;
+}
+
+bool
+gorilla_next (GorillaDecoder * dec, uint64_t * ts, double *value)
+{
+  uint64_t bits;
+
+  if (dec->read == dec->count)
+    {
+      return false;
+    }
+
+  if (dec->read == 0)
+    {
+      if (!get_bits (dec, 64, ts) || !get_bits (dec, 64, &bits))
+	{
+	  return false;
+	}
+    }
+  else
+    {
+      int64_t dod;
+      if (!get_dod (dec, &dod) || !get_value (dec, &bits))
+	{
+	  return false;
+	}
+      dec->last_delta += dod;
+      *ts = dec->last_ts + (uint64_t) dec->last_delta;
+    }
+
+  dec->read++;
+  dec->last_ts = *ts;
+  dec->last_value = bits;
+  *value = bits_double (bits);
+  return true;
+}
@@ -0,0 +1,82 @@
+/*
+* This file is part of atmotube-reader.
+*
+* atmotube-reader is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* atmotube-reader is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* You should have received a copy of the GNU General Public License
+* along with atmotube-reader.
+* If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef GORILLA_H
+#define GORILLA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compression of a series of samples as in Facebook's Gorilla:
+ * timestamps are stored as the difference of their deltas, values as
+ * the meaningful bits of their XOR with the previous value. Samples of
+ * a slowly changing metric taken at a steady rate take a few bits
+ * each. Timestamps must not decrease. */
+
+typedef struct
+{
+  uint8_t *data;
+  /* Bits written. */
+  size_t bits;
+  size_t capacity;
+  uint32_t count;
+  uint64_t last_ts;
+  int64_t last_delta;
+  uint64_t last_value;
+  /* Meaningful bits of the last XOR written with its window. */
+  int leading;
+  int trailing;
+} GorillaEncoder;
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t size;
+  size_t bits;
+  uint32_t count;
+  uint32_t read;
+  uint64_t last_ts;
+  int64_t last_delta;
+  uint64_t last_value;
+  int leading;
+  int trailing;
+} GorillaDecoder;
+
+void gorilla_encoder_init (GorillaEncoder * enc);
+
+/* Returns false when out of memory, the sample is then not added. */
+bool gorilla_append (GorillaEncoder * enc, uint64_t ts, double value);
+
+/* Bytes of the encoded samples so far, in enc->data. */
+size_t gorilla_size (const GorillaEncoder * enc);
+
+/* Forget the samples, keeping the buffer. */
+void gorilla_encoder_reset (GorillaEncoder * enc);
+
+void gorilla_encoder_free (GorillaEncoder * enc);
+
+/* Decode count samples from the size bytes at data, which must stay
+ * valid while decoding. */
+void gorilla_decoder_init (GorillaDecoder * dec, const void *data,
+			   size_t size, uint32_t count);
+
+/* The next sample. Returns false after the last one, or when the data
+ * is truncated. */
+bool gorilla_next (GorillaDecoder * dec, uint64_t * ts, double *value);
+
+#endif /* GORILLA_H */
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <check.h>
 
 #include <atmotube.h>
@@ -25,13 +26,17 @@
 #include <atmotube-interval.h>
 #include <atmotube-handler.h>
 #include <db.h>
+#include <sqlite3.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "atmotube-test-common.h"
 
 char filenamebuffer[1024];
 
 static AtmotubeOutput o;
+static const char *device_names[] = { "my device" };
+static const char *device_addresses[] = { "00:00:00:00:00:00" };
 
 static void
 setup_output (int counter)
@@ -41,8 +46,9 @@ setup_output (int counter)
   PRINT_DEBUG ("Using counter %d, filename: %s\n", counter,
 	       &filenamebuffer[0]);
   o.filename = &filenamebuffer[0];
-  o.device_name = "my device";
-  o.device_address = "00:00:00:00:00:00";
+  o.num_devices = 1;
+  o.device_names = device_names;
+  o.device_addresses = device_addresses;
 }
 
 typedef enum
@@ -53,59 +59,73 @@ typedef enum
   TO_INSERT_DEVICE,
   TO_DEVICE_FOUND,
   TO_TEST_DB_PLUGIN,
-  TO_INSERT_VALUES
+  TO_INSERT_VALUES,
+  TO_WRITE_BATCH,
+  TO_COMMIT,
+  TO_SAMPLES,
+  TO_MIGRATE,
+  TO_NEWER_SCHEMA,
+  TO_PARTITION,
+  TO_ROLLUP,
+  TO_RANGE,
+  TO_POOL,
+  TO_CHUNKS,
+  TO_VOC_SCALED,
+  TO_SPOOL,
+  TO_REPLAY,
+  TO_REPLAY_CHUNKS,
+  TO_WAL,
+  TO_MIGRATE_INTERRUPTED
 } test_output;
 
 START_TEST (test_create_tables)
 {
   setup_output (TO_CREATE_TABLES);
-  int ret = db_plugin_setup_database (o.filename,
-				      o.device_name,
-				      o.device_address);
-  ck_assert (ret == ATMOTUBE_RET_OK);
+  DbPlugin *db = db_plugin_setup_database (o.filename);
+  ck_assert (db != NULL);
 
-  ret = db_plugin_create_tables ();
+  int ret = db_plugin_create_tables (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
+
+  plugin_stop (db);
 }
 
 END_TEST
 START_TEST (test_create_statements)
 {
   setup_output (TO_CREATE_STATEMENTS);
-  int ret = db_plugin_setup_database (o.filename,
-				      o.device_name,
-				      o.device_address);
-  ck_assert (ret == ATMOTUBE_RET_OK);
+  DbPlugin *db = db_plugin_setup_database (o.filename);
+  ck_assert (db != NULL);
 
-  ret = db_plugin_create_tables ();
+  int ret = db_plugin_create_tables (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
-  ret = db_plugin_create_statements ();
+  ret = db_plugin_create_statements (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
-  db_plugin_destroy_statements ();
+  db_plugin_destroy_statements (db);
+  plugin_stop (db);
 }
 
 END_TEST
 START_TEST (test_find_device_not_found)
 {
   setup_output (TO_FIND_DEVICE);
-  int ret = db_plugin_setup_database (o.filename,
-				      o.device_name,
-				      o.device_address);
-  ck_assert (ret == ATMOTUBE_RET_OK);
+  DbPlugin *db = db_plugin_setup_database (o.filename);
+  ck_assert (db != NULL);
 
-  ret = db_plugin_create_tables ();
+  int ret = db_plugin_create_tables (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
-  ret = db_plugin_create_statements ();
+  ret = db_plugin_create_statements (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   int found_id = -1;
-  ret = db_plugin_find_device ("test", "00", &found_id);
+  ret = db_plugin_find_device (db, "test", "00", &found_id);
   ck_assert (ret != ATMOTUBE_RET_OK);
 
-  db_plugin_destroy_statements ();
+  db_plugin_destroy_statements (db);
+  plugin_stop (db);
 }
 
 END_TEST
@@ -113,29 +133,28 @@ START_TEST (test_insert_device)
 {
   setup_output (TO_INSERT_DEVICE);
 
-  int ret = db_plugin_setup_database (o.filename,
-				      o.device_name,
-				      o.device_address);
-  ck_assert (ret == ATMOTUBE_RET_OK);
+  DbPlugin *db = db_plugin_setup_database (o.filename);
+  ck_assert (db != NULL);
 
-  ret = db_plugin_create_tables ();
+  int ret = db_plugin_create_tables (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
-  ret = db_plugin_create_statements ();
+  ret = db_plugin_create_statements (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   const char *testname = "testname";
   const char *devaddress = "00:00:00:00:00:00";
-  ret = db_plugin_insert_device (testname, devaddress);
+  ret = db_plugin_insert_device (db, testname, devaddress);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   int found_id = -1;
-  ret = db_plugin_find_device (testname, devaddress, &found_id);
+  ret = db_plugin_find_device (db, testname, devaddress, &found_id);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   ck_assert (found_id != -1);
 
-  db_plugin_destroy_statements ();
+  db_plugin_destroy_statements (db);
+  plugin_stop (db);
 }
 
 END_TEST
@@ -143,64 +162,63 @@ START_TEST (test_find_device_found)
 {
   setup_output (TO_DEVICE_FOUND);
 
-  int ret = db_plugin_setup_database (o.filename,
-				      o.device_name,
-				      o.device_address);
-  ck_assert (ret == ATMOTUBE_RET_OK);
+  DbPlugin *db = db_plugin_setup_database (o.filename);
+  ck_assert (db != NULL);
 
-  ret = db_plugin_create_tables ();
+  int ret = db_plugin_create_tables (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
-  ret = db_plugin_create_statements ();
+  ret = db_plugin_create_statements (db);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   const char *testname0 = "testname0";
   const char *devaddress0 = "00:00:00:00:00:00";
-  ret = db_plugin_insert_device (testname0, devaddress0);
+  ret = db_plugin_insert_device (db, testname0, devaddress0);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   const char *testname1 = "testname1";
   const char *devaddress1 = "00:00:00:00:00:01";
-  ret = db_plugin_insert_device (testname1, devaddress1);
+  ret = db_plugin_insert_device (db, testname1, devaddress1);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   int found_id = -1;
-  ret = db_plugin_find_device ("test", "00", &found_id);
+  ret = db_plugin_find_device (db, "test", "00", &found_id);
   ck_assert (ret != ATMOTUBE_RET_OK);
 
-  ret = db_plugin_find_device (testname0, devaddress0, &found_id);
+  ret = db_plugin_find_device (db, testname0, devaddress0, &found_id);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   int saved_found_id = found_id;
-  ret = db_plugin_find_device (testname1, devaddress1, &found_id);
+  ret = db_plugin_find_device (db, testname1, devaddress1, &found_id);
   ck_assert (ret == ATMOTUBE_RET_OK);
 
   PRINT_DEBUG ("saved_found_id(%d) < found_id(%d)\n", saved_found_id,
 	       found_id);
   ck_assert (saved_found_id < found_id);
 
-  db_plugin_destroy_statements ();
+  db_plugin_destroy_statements (db);
+  plugin_stop (db);
 }
 
 END_TEST
 START_TEST (test_db_plugin)
 {
   setup_output (TO_TEST_DB_PLUGIN);
-  int ret = plugin_start (&o);
-  ck_assert (ret == ATMOTUBE_RET_OK);
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
 
-  plugin_stop ();
+  plugin_stop (ctx);
 }
 
 END_TEST static int
-check_values (unsigned long time,
+check_values (DbPlugin * db, unsigned long time,
 	      unsigned long tempval, unsigned long humval, float vocval)
 {
   unsigned long temp_from_db;
   unsigned long hum_from_db;
   float voc_from_db;
 
-  get_temperature (time, &temp_from_db);
+  get_temperature (db, 0, time, &temp_from_db);
   if (temp_from_db != tempval)
     {
       PRINT_DEBUG ("temp_from_db(%lu) != tempval(%lu)\n", temp_from_db,
@@ -208,15 +226,17 @@ check_values (unsigned long time,
       return ATMOTUBE_RET_ERROR;
     }
 
-  get_humidity (time, &hum_from_db);
+  get_humidity (db, 0, time, &hum_from_db);
   if (hum_from_db != humval)
     {
       PRINT_DEBUG ("hum_from_db(%lu) != humval(%lu)\n", hum_from_db, humval);
       return ATMOTUBE_RET_ERROR;
     }
 
-  get_voc (time, &voc_from_db);
-  if (voc_from_db != vocval)
+  /* VOC is stored to the precision of the device. */
+  get_voc (db, 0, time, &voc_from_db);
+  float delta = voc_from_db - vocval;
+  if (delta > 0.5f / ATMOTUBE_VOC_SCALE || delta < -0.5f / ATMOTUBE_VOC_SCALE)
     {
       PRINT_DEBUG ("voc_from_db(%f) != vocval(%f)\n", voc_from_db, vocval);
       return ATMOTUBE_RET_ERROR;
@@ -228,9 +248,10 @@ check_values (unsigned long time,
 START_TEST (test_insert_values)
 {
   setup_output (TO_INSERT_VALUES);
-  int ret = plugin_start (&o);
-  ck_assert (ret == ATMOTUBE_RET_OK);
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
 
+  int ret;
   unsigned long tempval = 0;
   unsigned long humval = 0;
   float vocval = 0.0;
@@ -241,15 +262,847 @@ START_TEST (test_insert_values)
       humval++;
       vocval += 0.10;
 
-      temperature (time, tempval);
-      humidity (time, humval);
-      voc (time, vocval);
+      ret = temperature (ctx, time, 0, tempval);
+      ck_assert (ret == ATMOTUBE_RET_OK);
+      ret = humidity (ctx, time, 0, humval);
+      ck_assert (ret == ATMOTUBE_RET_OK);
+      ret = voc (ctx, time, 0, vocval);
+      ck_assert (ret == ATMOTUBE_RET_OK);
+
+      ret = check_values ((DbPlugin *) ctx, time, tempval, humval,
+			  vocval);
+      ck_assert (ret == ATMOTUBE_RET_OK);
+    }
+
+  plugin_stop (ctx);
+}
+
+END_TEST
+START_TEST (test_write_batch)
+{
+  setup_output (TO_WRITE_BATCH);
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+#define BATCH_ROWS 16
+  uint64_t ts[BATCH_ROWS * 3];
+  int device[BATCH_ROWS * 3];
+  int metric[BATCH_ROWS * 3];
+  double value[BATCH_ROWS * 3];
+  size_t n = 0;
+
+  for (unsigned long time = 0; time < BATCH_ROWS; time++)
+    {
+      int m[] = { TEMPERATURE, HUMIDITY, VOC };
+      for (int j = 0; j < 3; j++)
+	{
+	  ts[n] = time;
+	  device[n] = 0;
+	  metric[n] = m[j];
+	  value[n] = (m[j] == VOC) ? (float) (time + 0.5) : time + 1;
+	  n++;
+	}
+    }
+
+  int ret = write_batch (ctx, n, ts, device, metric, value);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  for (unsigned long time = 0; time < BATCH_ROWS; time++)
+    {
+      ret = check_values ((DbPlugin *) ctx, time, time + 1, time + 1,
+			  (float) (time + 0.5));
+      ck_assert (ret == ATMOTUBE_RET_OK);
+    }
+
+  plugin_stop (ctx);
+}
+
+END_TEST
+/* Layout written before schema versions existed. */
+static const char *legacy_schema =
+  "CREATE TABLE voc (device_id INTEGER NOT NULL, time INTEGER NOT NULL, "
+  "value REAL NOT NULL, description VARCHAR(255) NOT NULL);"
+  "CREATE TABLE temperature (device_id INTEGER NOT NULL, "
+  "time NUMERIC NOT NULL, value INTEGER NOT NULL);"
+  "CREATE TABLE device (id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, "
+  "name VARCHAR(255) NOT NULL, address VARCHAR(255) NOT NULL);"
+  "CREATE TABLE humidity (time INTEGER NOT NULL, "
+  "device_id INTEGER NOT NULL, value INTEGER NOT NULL, PRIMARY KEY(time));"
+  "INSERT INTO device VALUES (NULL, 'my device', '00:00:00:00:00:00');"
+  "INSERT INTO temperature VALUES (1, 1700000000000, 21), "
+  "(1, 1700000010000, 22);"
+  "INSERT INTO humidity VALUES (1700000000000, 1, 40);"
+  "INSERT INTO voc VALUES (1, 1700000000000, 0.5, '');";
+
+/* The times of legacy_schema, in ms, as ns. */
+#define LEGACY_NS 1700000000000000000ULL
+#define LEGACY_NS_LATER 1700000010000000000ULL
+
+static int
+query_int (const char *filename, const char *sql)
+{
+  sqlite3 *handle;
+  sqlite3_stmt *stmt;
+  int value = -1;
+
+  ck_assert (sqlite3_open (filename, &handle) == SQLITE_OK);
+  ck_assert (sqlite3_prepare_v2 (handle, sql, -1, &stmt, NULL) ==
+	     SQLITE_OK);
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      value = sqlite3_column_int (stmt, 0);
+    }
+  sqlite3_finalize (stmt);
+  sqlite3_close (handle);
 
-      ret = check_values (time, tempval, humval, vocval);
+  return value;
+}
+
+static void
+exec_sql (const char *filename, const char *sql)
+{
+  sqlite3 *handle;
+
+  ck_assert (sqlite3_open (filename, &handle) == SQLITE_OK);
+  ck_assert (sqlite3_exec (handle, sql, NULL, NULL, NULL) == SQLITE_OK);
+  sqlite3_close (handle);
+}
+
+START_TEST (test_commit)
+{
+  setup_output (TO_COMMIT);
+  o.commit_rows = 4;
+  o.commit_interval = 0;
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  int ret;
+  for (unsigned long time = 0; time < 3; time++)
+    {
+      ret = temperature (ctx, time, 0, time);
       ck_assert (ret == ATMOTUBE_RET_OK);
     }
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 0);
+
+  /* The fourth row commits. */
+  ret = temperature (ctx, 3, 0, 3);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 4);
+
+  ret = temperature (ctx, 4, 0, 4);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 4);
+
+  /* Stopping commits the rest. */
+  plugin_stop (ctx);
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 5);
+
+  /* The database stays in WAL mode. */
+  sqlite3 *handle;
+  sqlite3_stmt *stmt;
+  ck_assert (sqlite3_open (o.filename, &handle) == SQLITE_OK);
+  ck_assert (sqlite3_prepare_v2 (handle, "PRAGMA journal_mode;", -1, &stmt,
+				 NULL) == SQLITE_OK);
+  ck_assert (sqlite3_step (stmt) == SQLITE_ROW);
+  ck_assert (strcmp ((const char *) sqlite3_column_text (stmt, 0), "wal") ==
+	     0);
+  sqlite3_finalize (stmt);
+  sqlite3_close (handle);
+
+  /* With no more rows, plugin_flush commits once the transaction is
+   * commit_interval old. */
+  o.commit_rows = 1000;
+  o.commit_interval = 50;
+  ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+  ck_assert (temperature (ctx, 5, 0, 5) == ATMOTUBE_RET_OK);
+  ck_assert (plugin_flush (ctx) == ATMOTUBE_RET_OK);
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 5);
+  usleep (60 * 1000);
+  ck_assert (plugin_flush (ctx) == ATMOTUBE_RET_OK);
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 6);
+  plugin_stop (ctx);
+
+  o.commit_rows = 0;
+  o.commit_interval = 0;
+}
+
+END_TEST
+static off_t
+file_size (const char *file_name)
+{
+  struct stat st;
+  return stat (file_name, &st) == 0 ? st.st_size : 0;
+}
+
+START_TEST (test_wal)
+{
+  char wal[1100];
+  sqlite3 *handle;
+  int log, done;
+
+  setup_output (TO_WAL);
+  unlink (o.filename);
+  snprintf (wal, sizeof (wal), "%s-wal", o.filename);
+  o.commit_rows = 1000;
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  /* The writer holds no snapshot between commits, so the log can be
+   * moved into the database and restarted while it runs, and stays
+   * bounded by the automatic checkpoints. */
+  ck_assert (sqlite3_open (o.filename, &handle) == SQLITE_OK);
+  off_t max = 0;
+  for (unsigned long i = 0; i < 100000; i++)
+    {
+      ck_assert (temperature (ctx, i * 1000, 0, 20 + i % 10) ==
+		 ATMOTUBE_RET_OK);
+      if (i % 10000 == 9999 && file_size (wal) > max)
+	{
+	  max = file_size (wal);
+	}
+    }
+  ck_assert (max < 8 * 1024 * 1024);
+  ck_assert (sqlite3_exec (handle, "select count(*) from device;", NULL,
+			   NULL, NULL) == SQLITE_OK);
+  ck_assert (sqlite3_wal_checkpoint_v2 (handle, NULL,
+					SQLITE_CHECKPOINT_TRUNCATE, &log,
+					&done) == SQLITE_OK);
+  ck_assert (file_size (wal) == 0);
+  sqlite3_close (handle);
+
+  plugin_stop (ctx);
+  o.commit_rows = 0;
+  ck_assert (query_int (o.filename, "select count(*) from samples;") ==
+	     100000);
+}
+
+END_TEST
+START_TEST (test_samples)
+{
+  static const char *names[] = { "first", "second" };
+  static const char *addresses[] = { "00:00:00:00:00:01",
+    "00:00:00:00:00:02"
+  };
+
+  setup_output (TO_SAMPLES);
+  o.num_devices = 2;
+  o.device_names = names;
+  o.device_addresses = addresses;
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  /* Two devices reporting at the same time do not collide. */
+  unsigned long hum;
+  float vocval;
+  ck_assert (humidity (ctx, 1000, 0, 40) == ATMOTUBE_RET_OK);
+  ck_assert (humidity (ctx, 1000, 1, 60) == ATMOTUBE_RET_OK);
+  ck_assert (voc (ctx, 1000, 1, 0.25) == ATMOTUBE_RET_OK);
+  ck_assert (get_humidity ((DbPlugin *) ctx, 0, 1000, &hum) ==
+	     ATMOTUBE_RET_OK && hum == 40);
+  ck_assert (get_humidity ((DbPlugin *) ctx, 1, 1000, &hum) ==
+	     ATMOTUBE_RET_OK && hum == 60);
+  ck_assert (get_voc ((DbPlugin *) ctx, 1, 1000, &vocval) ==
+	     ATMOTUBE_RET_OK && vocval == 0.25f);
+  ck_assert (get_voc ((DbPlugin *) ctx, 0, 1000, &vocval) !=
+	     ATMOTUBE_RET_OK);
+  plugin_stop (ctx);
+
+  /* The samples are only kept in their clustered table. */
+  ck_assert (query_int (o.filename,
+			"select count(*) from sqlite_master where tbl_name='samples';")
+	     == 1);
+}
+
+END_TEST
+START_TEST (test_migrate)
+{
+  setup_output (TO_MIGRATE);
+  unlink (o.filename);
+  exec_sql (o.filename, legacy_schema);
+
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  unsigned long value;
+  float vocval;
+  ck_assert (get_temperature ((DbPlugin *) ctx, 0, LEGACY_NS, &value) ==
+	     ATMOTUBE_RET_OK && value == 21);
+  ck_assert (get_temperature ((DbPlugin *) ctx, 0, LEGACY_NS_LATER, &value)
+	     == ATMOTUBE_RET_OK && value == 22);
+  ck_assert (get_humidity ((DbPlugin *) ctx, 0, LEGACY_NS, &value) ==
+	     ATMOTUBE_RET_OK && value == 40);
+  ck_assert (get_voc ((DbPlugin *) ctx, 0, LEGACY_NS, &vocval) ==
+	     ATMOTUBE_RET_OK && vocval == 0.5f);
+  plugin_stop (ctx);
+
+  ck_assert (query_int (o.filename, "PRAGMA user_version;") > 0);
+  ck_assert (query_int (o.filename,
+			"select count(*) from sqlite_master where name in "
+			"('temperature', 'humidity', 'voc');") == 0);
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 4);
+  ck_assert (query_int (o.filename, "select sum(count) from rollup_1d;") ==
+	     4);
+  ck_assert (query_int (o.filename, "select value from samples "
+			"where metric_id = 0;") == 50);
+  ck_assert (query_int (o.filename, "select count(*) from samples "
+			"where time = 1700000000000000000;") == 3);
+  ck_assert (query_int (o.filename, "select count(*) from rollup_1d "
+			"where bucket = 1699920000000000000;") == 3);
+
+  /* Nothing left to do the second time. */
+  ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+  plugin_stop (ctx);
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 4);
+}
+
+END_TEST
+/* Commits left before one fails, as if the process was killed then,
+ * -1 for none. Set on every connection opened. */
+static int commits_left = -1;
+
+static int
+interrupt_commit (void *data)
+{
+  UNUSED (data);
+  return commits_left >= 0 && commits_left-- == 0;
+}
+
+static int
+interrupt_extension (sqlite3 * handle, const char **err,
+		     const struct sqlite3_api_routines *api)
+{
+  UNUSED (err);
+  UNUSED (api);
+  sqlite3_commit_hook (handle, interrupt_commit, NULL);
+  return SQLITE_OK;
+}
+
+/* Start the plugin, stopped after each commit until it gets through.
+ * Returns the number of starts. */
+static int
+start_interrupted (void **ctx)
+{
+  int starts;
+
+  *ctx = NULL;
+  sqlite3_auto_extension ((void (*)(void)) interrupt_extension);
+  for (starts = 0; *ctx == NULL && starts < 100; starts++)
+    {
+      commits_left = 1;
+      *ctx = plugin_start (&o);
+    }
+  commits_left = -1;
+  sqlite3_reset_auto_extension ();
+
+  return starts;
+}
+
+START_TEST (test_migrate_interrupted)
+{
+  void *ctx;
+
+  setup_output (TO_MIGRATE_INTERRUPTED);
+  unlink (o.filename);
+  exec_sql (o.filename, legacy_schema);
+  /* More rows than a migration changes at a time. */
+  exec_sql (o.filename, "WITH RECURSIVE t(i) AS (SELECT 1 UNION ALL "
+	    "SELECT i + 1 FROM t WHERE i < 25000) INSERT INTO voc "
+	    "SELECT 1, 1700000000000 + i * 1000, 0.25, '' FROM t;");
+
+  ck_assert (start_interrupted (&ctx) > 2);
+  ck_assert (ctx != NULL);
+  plugin_stop (ctx);
+
+  /* Every sample in each rollup level once. */
+  ck_assert (query_int (o.filename, "select count(*) from samples;") ==
+	     25004);
+  ck_assert (query_int (o.filename, "select sum(count) from rollup_1m;")
+	     == 25004);
+  ck_assert (query_int (o.filename, "select sum(count) from rollup_1h;")
+	     == 25004);
+  ck_assert (query_int (o.filename, "select sum(count) from rollup_1d;")
+	     == 25004);
+
+  /* Back to version 4, with VOC in ppm. */
+  exec_sql (o.filename, "UPDATE samples SET value = value / 100.0 "
+	    "WHERE metric_id = 0; UPDATE rollup_1m SET min = min / 100.0, "
+	    "max = max / 100.0, sum = sum / 100.0 WHERE metric_id = 0; "
+	    "UPDATE rollup_1h SET min = min / 100.0, max = max / 100.0, "
+	    "sum = sum / 100.0 WHERE metric_id = 0; "
+	    "UPDATE rollup_1d SET min = min / 100.0, max = max / 100.0, "
+	    "sum = sum / 100.0 WHERE metric_id = 0; PRAGMA user_version=4;");
+
+  ck_assert (start_interrupted (&ctx) > 2);
+  ck_assert (ctx != NULL);
+  plugin_stop (ctx);
+
+  /* Every VOC value scaled once. */
+  ck_assert (query_int (o.filename, "PRAGMA user_version;") == 5);
+  ck_assert (query_int (o.filename, "select sum(value) from samples "
+			"where metric_id = 0;") == 25000 * 25 + 50);
+  ck_assert (query_int (o.filename, "select sum(sum) from rollup_1m "
+			"where metric_id = 0;") == 25000 * 25 + 50);
+  ck_assert (query_int (o.filename, "select sum(sum) from rollup_1d "
+			"where metric_id = 0;") == 25000 * 25 + 50);
+  ck_assert (query_int (o.filename, "select count(*) from "
+			"migration_state;") == 0);
+}
+
+END_TEST
+START_TEST (test_newer_schema)
+{
+  setup_output (TO_NEWER_SCHEMA);
+  unlink (o.filename);
+  exec_sql (o.filename, "PRAGMA user_version=1000;");
+
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx == NULL);
+}
+
+END_TEST
+#define DAY_NS (86400ULL * 1000000000ULL)
+
+START_TEST (test_partition)
+{
+  char day1[64];
+  char day3[64];
+
+  setup_output (TO_PARTITION);
+  o.partition = ATMOTUBE_PARTITION_DAY;
+  snprintf (day1, sizeof (day1), "test_db_plugin-%d-1970-01-02.db",
+	    TO_PARTITION);
+  snprintf (day3, sizeof (day3), "test_db_plugin-%d-1970-01-04.db",
+	    TO_PARTITION);
+  unlink (day1);
+  unlink (day3);
+
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  /* Each day goes to its own file. */
+  ck_assert (temperature (ctx, DAY_NS + 10, 0, 21) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, DAY_NS + 20, 0, 22) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, 3 * DAY_NS, 0, 23) == ATMOTUBE_RET_OK);
+  plugin_stop (ctx);
+
+  ck_assert (query_int (day1, "select count(*) from samples;") == 2);
+  ck_assert (query_int (day3, "select count(*) from samples;") == 1);
+
+  /* Reading a range only attaches the partitions overlapping it. */
+  DbReader *reader = db_reader_open (o.filename, o.partition, DAY_NS + 15,
+				     2 * DAY_NS + 1);
+  ck_assert (reader != NULL);
+  ck_assert (db_reader_partitions (reader) == 1);
+
+  sqlite3_stmt *stmt;
+  ck_assert (sqlite3_prepare_v2 (db_reader_handle (reader),
+				 "select name, value from range_samples;",
+				 -1, &stmt, NULL) == SQLITE_OK);
+  ck_assert (sqlite3_step (stmt) == SQLITE_ROW);
+  ck_assert (strcmp ((const char *) sqlite3_column_text (stmt, 0),
+		     device_names[0]) == 0);
+  ck_assert (sqlite3_column_int (stmt, 1) == 22);
+  ck_assert (sqlite3_step (stmt) == SQLITE_DONE);
+  sqlite3_finalize (stmt);
+  db_reader_close (reader);
+
+  reader = db_reader_open (o.filename, o.partition, 0, 4 * DAY_NS);
+  ck_assert (reader != NULL);
+  ck_assert (db_reader_partitions (reader) == 2);
+  db_reader_close (reader);
+
+  /* Old partitions are deleted, and old samples refused. */
+  o.retention = 30;
+  ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+  ck_assert (access (day1, F_OK) != 0);
+  ck_assert (access (day3, F_OK) != 0);
+  ck_assert (temperature (ctx, DAY_NS, 0, 21) != ATMOTUBE_RET_OK);
+  plugin_stop (ctx);
+
+  o.partition = ATMOTUBE_PARTITION_NONE;
+  o.retention = 0;
+}
+
+END_TEST
+#define MINUTE_NS (60ULL * 1000000000ULL)
+
+START_TEST (test_rollup)
+{
+  setup_output (TO_ROLLUP);
+  unlink (o.filename);
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  /* Two minutes, the second one getting a late sample of the first. */
+  ck_assert (temperature (ctx, 10, 0, 20) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, 20, 0, 24) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, MINUTE_NS + 10, 0, 30) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, 30, 0, 16) == ATMOTUBE_RET_OK);
+  ck_assert (humidity (ctx, MINUTE_NS + 20, 0, 50) == ATMOTUBE_RET_OK);
+  /* Replayed samples are not counted again. */
+  ck_assert (temperature (ctx, 10, 0, 99) == ATMOTUBE_RET_OK);
+  plugin_stop (ctx);
+
+  ck_assert (query_int (o.filename, "select count(*) from rollup_1m "
+			"where metric_id = 2;") == 2);
+  ck_assert (query_int (o.filename, "select min * 1000000 + max * 1000 + "
+			"sum from rollup_1m where bucket = 0 "
+			"and metric_id = 2;") == 16024060);
+  ck_assert (query_int (o.filename, "select count * 1000 + sum from "
+			"rollup_1h where bucket = 0 and metric_id = 2;") ==
+	     4090);
+  ck_assert (query_int (o.filename, "select count * 1000 + sum from "
+			"rollup_1d where metric_id = 1;") == 1050);
+
+  /* Reopening adds to the buckets already there. */
+  ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+  ck_assert (temperature (ctx, 40, 0, 10) == ATMOTUBE_RET_OK);
+  plugin_stop (ctx);
+  ck_assert (query_int (o.filename, "select count * 1000 + min from "
+			"rollup_1m where bucket = 0 and metric_id = 2;") ==
+	     4010);
+}
+
+END_TEST static int
+count_rows (void *user, const DbRangeRow * row)
+{
+  int *n = (int *) user;
+
+  UNUSED (row);
+  (*n)++;
+  return *n < 2 ? ATMOTUBE_RET_OK : ATMOTUBE_RET_ERROR;
+}
+
+START_TEST (test_range)
+{
+  setup_output (TO_RANGE);
+  unlink (o.filename);
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+  for (unsigned long i = 0; i < 10; i++)
+    {
+      ck_assert (temperature (ctx, i * 10, 0, i) == ATMOTUBE_RET_OK);
+      ck_assert (humidity (ctx, i * 10, 0, 50) == ATMOTUBE_RET_OK);
+    }
+  plugin_stop (ctx);
+
+  DbRangeQuery query = {
+    device_names[0], device_addresses[0], TEMPERATURE, 15, 85, 0
+  };
+  DbRangeRow row;
+
+  /* Samples 20 to 80. */
+  DbRange *range = db_range_open (o.filename, o.partition, &query);
+  ck_assert (range != NULL);
+  for (unsigned long i = 2; i <= 8; i++)
+    {
+      ck_assert (db_range_next (range, &row));
+      ck_assert (row.time == i * 10 && row.count == 1 && row.sum == i);
+    }
+  ck_assert (!db_range_next (range, &row));
+  ck_assert (db_range_close (range) == ATMOTUBE_RET_OK);
+
+  /* Buckets [0, 40), [40, 80) and [80, 120). */
+  query.bucket = 40;
+  range = db_range_open (o.filename, o.partition, &query);
+  ck_assert (range != NULL);
+  ck_assert (db_range_next (range, &row));
+  ck_assert (row.time == 0 && row.count == 2 && row.min == 2
+	     && row.max == 3 && row.sum == 5);
+  ck_assert (db_range_next (range, &row));
+  ck_assert (row.time == 40 && row.count == 4 && row.sum == 22);
+  ck_assert (db_range_next (range, &row));
+  ck_assert (row.time == 80 && row.count == 1 && row.sum == 8);
+  ck_assert (!db_range_next (range, &row));
+  ck_assert (db_range_close (range) == ATMOTUBE_RET_OK);
+
+  /* The callback stops the query. */
+  int n = 0;
+  ck_assert (db_range_query (o.filename, o.partition, &query, count_rows,
+			     &n) == ATMOTUBE_RET_OK);
+  ck_assert (n == 2);
+
+  /* Unknown devices have no samples. */
+  query.name = "other";
+  range = db_range_open (o.filename, o.partition, &query);
+  ck_assert (range != NULL);
+  ck_assert (!db_range_next (range, &row));
+  ck_assert (db_range_close (range) == ATMOTUBE_RET_OK);
+}
+
+END_TEST
+START_TEST (test_pool)
+{
+  setup_output (TO_POOL);
+  unlink (o.filename);
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+  ck_assert (temperature (ctx, 10, 0, 21) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, 20, 0, 22) == ATMOTUBE_RET_OK);
+
+  DbPool *pool = db_pool_open (o.filename, o.partition, 2);
+  ck_assert (pool != NULL);
+  DbReader *first = db_pool_acquire (pool, 0, 100);
+  DbReader *second = db_pool_acquire (pool, 0, 100);
+  ck_assert (first != NULL && second != NULL);
+
+  /* Reading while samples are written. */
+  sqlite3_stmt *stmt;
+  ck_assert (sqlite3_prepare_v2 (db_reader_handle (first),
+				 "select value from range_samples "
+				 "order by time;", -1, &stmt,
+				 NULL) == SQLITE_OK);
+  ck_assert (sqlite3_step (stmt) == SQLITE_ROW);
+  ck_assert (sqlite3_column_int (stmt, 0) == 21);
+  ck_assert (temperature (ctx, 30, 0, 23) == ATMOTUBE_RET_OK);
+  ck_assert (sqlite3_step (stmt) == SQLITE_ROW);
+  ck_assert (sqlite3_step (stmt) == SQLITE_DONE);
+  sqlite3_finalize (stmt);
+
+  /* Readers do not write. */
+  ck_assert (sqlite3_exec (db_reader_handle (second),
+			   "delete from p0.samples;", NULL, NULL,
+			   NULL) == SQLITE_READONLY);
+  db_reader_close (first);
+  db_reader_close (second);
+
+  /* Connections are reused, with the new rows. */
+  DbRangeQuery query = {
+    device_names[0], device_addresses[0], TEMPERATURE, 0, 100, 0
+  };
+  DbRangeRow row;
+  int n = 0;
+  DbRange *range = db_pool_range (pool, &query);
+  ck_assert (range != NULL);
+  while (db_range_next (range, &row))
+    {
+      n++;
+    }
+  ck_assert (db_range_close (range) == ATMOTUBE_RET_OK);
+  ck_assert (n == 3);
+
+  db_pool_close (pool);
+  plugin_stop (ctx);
+}
+
+END_TEST
+#define HOUR_NS (3600ULL * 1000000000ULL)
+
+START_TEST (test_chunks)
+{
+  setup_output (TO_CHUNKS);
+  unlink (o.filename);
+  o.storage = ATMOTUBE_STORAGE_CHUNKS;
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  /* Two hours of a sample per minute, a chunk each. */
+  for (unsigned long i = 0; i < 120; i++)
+    {
+      ck_assert (temperature (ctx, i * MINUTE_NS, 0, 20 + i % 3) ==
+		 ATMOTUBE_RET_OK);
+      ck_assert (voc (ctx, i * MINUTE_NS, 0, 0.25f * i) == ATMOTUBE_RET_OK);
+    }
+  ck_assert (temperature (ctx, 119 * MINUTE_NS, 0, 20) == ATMOTUBE_RET_OK);
+  /* Late, in a chunk of its own. */
+  ck_assert (temperature (ctx, 30 * MINUTE_NS + 1, 0, 30) ==
+	     ATMOTUBE_RET_OK);
+  plugin_stop (ctx);
+  o.storage = ATMOTUBE_STORAGE_ROWS;
+
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 0);
+  ck_assert (query_int (o.filename, "select count(*) from chunks "
+			"where metric_id = 2;") == 3);
+  ck_assert (query_int (o.filename, "select sum(count) from chunks;") ==
+	     241);
+  ck_assert (query_int (o.filename, "select max(length(data)) from chunks "
+			"where metric_id = 2;") < 60 * 4);
+  /* Rollups do not depend on the storage. */
+  ck_assert (query_int (o.filename, "select count from rollup_1h "
+			"where metric_id = 2 and bucket = 0;") == 61);
+
+  DbRangeQuery query = {
+    device_names[0], device_addresses[0], VOC, 10 * MINUTE_NS,
+    100 * MINUTE_NS, 0
+  };
+  DbRangeRow row;
+  unsigned long i = 10;
+  DbRange *range = db_range_open (o.filename, o.partition, &query);
+  ck_assert (range != NULL);
+  while (db_range_next (range, &row))
+    {
+      ck_assert (row.time == i * MINUTE_NS && row.sum == 0.25 * i);
+      i++;
+    }
+  ck_assert (db_range_close (range) == ATMOTUBE_RET_OK);
+  ck_assert (i == 100);
+
+  query.metric = TEMPERATURE;
+  query.t0 = 0;
+  query.t1 = 2 * HOUR_NS;
+  query.bucket = HOUR_NS;
+  range = db_range_open (o.filename, o.partition, &query);
+  ck_assert (range != NULL);
+  ck_assert (db_range_next (range, &row));
+  ck_assert (row.time == 0 && row.count == 61 && row.min == 20
+	     && row.max == 30);
+  ck_assert (db_range_next (range, &row));
+  ck_assert (row.time == HOUR_NS && row.count == 60);
+  ck_assert (!db_range_next (range, &row));
+  ck_assert (db_range_close (range) == ATMOTUBE_RET_OK);
+
+  /* The late sample comes in time order, in the bucket of its minute. */
+  query.t1 = 63 * MINUTE_NS;
+  query.bucket = MINUTE_NS;
+  i = 0;
+  range = db_range_open (o.filename, o.partition, &query);
+  ck_assert (range != NULL);
+  while (db_range_next (range, &row))
+    {
+      ck_assert (row.time == i * MINUTE_NS);
+      ck_assert (row.count == (i == 30 ? 2 : 1));
+      ck_assert (i != 30 || row.max == 30);
+      i++;
+    }
+  ck_assert (db_range_close (range) == ATMOTUBE_RET_OK);
+  ck_assert (i == 63);
+}
+
+END_TEST
+START_TEST (test_voc_scaled)
+{
+  setup_output (TO_VOC_SCALED);
+  unlink (o.filename);
+  o.voc_scale = ATMOTUBE_VOC_SCALE;
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+
+  /* Values as read from the device, stored as they are. */
+  ck_assert (voc (ctx, 10, 0, 1234) == ATMOTUBE_RET_OK);
+  const uint64_t ts[] = { 20, 30 };
+  const int device[] = { 0, 0 };
+  const int metric[] = { VOC, VOC };
+  const double value[] = { 65535, 1 };
+  ck_assert (write_batch (ctx, 2, ts, device, metric, value) ==
+	     ATMOTUBE_RET_OK);
+
+  float vocval;
+  ck_assert (get_voc ((DbPlugin *) ctx, 0, 10, &vocval) == ATMOTUBE_RET_OK
+	     && vocval == 12.34f);
+  plugin_stop (ctx);
+  o.voc_scale = 0;
+
+  ck_assert (query_int (o.filename, "select count(*) from samples "
+			"where typeof(value) = 'integer';") == 3);
+  ck_assert (query_int (o.filename, "select sum(value) from samples;") ==
+	     1234 + 65535 + 1);
+  ck_assert (query_int (o.filename, "select max from rollup_1m;") ==
+	     65535);
+}
+
+END_TEST
+START_TEST (test_spool)
+{
+  char spool[1100];
+  DbSpoolStats stats;
+  sqlite3 *lock;
+
+  setup_output (TO_SPOOL);
+  unlink (o.filename);
+  snprintf (spool, sizeof (spool), "%s.spool", o.filename);
+  void *ctx = plugin_start (&o);
+  ck_assert (ctx != NULL);
+  ck_assert (temperature (ctx, 10, 0, 20) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, 20, 0, 21) == ATMOTUBE_RET_OK);
+
+  /* Another writer holds the lock, rows are spooled. */
+  ck_assert (sqlite3_open (o.filename, &lock) == SQLITE_OK);
+  ck_assert (sqlite3_exec (lock, "BEGIN IMMEDIATE;", NULL, NULL, NULL) ==
+	     SQLITE_OK);
+  ck_assert (temperature (ctx, 30, 0, 22) == ATMOTUBE_RET_OK);
+  ck_assert (humidity (ctx, 30, 0, 40) == ATMOTUBE_RET_OK);
+  ck_assert (temperature (ctx, 40, 0, 23) == ATMOTUBE_RET_OK);
+  ck_assert (db_plugin_spool_stats ((DbPlugin *) ctx, &stats) ==
+	     ATMOTUBE_RET_OK);
+  ck_assert (stats.spooled == 3 && stats.pending == 3 && stats.bytes > 0);
+  ck_assert (access (spool, F_OK) == 0);
+
+  /* Drained once the lock is gone, ahead of the next row. */
+  ck_assert (sqlite3_exec (lock, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK);
+  sqlite3_close (lock);
+  usleep (1100000);
+  ck_assert (temperature (ctx, 50, 0, 24) == ATMOTUBE_RET_OK);
+  ck_assert (db_plugin_spool_stats ((DbPlugin *) ctx, &stats) ==
+	     ATMOTUBE_RET_OK);
+  ck_assert (stats.pending == 0 && stats.drained == 3
+	     && stats.dropped == 0 && stats.drain_rate > 0);
+  ck_assert (access (spool, F_OK) != 0);
+  plugin_stop (ctx);
+
+  ck_assert (query_int (o.filename, "select count(*) from samples;") == 6);
+  ck_assert (query_int (o.filename, "select sum(value) from samples "
+			"where metric_id = 2;") == 20 + 21 + 22 + 23 + 24);
+  ck_assert (query_int (o.filename, "select sum(count) from rollup_1d;") ==
+	     6);
+}
+
+END_TEST
+/* Write minutes [from, to) of temperature and humidity through batches,
+ * temperature starting at base. */
+static void
+write_minutes (void *ctx, unsigned long from, unsigned long to,
+	       unsigned long base)
+{
+  uint64_t ts[2];
+  const int device[] = { 0, 0 };
+  const int metric[] = { TEMPERATURE, HUMIDITY };
+  double value[2];
+
+  for (unsigned long i = from; i < to; i++)
+    {
+      ts[0] = ts[1] = i * MINUTE_NS;
+      value[0] = base + i % 5;
+      value[1] = 40;
+      ck_assert (write_batch (ctx, 2, ts, device, metric, value) ==
+		 ATMOTUBE_RET_OK);
+    }
+}
+
+START_TEST (test_replay)
+{
+  for (int storage = 0; storage < 2; storage++)
+    {
+      setup_output (storage ? TO_REPLAY_CHUNKS : TO_REPLAY);
+      unlink (o.filename);
+      o.storage = storage ? ATMOTUBE_STORAGE_CHUNKS : ATMOTUBE_STORAGE_ROWS;
+      void *ctx = plugin_start (&o);
+      ck_assert (ctx != NULL);
+      write_minutes (ctx, 0, 90, 20);
+      /* Replayed within the same run. */
+      write_minutes (ctx, 80, 100, 20);
+      plugin_stop (ctx);
+
+      /* And after a restart, with a few new ones. The samples stored
+       * first are kept. */
+      ctx = plugin_start (&o);
+      ck_assert (ctx != NULL);
+      write_minutes (ctx, 0, 150, 60);
+      plugin_stop (ctx);
+      o.storage = ATMOTUBE_STORAGE_ROWS;
 
-  plugin_stop ();
+      const char *count = storage ? "select sum(count) from chunks;"
+	: "select count(*) from samples;";
+      ck_assert (query_int (o.filename, count) == 300);
+      ck_assert (query_int (o.filename, "select sum(count) from rollup_1d "
+			    "where metric_id = 2;") == 150);
+      ck_assert (query_int (o.filename, "select sum(sum) from rollup_1d "
+			    "where metric_id = 2;") ==
+		 100 * 22 + 50 * 62);
+    }
 }
 
 END_TEST Suite *
@@ -271,6 +1124,21 @@ atmreader_db_suite (void)
   tcase_add_test (tc_core, test_find_device_found);
   tcase_add_test (tc_core, test_db_plugin);
   tcase_add_test (tc_core, test_insert_values);
+  tcase_add_test (tc_core, test_write_batch);
+  tcase_add_test (tc_core, test_commit);
+  tcase_add_test (tc_core, test_samples);
+  tcase_add_test (tc_core, test_migrate);
+  tcase_add_test (tc_core, test_migrate_interrupted);
+  tcase_add_test (tc_core, test_newer_schema);
+  tcase_add_test (tc_core, test_partition);
+  tcase_add_test (tc_core, test_rollup);
+  tcase_add_test (tc_core, test_range);
+  tcase_add_test (tc_core, test_pool);
+  tcase_add_test (tc_core, test_chunks);
+  tcase_add_test (tc_core, test_voc_scaled);
+  tcase_add_test (tc_core, test_spool);
+  tcase_add_test (tc_core, test_replay);
+  tcase_add_test (tc_core, test_wal);
   suite_add_tcase (s, tc_core);
   return s;
 }
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <check.h>
 
 #include <atmotube.h>
@@ -24,12 +25,71 @@
 #include <atmotube-private.h>
 #include <atmotube-interval.h>
 #include <atmotube-handler.h>
+#include <atmotube-time.h>
+#include <atmotube-queue.h>
+#include <atmotube-histogram.h>
+#include <atmotube-output.h>
+#include <atmotube-host.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "atmotube-test-common.h"
 
 static char *plugin_path = NULL;
 
+/* The test binary interposes the libc allocator, so that allocations
+ * done by atmlib, glib and the plugins can be counted. See
+ * test_steady_state_no_alloc. */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static volatile bool track_allocations = false;
+static volatile unsigned long num_allocations = 0;
+
+void *
+malloc (size_t size)
+{
+  if (track_allocations)
+    {
+      num_allocations++;
+    }
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  if (track_allocations)
+    {
+      num_allocations++;
+    }
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  if (track_allocations)
+    {
+      num_allocations++;
+    }
+  return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+  if (track_allocations && ptr != NULL)
+    {
+      num_allocations++;
+    }
+  __libc_free (ptr);
+}
+
 static void
 set_plugin_path (const char *path)
 {
@@ -56,6 +116,7 @@ test_handle_notification (enum CHARACTER_ID id, uint8_t * data,
   uuid_t *uuid = atmotube_getuuid (id);
   AtmotubeData d;
 
+  memset (&d, 0, sizeof (d));
   d.device.device_address = "00:00:00:00:00";
 
   //d.deviceAddress = "00:00:00:00:00";
@@ -126,7 +187,7 @@ START_TEST (test_load_config)
   atmotube_config_start (fullName);
 
   int ret = atmotube_config_load (set_plugin_path, dummy1, dummy2,
-				  sizeof (Atmotube_Device), 0);
+				  NULL, sizeof (Atmotube_Device), 0);
   if (ret == 0)
     {
       atmotube_config_end ();
@@ -139,6 +200,56 @@ START_TEST (test_load_config)
   plugin_path = NULL;
 }
 
+END_TEST
+START_TEST (test_load_config_transform)
+{
+  const char *fullName = "../test/config_transform.txt";
+  atmotube_config_start (fullName);
+
+  int ret = atmotube_config_load (set_plugin_path, dummy1, dummy2,
+				  NULL, sizeof (Atmotube_Device), 0);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  const Atmotube_Transform *t = deviceStore[0].device_transforms;
+
+  /* Temperature: one offset. */
+  ck_assert (t[TEMPERATURE].num_ops == 1);
+  ck_assert (transform_apply (&t[TEMPERATURE], 20) == 18);
+
+  /* Humidity: scaled, then clamped. */
+  ck_assert (t[HUMIDITY].num_ops == 2);
+  ck_assert (transform_apply (&t[HUMIDITY], 30) == 60);
+  ck_assert (transform_apply (&t[HUMIDITY], 95) == 100);
+
+  /* VOC: both affine steps folded into 2 * (x - 0.05), then clamped. */
+  ck_assert (t[VOC].num_ops == 2);
+  ck_assert (t[VOC].ops[0].type == TRANSFORM_AFFINE);
+  ck_assert (t[VOC].ops[0].a == 2 && t[VOC].ops[0].b == -0.1);
+  ck_assert (transform_apply (&t[VOC], 0.02) == 0);
+  ck_assert (transform_apply (&t[VOC], 9) == 10);
+
+  free (deviceStore);
+  deviceStore = NULL;
+
+  atmotube_config_end ();
+  free (plugin_path);
+  plugin_path = NULL;
+
+  /* A fractional correction of an integer metric is refused. */
+  atmotube_config_start ("../test/config_transform_fraction.txt");
+
+  ret = atmotube_config_load (set_plugin_path, dummy1, dummy2,
+			      NULL, sizeof (Atmotube_Device), 0);
+  ck_assert (ret == ATMOTUBE_RET_ERROR);
+
+  free (deviceStore);
+  deviceStore = NULL;
+
+  atmotube_config_end ();
+  free (plugin_path);
+  plugin_path = NULL;
+}
+
 END_TEST typedef struct
 {
   int somedata;
@@ -174,7 +285,7 @@ START_TEST (test_load_config_offset)
   size_t offset = offsetof (StructWithOffset, device);
   printf ("Using offset: %d\n", offset);
   int ret = atmotube_config_load (set_plugin_path, dummy4, dummy5,
-				  sizeof (StructWithOffset), offset);
+				  NULL, sizeof (StructWithOffset), offset);
   if (ret == 0)
     {
       atmotube_config_end ();
@@ -191,16 +302,16 @@ END_TEST static void *p1 = (void *) 0x1;
 static void *p2 = (void *) 0x2;
 
 void
-callback_ulong (unsigned long ts, unsigned long value, void *data_ptr)
+callback_ulong (uint64_t ts, unsigned long value, void *data_ptr)
 {
-  printf ("Time: %lu, value=%lu\n", ts, value);
+  printf ("Time: %" PRIu64 ", value=%lu\n", ts, value);
   ck_assert (data_ptr == p1);
 }
 
 void
-callback_float (unsigned long ts, float value, void *data_ptr)
+callback_float (uint64_t ts, float value, void *data_ptr)
 {
-  printf ("Time: %lu, value=%f\n", ts, value);
+  printf ("Time: %" PRIu64 ", value=%f\n", ts, value);
   ck_assert (data_ptr == p2);
 }
 
@@ -237,9 +348,10 @@ START_TEST (test_interval)
 
   for (i = 0; i < 21; i++)
     {
-      interval_log (device_id, TEST1, INTERVAL_ULONG, t1);
-      interval_log (device_id, TEST2, INTERVAL_FLOAT, f1);
-      interval_log (device_id, TEST3, INTERVAL_ULONG, t3);
+      uint64_t now = atmotube_timestamp_ns ();
+      interval_log (device_id, now, TEST1, INTERVAL_ULONG, t1);
+      interval_log (device_id, now, TEST2, INTERVAL_FLOAT, f1);
+      interval_log (device_id, now, TEST3, INTERVAL_ULONG, t3);
       usleep (100 * 1000);
     }
 
@@ -257,35 +369,35 @@ static int called_dev0 = 0;
 static int called_dev1 = 0;
 
 static void
-multi_callback_ulong_dev0 (unsigned long ts, unsigned long value,
+multi_callback_ulong_dev0 (uint64_t ts, unsigned long value,
 			   void *data_ptr)
 {
-  printf ("Time(0): %lu, value=%lu\n", ts, value);
+  printf ("Time(0): %" PRIu64 ", value=%lu\n", ts, value);
   ck_assert (data_ptr == device_ptr[0]);
   called_dev0++;
 }
 
 static void
-multi_callback_float_dev0 (unsigned long ts, float value, void *data_ptr)
+multi_callback_float_dev0 (uint64_t ts, float value, void *data_ptr)
 {
-  printf ("Time(0): %lu, value=%f\n", ts, value);
+  printf ("Time(0): %" PRIu64 ", value=%f\n", ts, value);
   ck_assert (data_ptr == device_ptr[0]);
   called_dev0++;
 }
 
 static void
-multi_callback_ulong_dev1 (unsigned long ts, unsigned long value,
+multi_callback_ulong_dev1 (uint64_t ts, unsigned long value,
 			   void *data_ptr)
 {
-  printf ("Time(1): %lu, value=%lu\n", ts, value);
+  printf ("Time(1): %" PRIu64 ", value=%lu\n", ts, value);
   ck_assert (data_ptr == device_ptr[1]);
   called_dev1++;
 }
 
 static void
-multi_callback_float_dev1 (unsigned long ts, float value, void *data_ptr)
+multi_callback_float_dev1 (uint64_t ts, float value, void *data_ptr)
 {
-  printf ("Time(1): %lu, value=%f\n", ts, value);
+  printf ("Time(1): %" PRIu64 ", value=%f\n", ts, value);
   ck_assert (data_ptr == device_ptr[1]);
   called_dev1++;
 }
@@ -342,11 +454,12 @@ START_TEST (test_multi_interval)
 
   for (i = 0; i < 100; i++)
     {
+      uint64_t now = atmotube_timestamp_ns ();
       for (device_id = 0; device_id < max_dev_id; device_id++)
 	{
-	  interval_log (device_id, TEST1, INTERVAL_ULONG, t1);
-	  interval_log (device_id, TEST2, INTERVAL_FLOAT, f1);
-	  interval_log (device_id, TEST3, INTERVAL_ULONG, t3);
+	  interval_log (device_id, now, TEST1, INTERVAL_ULONG, t1);
+	  interval_log (device_id, now, TEST2, INTERVAL_FLOAT, f1);
+	  interval_log (device_id, now, TEST3, INTERVAL_ULONG, t3);
 	}
       usleep (10 * 1000);
     }
@@ -367,6 +480,42 @@ START_TEST (test_multi_interval)
   ck_assert (called_dev1 > 0);
 }
 
+END_TEST static unsigned long mean_value = 0;
+
+static void
+mean_callback (uint64_t ts, unsigned long value, void *data_ptr)
+{
+  UNUSED (ts);
+  UNUSED (data_ptr);
+  mean_value = value;
+}
+
+START_TEST (test_interval_mean)
+{
+  int device_id = 0;
+  const char *TEST1 = "test1";
+
+  interval_add (device_id, TEST1, INTERVAL_ULONG);
+  interval_add_ulong_callback (device_id, TEST1, INTERVAL_ULONG,
+			       mean_callback, NULL);
+  interval_start (device_id, TEST1, INTERVAL_ULONG, 1000);
+
+  /* The mean of integer samples is exact, then rounded: 5/3. */
+  interval_log (device_id, 1, TEST1, INTERVAL_ULONG, 1UL);
+  interval_log (device_id, 2, TEST1, INTERVAL_ULONG, 2UL);
+  ck_assert (mean_value == 0);
+  interval_log (device_id, 1000000001, TEST1, INTERVAL_ULONG, 2UL);
+  ck_assert (mean_value == 2);
+
+  /* Scaled VOC at its largest does not overflow. */
+  interval_log (device_id, 1000000002, TEST1, INTERVAL_ULONG, 65535UL);
+  interval_log (device_id, 2000000001, TEST1, INTERVAL_ULONG, 65534UL);
+  ck_assert (mean_value == 65535);
+
+  interval_stop (device_id, TEST1, INTERVAL_ULONG);
+  interval_remove (device_id, TEST1, INTERVAL_ULONG);
+}
+
 END_TEST static StructWithOffset *deviceStore3 = NULL;
 
 static void *
@@ -394,7 +543,7 @@ START_TEST (test_plugin)
   size_t offset = offsetof (StructWithOffset, device);
   printf ("Using offset: %d\n", offset);
   int ret = atmotube_config_load (set_plugin_path, dummy7, dummy8,
-				  sizeof (StructWithOffset), offset);
+				  NULL, sizeof (StructWithOffset), offset);
   if (ret == 0)
     {
       atmotube_config_end ();
@@ -410,8 +559,14 @@ START_TEST (test_plugin)
   ck_assert (o != NULL);
   o = atmotube_plugin_get (OUTPUT_DB);
   ck_assert (o != NULL);
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+  /* Stock plugins are linked in, not loaded. */
+  ck_assert (o->builtin == ATMOTUBE_BUILTIN_DB);
+  ck_assert (o->handle == NULL);
+#endif
   o = atmotube_plugin_get (OUTPUT_CUSTOM);
   ck_assert (o != NULL);
+  ck_assert (o->builtin == ATMOTUBE_BUILTIN_NONE);
 
   atmotube_plugin_unload_all ();
 
@@ -493,7 +648,8 @@ START_TEST (test_output_db)
       printf ("Data %d\n", i);
 
       AtmotubeData *d = glData.deviceConfiguration + i;
-      AtmotubePlugin *plugin = d->plugin;
+      AtmotubePlugin *plugin =
+	(d->num_sinks > 0) ? d->sinks[0].sink->plugin : NULL;
       if (plugin != NULL)
 	{
 	  if (strcmp (plugin->type, OUTPUT_DB) == 0)
@@ -507,10 +663,16 @@ START_TEST (test_output_db)
 
   ck_assert (target != NULL);
 
-  unsigned long ts = 0;
+  uint64_t ts = 0;
   unsigned long value = 100UL;
   void *data_ptr = target;
 
+  /* The database logs its rows as it commits them. */
+  const char *log = "test/atmotube_one_db.db-wal";
+  struct stat st;
+  ck_assert (stat (log, &st) == 0);
+  off_t logged = st.st_size;
+
   for (i = 0; i < 5; i++)
     {
       output_temperature (ts + i, value + i, data_ptr);
@@ -518,6 +680,19 @@ START_TEST (test_output_db)
       output_voc (ts + i, value + i + 0.1f, data_ptr);
     }
 
+  /* Fewer rows than commit_rows, the worker has them committed once
+   * the transaction is commit_interval old. */
+  for (i = 0; i < 300; i++)
+    {
+      ck_assert (stat (log, &st) == 0);
+      if (st.st_size > logged)
+	{
+	  break;
+	}
+      usleep (10 * 1000);
+    }
+  ck_assert (st.st_size > logged);
+
   atmotube_end ();
 }
 
@@ -566,7 +741,8 @@ START_TEST (test_output_file)
       printf ("Data %d\n", i);
 
       AtmotubeData *d = glData.deviceConfiguration + i;
-      AtmotubePlugin *plugin = d->plugin;
+      AtmotubePlugin *plugin =
+	(d->num_sinks > 0) ? d->sinks[0].sink->plugin : NULL;
       if (plugin != NULL)
 	{
 	  if (strcmp (plugin->type, OUTPUT_FILE) == 0)
@@ -580,7 +756,8 @@ START_TEST (test_output_file)
 
   ck_assert (target != NULL);
 
-  unsigned long ts = 0;
+  /* Stamped now, as on receipt, so that the batch is not due yet. */
+  uint64_t ts = atmotube_timestamp_ns ();
   unsigned long value = 100UL;
   void *data_ptr = target;
 
@@ -591,6 +768,652 @@ START_TEST (test_output_file)
       output_voc (ts + i, value + i + 0.1f, data_ptr);
     }
 
+  /* The records still batched are written at once, without waiting
+   * for the batch interval. */
+  uint64_t start = atmotube_timestamp_ns ();
+  atmotube_end ();
+  ck_assert (atmotube_timestamp_ns () - start < ATMOTUBE_MS_TO_NS (1000));
+}
+
+END_TEST typedef struct
+{
+  enum CHARACTER_ID id;
+  uint8_t data[2];
+  size_t data_length;
+} TestNotification;
+
+/* Notifications captured from a device, see test_input.c. */
+static const TestNotification test_input[] = {
+  {VOC, {0x01, 0xb9}, 2},
+  {HUMIDITY, {0x27}, 1},
+  {VOC, {0x01, 0x8d}, 2},
+  {HUMIDITY, {0x26}, 1},
+  {TEMPERATURE, {0x20}, 1},
+  {VOC, {0x01, 0x75}, 2},
+  {HUMIDITY, {0x25}, 1},
+  {VOC, {0x01, 0x57}, 2},
+  {HUMIDITY, {0x24}, 1},
+  {TEMPERATURE, {0x21}, 1},
+  {VOC, {0x01, 0x45}, 2},
+  {HUMIDITY, {0x23}, 1},
+  {VOC, {0x01, 0x36}, 2},
+  {HUMIDITY, {0x22}, 1},
+  {VOC, {0x01, 0x23}, 2},
+  {HUMIDITY, {0x21}, 1},
+  {TEMPERATURE, {0x22}, 1},
+  {VOC, {0x01, 0x17}, 2},
+  {HUMIDITY, {0x20}, 1},
+  {VOC, {0x01, 0x0e}, 2},
+  {VOC, {0x01, 0x00}, 2},
+  {TEMPERATURE, {0x23}, 1}
+};
+
+static void
+replay_test_input (AtmotubeData * d)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof (test_input) / sizeof (TestNotification); i++)
+    {
+      const TestNotification *n = &test_input[i];
+      atmotube_handle_notification (atmotube_getuuid (n->id), n->data,
+				    n->data_length, d);
+    }
+}
+
+/* Allocations made while samples go through the first output of the
+ * given type in config, once warmed up. */
+static unsigned long
+steady_state_allocations (const char *config, const char *type)
+{
+  const unsigned long interval_ms = ATMOTUBE_MIN_RESOUTION;
+  uint8_t character_id;
+  int i;
+  int ret;
+
+  atmotube_start ();
+
+  ret = atmotube_add_devices_from_config (config);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  ret = atmotube_create_outputs ();
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  extern AtmotubeGlData glData;
+
+  AtmotubeData *target = NULL;
+  for (i = 0; i < glData.deviceConfigurationSize; i++)
+    {
+      AtmotubeData *d = glData.deviceConfiguration + i;
+      if (d->num_sinks > 0
+	  && strcmp (d->sinks[0].sink->plugin->type, type) == 0)
+	{
+	  target = d;
+	  break;
+	}
+    }
+
+  ck_assert (target != NULL);
+
+  const int device_id = target->device.device_id;
+  for (character_id = VOC; character_id < STATUS; character_id++)
+    {
+      interval_add (device_id, intervalnames[character_id],
+		    fmts[character_id]);
+      interval_start (device_id, intervalnames[character_id],
+		      fmts[character_id], interval_ms);
+    }
+  interval_add_float_callback (device_id, intervalnames[VOC], fmts[VOC],
+			       output_voc, target);
+  interval_add_ulong_callback (device_id, intervalnames[HUMIDITY],
+			       fmts[HUMIDITY], output_humidity, target);
+  interval_add_ulong_callback (device_id, intervalnames[TEMPERATURE],
+			       fmts[TEMPERATURE], output_temperature, target);
+
+  /* Warm up, so that one time allocations (stdio, SQLite statements
+   * and caches etc.) are done. */
+  replay_test_input (target);
+  usleep (interval_ms * 1000);
+  replay_test_input (target);
+  usleep (interval_ms * 1000);
+
+  num_allocations = 0;
+  track_allocations = true;
+  for (i = 0; i < 10; i++)
+    {
+      replay_test_input (target);
+      usleep (interval_ms * 1000 / 2);
+    }
+  track_allocations = false;
+  unsigned long allocations = num_allocations;
+
+  printf ("Steady state allocations for %s: %lu\n", type, allocations);
+
+  for (character_id = VOC; character_id < STATUS; character_id++)
+    {
+      interval_remove_callbacks (device_id, intervalnames[character_id],
+				 fmts[character_id]);
+      interval_stop (device_id, intervalnames[character_id],
+		     fmts[character_id]);
+      interval_remove (device_id, intervalnames[character_id],
+		       fmts[character_id]);
+    }
+
+  atmotube_end ();
+  return allocations;
+}
+
+START_TEST (test_steady_state_no_alloc)
+{
+  ck_assert (steady_state_allocations ("../test/config.txt", OUTPUT_FILE)
+	     == 0);
+  ck_assert (steady_state_allocations ("../test/config-db.txt", OUTPUT_DB)
+	     == 0);
+}
+
+END_TEST
+START_TEST (test_output_queue)
+{
+  AtmotubeQueue q;
+  AtmotubeQueueStats stats;
+  AtmotubeRecord r;
+  AtmotubeRecord out[8];
+  size_t n;
+  int i;
+  int ret;
+
+  /* Drop oldest: the four newest records remain. */
+  ret = queue_init (&q, 4, 1, QUEUE_POLICY_DROP_OLDEST);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  for (i = 0; i < 6; i++)
+    {
+      r.ts = i;
+      r.device = 0;
+      r.metric = TEMPERATURE;
+      r.value = i;
+      ret = queue_push (&q, &r);
+      ck_assert (ret == ATMOTUBE_RET_OK);
+    }
+
+  queue_get_stats (&q, &stats);
+  ck_assert (stats.depth == 4);
+  ck_assert (stats.high_water == 4);
+  ck_assert (stats.pushed == 6);
+  ck_assert (stats.dropped == 2);
+
+  n = queue_pop (&q, out, 8, 1);
+  ck_assert (n == 4);
+  ck_assert (out[0].ts == 2);
+  ck_assert (out[3].ts == 5);
+
+  /* Empty, times out. */
+  n = queue_pop (&q, out, 8, 1);
+  ck_assert (n == 0);
+  queue_destroy (&q);
+
+  /* Coalesce: a full queue keeps the mean of the values per metric,
+   * at the latest time. */
+  ret = queue_init (&q, 2, 1, QUEUE_POLICY_COALESCE);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  for (i = 0; i < 6; i++)
+    {
+      r.ts = i;
+      r.device = 0;
+      r.metric = (i == 0) ? VOC : HUMIDITY;
+      r.value = i;
+      queue_push (&q, &r);
+    }
+
+  queue_get_stats (&q, &stats);
+  ck_assert (stats.depth == 2);
+  ck_assert (stats.coalesced == 4);
+  ck_assert (stats.dropped == 0);
+
+  n = queue_pop (&q, out, 8, 1);
+  ck_assert (n == 2);
+  ck_assert (out[0].metric == VOC);
+  ck_assert (out[1].metric == HUMIDITY && out[1].value == 3);
+  ck_assert (out[1].ts == 5);
+
+  /* Closed: pushes fail, pops return at once. */
+  ck_assert (!queue_closed (&q));
+  queue_close (&q);
+  ck_assert (queue_closed (&q));
+  ck_assert (queue_push (&q, &r) != ATMOTUBE_RET_OK);
+  ck_assert (queue_pop (&q, out, 8, 0) == 0);
+  queue_destroy (&q);
+}
+
+END_TEST
+START_TEST (test_output_shed)
+{
+  AtmotubeQueue q;
+  AtmotubeQueueShed shed;
+  AtmotubeQueueStats stats;
+  AtmotubeRecord r;
+  AtmotubeRecord out[8];
+  size_t n;
+  int i;
+  int ret;
+
+  ret = queue_init (&q, 8, 9, QUEUE_POLICY_SHED);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  shed.coalesce_depth = 2;
+  shed.drop_depth = 4;
+  shed.low_priority = 1u << HUMIDITY;
+  queue_set_shed (&q, &shed);
+
+  r.metric = VOC;
+  for (i = 0; i < 2; i++)
+    {
+      r.ts = i;
+      r.device = i;
+      r.value = i;
+      queue_push (&q, &r);
+    }
+
+  /* Coalesced into the queued record of device 0. */
+  r.ts = 2;
+  r.device = 0;
+  r.value = 2;
+  queue_push (&q, &r);
+
+  r.device = 2;
+  queue_push (&q, &r);
+  r.device = 3;
+  r.metric = TEMPERATURE;
+  queue_push (&q, &r);
+
+  /* Low priority, refused. */
+  r.device = 0;
+  r.metric = HUMIDITY;
+  queue_push (&q, &r);
+
+  /* The last one finds the queue full and drops the oldest. */
+  r.metric = TEMPERATURE;
+  for (i = 4; i < 9; i++)
+    {
+      r.device = i;
+      queue_push (&q, &r);
+    }
+
+  queue_get_stats (&q, &stats);
+  ck_assert (stats.depth == 8);
+  ck_assert (stats.pushed == 10);
+  ck_assert (stats.coalesced == 1);
+  ck_assert (stats.shed == 1);
+  ck_assert (stats.dropped == 1);
+
+  n = queue_pop (&q, out, 8, 1);
+  ck_assert (n == 8);
+  ck_assert (out[0].device == 1);
+  ck_assert (out[7].device == 8);
+
+  /* A slow consumer sheds low priority metrics on an empty queue. */
+  queue_set_overloaded (&q, true);
+  queue_set_overloaded (&q, true);
+  r.metric = HUMIDITY;
+  queue_push (&q, &r);
+  queue_set_overloaded (&q, false);
+  queue_push (&q, &r);
+
+  queue_get_stats (&q, &stats);
+  ck_assert (stats.overloads == 1);
+  ck_assert (stats.shed == 2);
+  ck_assert (stats.depth == 1);
+  queue_destroy (&q);
+}
+
+END_TEST
+/* Check that file contains a line ending with the given text. */
+static bool
+file_has_line (const char *filename, const char *text)
+{
+  char line[256];
+  bool found = false;
+  FILE *f = fopen (filename, "r");
+
+  if (f == NULL)
+    {
+      return false;
+    }
+
+  while (!found && fgets (line, sizeof (line), f) != NULL)
+    {
+      found = (strstr (line, text) != NULL);
+    }
+
+  fclose (f);
+  return found;
+}
+
+/* Copy the file from over the file to, in place. */
+static bool
+copy_file (const char *from, const char *to)
+{
+  char buf[4096];
+  size_t n;
+  FILE *in = fopen (from, "r");
+  FILE *out = fopen (to, "w");
+  bool ok = (in != NULL && out != NULL);
+
+  while (ok && (n = fread (buf, 1, sizeof (buf), in)) > 0)
+    {
+      ok = (fwrite (buf, 1, n, out) == n);
+    }
+
+  if (in != NULL)
+    {
+      fclose (in);
+    }
+  if (out != NULL)
+    {
+      fclose (out);
+    }
+  return ok;
+}
+
+START_TEST (test_output_fan_out)
+{
+  const char *fullName = "../test/config.txt";
+  char expected[64];
+  int ret;
+
+  atmotube_start ();
+
+  ret = atmotube_add_devices_from_config (fullName);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  ret = atmotube_create_outputs ();
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  extern AtmotubeGlData glData;
+
+  /* "one" writes to file_one and file_all, "three" only to
+   * custom_third. */
+  AtmotubeData *one = glData.deviceConfiguration + 0;
+  AtmotubeData *two = glData.deviceConfiguration + 1;
+  AtmotubeData *three = glData.deviceConfiguration + 2;
+  ck_assert (one->num_sinks == 2);
+  ck_assert (two->num_sinks == 2);
+  ck_assert (three->num_sinks == 1);
+  ck_assert (one->sinks[1].sink == two->sinks[1].sink);
+  ck_assert (one->sinks[1].device == 0);
+  ck_assert (two->sinks[1].device == 1);
+
+  /* One sample ends up in both files. */
+  uint64_t ts = atmotube_timestamp_ns ();
+  output_temperature (ts, 42, one);
+
+  atmotube_end ();
+
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,42\n",
+	    ts);
+  ck_assert (file_has_line ("test/atmotube_one.txt", expected));
+
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",one,temperature,42\n",
+	    ts);
+  ck_assert (file_has_line ("test/atmotube_all.txt", expected));
+}
+
+END_TEST
+START_TEST (test_output_reload)
+{
+  const char *fullName = "../test/config.txt";
+  char expected[64];
+  int ret;
+
+  atmotube_start ();
+
+  ret = atmotube_add_devices_from_config (fullName);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  ret = atmotube_create_outputs ();
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  extern AtmotubeGlData glData;
+  AtmotubeData *one = glData.deviceConfiguration + 0;
+  AtmotubeData *three = glData.deviceConfiguration + 2;
+
+  uint64_t before = atmotube_timestamp_ns ();
+  output_temperature (before, 41, one);
+  output_temperature (before, 41, three);
+
+  ck_assert (atmotube_reload_plugins (NULL) == ATMOTUBE_RET_OK);
+  ck_assert (atmotube_reload_plugins ("custom") == ATMOTUBE_RET_OK);
+#ifdef ATMOTUBE_BUILTIN_PLUGINS
+  ck_assert (atmotube_reload_plugins ("file") != ATMOTUBE_RET_OK);
+#endif
+  ck_assert (three->sinks[0].sink->worker_started);
+  ck_assert (three->sinks[0].sink->plugin != NULL);
+
+  /* A library which does not load leaves the old one running. */
+  FILE *f;
+  mkdir ("test/broken", 0755);
+  f = fopen ("test/broken/plugins.manifest", "w");
+  ck_assert (f != NULL);
+  fputs ("custom libcustom.so\n", f);
+  fclose (f);
+  f = fopen ("test/broken/libcustom.so", "w");
+  ck_assert (f != NULL);
+  fputs ("not a library\n", f);
+  fclose (f);
+  AtmotubePlugin *custom = three->sinks[0].sink->plugin;
+  ck_assert (atmotube_plugin_find ("test/broken") == ATMOTUBE_RET_OK);
+  ck_assert (atmotube_reload_plugins ("custom") != ATMOTUBE_RET_OK);
+  ck_assert (three->sinks[0].sink->worker_started);
+  ck_assert (three->sinks[0].sink->plugin == custom);
+
+  /* The code of a library rebuilt in place runs after a reload. */
+  mkdir ("test/rebuilt", 0755);
+  f = fopen ("test/rebuilt/plugins.manifest", "w");
+  ck_assert (f != NULL);
+  fputs ("custom libcustom.so\n", f);
+  fclose (f);
+  ck_assert (copy_file ("src/plugin/libcustom.so",
+			"test/rebuilt/libcustom.so"));
+  ck_assert (atmotube_plugin_find ("test/rebuilt") == ATMOTUBE_RET_OK);
+  ck_assert (atmotube_reload_plugins ("custom") == ATMOTUBE_RET_OK);
+  ck_assert (copy_file ("src/plugin/libcustom_v2.so",
+			"test/rebuilt/libcustom.so"));
+  ck_assert (atmotube_reload_plugins ("custom") == ATMOTUBE_RET_OK);
+
+  uint64_t after = atmotube_timestamp_ns ();
+  output_temperature (after, 43, one);
+  output_temperature (after, 47, three);
+
+  atmotube_end ();
+
+  /* Nothing lost across the reload. */
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,41\n",
+	    before);
+  ck_assert (file_has_line ("test/atmotube_one.txt", expected));
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,43\n",
+	    after);
+  ck_assert (file_has_line ("test/atmotube_one.txt", expected));
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,47,v2",
+	    after);
+  ck_assert (file_has_line ("test/atmotube_custom", expected));
+}
+
+END_TEST
+START_TEST (test_output_host)
+{
+  const char *fullName = "../test/config_host.txt";
+  char expected[64];
+  int ret;
+
+  atmotube_start ();
+  ret = atmotube_add_devices_from_config (fullName);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+  ret = atmotube_create_outputs ();
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  extern AtmotubeGlData glData;
+  AtmotubeData *one = glData.deviceConfiguration + 0;
+  AtmotubeHost *h = (AtmotubeHost *) one->sinks[0].sink->plugin_ctx;
+  ck_assert (h != NULL && h->pid > 0);
+
+  uint64_t ts = atmotube_timestamp_ns ();
+  output_temperature (ts, 42, one);
+
+  atmotube_end ();
+
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,42\n",
+	    ts);
+  ck_assert (file_has_line ("test/atmotube_hosted.txt", expected));
+
+  /* A crashing host only costs the data of its output. */
+  atmotube_start ();
+  ret = atmotube_add_devices_from_config (fullName);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+  ret = atmotube_create_outputs ();
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  one = glData.deviceConfiguration + 0;
+  h = (AtmotubeHost *) one->sinks[0].sink->plugin_ctx;
+  kill (h->pid, SIGKILL);
+
+  const struct timespec poll = { 0, 10 * ATMOTUBE_NS_PER_MS };
+  int i;
+  for (i = 0; i < 200 && !h->dead; i++)
+    {
+      output_temperature (atmotube_timestamp_ns (), 43, one);
+      nanosleep (&poll, NULL);
+    }
+  ck_assert (h->dead);
+
+  /* It is started again, on the same ring. */
+  const struct timespec restart =
+    { 0, ATMOTUBE_MS_TO_NS (HOST_RESTART_MIN_MS + 50) };
+  nanosleep (&restart, NULL);
+  ts = atmotube_timestamp_ns ();
+  output_temperature (ts, 44, one);
+  for (i = 0; i < 200 && h->restarts == 0; i++)
+    {
+      nanosleep (&poll, NULL);
+    }
+  ck_assert (h->restarts == 1 && !h->dead);
+
+  atmotube_end ();
+
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,44\n",
+	    ts);
+  ck_assert (file_has_line ("test/atmotube_hosted.txt", expected));
+}
+
+END_TEST
+START_TEST (test_output_route)
+{
+  const char *fullName = "../test/config_route.txt";
+  char expected[64];
+  int ret;
+
+  atmotube_start ();
+  ret = atmotube_add_devices_from_config (fullName);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+  ret = atmotube_create_outputs ();
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  extern AtmotubeGlData glData;
+  AtmotubeData *lab1 = glData.deviceConfiguration + 0;
+  AtmotubeData *lab2 = glData.deviceConfiguration + 1;
+  AtmotubeData *field = glData.deviceConfiguration + 2;
+
+  /* voc_all takes VOC of everybody, raw_lab everything of lab1 only
+   * (lab2 is too coarse), field_temperature temperature of field. */
+  ck_assert (lab1->num_sinks == 2);
+  ck_assert (lab1->routes[VOC] == 0x3);
+  ck_assert (lab1->routes[TEMPERATURE] == 0x2);
+  ck_assert (lab2->num_sinks == 1);
+  ck_assert (lab2->routes[VOC] == 0x1);
+  ck_assert (lab2->routes[TEMPERATURE] == 0);
+  ck_assert (field->num_sinks == 2);
+  ck_assert (field->routes[VOC] == 0x1);
+  ck_assert (field->routes[HUMIDITY] == 0);
+  ck_assert (field->routes[TEMPERATURE] == 0x2);
+
+  uint64_t ts = atmotube_timestamp_ns ();
+  output_temperature (ts, 21, lab1);
+  output_temperature (ts, 22, lab2);
+  output_temperature (ts, 23, field);
+  output_humidity (ts, 50, field);
+
+  atmotube_end ();
+
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,21\n",
+	    ts);
+  ck_assert (file_has_line ("test/atmotube_route_raw.txt", expected));
+  ck_assert (!file_has_line ("test/atmotube_route_voc.txt", "temperature"));
+  snprintf (expected, sizeof (expected), "%" PRIu64 ",temperature,23\n",
+	    ts);
+  ck_assert (file_has_line ("test/atmotube_route_field.txt", expected));
+  ck_assert (!file_has_line ("test/atmotube_route_field.txt", "humidity"));
+}
+
+END_TEST
+START_TEST (test_output_latency)
+{
+  const char *fullName = "../test/config_route.txt";
+  static AtmotubeHistogram h;
+  static AtmotubeHistogram since;
+  AtmotubeLatencyStats stats;
+  uint64_t v;
+  int i;
+  int ret;
+
+  /* Small values are exact, larger ones within 1/16. */
+  histogram_reset (&h);
+  for (i = 1; i <= 10; i++)
+    {
+      histogram_record (&h, i);
+    }
+  ck_assert (h.count == 10);
+  ck_assert (h.max == 10);
+  ck_assert (histogram_percentile (&h, NULL, 50.0) == 5);
+  ck_assert (histogram_percentile (&h, NULL, 100.0) == 10);
+
+  histogram_copy (&since, &h);
+  for (i = 1; i <= 1000; i++)
+    {
+      histogram_record (&h, i * 1000ULL);
+    }
+  v = histogram_percentile (&h, &since, 99.0);
+  ck_assert (v >= 990000 && v <= 990000 + 990000 / 16);
+  v = histogram_percentile (&h, &since, 50.0);
+  ck_assert (v >= 500000 && v <= 500000 + 500000 / 16);
+  ck_assert (histogram_percentile (&h, NULL, 100.0) == 1000000);
+  ck_assert (histogram_percentile (&since, &since, 50.0) == 0);
+
+  /* Plugin calls of field_temperature, which writes each record. */
+  atmotube_start ();
+  ret = atmotube_add_devices_from_config (fullName);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+  ret = atmotube_create_outputs ();
+  ck_assert (ret == ATMOTUBE_RET_OK);
+
+  extern AtmotubeGlData glData;
+  AtmotubeData *field = glData.deviceConfiguration + 2;
+
+  ck_assert (output_get_latency_stats (3, &stats) != ATMOTUBE_RET_OK);
+  ret = output_get_latency_stats (2, &stats);
+  ck_assert (ret == ATMOTUBE_RET_OK);
+  ck_assert (stats.calls == 0);
+
+  output_temperature (atmotube_timestamp_ns (), 23, field);
+  for (i = 0; i < 200 && stats.calls == 0; i++)
+    {
+      usleep (10000);
+      output_get_latency_stats (2, &stats);
+    }
+  ck_assert (stats.calls == 1);
+  ck_assert (stats.errors == 0);
+  ck_assert (stats.max > 0);
+  ck_assert (stats.p50 <= stats.p99 && stats.p99 <= stats.max);
+
   atmotube_end ();
 }
 
@@ -609,16 +1432,26 @@ atmreader_suite (void)
   /* Inidividual testcases. */
   tcase_add_test (tc_core, test_interval);
   tcase_add_test (tc_core, test_multi_interval);
+  tcase_add_test (tc_core, test_interval_mean);
   tcase_add_test (tc_core, test_handle_VOC_notification);
   tcase_add_test (tc_core, test_handle_TEMPERATURE_notification);
   tcase_add_test (tc_core, test_handle_HUMIDITY_notification);
   tcase_add_test (tc_core, test_handle_STATUS_notification);
   tcase_add_test (tc_core, test_load_config);
   tcase_add_test (tc_core, test_load_config_offset);
+  tcase_add_test (tc_core, test_load_config_transform);
   tcase_add_test (tc_core, test_plugin);
   tcase_add_test (tc_core, test_output);
   tcase_add_test (tc_core, test_output_file);
   tcase_add_test (tc_core, test_output_db);
+  tcase_add_test (tc_core, test_steady_state_no_alloc);
+  tcase_add_test (tc_core, test_output_queue);
+  tcase_add_test (tc_core, test_output_shed);
+  tcase_add_test (tc_core, test_output_fan_out);
+  tcase_add_test (tc_core, test_output_reload);
+  tcase_add_test (tc_core, test_output_host);
+  tcase_add_test (tc_core, test_output_route);
+  tcase_add_test (tc_core, test_output_latency);
   suite_add_tcase (s, tc_core);
   return s;
 }